@@ -14,28 +14,229 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE // for sched_setaffinity
+
 #include <err.h>
+#include <getopt.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+
+#include "erlcmd.h"
+#include "gpio.h"
+#include "sim.h"
+#include "worker.h"
 
 extern int gpio_main(int argc, char *argv[]);
+extern int gpio_bank_main(int argc, char *argv[]);
 extern int i2c_main(int argc, char *argv[]);
 extern int spi_main(int argc, char *argv[]);
+extern int pwm_main(int argc, char *argv[]);
+extern int hub_main(int argc, char *argv[]);
 
-int main(int argc, char *argv[])
+static struct option long_options[] = {
+    {"packet", required_argument, 0, 'p'},
+    {"nonblocking", no_argument, 0, 'n'},
+    {"gpiomem", no_argument, 0, 'm'},
+    {"rt-priority", required_argument, 0, 'r'},
+    {"cpus", required_argument, 0, 'c'},
+    {"mlockall", no_argument, 0, 'l'},
+    {"schedule", no_argument, 0, 's'},
+    {"retries", required_argument, 0, 't'},
+    {"workers", no_argument, 0, 'w'},
+    {0, 0, 0, 0}
+};
+
+/**
+ * @brief	Parse a CPU list like "2" or "0,2-3"
+ *
+ * @return 	0 on success, -1 if the list is bad
+ */
+static int parse_cpu_list(const char *str, cpu_set_t *cpus)
 {
-    if (argc < 2)
-        errx(EXIT_FAILURE, "Must pass mode (e.g. gpio, i2c, spi)");
+    CPU_ZERO(cpus);
+    while (*str) {
+        char *end;
+        long first = strtol(str, &end, 10);
+        long last = first;
+        if (end == str || first < 0)
+            return -1;
+        if (*end == '-') {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+            if (end == str || last < first)
+                return -1;
+        }
+        if (last >= CPU_SETSIZE)
+            return -1;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, cpus);
+
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return -1;
+        str = end;
+    }
+    return 0;
+}
+
+/*
+ * These settings bound the time from an edge or a request to the
+ * response when the BEAM is loading the system. They need privileges
+ * (CAP_SYS_NICE and CAP_IPC_LOCK or raised rlimits), so failures are
+ * warnings and erlang-ale runs without them.
+ */
+static void set_cpu_affinity(const char *list)
+{
+    cpu_set_t cpus;
+    if (parse_cpu_list(list, &cpus) < 0)
+        errx(EXIT_FAILURE, "Bad CPU list '%s'", list);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+        warn("sched_setaffinity(%s)", list);
+}
+
+static void set_rt_priority(int priority)
+{
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    if (sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+        warn("sched_setscheduler(SCHED_FIFO, %d)", priority);
+}
+
+static void lock_memory()
+{
+    /* Avoid page faults in the loops by locking everything that's
+     * mapped now and later. */
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        warn("mlockall");
+}
 
+static int run_mode(int argc, char *argv[]);
+
+/*
+ * bench runs gpio, gpio_bank, i2c, spi or hub with the devices replaced by
+ * the simulated backend in sim.c. Requests take the same path through erlcmd and
+ * the mode as they do with hardware, so this is for measuring that
+ * overhead (see ale_bench.erl) and for testing without hardware.
+ */
+static int bench_main(int argc, char *argv[])
+{
+    if (argc < 3 ||
+            (strcmp(argv[2], "gpio") != 0 && strcmp(argv[2], "gpio_bank") != 0 &&
+             strcmp(argv[2], "i2c") != 0 && strcmp(argv[2], "spi") != 0 &&
+             strcmp(argv[2], "hub") != 0))
+        errx(EXIT_FAILURE, "%s bench <gpio|gpio_bank|i2c|spi|hub> <mode arguments>", argv[0]);
+
+    sim_enable();
+
+    argv[1] = argv[0];
+    return run_mode(argc - 1, argv + 1);
+}
+
+static int run_mode(int argc, char *argv[])
+{
     if (strcmp(argv[1], "gpio") == 0)
         return gpio_main(argc, argv);
+    else if (strcmp(argv[1], "gpio_bank") == 0)
+        return gpio_bank_main(argc, argv);
     else if (strcmp(argv[1], "i2c") == 0)
         return i2c_main(argc, argv);
     else if (strcmp(argv[1], "spi") == 0)
         return spi_main(argc, argv);
+    else if (strcmp(argv[1], "pwm") == 0)
+        return pwm_main(argc, argv);
+    else if (strcmp(argv[1], "hub") == 0)
+        return hub_main(argc, argv);
+    else if (strcmp(argv[1], "bench") == 0)
+        return bench_main(argc, argv);
     else
         errx(EXIT_FAILURE, "Unknown mode '%s'", argv[1]);
 
     return 1;
 }
+
+int main(int argc, char *argv[])
+{
+    /* Process options that apply to all modes. These come before
+     * the mode so that the mode's arguments aren't touched.
+     */
+    int rt_priority = 0;
+    const char *cpus = NULL;
+    int lock = 0;
+    int schedule = 0;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "+p:nmr:c:lst:w", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'p':
+            erlcmd_set_packet_size(strtol(optarg, NULL, 0));
+            break;
+        case 'n':
+            erlcmd_set_nonblocking(1);
+            break;
+        case 'm':
+            /* If the registers can't be mapped, GPIOs fall back to
+             * sysfs or the character device. */
+            if (gpio_mmap_open() < 0)
+                warnx("/dev/gpiomem not available. Using the kernel for GPIO reads and writes.");
+            break;
+        case 'r':
+            rt_priority = strtol(optarg, NULL, 0);
+            if (rt_priority < sched_get_priority_min(SCHED_FIFO) ||
+                    rt_priority > sched_get_priority_max(SCHED_FIFO))
+                errx(EXIT_FAILURE, "Bad SCHED_FIFO priority %d", rt_priority);
+            break;
+        case 'c':
+            cpus = optarg;
+            break;
+        case 'l':
+            lock = 1;
+            break;
+        case 's':
+            /* Serve many Erlang clients of one bus by priority. */
+            schedule = 1;
+            erlcmd_set_scheduling(1);
+            break;
+        case 't':
+            erlcmd_set_retries(strtol(optarg, NULL, 0));
+            break;
+        case 'w':
+            /* Run each bus's accesses on its own thread. */
+            worker_set_enabled(1);
+            break;
+        default:
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (cpus)
+        set_cpu_affinity(cpus);
+    if (lock)
+        lock_memory();
+    if (rt_priority)
+        set_rt_priority(rt_priority);
+
+    /* Shift the options out so that argv[1] is the mode. */
+    argv[optind - 1] = argv[0];
+    argv += optind - 1;
+    argc -= optind - 1;
+
+    if (argc < 2)
+        errx(EXIT_FAILURE, "Must pass mode (e.g. gpio, gpio_bank, i2c, spi, pwm, hub, bench)");
+
+    const char *mode = argv[1];
+    if (strcmp(mode, "bench") == 0 && argc > 2)
+        mode = argv[2];
+    int has_bus = (strcmp(mode, "i2c") == 0 || strcmp(mode, "spi") == 0 ||
+                   strcmp(mode, "hub") == 0);
+    if (schedule && !has_bus)
+        errx(EXIT_FAILURE, "--schedule is only supported by i2c, spi and hub");
+    if (worker_enabled() && !has_bus)
+        errx(EXIT_FAILURE, "--workers is only supported by i2c, spi and hub");
+
+    return run_mode(argc, argv);
+}
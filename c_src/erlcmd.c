@@ -15,12 +15,267 @@
  */
 
 #include "erlcmd.h"
+#include "stats.h"
 
+#include <arpa/inet.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
+/* Length prefix size. This must match the {packet, N} option that
+ * the Erlang side used to open the port.
+ */
+static int packet_size = 2;
+
+/* Responses and notifications are queued and written to Erlang in
+ * one write() when the caller goes idle. In non-blocking mode, a
+ * slow reader only causes the queue to grow up to
+ * ERLCMD_MAX_OUTPUT_QUEUE.
+ */
+struct erlcmd_output
+{
+    char *buffer;
+    size_t buffer_size;
+    size_t start;
+    size_t index;
+    int nonblocking;
+};
+static struct erlcmd_output output;
+
+/* The tag of the request being dispatched if it was sent as
+ * {async, Tag, Request}. It's copied out since the request is
+ * rewritten in place to strip the wrapper.
+ */
+struct erlcmd_tag
+{
+    char *buffer;
+    size_t buffer_size;
+    size_t len; // 0 if the request wasn't tagged
+};
+static struct erlcmd_tag tag;
+
+/* In hub mode, lookup() finds the handler for each handle and current
+ * is the handle that messages to Erlang are sent from.
+ */
+struct erlcmd_handles
+{
+    struct erlcmd *(*lookup)(uint16_t handle);
+    uint16_t current;
+};
+static struct erlcmd_handles handles;
+
+/* How many times to retry a device access that hit a transient error */
+static int retries = 0;
+
+/* Requests are queued by priority instead of run as they arrive */
+static int scheduling = 0;
+
+/* A queued request and its tag are copied out of the receive buffer
+ * since it gets reused before the request runs.
+ */
+struct erlcmd_request
+{
+    struct erlcmd_request *next;
+    uint64_t queued_ns;
+    uint16_t handle;
+    char *tag;
+    size_t tag_len;
+    size_t len;
+    char req[]; // Version byte and the term or a binary command
+};
+
+/* The event loop's epoll set and the callbacks for each watched fd,
+ * indexed by fd. stdin and stdout are handled by erlcmd_run() and
+ * don't have entries.
+ */
+struct erlcmd_watch
+{
+    void (*callback)(int fd, uint32_t events, void *cookie);
+    void *cookie;
+    int timer; // 1 to read the expirations before calling back
+    uint16_t handle; // The handle that was current when it was watched
+};
+
+struct erlcmd_reactor
+{
+    int epoll_fd;
+    struct erlcmd_watch *watches;
+    size_t watch_count;
+    int stdout_watched;
+};
+static struct erlcmd_reactor reactor = { .epoll_fd = -1 };
+
+/**
+ * @brief Set the size of the length prefix on each message
+ *
+ * @param bytes 2 or 4
+ */
+void erlcmd_set_packet_size(int bytes)
+{
+    if (bytes != 2 && bytes != 4)
+	errx(EXIT_FAILURE, "Unsupported packet size %d", bytes);
+
+    packet_size = bytes;
+}
+
+int erlcmd_packet_size()
+{
+    return packet_size;
+}
+
+/**
+ * @brief Serve several handles from this process
+ *
+ * Every request starts with the handle that it's for, and handle 0
+ * is the handler passed to erlcmd_run().
+ *
+ * @param lookup returns the handler for a handle or NULL if it isn't
+ *               open
+ */
+void erlcmd_set_handles(struct erlcmd *(*lookup)(uint16_t handle))
+{
+    handles.lookup = lookup;
+}
+
+/**
+ * @brief Send messages from a handle until the next request
+ *
+ * Watches and timers that are created now belong to the handle too.
+ *
+ * @return the handle that was current
+ */
+uint16_t erlcmd_select_handle(uint16_t handle)
+{
+    uint16_t previous = handles.current;
+    handles.current = handle;
+    return previous;
+}
+
+/**
+ * @brief Set how many times to retry failed device accesses
+ *
+ * Retries are off by default since a retried write may be seen twice
+ * by a device that received it but failed to acknowledge it.
+ */
+void erlcmd_set_retries(int count)
+{
+    if (count < 0 || count > ERLCMD_MAX_RETRIES)
+	errx(EXIT_FAILURE, "Retries must be between 0 and %d", ERLCMD_MAX_RETRIES);
+
+    retries = count;
+}
+
+/**
+ * @brief Decide whether to try a failed device access again
+ *
+ * Only errors that a NAK, arbitration loss or bus timeout can cause
+ * are retried. Anything else fails the same way the next time.
+ *
+ * @param attempt the number of retries so far
+ * @param errnum  the errno from the failed access
+ *
+ * @return 1 to try again
+ */
+int erlcmd_should_retry(int attempt, int errnum)
+{
+    if (attempt >= retries)
+	return 0;
+
+    switch (errnum) {
+    case EINTR:
+    case EAGAIN:
+    case EBUSY:
+    case EIO:
+    case ENXIO:
+    case EREMOTEIO:
+    case ETIMEDOUT:
+	stats_record_retry();
+	return 1;
+    default:
+	return 0;
+    }
+}
+
+/**
+ * @brief Queue requests and run the most urgent one first
+ *
+ * erlcmd_run() calls erlcmd_run_queued() after every wakeup and
+ * doesn't block while erlcmd_queued() is nonzero.
+ */
+void erlcmd_set_scheduling(int enable)
+{
+    scheduling = enable;
+}
+
+/**
+ * @brief Don't block when Erlang isn't reading responses fast enough
+ *
+ * erlcmd_run() watches stdout while erlcmd_output_pending() is
+ * nonzero and calls erlcmd_flush() when it's writable.
+ */
+void erlcmd_set_nonblocking(int enable)
+{
+    int flags = fcntl(STDOUT_FILENO, F_GETFL);
+    if (flags < 0 ||
+	    fcntl(STDOUT_FILENO, F_SETFL, enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK)) < 0)
+	err(EXIT_FAILURE, "fcntl(stdout)");
+
+    output.nonblocking = enable;
+}
+
+/**
+ * @return the number of bytes waiting to be written to Erlang
+ */
+size_t erlcmd_output_pending()
+{
+    return output.index - output.start;
+}
+
+static void erlcmd_wait_writable()
+{
+    struct pollfd fdset;
+    fdset.fd = STDOUT_FILENO;
+    fdset.events = POLLOUT;
+    fdset.revents = 0;
+    if (poll(&fdset, 1, -1) < 0 && errno != EINTR)
+	err(EXIT_FAILURE, "poll(stdout)");
+}
+
+/**
+ * @brief Write queued responses and notifications to Erlang
+ *
+ * In blocking mode, this returns when everything has been written.
+ * In non-blocking mode, it returns when stdout would block.
+ */
+void erlcmd_flush()
+{
+    while (output.start < output.index) {
+	ssize_t amount_written = write(STDOUT_FILENO,
+				       output.buffer + output.start,
+				       output.index - output.start);
+	if (amount_written < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return;
+
+	    err(EXIT_FAILURE, "write");
+	}
+
+	output.start += amount_written;
+    }
+
+    output.start = 0;
+    output.index = 0;
+}
+
 /**
  * Initialize an Erlang command handler.
  *
@@ -32,34 +287,560 @@ void erlcmd_init(struct erlcmd *handler,
 		 void (*request_handler)(const char *req, void *cookie),
 		 void *cookie)
 {
+    /* The receive buffer is allocated on the first read, since the
+     * handlers of hub handles never read.
+     */
     memset(handler, 0, sizeof(*handler));
 
     handler->request_handler = request_handler;
     handler->cookie = cookie;
+
+    for (int i = 0; i < ERLCMD_PRIORITIES; i++)
+	handler->queue_tail[i] = &handler->queue[i];
+}
+
+/**
+ * @brief Set the table for binary commands
+ *
+ * @param opcodes the commands indexed by opcode. Unused entries have
+ *                a NULL handler.
+ * @param count   the number of entries
+ */
+void erlcmd_set_opcodes(struct erlcmd *handler, const struct erlcmd_opcode *opcodes, size_t count)
+{
+    handler->opcodes = opcodes;
+    handler->opcode_count = count;
+}
+
+static void erlcmd_encode_length(char *header, size_t len)
+{
+    if (packet_size == 2) {
+	uint16_t be_len = htons(len);
+	memcpy(header, &be_len, sizeof(be_len));
+    } else {
+	uint32_t be_len = htonl(len);
+	memcpy(header, &be_len, sizeof(be_len));
+    }
+}
+
+static size_t erlcmd_decode_length(const char *header)
+{
+    if (packet_size == 2) {
+	uint16_t be_len;
+	memcpy(&be_len, header, sizeof(be_len));
+	return ntohs(be_len);
+    } else {
+	uint32_t be_len;
+	memcpy(&be_len, header, sizeof(be_len));
+	return ntohl(be_len);
+    }
 }
 
 /**
- * @brief Synchronously send a response back to Erlang
+ * @brief Queue a response to be sent back to Erlang
+ *
+ * The response is copied, so the caller can reuse the buffer. It's
+ * sent on the next erlcmd_flush(). erlcmd_process() flushes after
+ * dispatching requests. In hub mode, the current handle is inserted
+ * after the type byte.
  *
  * @param response what to send back
+ * @param len the length of the response
  */
 void erlcmd_send(char *response, size_t len)
 {
-    uint16_t be_len = htons(len - sizeof(uint16_t));
-    memcpy(response, &be_len, sizeof(be_len));
+    size_t handle_len = (handles.lookup && len > 0 ? ERLCMD_HANDLE_SIZE : 0);
+    if (packet_size == 2 && len + handle_len > 0xffff)
+	errx(EXIT_FAILURE, "Response too long for {packet, 2}");
 
-    size_t wrote = 0;
-    do {
-	ssize_t amount_written = write(STDOUT_FILENO, response + wrote, len - wrote);
-	if (amount_written < 0) {
-	    if (errno == EINTR)
-		continue;
+    size_t needed = packet_size + handle_len + len;
+    if (output.index + needed > output.buffer_size) {
+	/* Apply backpressure if Erlang has fallen too far behind. */
+	while (erlcmd_output_pending() + needed > ERLCMD_MAX_OUTPUT_QUEUE &&
+	       erlcmd_output_pending() > 0) {
+	    erlcmd_flush();
+	    if (erlcmd_output_pending() > 0)
+		erlcmd_wait_writable();
+	}
 
-	    err(EXIT_FAILURE, "write");
+	size_t pending = erlcmd_output_pending();
+	if (output.start > 0) {
+	    memmove(output.buffer, output.buffer + output.start, pending);
+	    output.start = 0;
+	    output.index = pending;
+	}
+
+	if (pending + needed > output.buffer_size) {
+	    size_t new_size = output.buffer_size ? output.buffer_size : ERLCMD_INITIAL_BUF_SIZE;
+	    while (new_size < pending + needed)
+		new_size *= 2;
+
+	    char *buffer = realloc(output.buffer, new_size);
+	    if (!buffer)
+		err(EXIT_FAILURE, "realloc");
+	    output.buffer = buffer;
+	    output.buffer_size = new_size;
+	}
+    }
+
+    char *msg = output.buffer + output.index;
+    erlcmd_encode_length(msg, handle_len + len);
+    msg += packet_size;
+    if (handle_len) {
+	*msg++ = response[0];
+	*msg++ = (char) (handles.current >> 8);
+	*msg++ = (char) handles.current;
+	memcpy(msg, response + 1, len - 1);
+    } else
+	memcpy(msg, response, len);
+    output.index += needed;
+
+    stats.messages_out++;
+    stats.bytes_out += needed;
+    if (erlcmd_output_pending() > stats.max_output_queue)
+	stats.max_output_queue = erlcmd_output_pending();
+}
+
+static void erlcmd_send_reply(const char *tag_buffer, size_t tag_len, char *response, size_t len)
+{
+    if (tag_len == 0 || len < 2) {
+	erlcmd_send(response, len);
+	return;
+    }
+
+    size_t tagged_len = len + tag_len + 8;
+    char *tagged = malloc(tagged_len);
+    if (!tagged)
+	err(EXIT_FAILURE, "malloc");
+
+    int index = 1;
+    tagged[0] = ERLCMD_TAGGED_REPLY;
+    ei_encode_version(tagged, &index);
+    ei_encode_tuple_header(tagged, &index, 2);
+    memcpy(tagged + index, tag_buffer, tag_len);
+    index += tag_len;
+
+    // Skip the type and version on the original reply
+    memcpy(tagged + index, response + 2, len - 2);
+    index += len - 2;
+
+    erlcmd_send(tagged, index);
+    free(tagged);
+}
+
+/**
+ * @brief Queue the reply to the request being dispatched
+ *
+ * The reply is formatted like any other message to Erlang: a type
+ * byte, the version and then the term. If the request was tagged,
+ * the term is sent as {Tag, Reply} in a tagged reply.
+ */
+void erlcmd_reply(char *response, size_t len)
+{
+    erlcmd_send_reply(tag.buffer, tag.len, response, len);
+}
+
+/**
+ * @brief Reply {error, badarg} to a request that couldn't be decoded
+ *
+ * The reason is logged to stderr. The caller should return from the
+ * request handler without replying.
+ */
+void erlcmd_bad_request(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vwarnx(fmt, ap);
+    va_end(ap);
+
+    char resp[32];
+    int resp_index = 1; // Space for the type
+    resp[0] = ERLCMD_REPLY;
+    ei_encode_version(resp, &resp_index);
+    ei_encode_tuple_header(resp, &resp_index, 2);
+    ei_encode_atom(resp, &resp_index, "error");
+    ei_encode_atom(resp, &resp_index, "badarg");
+    erlcmd_reply(resp, resp_index);
+
+    stats.bad_requests++;
+}
+
+/* The names that Erlang's file and inet modules use for errors */
+static const struct {
+    int errnum;
+    const char *name;
+} errno_names[] = {
+    {EPERM, "eperm"},
+    {ENOENT, "enoent"},
+    {EINTR, "eintr"},
+    {EIO, "eio"},
+    {ENXIO, "enxio"},
+    {EBADF, "ebadf"},
+    {EAGAIN, "eagain"},
+    {ENOMEM, "enomem"},
+    {EACCES, "eacces"},
+    {EBUSY, "ebusy"},
+    {ENODEV, "enodev"},
+    {EINVAL, "einval"},
+    {ENOTTY, "enotty"},
+    {ENOSYS, "enosys"},
+    {EPROTO, "eproto"},
+    {EMSGSIZE, "emsgsize"},
+    {EOPNOTSUPP, "eopnotsupp"},
+    {ETIMEDOUT, "etimedout"},
+    {EREMOTEIO, "eremoteio"},
+};
+
+/**
+ * @brief Encode {error, Reason, Errno} for a failed system call
+ *
+ * Errno is an atom like eio or enxio. Errors without a name are sent
+ * as their number.
+ */
+void erlcmd_encode_errno_error(char *buf, int *index, const char *reason, int errnum)
+{
+    ei_encode_tuple_header(buf, index, 3);
+    ei_encode_atom(buf, index, "error");
+    ei_encode_atom(buf, index, reason);
+    for (size_t i = 0; i < sizeof(errno_names) / sizeof(errno_names[0]); i++) {
+	if (errno_names[i].errnum == errnum) {
+	    ei_encode_atom(buf, index, errno_names[i].name);
+	    return;
+	}
+    }
+    ei_encode_long(buf, index, errnum);
+}
+
+static void erlcmd_save_tag(const char *buffer, size_t len)
+{
+    if (len > tag.buffer_size) {
+	char *new_buffer = realloc(tag.buffer, len);
+	if (!new_buffer)
+	    err(EXIT_FAILURE, "realloc");
+	tag.buffer = new_buffer;
+	tag.buffer_size = len;
+    }
+    memcpy(tag.buffer, buffer, len);
+    tag.len = len;
+}
+
+/**
+ * @brief Remember the tag on an {async, Tag, Request} request
+ *
+ * @param offset set to the offset of the Request to dispatch preceded
+ *               by a version byte or 0 if the request wasn't tagged
+ *
+ * @return 0 on success or -1 if the tag is malformed
+ */
+static int erlcmd_strip_tag(char *req, size_t *offset)
+{
+    int index = 0;
+    int arity;
+    char atom[MAXATOMLEN];
+
+    tag.len = 0;
+    *offset = 0;
+    if (ei_decode_version(req, &index, NULL) < 0 ||
+	    ei_decode_tuple_header(req, &index, &arity) < 0 ||
+	    arity != 3 ||
+	    ei_decode_atom(req, &index, atom) < 0 ||
+	    strcmp(atom, "async") != 0)
+	return 0;
+
+    int tag_start = index;
+    if (ei_skip_term(req, &index) < 0)
+	return -1;
+
+    erlcmd_save_tag(req + tag_start, index - tag_start);
+
+    /* Overwrite the end of the tag with a version byte so that the
+     * request looks like it was sent by itself.
+     */
+    req[index - 1] = (char) ERL_VERSION_MAGIC;
+    *offset = index - 1;
+    return 0;
+}
+
+/**
+ * @brief Strip the wrapper from a {priority, Priority, Request} request
+ *
+ * @param offset set to the offset of the Request preceded by a version
+ *               byte or 0 if the request didn't have a priority
+ *
+ * @return 0 on success or -1 if the priority is out of range. The
+ *         offset is still set when the Request can be found so that
+ *         the error can keep its tag.
+ */
+static int erlcmd_strip_priority(char *req, size_t *offset, int *priority)
+{
+    int index = 0;
+    int arity;
+    char atom[MAXATOMLEN];
+    long value;
+
+    *priority = ERLCMD_DEFAULT_PRIORITY;
+    *offset = 0;
+    if (ei_decode_version(req, &index, NULL) < 0 ||
+	    ei_decode_tuple_header(req, &index, &arity) < 0 ||
+	    arity != 3 ||
+	    ei_decode_atom(req, &index, atom) < 0 ||
+	    strcmp(atom, "priority") != 0)
+	return 0;
+
+    int rc = 0;
+    int priority_start = index;
+    if (ei_decode_long(req, &index, &value) < 0 ||
+	    value < 0 ||
+	    value >= ERLCMD_PRIORITIES) {
+	index = priority_start;
+	if (ei_skip_term(req, &index) < 0)
+	    return -1;
+	rc = -1;
+    } else
+	*priority = value;
+
+    // Same trick as erlcmd_strip_tag()
+    req[index - 1] = (char) ERL_VERSION_MAGIC;
+    *offset = index - 1;
+    return rc;
+}
+
+/**
+ * @return 1 if the request is a term and 0 if it's a binary command
+ */
+static int erlcmd_is_term(const char *req, size_t len)
+{
+    return len > 0 && (uint8_t) req[0] == ERL_VERSION_MAGIC;
+}
+
+/**
+ * @brief Reply {error, badarg} to a request that can't be dispatched
+ *
+ * The reply goes to the request's handle and is tagged if the request
+ * has a tag that can be decoded.
+ */
+static void erlcmd_reject(uint16_t handle, char *req, size_t len, const char *reason)
+{
+    size_t offset;
+    tag.len = 0;
+    if (erlcmd_is_term(req, len))
+	erlcmd_strip_tag(req, &offset);
+
+    handles.current = handle;
+    erlcmd_bad_request("%s", reason);
+    stats.requests++;
+    handles.current = 0;
+    tag.len = 0;
+}
+
+static void erlcmd_dispatch_opcode(struct erlcmd *handler, const uint8_t *req, size_t len)
+{
+    uint8_t opcode = req[0];
+    const struct erlcmd_opcode *op = (opcode < handler->opcode_count ? &handler->opcodes[opcode] : NULL);
+    size_t arg_len = len - 1;
+    if (!op || !op->handler) {
+	erlcmd_bad_request("unknown opcode: %d", opcode);
+	return;
+    }
+    if (arg_len < op->arg_len || (!op->variable && arg_len != op->arg_len)) {
+	erlcmd_bad_request("opcode %d: bad length %d", opcode, (int) arg_len);
+	return;
+    }
+
+    op->handler(req + 1, arg_len, handler->cookie);
+}
+
+static void erlcmd_dispatch(struct erlcmd *handler, uint16_t handle, const char *req, size_t len)
+{
+    uint64_t start = stats_now_ns();
+    handles.current = handle;
+    if (handle != 0)
+	handler = handles.lookup(handle);
+
+    if (!handler)
+	erlcmd_bad_request("unknown handle: %d", handle);
+    else if (len == 0)
+	erlcmd_bad_request("empty request");
+    else if (erlcmd_is_term(req, len))
+	handler->request_handler(req, handler->cookie);
+    else
+	erlcmd_dispatch_opcode(handler, (const uint8_t *) req, len);
+    stats_record(&stats.request_time, stats_now_ns() - start);
+    stats.requests++;
+    handles.current = 0;
+    tag.len = 0;
+}
+
+/**
+ * @brief Copy a request to the end of its priority's queue
+ */
+static void erlcmd_enqueue(struct erlcmd *handler, uint16_t handle, char *req, size_t len, int priority)
+{
+    size_t offset = 0;
+    if (erlcmd_is_term(req, len) && erlcmd_strip_tag(req, &offset) < 0) {
+	erlcmd_reject(handle, req, len, "async: bad tag");
+	return;
+    }
+    size_t req_len = len - offset;
+
+    struct erlcmd_request *r = malloc(sizeof(struct erlcmd_request) + req_len + tag.len);
+    if (!r)
+	err(EXIT_FAILURE, "malloc");
+
+    r->next = NULL;
+    r->queued_ns = stats_now_ns();
+    r->handle = handle;
+    r->len = req_len;
+    memcpy(r->req, req + offset, req_len);
+    r->tag = r->req + req_len;
+    r->tag_len = tag.len;
+    memcpy(r->tag, tag.buffer, tag.len);
+    tag.len = 0;
+
+    *handler->queue_tail[priority] = r;
+    handler->queue_tail[priority] = &r->next;
+    handler->queued++;
+    if (handler->queued > stats.max_queued)
+	stats.max_queued = handler->queued;
+}
+
+static struct erlcmd_request *erlcmd_dequeue(struct erlcmd *handler)
+{
+    for (int i = 0; i < ERLCMD_PRIORITIES; i++) {
+	struct erlcmd_request *r = handler->queue[i];
+	if (r) {
+	    handler->queue[i] = r->next;
+	    if (!handler->queue[i])
+		handler->queue_tail[i] = &handler->queue[i];
+	    handler->queued--;
+	    stats_record(&stats.queue_time, stats_now_ns() - r->queued_ns);
+	    return r;
 	}
+    }
+    return NULL;
+}
+
+/**
+ * @return the number of requests waiting to run
+ */
+size_t erlcmd_queued(struct erlcmd *handler)
+{
+    return handler->queued;
+}
+
+/**
+ * @brief Run the most urgent queued request
+ *
+ * Only one request is run so that the caller can check for more
+ * urgent ones before the next.
+ */
+void erlcmd_run_queued(struct erlcmd *handler)
+{
+    struct erlcmd_request *r = erlcmd_dequeue(handler);
+    if (!r)
+	return;
+
+    erlcmd_save_tag(r->tag, r->tag_len);
+    erlcmd_dispatch(handler, r->handle, r->req, r->len);
+    free(r);
+
+    erlcmd_flush();
+}
+
+/**
+ * @brief Look at a request that's waiting to run
+ *
+ * Handlers use this to combine the requests that run after the one
+ * being dispatched with it. Requests to hub handles are queued on the
+ * hub's handler, so they're never combined.
+ *
+ * @param n 0 for the next request to run, 1 for the one after, etc.
+ * @return the request or NULL if fewer are queued or it's a binary
+ *         command
+ */
+const char *erlcmd_peek_queued(struct erlcmd *handler, size_t n)
+{
+    for (int i = 0; i < ERLCMD_PRIORITIES; i++) {
+	for (struct erlcmd_request *r = handler->queue[i]; r; r = r->next) {
+	    if (n == 0)
+		return erlcmd_is_term(r->req, r->len) ? r->req : NULL;
+	    n--;
+	}
+    }
+    return NULL;
+}
+
+/**
+ * @brief Reply to the next queued request and drop it from the queue
+ *
+ * This is for requests that were handled along with the one being
+ * dispatched. See erlcmd_peek_queued().
+ */
+void erlcmd_reply_queued(struct erlcmd *handler, char *response, size_t len)
+{
+    struct erlcmd_deferred reply;
+    erlcmd_defer_queued(handler, &reply);
+    erlcmd_reply_deferred(&reply, response, len);
+}
+
+static void erlcmd_copy_tag(struct erlcmd_deferred *reply, uint16_t handle,
+			    const char *tag_buffer, size_t tag_len)
+{
+    reply->handle = handle;
+    reply->tag = NULL;
+    reply->tag_len = tag_len;
+    if (tag_len > 0) {
+	reply->tag = malloc(tag_len);
+	if (!reply->tag)
+	    err(EXIT_FAILURE, "malloc");
+	memcpy(reply->tag, tag_buffer, tag_len);
+    }
+}
+
+/**
+ * @brief Reply to the request being dispatched later
+ *
+ * The handler returns without replying and calls
+ * erlcmd_reply_deferred() once it has the reply.
+ */
+void erlcmd_defer(struct erlcmd_deferred *reply)
+{
+    erlcmd_copy_tag(reply, handles.current, tag.buffer, tag.len);
+}
+
+/**
+ * @brief Like erlcmd_reply_queued(), but reply later
+ *
+ * The next queued request is dropped from the queue. See
+ * erlcmd_peek_queued().
+ */
+void erlcmd_defer_queued(struct erlcmd *handler, struct erlcmd_deferred *reply)
+{
+    struct erlcmd_request *r = erlcmd_dequeue(handler);
+    if (!r)
+	errx(EXIT_FAILURE, "No queued request to reply to");
+
+    erlcmd_copy_tag(reply, r->handle, r->tag, r->tag_len);
+    stats.requests++;
+    stats.coalesced++;
+    free(r);
+}
+
+/**
+ * @brief Send the reply to a request that was deferred
+ *
+ * It's sent from the handle that the request was for and formatted
+ * like erlcmd_reply() would have.
+ */
+void erlcmd_reply_deferred(struct erlcmd_deferred *reply, char *response, size_t len)
+{
+    uint16_t previous = erlcmd_select_handle(reply->handle);
+    erlcmd_send_reply(reply->tag, reply->tag_len, response, len);
+    erlcmd_select_handle(previous);
 
-	wrote += amount_written;
-    } while (wrote < len);
+    free(reply->tag);
+    reply->tag = NULL;
+    reply->tag_len = 0;
 }
 
 /**
@@ -68,23 +849,83 @@ void erlcmd_send(char *response, size_t len)
  */
 static size_t erlcmd_try_dispatch(struct erlcmd *handler)
 {
+    const char *msg = handler->buffer + handler->start;
+    size_t available = handler->index - handler->start;
+
     /* Check for length field */
-    if (handler->index < sizeof(uint16_t))
+    if (available < (size_t) packet_size)
 	return 0;
 
-    uint16_t be_len;
-    memcpy(&be_len, handler->buffer, sizeof(uint16_t));
-    size_t msglen = ntohs(be_len);
-    if (msglen + sizeof(uint16_t) > sizeof(handler->buffer))
+    size_t msglen = erlcmd_decode_length(msg);
+    if (msglen > ERLCMD_MAX_MESSAGE_SIZE)
 	errx(EXIT_FAILURE, "Message too long");
 
     /* Check whether we've received the entire message */
-    if (msglen + sizeof(uint16_t) > handler->index)
+    if (msglen + packet_size > available)
 	return 0;
 
-    handler->request_handler(handler->buffer, handler->cookie);
+    char *req = handler->buffer + handler->start + packet_size;
+    size_t len = msglen;
+    stats.bytes_in += msglen + packet_size;
+
+    /* A request that's too short for a handle is dispatched to handle
+     * 0 so that it gets {error, badarg}.
+     */
+    uint16_t handle = 0;
+    if (handles.lookup && len >= ERLCMD_HANDLE_SIZE) {
+	handle = erlcmd_get16((const uint8_t *) req);
+	req += ERLCMD_HANDLE_SIZE;
+	len -= ERLCMD_HANDLE_SIZE;
+    } else if (handles.lookup)
+	len = 0;
+
+    int priority = ERLCMD_DEFAULT_PRIORITY;
+    size_t offset = 0;
+    size_t tag_offset = 0;
+    if (erlcmd_is_term(req, len) && erlcmd_strip_priority(req, &offset, &priority) < 0)
+	erlcmd_reject(handle, req + offset, len - offset, "priority: out of range");
+    else if (scheduling)
+	erlcmd_enqueue(handler, handle, req + offset, len - offset, priority);
+    else if (erlcmd_is_term(req + offset, len - offset) &&
+	     erlcmd_strip_tag(req + offset, &tag_offset) < 0)
+	erlcmd_reject(handle, req + offset, len - offset, "async: bad tag");
+    else
+	erlcmd_dispatch(handler, handle, req + offset + tag_offset, len - offset - tag_offset);
 
-    return msglen + sizeof(uint16_t);
+    return msglen + packet_size;
+}
+
+/**
+ * @brief Make room in the buffer for the rest of a partial message
+ *
+ * The unprocessed bytes are only moved to the front when the
+ * partial message wouldn't fit otherwise, and the buffer is only
+ * grown when a message is bigger than it.
+ */
+static void erlcmd_make_room(struct erlcmd *handler)
+{
+    size_t available = handler->index - handler->start;
+    size_t needed = handler->buffer_size ? handler->buffer_size : ERLCMD_INITIAL_BUF_SIZE;
+    if (available >= (size_t) packet_size)
+	needed = erlcmd_decode_length(handler->buffer + handler->start) + packet_size;
+
+    if (handler->start + needed <= handler->buffer_size &&
+	    handler->index < handler->buffer_size)
+	return;
+
+    if (handler->start > 0) {
+	memmove(handler->buffer, handler->buffer + handler->start, available);
+	handler->start = 0;
+	handler->index = available;
+    }
+
+    if (needed > handler->buffer_size) {
+	char *buffer = realloc(handler->buffer, needed);
+	if (!buffer)
+	    err(EXIT_FAILURE, "realloc");
+	handler->buffer = buffer;
+	handler->buffer_size = needed;
+    }
 }
 
 /**
@@ -92,7 +933,9 @@ static size_t erlcmd_try_dispatch(struct erlcmd *handler)
  */
 void erlcmd_process(struct erlcmd *handler)
 {
-    ssize_t amount_read = read(STDIN_FILENO, handler->buffer + handler->index, sizeof(handler->buffer) - handler->index);
+    erlcmd_make_room(handler);
+
+    ssize_t amount_read = read(STDIN_FILENO, handler->buffer + handler->index, handler->buffer_size - handler->index);
     if (amount_read < 0) {
 	/* EINTR is ok to get, since we were interrupted by a signal. */
 	if (errno == EINTR)
@@ -106,20 +949,224 @@ void erlcmd_process(struct erlcmd *handler)
     }
 
     handler->index += amount_read;
+    if (handler->index - handler->start > stats.max_input_backlog)
+	stats.max_input_backlog = handler->index - handler->start;
+
     for (;;) {
 	size_t bytes_processed = erlcmd_try_dispatch(handler);
 
 	if (bytes_processed == 0) {
 	    /* Only have part of the command to process. */
 	    break;
-	} else if (handler->index > bytes_processed) {
-	    /* Processed the command and there's more data. */
-	    memmove(handler->buffer, &handler->buffer[bytes_processed], handler->index - bytes_processed);
-	    handler->index -= bytes_processed;
-	} else {
+	}
+
+	handler->start += bytes_processed;
+	if (handler->start == handler->index) {
 	    /* Processed the whole buffer. */
+	    handler->start = 0;
 	    handler->index = 0;
 	    break;
 	}
     }
+
+    /* Send all of the responses at once. */
+    erlcmd_flush();
+}
+
+static int erlcmd_epoll_fd()
+{
+    if (reactor.epoll_fd < 0) {
+	reactor.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (reactor.epoll_fd < 0)
+	    err(EXIT_FAILURE, "epoll_create1");
+    }
+    return reactor.epoll_fd;
+}
+
+static void erlcmd_epoll_ctl(int op, int fd, uint32_t events)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = fd;
+    if (epoll_ctl(erlcmd_epoll_fd(), op, fd, &event) < 0)
+	err(EXIT_FAILURE, "epoll_ctl(%d)", fd);
+}
+
+/**
+ * @brief Call back from erlcmd_run() when fd has any of the epoll
+ *        events
+ *
+ * Watching an fd again replaces its events and callback. Fds must be
+ * unwatched before they're closed.
+ */
+void erlcmd_watch(int fd, uint32_t events,
+		  void (*callback)(int fd, uint32_t events, void *cookie),
+		  void *cookie)
+{
+    if (fd <= STDOUT_FILENO)
+	errx(EXIT_FAILURE, "Can't watch fd %d", fd);
+
+    if ((size_t) fd >= reactor.watch_count) {
+	size_t count = reactor.watch_count ? reactor.watch_count : 16;
+	while (count <= (size_t) fd)
+	    count *= 2;
+
+	reactor.watches = realloc(reactor.watches, count * sizeof(struct erlcmd_watch));
+	if (!reactor.watches)
+	    err(EXIT_FAILURE, "realloc");
+	memset(&reactor.watches[reactor.watch_count], 0,
+	       (count - reactor.watch_count) * sizeof(struct erlcmd_watch));
+	reactor.watch_count = count;
+    }
+
+    struct erlcmd_watch *watch = &reactor.watches[fd];
+    erlcmd_epoll_ctl(watch->callback ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, events);
+    watch->callback = callback;
+    watch->cookie = cookie;
+    watch->timer = 0;
+    watch->handle = handles.current;
+}
+
+/**
+ * @brief Stop watching fd
+ *
+ * It's ok to unwatch an fd that isn't watched, and to unwatch fds
+ * from a callback. Events that were already returned for them are
+ * dropped.
+ */
+void erlcmd_unwatch(int fd)
+{
+    if (fd < 0 || (size_t) fd >= reactor.watch_count || !reactor.watches[fd].callback)
+	return;
+
+    erlcmd_epoll_ctl(EPOLL_CTL_DEL, fd, 0);
+    reactor.watches[fd].callback = NULL;
+}
+
+/**
+ * @brief Create a watched timer that's set with erlcmd_timer_set()
+ *
+ * The timer is read before the callback, so callbacks don't need to.
+ *
+ * @return the timer's fd
+ */
+int erlcmd_timer_create(void (*callback)(int fd, uint32_t events, void *cookie),
+			void *cookie)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+	err(EXIT_FAILURE, "timerfd_create");
+
+    erlcmd_watch(fd, EPOLLIN, callback, cookie);
+    reactor.watches[fd].timer = 1;
+    return fd;
+}
+
+/**
+ * @brief Call back once at a CLOCK_MONOTONIC time
+ *
+ * Deadlines in the past expire right away. Setting a timer that
+ * hasn't been handled yet replaces the earlier deadline.
+ *
+ * @param deadline_ns the time in nanoseconds or 0 to cancel
+ */
+void erlcmd_timer_set(int timer_fd, uint64_t deadline_ns)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = deadline_ns / 1000000000ULL;
+    its.it_value.tv_nsec = deadline_ns % 1000000000ULL;
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+	err(EXIT_FAILURE, "timerfd_settime");
+}
+
+void erlcmd_timer_close(int timer_fd)
+{
+    erlcmd_unwatch(timer_fd);
+    close(timer_fd);
+}
+
+static void erlcmd_dispatch_event(const struct epoll_event *event)
+{
+    int fd = event->data.fd;
+    if ((size_t) fd >= reactor.watch_count)
+	return;
+
+    struct erlcmd_watch *watch = &reactor.watches[fd];
+    if (!watch->callback)
+	return;
+
+    if (watch->timer) {
+	/* Nothing to read if the timer was set again after this
+	 * event was returned.
+	 */
+	uint64_t expirations;
+	if (read(fd, &expirations, sizeof(expirations)) < 0) {
+	    if (errno == EAGAIN || errno == EINTR)
+		return;
+	    err(EXIT_FAILURE, "read(timerfd)");
+	}
+    }
+
+    handles.current = watch->handle;
+    watch->callback(fd, event->events, watch->cookie);
+    handles.current = 0;
+}
+
+/* Only wait on stdout if responses couldn't all be written. */
+static void erlcmd_watch_stdout()
+{
+    int pending = erlcmd_output_pending() > 0;
+    if (pending == reactor.stdout_watched)
+	return;
+
+    erlcmd_epoll_ctl(pending ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, STDOUT_FILENO, EPOLLOUT);
+    reactor.stdout_watched = pending;
+}
+
+/**
+ * @brief Process requests from Erlang and events on the watched fds
+ *        until Erlang closes the port
+ *
+ * Requests are read after the other events from the same wakeup
+ * since a request could close an fd that has an event waiting.
+ * Everything that was sent is flushed before waiting again.
+ */
+void erlcmd_run(struct erlcmd *handler)
+{
+    erlcmd_epoll_ctl(EPOLL_CTL_ADD, STDIN_FILENO, EPOLLIN);
+
+    for (;;) {
+	erlcmd_flush();
+	erlcmd_watch_stdout();
+
+	/* Don't wait while there are scheduled requests to run */
+	struct epoll_event events[ERLCMD_MAX_EVENTS];
+	int count = epoll_wait(erlcmd_epoll_fd(), events, ERLCMD_MAX_EVENTS,
+			       erlcmd_queued(handler) > 0 ? 0 : -1);
+	if (count < 0) {
+	    // Retry if EINTR
+	    if (errno == EINTR)
+		continue;
+
+	    err(EXIT_FAILURE, "epoll_wait");
+	}
+
+	int input_ready = 0;
+	for (int i = 0; i < count; i++) {
+	    if (events[i].data.fd == STDIN_FILENO)
+		input_ready = 1;
+	    else if (events[i].data.fd == STDOUT_FILENO)
+		erlcmd_flush();
+	    else
+		erlcmd_dispatch_event(&events[i]);
+	}
+
+	if (input_ready)
+	    erlcmd_process(handler);
+
+	/* Run one so that more urgent requests can arrive first */
+	erlcmd_run_queued(handler);
+    }
 }
@@ -20,24 +20,178 @@
 #define ERLCMD_H
 
 #include <ei.h>
+#include <stdint.h>
+#include <sys/epoll.h>
 
 /*
  * Erlang request/response processing
+ *
+ * Messages are framed with a big endian length like Erlang's
+ * {packet, 2} or {packet, 4} port options. The receive buffer grows
+ * to fit the largest message that's been seen and requests are
+ * dispatched in place.
+ */
+#define ERLCMD_INITIAL_BUF_SIZE 4096
+#define ERLCMD_MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+#define ERLCMD_MAX_OUTPUT_QUEUE (1024 * 1024)
+
+/*
+ * Messages to Erlang start with a type byte and then the encoded
+ * term. A request can be wrapped as {async, Tag, Request} to have its
+ * reply sent as a tagged reply containing {Tag, Reply}. This lets
+ * Erlang have many requests in flight without waiting on each one.
+ */
+#define ERLCMD_REPLY 0
+#define ERLCMD_NOTIFICATION 1
+#define ERLCMD_TAGGED_REPLY 2
+
+/*
+ * Requests that can't be decoded get an {error, badarg} reply and
+ * system calls that fail get {error, Reason, Errno}. Neither stops
+ * erlang-ale, so one bad request or a glitch on a bus doesn't cost a
+ * restart. Device accesses that fail with an error that's likely
+ * transient can be retried automatically. See erlcmd_set_retries().
+ */
+#define ERLCMD_MAX_RETRIES 100
+
+/*
+ * A request can also be wrapped as {priority, Priority, Request} where
+ * Request may be tagged. When scheduling is enabled, requests are
+ * queued as they arrive and the most urgent one runs next, so a
+ * latency critical device doesn't wait behind bulk transfers. Priority
+ * 0 is the most urgent. Requests without a priority get the default.
+ * Without scheduling, requests run in order and priorities are ignored.
+ */
+#define ERLCMD_PRIORITIES 4
+#define ERLCMD_DEFAULT_PRIORITY 2
+
+/*
+ * Requests that don't start with the external term format's version
+ * byte are binary commands: an opcode byte followed by arguments with
+ * a fixed big endian layout. They're dispatched through a table
+ * indexed by opcode without decoding any terms, which matters for
+ * small requests like reading a pin. Replies are still terms. Binary
+ * commands can't be tagged or given a priority.
+ */
+struct erlcmd_opcode
+{
+    void (*handler)(const uint8_t *args, size_t len, void *cookie);
+    size_t arg_len;  // Length of the arguments or the minimum if variable
+    int variable;    // 1 if the arguments end with data of any length
+};
+
+static inline uint16_t erlcmd_get16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t erlcmd_get32(const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*
+ * A hub process serves several GPIOs, I2C buses and SPI devices. Each
+ * one is a handle with its own handler. Requests start with the
+ * handle as a 16-bit big endian number and messages to Erlang have it
+ * after the type byte:
+ *
+ *   <<Handle:16, Request/binary>>
+ *   <<Type, Handle:16, Term/binary>>
+ *
+ * Handle 0 is the handler passed to erlcmd_run(). Watches and timers
+ * send their notifications from the handle that they were created by.
+ */
+#define ERLCMD_HANDLE_SIZE 2
+
+/*
+ * A request handler that hands its device access to a bus worker
+ * replies when the access completes. erlcmd_defer() saves the handle
+ * and tag of the request being dispatched for
+ * erlcmd_reply_deferred().
  */
-#define ERLCMD_BUF_SIZE 1024
+struct erlcmd_deferred
+{
+    uint16_t handle;
+    char *tag;
+    size_t tag_len;
+};
+
+struct erlcmd_request;
+
 struct erlcmd
 {
-    char buffer[ERLCMD_BUF_SIZE];
-    size_t index;
+    char *buffer;
+    size_t buffer_size;
+    size_t start;  // Offset of the first unprocessed byte
+    size_t index;  // Offset after the last byte read
 
     void (*request_handler)(const char *emsg, void *cookie);
     void *cookie;
+
+    // Binary commands
+    const struct erlcmd_opcode *opcodes;
+    size_t opcode_count;
+
+    // Requests waiting to run when scheduling is enabled
+    struct erlcmd_request *queue[ERLCMD_PRIORITIES];
+    struct erlcmd_request **queue_tail[ERLCMD_PRIORITIES];
+    size_t queued;
 };
 
+void erlcmd_set_packet_size(int bytes);
+int erlcmd_packet_size();
+
 void erlcmd_init(struct erlcmd *handler,
 		 void (*request_handler)(const char *req, void *cookie),
 		 void *cookie);
+void erlcmd_set_opcodes(struct erlcmd *handler, const struct erlcmd_opcode *opcodes, size_t count);
 void erlcmd_send(char *response, size_t len);
+void erlcmd_reply(char *response, size_t len);
 void erlcmd_process(struct erlcmd *handler);
 
+void erlcmd_bad_request(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void erlcmd_encode_errno_error(char *buf, int *index, const char *reason, int errnum);
+
+void erlcmd_set_handles(struct erlcmd *(*lookup)(uint16_t handle));
+uint16_t erlcmd_select_handle(uint16_t handle);
+
+void erlcmd_set_retries(int count);
+int erlcmd_should_retry(int attempt, int errnum);
+
+void erlcmd_set_scheduling(int enable);
+size_t erlcmd_queued(struct erlcmd *handler);
+void erlcmd_run_queued(struct erlcmd *handler);
+const char *erlcmd_peek_queued(struct erlcmd *handler, size_t n);
+void erlcmd_reply_queued(struct erlcmd *handler, char *response, size_t len);
+
+void erlcmd_defer(struct erlcmd_deferred *reply);
+void erlcmd_defer_queued(struct erlcmd *handler, struct erlcmd_deferred *reply);
+void erlcmd_reply_deferred(struct erlcmd_deferred *reply, char *response, size_t len);
+
+void erlcmd_set_nonblocking(int enable);
+size_t erlcmd_output_pending();
+void erlcmd_flush();
+
+/*
+ * Every mode runs the same event loop. stdin, stdout while responses
+ * are waiting to be written and the fds that the mode watches are in
+ * one epoll set, so a wakeup costs the same however many pins and
+ * timers are watched. Callbacks get the fd and its ready epoll events.
+ * Timers from erlcmd_timer_create() are timerfds set to absolute
+ * deadlines. A callback can send notifications with erlcmd_send();
+ * they're flushed before the loop waits again.
+ */
+#define ERLCMD_MAX_EVENTS 64
+
+void erlcmd_watch(int fd, uint32_t events,
+		  void (*callback)(int fd, uint32_t events, void *cookie),
+		  void *cookie);
+void erlcmd_unwatch(int fd);
+int erlcmd_timer_create(void (*callback)(int fd, uint32_t events, void *cookie),
+			void *cookie);
+void erlcmd_timer_set(int timer_fd, uint64_t deadline_ns);
+void erlcmd_timer_close(int timer_fd);
+void erlcmd_run(struct erlcmd *handler) __attribute__((noreturn));
+
 #endif
@@ -0,0 +1,574 @@
+/*
+ * Copyright (C) 2015 Frank Hunleth
+ * Copyright (C) 2013 Erlang Solutions Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "gpio.h"
+#include "sim.h"
+#include "stats.h"
+
+//#define DEBUG
+#ifdef DEBUG
+#define debug(...) do { fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\r\n"); } while(0)
+#else
+#define debug(...)
+#endif
+
+/**
+ * @brief write a string to a sysfs file
+ * @return returns 0 on failure, >0 on success
+ */
+int sysfs_write_file(const char *pathname, const char *value)
+{
+    int fd = open(pathname, O_WRONLY);
+    if (fd < 0) {
+        debug("Error opening %s", pathname);
+        return 0;
+    }
+
+    size_t count = strlen(value);
+    ssize_t written = write(fd, value, count);
+    close(fd);
+
+    if (written < 0 || (size_t) written != count) {
+        warn("Error writing '%s' to %s", value, pathname);
+        return 0;
+    }
+
+    return written;
+}
+
+/* After a pin is exported, udev may still be changing the owner and
+ * mode of its files, so opening them fails for a moment. This is
+ * retried with exponential backoff for up to GPIO_EXPORT_WAIT_US.
+ * inotify isn't used since sysfs doesn't report these changes.
+ */
+#define GPIO_EXPORT_FIRST_DELAY_US 1000
+#define GPIO_EXPORT_MAX_DELAY_US 64000
+#define GPIO_EXPORT_WAIT_US 1000000
+
+/**
+ * @brief	Sleep before trying to access a newly exported pin again
+ *
+ * @return 	1 to try again, 0 if it's taken too long
+ */
+static int gpio_export_backoff(unsigned int *delay_us, unsigned int *waited_us)
+{
+    if (*waited_us >= GPIO_EXPORT_WAIT_US)
+        return 0;
+
+    usleep(*delay_us);
+    *waited_us += *delay_us;
+    if (*delay_us < GPIO_EXPORT_MAX_DELAY_US)
+        *delay_us *= 2;
+    return 1;
+}
+
+/**
+ * @return 	1 if the direction file has the specified value
+ */
+static int gpio_sysfs_direction_is(const char *direction_path, const char *value)
+{
+    int fd = open(direction_path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    char buf[8];
+    ssize_t amount_read = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (amount_read <= 0)
+        return 0;
+
+    buf[amount_read] = '\0';
+    return strncmp(buf, value, strlen(value)) == 0 && buf[strlen(value)] == '\n';
+}
+
+/**
+ * @brief	Export a pin through sysfs if it isn't already
+ *
+ * The files for the pin may not be usable right away. When opening
+ * many pins, exporting them all first and then calling gpio_init()
+ * on each overlaps the waits.
+ *
+ * @return 	1 for success, -1 for failure
+ */
+int gpio_export(unsigned int pin_number)
+{
+#ifndef ALE_NIF
+    if (sim_enabled())
+        return 1;
+#endif
+
+    char value_path[64];
+    sprintf(value_path, "/sys/class/gpio/gpio%d/value", pin_number);
+
+    /* Check if the gpio has been exported already. */
+    if (access(value_path, F_OK) != -1)
+        return 1;
+
+    char pinstr[64];
+    sprintf(pinstr, "%d", pin_number);
+    return sysfs_write_file("/sys/class/gpio/export", pinstr) ? 1 : -1;
+}
+
+// Memory mapped GPIO registers
+
+/* On the BCM2835, BCM2836, BCM2837 and BCM2711, /dev/gpiomem maps the
+ * GPIO register block without needing root. Once a pin has been
+ * configured through sysfs or the character device, its level can be
+ * read and set with plain loads and stores. Direction, pull and edge
+ * configuration are left to the kernel.
+ */
+#define GPIO_MMAP_SIZE  4096
+#define GPIO_MMAP_GPSET0 (0x1c / 4)
+#define GPIO_MMAP_GPCLR0 (0x28 / 4)
+#define GPIO_MMAP_GPLEV0 (0x34 / 4)
+
+static volatile uint32_t *gpio_mmap_regs = NULL;
+static int gpio_mmap_sysfs_base = -2; // -2 when not looked up yet
+
+/**
+ * @brief	Map the GPIO registers through /dev/gpiomem
+ *
+ * Pins opened after a successful call use the registers for reads and
+ * writes when they're on the SoC's GPIO controller. Otherwise they
+ * keep using sysfs or the character device.
+ *
+ * @return 	1 for success, -1 if the mapping isn't available
+ */
+int gpio_mmap_open()
+{
+    if (gpio_mmap_regs)
+        return 1;
+
+    int fd = open("/dev/gpiomem", O_RDWR | O_SYNC | O_CLOEXEC);
+    if (fd < 0) {
+        debug("Can't open /dev/gpiomem");
+        return -1;
+    }
+
+    void *regs = mmap(NULL, GPIO_MMAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (regs == MAP_FAILED) {
+        debug("Can't mmap /dev/gpiomem");
+        return -1;
+    }
+
+    gpio_mmap_regs = (volatile uint32_t *) regs;
+    return 1;
+}
+
+static int gpio_mmap_is_soc_label(const char *label)
+{
+    // pinctrl-bcm2835 also covers the BCM2836 and BCM2837
+    return strncmp(label, "pinctrl-bcm2835", 15) == 0 ||
+           strncmp(label, "pinctrl-bcm2711", 15) == 0;
+}
+
+/**
+ * @brief	Find the sysfs GPIO number of the SoC's first GPIO
+ *
+ * @return 	the base or -1 if the SoC's controller isn't found
+ */
+static int gpio_mmap_find_sysfs_base()
+{
+    DIR *dir = opendir("/sys/class/gpio");
+    if (!dir)
+        return -1;
+
+    int base = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && base < 0) {
+        if (strncmp(entry->d_name, "gpiochip", 8) != 0)
+            continue;
+
+        char path[300];
+        char contents[64];
+        snprintf(path, sizeof(path), "/sys/class/gpio/%s/label", entry->d_name);
+        FILE *fp = fopen(path, "r");
+        if (!fp)
+            continue;
+        int is_soc = fgets(contents, sizeof(contents), fp) && gpio_mmap_is_soc_label(contents);
+        fclose(fp);
+        if (!is_soc)
+            continue;
+
+        snprintf(path, sizeof(path), "/sys/class/gpio/%s/base", entry->d_name);
+        fp = fopen(path, "r");
+        if (!fp)
+            continue;
+        if (fscanf(fp, "%d", &base) != 1)
+            base = -1;
+        fclose(fp);
+    }
+    closedir(dir);
+    return base;
+}
+
+static void gpio_mmap_attach_sysfs(struct gpio *pin)
+{
+    if (!gpio_mmap_regs)
+        return;
+
+    if (gpio_mmap_sysfs_base == -2)
+        gpio_mmap_sysfs_base = gpio_mmap_find_sysfs_base();
+
+    int number = pin->pin_number - gpio_mmap_sysfs_base;
+    if (gpio_mmap_sysfs_base >= 0 && number >= 0 && number < GPIO_MMAP_MAX_PINS)
+        pin->mmap_number = number;
+}
+
+#ifdef HAVE_GPIO_CDEV
+static void gpio_mmap_attach_cdev(struct gpio **pins, int chip_fd, int count)
+{
+    if (!gpio_mmap_regs)
+        return;
+
+    struct gpiochip_info info;
+    memset(&info, 0, sizeof(info));
+    if (ioctl(chip_fd, GPIO_GET_CHIPINFO_IOCTL, &info) < 0 ||
+            !gpio_mmap_is_soc_label(info.label))
+        return;
+
+    // Line offsets on the SoC's chip are the GPIO numbers
+    for (int i = 0; i < count; i++) {
+        if (pins[i]->pin_number < GPIO_MMAP_MAX_PINS)
+            pins[i]->mmap_number = pins[i]->pin_number;
+    }
+}
+#endif
+
+// GPIO functions
+
+/**
+ * @brief	Open and configure a GPIO
+ *
+ * @param	pin           The pin structure
+ * @param	pin_number    The GPIO pin
+ * @param   dir           Direction of pin (input or output)
+ *
+ * @return 	1 for success, -1 for failure
+ */
+int gpio_init(struct gpio *pin, unsigned int pin_number, enum gpio_state dir)
+{
+    /* Initialize the pin structure. */
+    pin->backend = GPIO_BACKEND_SYSFS;
+    pin->state = dir;
+    pin->fd = -1;
+    pin->pin_number = pin_number;
+    pin->line_index = 0;
+    pin->int_mode = GPIO_INT_NONE;
+    pin->last_value = -1;
+    pin->last_seqno = 0;
+    pin->mmap_number = -1;
+    pin->debounce_us = 0;
+    pin->debounce_kernel = 0;
+    pin->debounce_deadline_ns = 0;
+    pin->count_report_ns = 0;
+    pin->count_deadline_ns = 0;
+
+#ifndef ALE_NIF
+    if (sim_enabled())
+        return sim_gpio_open(pin);
+#endif
+
+    if (gpio_export(pin_number) < 0)
+        return -1;
+
+    /* Construct the gpio control file paths */
+    char direction_path[64];
+    sprintf(direction_path, "/sys/class/gpio/gpio%d/direction", pin_number);
+
+    char value_path[64];
+    sprintf(value_path, "/sys/class/gpio/gpio%d/value", pin_number);
+
+    /* The direction file may not exist if the pin only works one way.
+       It is ok if the direction file doesn't exist, but if it does
+       exist, we must be able to write it. Inputs that are already
+       inputs are left alone. Outputs are always written since that
+       also drives them low.
+    */
+    unsigned int delay_us = GPIO_EXPORT_FIRST_DELAY_US;
+    unsigned int waited_us = 0;
+    if (access(direction_path, F_OK) != -1 &&
+            !(dir == GPIO_INPUT && gpio_sysfs_direction_is(direction_path, "in"))) {
+	const char *dir_string = (dir == GPIO_OUTPUT ? "out" : "in");
+        while (!sysfs_write_file(direction_path, dir_string)) {
+            if (!gpio_export_backoff(&delay_us, &waited_us))
+                return -1;
+        }
+    }
+
+    pin->pin_number = pin_number;
+
+    /* Open the value file for quick access later */
+    while ((pin->fd = open(value_path, pin->state == GPIO_OUTPUT ? O_RDWR : O_RDONLY)) < 0) {
+        if (!gpio_export_backoff(&delay_us, &waited_us))
+            return -1;
+    }
+
+    gpio_mmap_attach_sysfs(pin);
+    return 1;
+}
+
+#ifdef HAVE_GPIO_CDEV
+/**
+ * @brief	Return the line request flags for an interrupt mode
+ */
+uint64_t gpio_cdev_edge_flags(enum interrupt_mode mode)
+{
+    switch (mode) {
+    case GPIO_INT_NONE:
+        return 0;
+    case GPIO_INT_RISING:
+        return GPIO_V2_LINE_FLAG_EDGE_RISING;
+    case GPIO_INT_FALLING:
+        return GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    default:
+        return GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    }
+}
+#endif
+
+/**
+ * @brief	Open and configure GPIO lines on a GPIO character device
+ *
+ * Unlike sysfs, the kernel queues every edge with a timestamp and
+ * sequence number on the line request, so none are lost between
+ * calls to gpio_process.
+ *
+ * All of the lines are put in one line request so that they can be
+ * read or written together with one ioctl. They share the request's
+ * fd and each pin's line_index is its bit in the request's values.
+ *
+ * @param	pins          The pin structures
+ * @param	chip_fd       An open /dev/gpiochipN
+ * @param	offsets       The line offsets on the chip
+ * @param	count         The number of lines (max GPIO_V2_LINES_MAX)
+ * @param   dir           Direction of the pins (input or output)
+ *
+ * @return 	1 for success, -1 for failure
+ */
+int gpio_cdev_init(struct gpio **pins, int chip_fd, const unsigned int *offsets, int count, enum gpio_state dir)
+{
+    for (int i = 0; i < count; i++) {
+        struct gpio *pin = pins[i];
+        pin->backend = GPIO_BACKEND_CDEV;
+        pin->state = dir;
+        pin->fd = -1;
+        pin->pin_number = offsets[i];
+        pin->line_index = i;
+        pin->int_mode = GPIO_INT_NONE;
+        pin->last_value = -1;
+        pin->last_seqno = 0;
+        pin->mmap_number = -1;
+        pin->debounce_us = 0;
+        pin->debounce_kernel = 0;
+        pin->debounce_deadline_ns = 0;
+        pin->count_report_ns = 0;
+        pin->count_deadline_ns = 0;
+    }
+
+#ifdef HAVE_GPIO_CDEV
+    if (count < 1 || count > GPIO_V2_LINES_MAX)
+        return -1;
+
+    struct gpio_v2_line_request req;
+    memset(&req, 0, sizeof(req));
+    for (int i = 0; i < count; i++)
+        req.offsets[i] = offsets[i];
+    req.num_lines = count;
+    req.event_buffer_size = GPIO_CDEV_EVENT_BUFFER_SIZE;
+    strncpy(req.consumer, "erlang-ale", sizeof(req.consumer) - 1);
+    req.config.flags = (dir == GPIO_OUTPUT ? GPIO_V2_LINE_FLAG_OUTPUT : GPIO_V2_LINE_FLAG_INPUT);
+
+    if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+        debug("GPIO_V2_GET_LINE_IOCTL failed for line %d", offsets[0]);
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++)
+        pins[i]->fd = req.fd;
+
+    gpio_mmap_attach_cdev(pins, chip_fd, count);
+    return 1;
+#else
+    return -1;
+#endif
+}
+
+#ifdef HAVE_GPIO_CDEV
+/**
+ * @brief	Set the lines in mask on a line request to bits
+ *
+ * @return 	1 for success, -1 for failure
+ */
+int gpio_cdev_write_values(int fd, uint64_t mask, uint64_t bits)
+{
+    struct gpio_v2_line_values values;
+    values.bits = bits;
+    values.mask = mask;
+
+    uint64_t start = stats_now_ns();
+    int rc = ioctl(fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values);
+    stats_record_io(start, rc >= 0);
+    if (rc < 0)
+        return -1;
+    return 1;
+}
+
+/**
+ * @brief	Read the lines in mask on a line request
+ *
+ * @return 	1 for success, -1 for failure
+ */
+int gpio_cdev_read_values(int fd, uint64_t mask, uint64_t *bits)
+{
+    struct gpio_v2_line_values values;
+    values.bits = 0;
+    values.mask = mask;
+
+    uint64_t start = stats_now_ns();
+    int rc = ioctl(fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values);
+    stats_record_io(start, rc >= 0);
+    if (rc < 0)
+        return -1;
+    *bits = values.bits;
+    return 1;
+}
+#endif
+
+/**
+ * @brief	Set pin with the value "0" or "1"
+ *
+ * @param	pin           The pin structure
+ * @param       value         Value to set (0 or 1)
+ *
+ * @return 	1 for success, -1 for failure
+ */
+int gpio_write(struct gpio *pin, unsigned int val)
+{
+    if (pin->state != GPIO_OUTPUT)
+        return -1;
+
+    if (pin->mmap_number >= 0) {
+        int reg = (val ? GPIO_MMAP_GPSET0 : GPIO_MMAP_GPCLR0) + pin->mmap_number / 32;
+        gpio_mmap_regs[reg] = 1u << (pin->mmap_number % 32);
+        return 1;
+    }
+
+#ifndef ALE_NIF
+    if (pin->backend == GPIO_BACKEND_SIM)
+        return sim_gpio_write(pin, val);
+#endif
+
+#ifdef HAVE_GPIO_CDEV
+    if (pin->backend == GPIO_BACKEND_CDEV) {
+        uint64_t mask = 1ULL << pin->line_index;
+        return gpio_cdev_write_values(pin->fd, mask, val ? mask : 0);
+    }
+#endif
+
+    char buf = val ? '1' : '0';
+    uint64_t start = stats_now_ns();
+    ssize_t amount_written = pwrite(pin->fd, &buf, sizeof(buf), 0);
+    stats_record_io(start, amount_written == sizeof(buf));
+    if (amount_written < (ssize_t) sizeof(buf))
+        return -1;
+
+    return 1;
+}
+
+/**
+* @brief	Read the value of the pin
+*
+* @param	pin            The GPIO pin
+*
+* @return 	The pin value if success, -1 for failure
+*/
+int gpio_read(struct gpio *pin)
+{
+    if (pin->mmap_number >= 0) {
+        uint32_t levels = gpio_mmap_regs[GPIO_MMAP_GPLEV0 + pin->mmap_number / 32];
+        return (levels >> (pin->mmap_number % 32)) & 1;
+    }
+
+#ifndef ALE_NIF
+    if (pin->backend == GPIO_BACKEND_SIM)
+        return sim_gpio_read(pin);
+#endif
+
+#ifdef HAVE_GPIO_CDEV
+    if (pin->backend == GPIO_BACKEND_CDEV) {
+        uint64_t mask = 1ULL << pin->line_index;
+        uint64_t bits;
+        if (gpio_cdev_read_values(pin->fd, mask, &bits) < 0)
+            return -1;
+        return (bits & mask) ? 1 : 0;
+    }
+#endif
+
+    char buf;
+    uint64_t start = stats_now_ns();
+    ssize_t amount_read = pread(pin->fd, &buf, sizeof(buf), 0);
+    stats_record_io(start, amount_read == sizeof(buf));
+    if (amount_read < (ssize_t) sizeof(buf))
+        return -1;
+
+    return buf == '1' ? 1 : 0;
+}
+
+/**
+ * @brief	Release a GPIO opened by gpio_init or gpio_cdev_init
+ *
+ * @param	pin           The pin structure
+ */
+void gpio_close(struct gpio *pin)
+{
+    if (pin->fd < 0)
+        return;
+
+    /* Turn off edge detection so that the kernel doesn't keep
+       generating events for a pin that no one is watching. */
+    if (pin->backend == GPIO_BACKEND_SYSFS &&
+            pin->state == GPIO_INPUT &&
+            pin->int_mode != GPIO_INT_NONE) {
+        char path[64];
+        sprintf(path, "/sys/class/gpio/gpio%d/edge", pin->pin_number);
+        sysfs_write_file(path, "none");
+    }
+
+#ifndef ALE_NIF
+    if (pin->backend == GPIO_BACKEND_SIM)
+        sim_gpio_close(pin);
+#endif
+
+    close(pin->fd);
+    pin->fd = -1;
+    pin->int_mode = GPIO_INT_NONE;
+    pin->mmap_number = -1;
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2015 Frank Hunleth
+ * Copyright (C) 2013 Erlang Solutions Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * GPIO pin access shared by the port and the NIF
+ */
+
+#ifndef GPIO_H
+#define GPIO_H
+
+#include <stdint.h>
+
+#include <linux/gpio.h>
+
+/* The GPIO character device line request API (v2) is only in newer
+ * kernel headers. Without it, only the sysfs backend is available.
+ */
+#ifdef GPIO_V2_GET_LINE_IOCTL
+#define HAVE_GPIO_CDEV
+#endif
+
+/*
+ * GPIO handling definitions and prototypes
+ *
+ * None of these functions exit on errors, since the NIF can't.
+ */
+enum gpio_state {
+    GPIO_OUTPUT,
+    GPIO_INPUT
+};
+
+enum interrupt_mode {
+    GPIO_INT_NONE,
+    GPIO_INT_BOTH,
+    GPIO_INT_RISING,
+    GPIO_INT_FALLING,
+    GPIO_INT_SUMMARIZE,
+    GPIO_INT_COUNT      // Count rising edges instead of reporting them
+};
+
+enum gpio_backend {
+    GPIO_BACKEND_SYSFS,  // /sys/class/gpio/gpioN/value
+    GPIO_BACKEND_CDEV,   // /dev/gpiochipN line request
+    GPIO_BACKEND_SIM     // Simulated pin (see sim.h)
+};
+
+// Number of edge events that the kernel queues on a line request
+#define GPIO_CDEV_EVENT_BUFFER_SIZE 256
+
+// Highest GPIO number + 1 in the BCM283x/BCM2711 GPIO register block
+#define GPIO_MMAP_MAX_PINS 58
+
+struct gpio {
+    enum gpio_backend backend;
+    enum gpio_state state;
+    int fd;
+    int pin_number; // GPIO number for sysfs or line offset for cdev
+    int line_index; // Bit for this pin in a cdev line request's values
+    enum interrupt_mode int_mode;
+    int last_value;
+    uint32_t last_seqno;
+    int mmap_number; // SoC GPIO number when reads and writes use /dev/gpiomem, otherwise -1
+
+    // Debouncing. Edges are only reported after the input has been
+    // stable for debounce_us. The kernel does this on line requests
+    // that support it. Otherwise, debounce_deadline_ns is when the
+    // last edge that was seen becomes stable (0 if none pending).
+    uint32_t debounce_us;
+    int debounce_kernel;
+    uint64_t debounce_deadline_ns;
+    uint64_t debounce_timestamp;
+
+    // Edge counting (GPIO_INT_COUNT). The min and max periods are
+    // between counted edges since the count was last read or
+    // reported. Counts are reported every count_report_ns if it's
+    // non-zero.
+    uint64_t count;
+    uint64_t count_last_ns;
+    uint64_t count_min_period_ns;
+    uint64_t count_max_period_ns;
+    uint64_t count_report_ns;
+    uint64_t count_deadline_ns;
+};
+
+int sysfs_write_file(const char *pathname, const char *value);
+
+int gpio_mmap_open();
+
+int gpio_export(unsigned int pin_number);
+int gpio_init(struct gpio *pin, unsigned int pin_number, enum gpio_state dir);
+int gpio_cdev_init(struct gpio **pins, int chip_fd, const unsigned int *offsets, int count, enum gpio_state dir);
+int gpio_write(struct gpio *pin, unsigned int val);
+int gpio_read(struct gpio *pin);
+void gpio_close(struct gpio *pin);
+
+#ifdef HAVE_GPIO_CDEV
+uint64_t gpio_cdev_edge_flags(enum interrupt_mode mode);
+int gpio_cdev_write_values(int fd, uint64_t mask, uint64_t bits);
+int gpio_cdev_read_values(int fd, uint64_t mask, uint64_t *bits);
+#endif
+
+#endif
@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Optional NIF for reading and writing GPIOs without a port round
+ * trip. It uses the same pin code as the port.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <erl_nif.h>
+
+#include "gpio.h"
+
+struct gpio_nif_pin
+{
+    ErlNifMutex *lock; // Serializes close with reads and writes
+    struct gpio pin;
+};
+
+static ErlNifResourceType *gpio_nif_pin_type;
+
+static void gpio_nif_pin_dtor(ErlNifEnv *env, void *obj)
+{
+    struct gpio_nif_pin *res = (struct gpio_nif_pin *) obj;
+    gpio_close(&res->pin);
+    enif_mutex_destroy(res->lock);
+}
+
+static int gpio_nif_load(ErlNifEnv *env, void **priv_data, ERL_NIF_TERM load_info)
+{
+    gpio_nif_pin_type = enif_open_resource_type(env, NULL, "gpio_nif_pin",
+                                                gpio_nif_pin_dtor,
+                                                ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER,
+                                                NULL);
+    return gpio_nif_pin_type ? 0 : 1;
+}
+
+static int gpio_nif_upgrade(ErlNifEnv *env, void **priv_data, void **old_priv_data, ERL_NIF_TERM load_info)
+{
+    return gpio_nif_load(env, priv_data, load_info);
+}
+
+static void gpio_nif_unload(ErlNifEnv *env, void *priv_data)
+{
+}
+
+static ERL_NIF_TERM make_error(ErlNifEnv *env, const char *reason)
+{
+    return enif_make_tuple2(env, enif_make_atom(env, "error"), enif_make_atom(env, reason));
+}
+
+static int get_direction(ErlNifEnv *env, ERL_NIF_TERM term, enum gpio_state *dir)
+{
+    char dirstr[16];
+    if (!enif_get_atom(env, term, dirstr, sizeof(dirstr), ERL_NIF_LATIN1))
+        return 0;
+
+    if (strcmp(dirstr, "input") == 0)
+        *dir = GPIO_INPUT;
+    else if (strcmp(dirstr, "output") == 0)
+        *dir = GPIO_OUTPUT;
+    else
+        return 0;
+
+    return 1;
+}
+
+static struct gpio_nif_pin *gpio_nif_alloc()
+{
+    struct gpio_nif_pin *res = enif_alloc_resource(gpio_nif_pin_type, sizeof(struct gpio_nif_pin));
+    res->lock = enif_mutex_create("gpio_nif_pin");
+    res->pin.fd = -1;
+    res->pin.int_mode = GPIO_INT_NONE;
+    return res;
+}
+
+static ERL_NIF_TERM gpio_nif_make_pin(ErlNifEnv *env, struct gpio_nif_pin *res)
+{
+    ERL_NIF_TERM term = enif_make_resource(env, res);
+    enif_release_resource(res);
+    return enif_make_tuple2(env, enif_make_atom(env, "ok"), term);
+}
+
+/*
+ * open(Pin, Direction) opens a GPIO through /sys/class/gpio. This can
+ * sleep when exporting the pin, so it runs on a dirty I/O scheduler.
+ */
+static ERL_NIF_TERM gpio_nif_open_sysfs(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    unsigned int pin_number;
+    enum gpio_state dir;
+    if (!enif_get_uint(env, argv[0], &pin_number) ||
+            !get_direction(env, argv[1], &dir))
+        return enif_make_badarg(env);
+
+    struct gpio_nif_pin *res = gpio_nif_alloc();
+    if (gpio_init(&res->pin, pin_number, dir) < 0) {
+        enif_release_resource(res);
+        return make_error(env, "gpio_open_failed");
+    }
+
+    return gpio_nif_make_pin(env, res);
+}
+
+/*
+ * open(ChipPath, Offset, Direction) requests a line on a GPIO
+ * character device like /dev/gpiochip0.
+ */
+static ERL_NIF_TERM gpio_nif_open_cdev(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    char chip_path[64];
+    unsigned int offset;
+    enum gpio_state dir;
+    if (enif_get_string(env, argv[0], chip_path, sizeof(chip_path), ERL_NIF_LATIN1) <= 0 ||
+            !enif_get_uint(env, argv[1], &offset) ||
+            !get_direction(env, argv[2], &dir))
+        return enif_make_badarg(env);
+
+    int chip_fd = open(chip_path, O_RDWR | O_CLOEXEC);
+    if (chip_fd < 0)
+        return make_error(env, "gpio_open_failed");
+
+    struct gpio_nif_pin *res = gpio_nif_alloc();
+    struct gpio *pin = &res->pin;
+    int rc = gpio_cdev_init(&pin, chip_fd, &offset, 1, dir);
+
+    // The line request doesn't need the chip to stay open
+    close(chip_fd);
+
+    if (rc < 0) {
+        enif_release_resource(res);
+        return make_error(env, "gpio_open_failed");
+    }
+
+    return gpio_nif_make_pin(env, res);
+}
+
+static ERL_NIF_TERM gpio_nif_read(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    struct gpio_nif_pin *res;
+    if (!enif_get_resource(env, argv[0], gpio_nif_pin_type, (void **) &res))
+        return enif_make_badarg(env);
+
+    enif_mutex_lock(res->lock);
+    int value = res->pin.fd >= 0 ? gpio_read(&res->pin) : -2;
+    enif_mutex_unlock(res->lock);
+
+    if (value == -2)
+        return make_error(env, "closed");
+    else if (value < 0)
+        return make_error(env, "gpio_read_failed");
+    else
+        return enif_make_int(env, value);
+}
+
+static ERL_NIF_TERM gpio_nif_write(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    struct gpio_nif_pin *res;
+    unsigned int value;
+    if (!enif_get_resource(env, argv[0], gpio_nif_pin_type, (void **) &res) ||
+            !enif_get_uint(env, argv[1], &value))
+        return enif_make_badarg(env);
+
+    enif_mutex_lock(res->lock);
+    int rc = res->pin.fd >= 0 ? gpio_write(&res->pin, value) : -2;
+    enif_mutex_unlock(res->lock);
+
+    if (rc == -2)
+        return make_error(env, "closed");
+    else if (rc < 0)
+        return make_error(env, "gpio_write_failed");
+    else
+        return enif_make_atom(env, "ok");
+}
+
+static ERL_NIF_TERM gpio_nif_close(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    struct gpio_nif_pin *res;
+    if (!enif_get_resource(env, argv[0], gpio_nif_pin_type, (void **) &res))
+        return enif_make_badarg(env);
+
+    enif_mutex_lock(res->lock);
+    gpio_close(&res->pin);
+    enif_mutex_unlock(res->lock);
+
+    return enif_make_atom(env, "ok");
+}
+
+/*
+ * enable_gpiomem() maps /dev/gpiomem so that pins opened afterwards on
+ * a BCM283x/BCM2711 are read and written through the registers.
+ */
+static ERL_NIF_TERM gpio_nif_enable_gpiomem(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    if (gpio_mmap_open() < 0)
+        return make_error(env, "not_available");
+
+    return enif_make_atom(env, "ok");
+}
+
+static ErlNifFunc nif_funcs[] = {
+    {"enable_gpiomem", 0, gpio_nif_enable_gpiomem, 0},
+    {"open", 2, gpio_nif_open_sysfs, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"open", 3, gpio_nif_open_cdev, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"read", 1, gpio_nif_read, 0},
+    {"write", 2, gpio_nif_write, 0},
+    {"close", 1, gpio_nif_close, 0}
+};
+
+ERL_NIF_INIT(gpio_nif, nif_funcs, gpio_nif_load, NULL, gpio_nif_upgrade, gpio_nif_unload)
@@ -16,16 +16,25 @@
  */
 
 #include <err.h>
-#include <poll.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include <linux/gpio.h>
+
 #include "erlcmd.h"
+#include "gpio.h"
+#include "sim.h"
+#include "stats.h"
+#include "stream.h"
 
 //#define DEBUG
 #ifdef DEBUG
@@ -35,152 +44,224 @@
 #endif
 
 /*
- * GPIO handling definitions and prototypes
+ * A bank is the table of GPIOs managed by one erlang-ale process. The
+ * single pin mode is just a bank with one entry opened at startup.
+ */
+#define GPIO_BANK_MAX_PINS 128
+
+// Large enough for a read_mask reply covering every pin
+#define GPIO_RESP_SIZE 512
+
+// Most edges reported each time a simulated pin is ready
+#define GPIO_SIM_MAX_EDGES 64
+
+/*
+ * Optionally, interrupt notifications are batched so that bursts of
+ * edges cost one port message. Each event is packed into a record:
+ *
+ *   <<Timestamp:64, Pin:16, IsRising:8>>
+ *
+ * and the batch is sent as {gpio_interrupts, Records} after
+ * max_events events or max_delay_ns after the first one.
  */
-enum gpio_state {
-    GPIO_OUTPUT,
-    GPIO_INPUT
+#define GPIO_BATCH_MAX_EVENTS 256
+#define GPIO_BATCH_RECORD_SIZE 11
+
+struct gpio_batch {
+    unsigned int max_events; // 0 to send each event immediately
+    uint64_t max_delay_ns;
+
+    unsigned int count;
+    uint64_t deadline_ns;
+    char records[GPIO_BATCH_MAX_EVENTS * GPIO_BATCH_RECORD_SIZE];
 };
 
-enum interrupt_mode {
-    GPIO_INT_NONE,
-    GPIO_INT_BOTH,
-    GPIO_INT_RISING,
-    GPIO_INT_FALLING,
-    GPIO_INT_SUMMARIZE
+/*
+ * A waveform is a list of {Level, DurationUs} steps that's played on
+ * an output from a timerfd so that Erlang isn't involved per edge.
+ * The timer is armed with absolute deadlines so that a late wakeup
+ * shortens one step instead of shifting the rest of the waveform.
+ */
+#define GPIO_WAVEFORM_MAX_STEPS 1024
+
+struct gpio_waveform_step {
+    uint8_t level;
+    uint32_t duration_us;
 };
 
-struct gpio {
-    enum gpio_state state;
-    int fd;
-    int pin_number;
-    enum interrupt_mode int_mode;
-    int last_value;
+struct gpio_waveform {
+    int timer_fd; // -1 when not playing
+    struct gpio *pin;
+    int count;
+    int index;
+    unsigned long repeat; // Plays left including this one, or 0 for forever
+    struct timespec deadline;
+    struct gpio_waveform_step steps[GPIO_WAVEFORM_MAX_STEPS];
 };
 
-/**
- * @brief write a string to a sysfs file
- * @return returns 0 on failure, >0 on success
+struct gpio_bank;
+
+/*
+ * The event loop calls back with one of these for a pin with
+ * interrupts enabled.
  */
-int sysfs_write_file(const char *pathname, const char *value)
-{
-    int fd = open(pathname, O_WRONLY);
-    if (fd < 0) {
-        debug("Error opening %s", pathname);
-        return 0;
-    }
+struct gpio_bank_watch {
+    struct gpio_bank *bank;
+    struct gpio *pin;
+};
 
-    size_t count = strlen(value);
-    ssize_t written = write(fd, value, count);
-    close(fd);
+struct gpio_bank {
+    int chip_fd; // -1 to use sysfs
+    struct gpio pins[GPIO_BANK_MAX_PINS];
+    struct gpio_bank_watch watches[GPIO_BANK_MAX_PINS];
+    struct gpio_batch batch;
 
-    if (written < 0 || (size_t) written != count) {
-        warn("Error writing '%s' to %s", value, pathname);
-        return 0;
-    }
+    // Debounce windows, count reports and batches share one timer
+    // that's set for the earliest of their deadlines.
+    int deadline_fd;
+    uint64_t deadline_ns; // 0 when not set
+
+    // Pins sampled every period while streaming. Each sample has
+    // one byte per pin.
+    long stream_pins[GPIO_BANK_MAX_PINS];
+    int stream_pin_count;
+    struct stream stream;
+
+    struct gpio_waveform waveform;
+};
 
-    return written;
+/**
+ * @brief Return CLOCK_MONOTONIC in nanoseconds. This is the same
+ *        clock that the kernel uses to timestamp cdev edge events.
+ */
+static uint64_t gpio_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-// GPIO functions
+/**
+ * @brief	Make sure that the deadline timer expires by deadline_ns
+ */
+static void gpio_bank_arm(struct gpio_bank *bank, uint64_t deadline_ns)
+{
+    if (bank->deadline_ns != 0 && bank->deadline_ns <= deadline_ns)
+        return;
+
+    bank->deadline_ns = deadline_ns;
+    erlcmd_timer_set(bank->deadline_fd, deadline_ns);
+}
 
 /**
- * @brief	Open and configure a GPIO
+ * @brief	Return the edges that the kernel needs to report for a pin
  *
- * @param	pin           The pin structure
- * @param	pin_number    The GPIO pin
- * @param   dir           Direction of pin (input or output)
+ * Debouncing in erlang-ale needs both edges to tell when the input
+ * has settled.
+ */
+static enum interrupt_mode gpio_edge_mode(const struct gpio *pin)
+{
+    if (pin->int_mode != GPIO_INT_NONE && pin->debounce_us > 0 && !pin->debounce_kernel)
+        return GPIO_INT_BOTH;
+    if (pin->int_mode == GPIO_INT_COUNT)
+        return GPIO_INT_RISING;
+    return pin->int_mode;
+}
+
+#ifdef HAVE_GPIO_CDEV
+/**
+ * @brief	Update the edge detection on a line request
  *
- * @return 	1 for success, -1 for failure
+ * The config applies to every line in the request, so it's built
+ * from the interrupt modes and debounce periods of all of the pins
+ * that share the fd.
  */
-int gpio_init(struct gpio *pin, unsigned int pin_number, enum gpio_state dir)
+static int gpio_cdev_set_edge(struct gpio_bank *bank, int fd)
 {
-    /* Initialize the pin structure. */
-    pin->state = dir;
-    pin->fd = -1;
-    pin->pin_number = pin_number;
-    pin->int_mode = GPIO_INT_NONE;
-    pin->last_value = -1;
+    static const enum interrupt_mode modes[] = {
+        GPIO_INT_RISING, GPIO_INT_FALLING, GPIO_INT_BOTH
+    };
 
-    /* Construct the gpio control file paths */
-    char direction_path[64];
-    sprintf(direction_path, "/sys/class/gpio/gpio%d/direction", pin_number);
+    struct gpio_v2_line_config config;
+    memset(&config, 0, sizeof(config));
+    config.flags = GPIO_V2_LINE_FLAG_INPUT;
 
-    char value_path[64];
-    sprintf(value_path, "/sys/class/gpio/gpio%d/value", pin_number);
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        uint64_t mask = 0;
+        for (int i = 0; i < GPIO_BANK_MAX_PINS; i++) {
+            struct gpio *pin = &bank->pins[i];
+            uint64_t flags = gpio_cdev_edge_flags(gpio_edge_mode(pin));
+            if (pin->fd == fd && flags == gpio_cdev_edge_flags(modes[m]))
+                mask |= 1ULL << pin->line_index;
+        }
+        if (mask == 0)
+            continue;
 
-    /* Check if the gpio has been exported already. */
-    if (access(value_path, F_OK) == -1) {
-        /* Nope. Export it. */
-        char pinstr[64];
-        sprintf(pinstr, "%d", pin_number);
-        if (!sysfs_write_file("/sys/class/gpio/export", pinstr))
-            return -1;
+        struct gpio_v2_line_config_attribute *attr = &config.attrs[config.num_attrs++];
+        attr->attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+        attr->attr.flags = GPIO_V2_LINE_FLAG_INPUT | gpio_cdev_edge_flags(modes[m]);
+        attr->mask = mask;
     }
 
-    /* The direction file may not exist if the pin only works one way.
-       It is ok if the direction file doesn't exist, but if it does
-       exist, we must be able to write it.
-    */
-    if (access(direction_path, F_OK) != -1) {
-	const char *dir_string = (dir == GPIO_OUTPUT ? "out" : "in");
-        if (!sysfs_write_file(direction_path, dir_string)) {
-            /* This has failed on a Raspberry Pi in what looks is due
-               to a race condition with exporting the GPIO. Sleep
-               momentarily as a workaround. */
-            sleep(1);
+    /* Lines that share a debounce period share an attribute. */
+    uint64_t done = 0;
+    for (int i = 0; i < GPIO_BANK_MAX_PINS; i++) {
+        struct gpio *pin = &bank->pins[i];
+        uint64_t bit = 1ULL << pin->line_index;
+        if (pin->fd != fd || !pin->debounce_kernel || (done & bit))
+            continue;
 
-            if (!sysfs_write_file(direction_path, dir_string))
-                return -1;
+        uint64_t mask = 0;
+        for (int j = i; j < GPIO_BANK_MAX_PINS; j++) {
+            struct gpio *other = &bank->pins[j];
+            if (other->fd == fd && other->debounce_kernel &&
+                    other->debounce_us == pin->debounce_us)
+                mask |= 1ULL << other->line_index;
         }
-    }
+        done |= mask;
 
-    pin->pin_number = pin_number;
+        if (config.num_attrs >= GPIO_V2_LINE_NUM_ATTRS_MAX)
+            return -1;
+        struct gpio_v2_line_config_attribute *attr = &config.attrs[config.num_attrs++];
+        attr->attr.id = GPIO_V2_LINE_ATTR_ID_DEBOUNCE;
+        attr->attr.debounce_period_us = pin->debounce_us;
+        attr->mask = mask;
+    }
 
-    /* Open the value file for quick access later */
-    pin->fd = open(value_path, pin->state == GPIO_OUTPUT ? O_RDWR : O_RDONLY);
-    if (pin->fd < 0)
+    if (ioctl(fd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &config) < 0)
         return -1;
 
     return 1;
 }
+#endif
+
+static const struct {
+    const char *name;
+    enum interrupt_mode mode;
+} gpio_int_mode_names[] = {
+    {"none", GPIO_INT_NONE},
+    {"rising", GPIO_INT_RISING},
+    {"falling", GPIO_INT_FALLING},
+    {"both", GPIO_INT_BOTH},
+    {"enabled", GPIO_INT_BOTH},
+    {"summarize", GPIO_INT_SUMMARIZE},
+    {"count", GPIO_INT_COUNT}
+};
 
 /**
- * @brief	Set pin with the value "0" or "1"
- *
- * @param	pin           The pin structure
- * @param       value         Value to set (0 or 1)
+ * @brief	Look up an interrupt mode by name
  *
- * @return 	1 for success, -1 for failure
+ * @return	0 on success or -1 if the name isn't a mode
  */
-int gpio_write(struct gpio *pin, unsigned int val)
+static int gpio_decode_int_mode(const char *name, enum interrupt_mode *mode)
 {
-    if (pin->state != GPIO_OUTPUT)
-        return -1;
-
-    char buf = val ? '1' : '0';
-    ssize_t amount_written = pwrite(pin->fd, &buf, sizeof(buf), 0);
-    if (amount_written < (ssize_t) sizeof(buf))
-        err(EXIT_FAILURE, "pwrite");
-
-    return 1;
-}
-
-/**
-* @brief	Read the value of the pin
-*
-* @param	pin            The GPIO pin
-*
-* @return 	The pin value if success, -1 for failure
-*/
-int gpio_read(struct gpio *pin)
-{
-    char buf;
-    ssize_t amount_read = pread(pin->fd, &buf, sizeof(buf), 0);
-    if (amount_read < (ssize_t) sizeof(buf))
-        err(EXIT_FAILURE, "pread");
-
-    return buf == '1' ? 1 : 0;
+    for (size_t i = 0; i < sizeof(gpio_int_mode_names) / sizeof(gpio_int_mode_names[0]); i++) {
+        if (strcmp(name, gpio_int_mode_names[i].name) == 0) {
+            *mode = gpio_int_mode_names[i].mode;
+            return 0;
+        }
+    }
+    return -1;
 }
 
 /**
@@ -197,40 +278,80 @@ int gpio_read(struct gpio *pin)
  *                  between notifications, avoid reporting
  *                  transients. This is a weak form of
  *                  debouncing.
+ *   "count" -> count rising edges and measure the time between
+ *              them without notifying each one
  *
- * @param   pin	    Pin number to attach interrupt to
- * @param   modes   Interrupt mode
+ * If debounce_us is non-zero, a transition is only reported once the
+ * input has stayed at the new level for that long. Line requests
+ * use the kernel's debouncing if the chip supports it.
+ *
+ * @param   bank        The bank that the pin is in
+ * @param   pin	        Pin number to attach interrupt to
+ * @param   mode        Interrupt mode (see gpio_decode_int_mode())
+ * @param   debounce_us Time the input must be stable (0 to disable)
+ * @param   report_us   How often to report counts in "count" mode (0 for
+ *                      only when asked)
  *
  * @return  Returns 1 on success.
  */
-int gpio_set_int(struct gpio *pin, const char *mode)
-{
-    if (strcmp(mode, "none") == 0)
-        pin->int_mode = GPIO_INT_NONE;
-    else if (strcmp(mode, "rising") == 0)
-        pin->int_mode = GPIO_INT_RISING;
-    else if (strcmp(mode, "falling") == 0)
-        pin->int_mode = GPIO_INT_FALLING;
-    else if (strcmp(mode, "both") == 0)
-        pin->int_mode = GPIO_INT_BOTH;
-    else if (strcmp(mode, "enabled") == 0)
-        pin->int_mode = GPIO_INT_BOTH;
-    else if (strcmp(mode, "summarize") == 0)
-        pin->int_mode = GPIO_INT_SUMMARIZE;
-    else
-        errx(EXIT_FAILURE, "Unknown interrupt mode: %s", mode);
+int gpio_set_int(struct gpio_bank *bank, struct gpio *pin, enum interrupt_mode mode, uint32_t debounce_us, uint64_t report_us)
+{
+    pin->int_mode = mode;
 
     if (pin->state != GPIO_INPUT)
         return 0;
 
+    pin->debounce_us = (pin->int_mode == GPIO_INT_NONE ? 0 : debounce_us);
+    pin->debounce_kernel = 0;
+    pin->debounce_deadline_ns = 0;
+
+    pin->count = 0;
+    pin->count_last_ns = 0;
+    pin->count_min_period_ns = 0;
+    pin->count_max_period_ns = 0;
+    pin->count_report_ns = (pin->int_mode == GPIO_INT_COUNT ? report_us * 1000 : 0);
+    pin->count_deadline_ns = (pin->count_report_ns ? gpio_now_ns() + pin->count_report_ns : 0);
+    if (pin->count_deadline_ns)
+        gpio_bank_arm(bank, pin->count_deadline_ns);
+
     /* Never summarize the first interrupt so that the
      * app can get the initial state. Linux sends a notification
      * on registration.
      */
     pin->last_value = -1;
 
+    if (pin->backend == GPIO_BACKEND_SIM) {
+        /* Simulated edges are filtered by mode in
+         * gpio_sim_process(). Like the character device, there's
+         * no event on registration.
+         */
+        pin->last_value = gpio_read(pin);
+        return 1;
+    }
+
+#ifdef HAVE_GPIO_CDEV
+    if (pin->backend == GPIO_BACKEND_CDEV) {
+        /* The character device doesn't send an event on
+         * registration, so remember the current value for
+         * summarizing.
+         */
+        pin->last_value = gpio_read(pin);
+
+        /* If the kernel can't debounce this line, do it here. */
+        pin->debounce_kernel = (pin->debounce_us > 0);
+        if (gpio_cdev_set_edge(bank, pin->fd) > 0)
+            return 1;
+        if (!pin->debounce_kernel)
+            return -1;
+
+        debug("gpio %d: no kernel debouncing", pin->pin_number);
+        pin->debounce_kernel = 0;
+        return gpio_cdev_set_edge(bank, pin->fd);
+    }
+#endif
+
     const char *edge_mode;
-    switch (pin->int_mode) {
+    switch (gpio_edge_mode(pin)) {
     case GPIO_INT_NONE:
         edge_mode = "none";
         break;
@@ -253,27 +374,272 @@ int gpio_set_int(struct gpio *pin, const char *mode)
     return 1;
 }
 
-static void gpio_report_interrupt(int pin_number, int is_rising)
+/**
+ * @brief Send all batched interrupt notifications to Erlang
+ */
+static void gpio_flush_interrupts(struct gpio_bank *bank)
+{
+    struct gpio_batch *batch = &bank->batch;
+    if (batch->count == 0)
+        return;
+
+    char resp[sizeof(batch->records) + 64];
+    int resp_index = 1; // Space for the type
+    resp[0] = 1; // Notification
+    ei_encode_version(resp, &resp_index);
+    ei_encode_tuple_header(resp, &resp_index, 2);
+    ei_encode_atom(resp, &resp_index, "gpio_interrupts");
+    ei_encode_binary(resp, &resp_index, batch->records, batch->count * GPIO_BATCH_RECORD_SIZE);
+    erlcmd_send(resp, resp_index);
+
+    batch->count = 0;
+}
+
+static void gpio_report_interrupt(struct gpio_bank *bank, int pin_number, int is_rising, uint64_t timestamp)
 {
+    stats.interrupts++;
+
+    struct gpio_batch *batch = &bank->batch;
+    if (batch->max_events > 0) {
+        if (batch->count == 0) {
+            batch->deadline_ns = gpio_now_ns() + batch->max_delay_ns;
+            gpio_bank_arm(bank, batch->deadline_ns);
+        }
+
+        char *record = &batch->records[batch->count * GPIO_BATCH_RECORD_SIZE];
+        for (int i = 0; i < 8; i++)
+            record[i] = (char) (timestamp >> (56 - 8 * i));
+        record[8] = (char) (pin_number >> 8);
+        record[9] = (char) pin_number;
+        record[10] = is_rising ? 1 : 0;
+
+        batch->count++;
+        if (batch->count >= batch->max_events)
+            gpio_flush_interrupts(bank);
+        return;
+    }
+
     char resp[256];
-    int resp_index = sizeof(uint16_t) + 1; // Space for payload size and type
-    resp[2] = 1; // Notification
+    int resp_index = 1; // Space for the type
+    resp[0] = 1; // Notification
     ei_encode_version(resp, &resp_index);
-    ei_encode_tuple_header(resp, &resp_index, 3);
+    ei_encode_tuple_header(resp, &resp_index, 4);
     ei_encode_atom(resp, &resp_index, "gpio_interrupt");
     ei_encode_long(resp, &resp_index, pin_number);
     ei_encode_atom(resp, &resp_index, is_rising ? "rising" : "falling");
+    ei_encode_ulonglong(resp, &resp_index, timestamp);
+    erlcmd_send(resp, resp_index);
+}
+
+/**
+ * @brief	Count an edge in GPIO_INT_COUNT mode
+ */
+static void gpio_count_edge(struct gpio *pin, uint64_t timestamp)
+{
+    if (pin->count_last_ns != 0 && timestamp > pin->count_last_ns) {
+        uint64_t period = timestamp - pin->count_last_ns;
+        if (pin->count_min_period_ns == 0 || period < pin->count_min_period_ns)
+            pin->count_min_period_ns = period;
+        if (period > pin->count_max_period_ns)
+            pin->count_max_period_ns = period;
+    }
+    pin->count_last_ns = timestamp;
+    pin->count++;
+}
+
+/**
+ * @brief	Encode a pin's count as
+ *          {Count, LastEdgeNs, MinPeriodNs, MaxPeriodNs}
+ *
+ * The min and max periods start over afterwards.
+ */
+static void gpio_encode_count(char *resp, int *resp_index, struct gpio *pin)
+{
+    ei_encode_tuple_header(resp, resp_index, 4);
+    ei_encode_ulonglong(resp, resp_index, pin->count);
+    ei_encode_ulonglong(resp, resp_index, pin->count_last_ns);
+    ei_encode_ulonglong(resp, resp_index, pin->count_min_period_ns);
+    ei_encode_ulonglong(resp, resp_index, pin->count_max_period_ns);
+
+    pin->count_min_period_ns = 0;
+    pin->count_max_period_ns = 0;
+}
+
+/**
+ * @brief	Send {gpio_count, Pin, Count} and schedule the next report
+ */
+static void gpio_report_count(struct gpio_bank *bank, struct gpio *pin)
+{
+    /* Batched interrupts go first so that messages stay in order. */
+    gpio_flush_interrupts(bank);
+
+    char resp[128];
+    int resp_index = 1; // Space for the type
+    resp[0] = 1; // Notification
+    ei_encode_version(resp, &resp_index);
+    ei_encode_tuple_header(resp, &resp_index, 3);
+    ei_encode_atom(resp, &resp_index, "gpio_count");
+    ei_encode_long(resp, &resp_index, pin->pin_number);
+    gpio_encode_count(resp, &resp_index, pin);
     erlcmd_send(resp, resp_index);
+
+    pin->count_deadline_ns += pin->count_report_ns;
+}
+
+/**
+ * @brief	Start or restart the debounce window for a pin
+ *
+ * @return 	1 if the edge was taken by the debouncer
+ */
+static int gpio_debounce_edge(struct gpio_bank *bank, struct gpio *pin, uint64_t timestamp)
+{
+    if (pin->debounce_us == 0 || pin->debounce_kernel)
+        return 0;
+
+    pin->debounce_timestamp = timestamp;
+    pin->debounce_deadline_ns = gpio_now_ns() + (uint64_t) pin->debounce_us * 1000;
+    gpio_bank_arm(bank, pin->debounce_deadline_ns);
+    return 1;
+}
+
+/**
+ * @brief	Report a debounced pin if it settled at a new level
+ */
+static void gpio_debounce_settle(struct gpio_bank *bank, struct gpio *pin)
+{
+    pin->debounce_deadline_ns = 0;
+
+    int value = gpio_read(pin);
+    if (value < 0 || value == pin->last_value)
+        return;
+
+    if (pin->int_mode == GPIO_INT_COUNT) {
+        if (value == 1)
+            gpio_count_edge(pin, pin->debounce_timestamp);
+    } else if ((pin->int_mode != GPIO_INT_RISING || value == 1) &&
+            (pin->int_mode != GPIO_INT_FALLING || value == 0))
+        gpio_report_interrupt(bank, pin->pin_number, value, pin->debounce_timestamp);
+
+    pin->last_value = value;
+}
+
+#ifdef HAVE_GPIO_CDEV
+static struct gpio *gpio_cdev_find_line(struct gpio_bank *bank, int fd, unsigned int offset)
+{
+    for (int i = 0; i < GPIO_BANK_MAX_PINS; i++) {
+        struct gpio *pin = &bank->pins[i];
+        if (pin->fd == fd && pin->pin_number == (int) offset)
+            return pin;
+    }
+    return NULL;
+}
+
+/**
+ * Called when a line request has edge events queued. Each event was timestamped by the kernel, so
+ * report them exactly as they happened.
+ *
+ * @param fd the line request to check
+ */
+static void gpio_cdev_process(struct gpio_bank *bank, int fd)
+{
+    struct gpio_v2_line_event events[16];
+    ssize_t amount_read = read(fd, events, sizeof(events));
+    if (amount_read < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return;
+        err(EXIT_FAILURE, "read(gpio line events)");
+    }
+
+    size_t count = amount_read / sizeof(struct gpio_v2_line_event);
+    for (size_t i = 0; i < count; i++) {
+        const struct gpio_v2_line_event *event = &events[i];
+        int value = (event->id == GPIO_V2_LINE_EVENT_RISING_EDGE);
+
+        /* The request may have several lines, so find the pin. */
+        struct gpio *pin = gpio_cdev_find_line(bank, fd, event->offset);
+        if (!pin || pin->int_mode == GPIO_INT_NONE)
+            continue;
+
+        /* Sequence numbers only skip if the kernel's event
+         * buffer overflowed.
+         */
+        if (pin->last_seqno != 0 && event->line_seqno != pin->last_seqno + 1) {
+            debug("gpio %d: missed %d events", pin->pin_number,
+                  event->line_seqno - pin->last_seqno - 1);
+            stats.interrupts_missed += event->line_seqno - pin->last_seqno - 1;
+        }
+        pin->last_seqno = event->line_seqno;
+
+        if (gpio_debounce_edge(bank, pin, event->timestamp_ns))
+            continue;
+
+        if (pin->int_mode == GPIO_INT_COUNT) {
+            if (value)
+                gpio_count_edge(pin, event->timestamp_ns);
+            continue;
+        }
+
+        if (pin->int_mode != GPIO_INT_SUMMARIZE || pin->last_value != value)
+            gpio_report_interrupt(bank, pin->pin_number, value, event->timestamp_ns);
+
+        pin->last_value = value;
+    }
+}
+#endif
+
+/**
+ * Called when a simulated pin has edges. There's no kernel to
+ * filter them, so that's done here.
+ */
+static void gpio_sim_process(struct gpio_bank *bank, struct gpio *pin)
+{
+    int values[GPIO_SIM_MAX_EDGES];
+    int count = sim_gpio_edges(pin, values, GPIO_SIM_MAX_EDGES);
+    uint64_t timestamp = gpio_now_ns();
+    for (int i = 0; i < count; i++) {
+        int value = values[i];
+        if (gpio_debounce_edge(bank, pin, timestamp))
+            continue;
+
+        if (pin->int_mode == GPIO_INT_COUNT) {
+            if (value)
+                gpio_count_edge(pin, timestamp);
+        } else if ((pin->int_mode != GPIO_INT_RISING || value == 1) &&
+                (pin->int_mode != GPIO_INT_FALLING || value == 0) &&
+                (pin->int_mode != GPIO_INT_SUMMARIZE || pin->last_value != value))
+            gpio_report_interrupt(bank, pin->pin_number, value, timestamp);
+
+        pin->last_value = value;
+    }
 }
 
 /**
- * Called after poll() returns when the GPIO sysfs file indicates
- * a status change.
+ * Called when the GPIO sysfs file indicates a status change.
  *
+ * @param bank the bank that the pin is in
  * @param pin which pin to check
  */
-void gpio_process(struct gpio *pin)
+void gpio_process(struct gpio_bank *bank, struct gpio *pin)
 {
+    if (pin->backend == GPIO_BACKEND_SIM) {
+        gpio_sim_process(bank, pin);
+        return;
+    }
+
+#ifdef HAVE_GPIO_CDEV
+    if (pin->backend == GPIO_BACKEND_CDEV) {
+        gpio_cdev_process(bank, pin->fd);
+        return;
+    }
+#endif
+
+    uint64_t timestamp = gpio_now_ns();
+    if (gpio_debounce_edge(bank, pin, timestamp)) {
+        /* Clear the edge. The level is read when it has settled. */
+        gpio_read(pin);
+        return;
+    }
+
     int value = gpio_read(pin);
 
     switch (pin->int_mode) {
@@ -283,17 +649,24 @@ void gpio_process(struct gpio *pin)
            at one time. It could be that the value is 0 if it
            was a transient, so it would be a race condition if
            we did use it. */
-        gpio_report_interrupt(pin->pin_number, 1);
+        gpio_report_interrupt(bank, pin->pin_number, 1, timestamp);
         break;
 
     case GPIO_INT_FALLING:
-        gpio_report_interrupt(pin->pin_number, 0);
+        gpio_report_interrupt(bank, pin->pin_number, 0, timestamp);
+        break;
+
+    case GPIO_INT_COUNT:
+        /* Like rising, but skip the notification that Linux sends
+           when the edge is first set. */
+        if (pin->last_value != -1)
+            gpio_count_edge(pin, timestamp);
         break;
 
     case GPIO_INT_SUMMARIZE:
         /* If summarizing, only report if different. */
         if (pin->last_value != value)
-            gpio_report_interrupt(pin->pin_number, value);
+            gpio_report_interrupt(bank, pin->pin_number, value, timestamp);
         break;
 
     case GPIO_INT_BOTH:
@@ -319,9 +692,10 @@ void gpio_process(struct gpio *pin)
              * though, it's likely that we missed one anyway,
              * so I don't feel too bad.
              */
-            gpio_report_interrupt(pin->pin_number, !value);
+            gpio_report_interrupt(bank, pin->pin_number, !value, timestamp);
+            stats.interrupts_doubled++;
         }
-        gpio_report_interrupt(pin->pin_number, value);
+        gpio_report_interrupt(bank, pin->pin_number, value, timestamp);
         break;
 
     default:
@@ -331,121 +705,1167 @@ void gpio_process(struct gpio *pin)
     pin->last_value = value;
 }
 
-void gpio_handle_request(const char *req, void *cookie)
+static void gpio_pin_ready(int fd, uint32_t events, void *cookie)
 {
-    struct gpio *pin = (struct gpio *) cookie;
+    struct gpio_bank_watch *watch = (struct gpio_bank_watch *) cookie;
+    if (events & (EPOLLPRI | EPOLLIN))
+        gpio_process(watch->bank, watch->pin);
+}
 
-    // Commands are of the form {Command, Arguments}:
-    // { atom(), term() }
-    int req_index = sizeof(uint16_t);
-    if (ei_decode_version(req, &req_index, NULL) < 0)
-        errx(EXIT_FAILURE, "Message version issue?");
+/**
+ * @brief	Watch fd while any pin that uses it has interrupts enabled
+ *
+ * Pins opened together on a cdev share one fd, so it's watched once
+ * for all of them. Call this whenever a pin's interrupt mode changes
+ * and before its fd is closed.
+ */
+static void gpio_bank_watch(struct gpio_bank *bank, int fd)
+{
+    if (fd < 0)
+        return;
 
-    int arity;
-    if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
-            arity != 2)
-        errx(EXIT_FAILURE, "expecting {cmd, args} tuple");
+    for (int i = 0; i < GPIO_BANK_MAX_PINS; i++) {
+        struct gpio *pin = &bank->pins[i];
+        if (pin->fd != fd || pin->int_mode == GPIO_INT_NONE)
+            continue;
 
-    char cmd[MAXATOMLEN];
-    if (ei_decode_atom(req, &req_index, cmd) < 0)
-        errx(EXIT_FAILURE, "expecting command atom");
+        /* sysfs signals edges with POLLPRI and line
+         * requests have events to read.
+         */
+        erlcmd_watch(fd, pin->backend == GPIO_BACKEND_SYSFS ? EPOLLPRI : EPOLLIN,
+                     gpio_pin_ready, &bank->watches[i]);
+        return;
+    }
 
-    char resp[256];
-    int resp_index = sizeof(uint16_t) + 1; // Space for payload size and type
-    resp[2] = 0; // Reply
-    ei_encode_version(resp, &resp_index);
-    if (strcmp(cmd, "read") == 0) {
-        debug("read");
-        int value = gpio_read(pin);
-        if (value !=-1)
-            ei_encode_long(resp, &resp_index, value);
-        else {
-            ei_encode_tuple_header(resp, &resp_index, 2);
-            ei_encode_atom(resp, &resp_index, "error");
-            ei_encode_atom(resp, &resp_index, "gpio_read_failed");
-        }
-    } else if (strcmp(cmd, "write") == 0) {
-        long value;
-        if (ei_decode_long(req, &req_index, &value) < 0)
-            errx(EXIT_FAILURE, "write: didn't get value to write");
-        debug("write %d", value);
-        if (gpio_write(pin, value))
-            ei_encode_atom(resp, &resp_index, "ok");
-        else {
-            ei_encode_tuple_header(resp, &resp_index, 2);
-            ei_encode_atom(resp, &resp_index, "error");
-            ei_encode_atom(resp, &resp_index, "gpio_write_failed");
-        }
-    } else if (strcmp(cmd, "set_int") == 0) {
-        char mode[32];
-        if (ei_decode_atom(req, &req_index, mode) < 0)
-            errx(EXIT_FAILURE, "set_int: didn't get value");
-        debug("set_int %s", mode);
+    erlcmd_unwatch(fd);
+}
 
-        if (gpio_set_int(pin, mode))
-            ei_encode_atom(resp, &resp_index, "ok");
-        else {
-            ei_encode_tuple_header(resp, &resp_index, 2);
-            ei_encode_atom(resp, &resp_index, "error");
-            ei_encode_atom(resp, &resp_index, "gpio_set_int_failed");
-        }
-    } else
-        errx(EXIT_FAILURE, "unknown command: %s", cmd);
+/**
+ * @brief	Handle the debounce windows, count reports and batches
+ *              that are due and set the timer for the next one
+ */
+static void gpio_bank_deadline(int fd, uint32_t events, void *cookie)
+{
+    struct gpio_bank *bank = (struct gpio_bank *) cookie;
+    uint64_t now = gpio_now_ns();
+    uint64_t next = UINT64_MAX;
+    for (int i = 0; i < GPIO_BANK_MAX_PINS; i++) {
+        struct gpio *pin = &bank->pins[i];
+        if (pin->fd < 0)
+            continue;
+        if (pin->debounce_deadline_ns != 0 && now >= pin->debounce_deadline_ns)
+            gpio_debounce_settle(bank, pin);
+        if (pin->count_deadline_ns != 0 && now >= pin->count_deadline_ns)
+            gpio_report_count(bank, pin);
 
-    debug("sending response: %d bytes", resp_index);
-    erlcmd_send(resp, resp_index);
+        if (pin->debounce_deadline_ns != 0 && pin->debounce_deadline_ns < next)
+            next = pin->debounce_deadline_ns;
+        if (pin->count_deadline_ns != 0 && pin->count_deadline_ns < next)
+            next = pin->count_deadline_ns;
+    }
+
+    if (bank->batch.count > 0 && now >= bank->batch.deadline_ns)
+        gpio_flush_interrupts(bank);
+    if (bank->batch.count > 0 && bank->batch.deadline_ns < next)
+        next = bank->batch.deadline_ns;
+
+    bank->deadline_ns = 0;
+    if (next != UINT64_MAX)
+        gpio_bank_arm(bank, next);
 }
 
-int gpio_main(int argc, char *argv[])
+static void gpio_waveform_arm(struct gpio_waveform *waveform)
 {
-    if (argc != 4)
-        errx(EXIT_FAILURE, "%s gpio <pin#> <input|output>", argv[0]);
+    const struct gpio_waveform_step *step = &waveform->steps[waveform->index];
+    gpio_write(waveform->pin, step->level);
 
-    int pin_number = strtol(argv[2], NULL, 0);
-    enum gpio_state initial_state;
-    if (strcmp(argv[3], "input") == 0)
-        initial_state = GPIO_INPUT;
-    else if (strcmp(argv[3], "output") == 0)
-        initial_state = GPIO_OUTPUT;
-    else
-        errx(EXIT_FAILURE, "Specify 'input' or 'output'");
+    waveform->deadline.tv_nsec += (long) (step->duration_us % 1000000) * 1000;
+    waveform->deadline.tv_sec += step->duration_us / 1000000 + waveform->deadline.tv_nsec / 1000000000;
+    waveform->deadline.tv_nsec %= 1000000000;
 
-    struct gpio pin;
-    if (gpio_init(&pin, pin_number, initial_state) < 0)
-	errx(EXIT_FAILURE, "Couldn't initialize gpio %d\n", pin_number);
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value = waveform->deadline;
+    if (timerfd_settime(waveform->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        err(EXIT_FAILURE, "timerfd_settime");
+}
 
-    struct erlcmd handler;
-    erlcmd_init(&handler, gpio_handle_request, &pin);
+/**
+ * @brief	Stop playing a waveform
+ *
+ * The output is left at the level of the last step that was played.
+ */
+static void gpio_waveform_stop(struct gpio_waveform *waveform)
+{
+    if (waveform->timer_fd < 0)
+        return;
 
-    for (;;) {
-        struct pollfd fdset[2];
+    erlcmd_unwatch(waveform->timer_fd);
+    close(waveform->timer_fd);
+    waveform->timer_fd = -1;
+    waveform->pin = NULL;
+}
 
-        fdset[0].fd = STDIN_FILENO;
-        fdset[0].events = POLLIN;
-        fdset[0].revents = 0;
+static void gpio_waveform_process(int fd, uint32_t events, void *cookie);
 
-        fdset[1].fd = pin.fd;
-        fdset[1].events = POLLPRI;
-        fdset[1].revents = 0;
+/**
+ * @brief	Start playing the decoded steps in waveform on pin
+ *
+ * @return 	NULL on success, or an atom describing the failure
+ */
+static const char *gpio_waveform_start(struct gpio_waveform *waveform, struct gpio *pin)
+{
+    if (pin->state != GPIO_OUTPUT)
+        return "gpio_write_failed";
 
-        /* Always fill out the fdset structure, but only have poll() monitor
-     * the sysfs file if interrupts are enabled.
-     */
-        int rc = poll(fdset, pin.int_mode != GPIO_INT_NONE ? 2 : 1, -1);
-        if (rc < 0) {
-            // Retry if EINTR
-            if (errno == EINTR)
-                continue;
+    waveform->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (waveform->timer_fd < 0)
+        return "no_timer";
+
+    waveform->pin = pin;
+    waveform->index = 0;
+    clock_gettime(CLOCK_MONOTONIC, &waveform->deadline);
+    gpio_waveform_arm(waveform);
+    erlcmd_watch(waveform->timer_fd, EPOLLIN, gpio_waveform_process, waveform);
+    return NULL;
+}
+
+/**
+ * @brief	Advance to the next step when the timer expires
+ */
+static void gpio_waveform_process(int fd, uint32_t events, void *cookie)
+{
+    struct gpio_waveform *waveform = (struct gpio_waveform *) cookie;
+    uint64_t expirations;
+    if (read(waveform->timer_fd, &expirations, sizeof(expirations)) < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return;
+        err(EXIT_FAILURE, "read(waveform timer)");
+    }
+
+    waveform->index++;
+    if (waveform->index == waveform->count) {
+        if (waveform->repeat != 1) {
+            if (waveform->repeat > 1)
+                waveform->repeat--;
+            waveform->index = 0;
+        } else {
+            int pin_number = waveform->pin->pin_number;
+            gpio_waveform_stop(waveform);
 
-            err(EXIT_FAILURE, "poll");
+            char resp[64];
+            int resp_index = 1; // Space for the type
+            resp[0] = 1; // Notification
+            ei_encode_version(resp, &resp_index);
+            ei_encode_tuple_header(resp, &resp_index, 2);
+            ei_encode_atom(resp, &resp_index, "waveform_done");
+            ei_encode_long(resp, &resp_index, pin_number);
+            erlcmd_send(resp, resp_index);
+            return;
         }
+    }
+
+    gpio_waveform_arm(waveform);
+}
 
-        if (fdset[0].revents & (POLLIN | POLLHUP))
-            erlcmd_process(&handler);
+/**
+ * @return 	NULL on success, or an atom describing the failure with
+ *              errno set
+ */
+static const char *gpio_bank_init(struct gpio_bank *bank, const char *chip_path)
+{
+    bank->chip_fd = -1;
+    if (chip_path) {
+        /* bench mode only simulates sysfs GPIOs */
+#ifdef HAVE_GPIO_CDEV
+        if (sim_enabled()) {
+            errno = EOPNOTSUPP;
+            return "gpio_chip_not_supported";
+        }
+        bank->chip_fd = open(chip_path, O_RDWR | O_CLOEXEC);
+        if (bank->chip_fd < 0)
+            return "gpio_chip_open_failed";
+#else
+        errno = EOPNOTSUPP;
+        return "gpio_chip_not_supported";
+#endif
+    }
 
-        if (fdset[1].revents & POLLPRI)
-            gpio_process(&pin);
+    for (int i = 0; i < GPIO_BANK_MAX_PINS; i++) {
+        bank->pins[i].fd = -1;
+        bank->pins[i].int_mode = GPIO_INT_NONE;
+        bank->watches[i].bank = bank;
+        bank->watches[i].pin = &bank->pins[i];
     }
 
-    return 0;
+    bank->batch.max_events = 0;
+    bank->batch.count = 0;
+    bank->deadline_fd = erlcmd_timer_create(gpio_bank_deadline, bank);
+    bank->deadline_ns = 0;
+    bank->waveform.timer_fd = -1;
+    return NULL;
+}
+
+/**
+ * @brief	Find an open pin in the bank
+ *
+ * @return 	the pin or NULL if it hasn't been opened
+ */
+static struct gpio *gpio_bank_find(struct gpio_bank *bank, int pin_number)
+{
+    for (int i = 0; i < GPIO_BANK_MAX_PINS; i++) {
+        struct gpio *pin = &bank->pins[i];
+        if (pin->fd >= 0 && pin->pin_number == pin_number)
+            return pin;
+    }
+    return NULL;
+}
+
+/**
+ * @brief	Close a pin in the bank
+ *
+ * Pins opened together on a GPIO character device share a line
+ * request, so the request is only released with the last one.
+ */
+static void gpio_bank_close(struct gpio_bank *bank, struct gpio *pin)
+{
+    if (bank->waveform.pin == pin)
+        gpio_waveform_stop(&bank->waveform);
+
+    if (pin->backend == GPIO_BACKEND_CDEV) {
+        int fd = pin->fd;
+        for (int i = 0; i < GPIO_BANK_MAX_PINS; i++) {
+            struct gpio *other = &bank->pins[i];
+            if (other != pin && other->fd == fd) {
+                int had_int = (pin->int_mode != GPIO_INT_NONE);
+                pin->fd = -1;
+                pin->int_mode = GPIO_INT_NONE;
+                pin->mmap_number = -1;
+#ifdef HAVE_GPIO_CDEV
+                if (had_int)
+                    gpio_cdev_set_edge(bank, fd);
+#else
+                (void) had_int;
+#endif
+                gpio_bank_watch(bank, fd);
+                return;
+            }
+        }
+    }
+
+    erlcmd_unwatch(pin->fd);
+    gpio_close(pin);
+}
+
+/**
+ * @brief	Open pins and add them to the bank
+ *
+ * On a GPIO character device, the pins with the same direction are
+ * requested together so that read_mask and write_mask can access
+ * them with one ioctl. With sysfs, every pin is exported before any
+ * are configured so that waiting for udev to set up the files of
+ * one pin overlaps with the others.
+ *
+ * @param	dirs  the direction of each pin
+ *
+ * @return 	NULL on success, or an atom describing the failure
+ */
+static const char *gpio_bank_open(struct gpio_bank *bank, const long *pin_numbers, const enum gpio_state *dirs, int count)
+{
+    struct gpio *pins[GPIO_BANK_MAX_PINS];
+    if (count < 1 || count > GPIO_BANK_MAX_PINS)
+        return "bad_pin_count";
+
+    int found = 0;
+    for (int i = 0; i < count; i++) {
+        if (gpio_bank_find(bank, pin_numbers[i]))
+            return "already_open";
+        for (int j = 0; j < i; j++) {
+            if (pin_numbers[j] == pin_numbers[i])
+                return "duplicate_pin";
+        }
+    }
+    for (int i = 0; i < GPIO_BANK_MAX_PINS && found < count; i++) {
+        if (bank->pins[i].fd < 0)
+            pins[found++] = &bank->pins[i];
+    }
+    if (found < count)
+        return "too_many_pins";
+
+    if (bank->chip_fd >= 0) {
+        static const enum gpio_state directions[] = {GPIO_INPUT, GPIO_OUTPUT};
+        struct gpio *opened[GPIO_BANK_MAX_PINS];
+        int opened_count = 0;
+        for (size_t d = 0; d < sizeof(directions) / sizeof(directions[0]); d++) {
+            struct gpio *group[GPIO_BANK_MAX_PINS];
+            unsigned int offsets[GPIO_BANK_MAX_PINS];
+            int group_count = 0;
+            for (int i = 0; i < count; i++) {
+                if (dirs[i] == directions[d]) {
+                    group[group_count] = pins[i];
+                    offsets[group_count] = pin_numbers[i];
+                    group_count++;
+                }
+            }
+            if (group_count == 0)
+                continue;
+
+            if (gpio_cdev_init(group, bank->chip_fd, offsets, group_count, directions[d]) < 0) {
+                for (int i = 0; i < opened_count; i++)
+                    gpio_bank_close(bank, opened[i]);
+                return "gpio_open_failed";
+            }
+            for (int i = 0; i < group_count; i++)
+                opened[opened_count++] = group[i];
+        }
+    } else {
+        for (int i = 0; i < count; i++) {
+            if (gpio_export(pin_numbers[i]) < 0)
+                return "gpio_open_failed";
+        }
+        for (int i = 0; i < count; i++) {
+            if (gpio_init(pins[i], pin_numbers[i], dirs[i]) < 0) {
+                for (int j = 0; j <= i; j++)
+                    gpio_close(pins[j]);
+                return "gpio_open_failed";
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief	Set several output pins with as few device accesses as
+ *              possible
+ *
+ * All pins are checked before any are written. Pins that share a
+ * cdev line request are updated together with one ioctl.
+ *
+ * @return 	NULL on success, or an atom describing the failure
+ */
+static const char *gpio_bank_write_mask(struct gpio_bank *bank, const long *pin_numbers, const long *values, int count)
+{
+    struct gpio *pins[GPIO_BANK_MAX_PINS];
+    for (int i = 0; i < count; i++) {
+        pins[i] = gpio_bank_find(bank, pin_numbers[i]);
+        if (!pins[i])
+            return "pin_not_open";
+        if (pins[i]->state != GPIO_OUTPUT)
+            return "gpio_write_failed";
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (!pins[i])
+            continue;
+
+#ifdef HAVE_GPIO_CDEV
+        /* Pins with mapped registers are faster to set one at a time. */
+        if (pins[i]->backend == GPIO_BACKEND_CDEV && pins[i]->mmap_number < 0) {
+            /* Gather every pin on this line request. */
+            int fd = pins[i]->fd;
+            uint64_t mask = 0;
+            uint64_t bits = 0;
+            for (int j = i; j < count; j++) {
+                if (pins[j] && pins[j]->fd == fd && pins[j]->mmap_number < 0) {
+                    uint64_t bit = 1ULL << pins[j]->line_index;
+                    mask |= bit;
+                    if (values[j])
+                        bits |= bit;
+                    else
+                        bits &= ~bit;
+                    pins[j] = NULL;
+                }
+            }
+            if (gpio_cdev_write_values(fd, mask, bits) < 0)
+                return "gpio_write_failed";
+            continue;
+        }
+#endif
+        if (gpio_write(pins[i], values[i]) < 0)
+            return "gpio_write_failed";
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief	Sample several pins with as few device accesses as possible
+ *
+ * Pins that share a cdev line request are sampled together with
+ * one ioctl.
+ *
+ * @return 	NULL on success, or an atom describing the failure
+ */
+static const char *gpio_bank_read_mask(struct gpio_bank *bank, const long *pin_numbers, long *values, int count)
+{
+    struct gpio *pins[GPIO_BANK_MAX_PINS];
+    for (int i = 0; i < count; i++) {
+        pins[i] = gpio_bank_find(bank, pin_numbers[i]);
+        if (!pins[i])
+            return "pin_not_open";
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (!pins[i])
+            continue;
+
+#ifdef HAVE_GPIO_CDEV
+        if (pins[i]->backend == GPIO_BACKEND_CDEV && pins[i]->mmap_number < 0) {
+            int fd = pins[i]->fd;
+            uint64_t mask = 0;
+            for (int j = i; j < count; j++) {
+                if (pins[j] && pins[j]->fd == fd && pins[j]->mmap_number < 0)
+                    mask |= 1ULL << pins[j]->line_index;
+            }
+
+            uint64_t bits;
+            if (gpio_cdev_read_values(fd, mask, &bits) < 0)
+                return "gpio_read_failed";
+            for (int j = i; j < count; j++) {
+                if (pins[j] && pins[j]->fd == fd && pins[j]->mmap_number < 0) {
+                    values[j] = (bits >> pins[j]->line_index) & 1;
+                    pins[j] = NULL;
+                }
+            }
+            continue;
+        }
+#endif
+        values[i] = gpio_read(pins[i]);
+        if (values[i] < 0)
+            return "gpio_read_failed";
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Read the stream's pins into a sample
+ *
+ * @return 1 for success, 0 if a pin was closed or couldn't be read
+ */
+static int gpio_stream_sample(char *data, void *cookie)
+{
+    struct gpio_bank *bank = (struct gpio_bank *) cookie;
+    long values[GPIO_BANK_MAX_PINS];
+
+    if (gpio_bank_read_mask(bank, bank->stream_pins, values, bank->stream_pin_count) != NULL)
+        return 0;
+
+    for (int i = 0; i < bank->stream_pin_count; i++)
+        data[i] = (char) values[i];
+    return 1;
+}
+
+static void encode_error(char *resp, int *resp_index, const char *reason)
+{
+    ei_encode_tuple_header(resp, resp_index, 2);
+    ei_encode_atom(resp, resp_index, "error");
+    ei_encode_atom(resp, resp_index, reason);
+}
+
+/**
+ * @brief	Configure interrupt batching
+ *
+ * @param	max_events    Events to collect before sending (0 or 1 disables)
+ * @param	max_delay_us  Longest time to hold onto an event
+ */
+static void gpio_set_batch(struct gpio_bank *bank, unsigned long max_events, unsigned long max_delay_us)
+{
+    struct gpio_batch *batch = &bank->batch;
+
+    /* Don't strand events that were batched under the old settings */
+    gpio_flush_interrupts(bank);
+
+    if (max_events <= 1)
+        max_events = 0;
+    else if (max_events > GPIO_BATCH_MAX_EVENTS)
+        max_events = GPIO_BATCH_MAX_EVENTS;
+
+    batch->max_events = max_events;
+    batch->max_delay_ns = (uint64_t) max_delay_us * 1000;
+}
+
+/**
+ * @brief Decode a list of pin numbers
+ *
+ * Erlang encodes lists of small integers as strings, so handle
+ * both encodings.
+ *
+ * @return the number of pins or -1 on error
+ */
+static int decode_pin_list(const char *req, int *req_index, long *pins, int max_pins)
+{
+    int type;
+    int size;
+    if (ei_get_type(req, req_index, &type, &size) < 0 || size > max_pins)
+        return -1;
+
+    if (type == ERL_STRING_EXT) {
+        unsigned char str[GPIO_BANK_MAX_PINS + 1];
+        if (ei_decode_string(req, req_index, (char *) str) < 0)
+            return -1;
+        for (int i = 0; i < size; i++)
+            pins[i] = str[i];
+        return size;
+    }
+
+    int count;
+    if (ei_decode_list_header(req, req_index, &count) < 0)
+        return -1;
+    for (int i = 0; i < count; i++) {
+        if (ei_decode_long(req, req_index, &pins[i]) < 0)
+            return -1;
+    }
+    if (count > 0 && ei_decode_list_header(req, req_index, &size) < 0)
+        return -1;
+
+    return count;
+}
+
+static int decode_direction(const char *req, int *req_index, enum gpio_state *dir)
+{
+    char dirstr[MAXATOMLEN];
+    if (ei_decode_atom(req, req_index, dirstr) < 0)
+        return -1;
+
+    if (strcmp(dirstr, "input") == 0)
+        *dir = GPIO_INPUT;
+    else if (strcmp(dirstr, "output") == 0)
+        *dir = GPIO_OUTPUT;
+    else
+        return -1;
+
+    return 0;
+}
+
+/*
+ * The commands below can arrive as either terms or binary commands, so
+ * the decoding is done by the caller and these only run the command
+ * and encode the reply.
+ */
+static void gpio_cmd_read(struct gpio_bank *bank, long pin_number, char *resp, int *resp_index)
+{
+    debug("read %d", pin_number);
+
+    struct gpio *pin = gpio_bank_find(bank, pin_number);
+    int value = pin ? gpio_read(pin) : -1;
+    if (!pin)
+        encode_error(resp, resp_index, "pin_not_open");
+    else if (value != -1)
+        ei_encode_long(resp, resp_index, value);
+    else
+        erlcmd_encode_errno_error(resp, resp_index, "gpio_read_failed", errno);
+}
+
+static void gpio_cmd_write(struct gpio_bank *bank, long pin_number, long value, char *resp, int *resp_index)
+{
+    debug("write %d %d", pin_number, value);
+
+    struct gpio *pin = gpio_bank_find(bank, pin_number);
+    if (!pin)
+        encode_error(resp, resp_index, "pin_not_open");
+    else if (gpio_write(pin, value) > 0)
+        ei_encode_atom(resp, resp_index, "ok");
+    else
+        erlcmd_encode_errno_error(resp, resp_index, "gpio_write_failed", errno);
+}
+
+static void gpio_cmd_set_int(struct gpio_bank *bank, long pin_number, enum interrupt_mode mode,
+                             uint32_t debounce_us, uint64_t report_us, char *resp, int *resp_index)
+{
+    debug("set_int %d %d %u %llu", pin_number, mode, debounce_us, (unsigned long long) report_us);
+
+    struct gpio *pin = gpio_bank_find(bank, pin_number);
+    if (!pin) {
+        encode_error(resp, resp_index, "pin_not_open");
+        return;
+    }
+
+    int rc = gpio_set_int(bank, pin, mode, debounce_us, report_us);
+    gpio_bank_watch(bank, pin->fd);
+    if (rc > 0)
+        ei_encode_atom(resp, resp_index, "ok");
+    else
+        encode_error(resp, resp_index, "gpio_set_int_failed");
+}
+
+static void gpio_cmd_write_mask(struct gpio_bank *bank, const long *pin_numbers, const long *values, int count, char *resp, int *resp_index)
+{
+    debug("write_mask %d pins", count);
+
+    const char *reason = gpio_bank_write_mask(bank, pin_numbers, values, count);
+    if (!reason)
+        ei_encode_atom(resp, resp_index, "ok");
+    else
+        encode_error(resp, resp_index, reason);
+}
+
+static void gpio_cmd_read_mask(struct gpio_bank *bank, const long *pin_numbers, int count, char *resp, int *resp_index)
+{
+    debug("read_mask %d pins", count);
+
+    long values[GPIO_BANK_MAX_PINS];
+    const char *reason = gpio_bank_read_mask(bank, pin_numbers, values, count);
+    if (!reason) {
+        if (count > 0)
+            ei_encode_list_header(resp, resp_index, count);
+        for (int i = 0; i < count; i++)
+            ei_encode_long(resp, resp_index, values[i]);
+        ei_encode_empty_list(resp, resp_index);
+    } else
+        encode_error(resp, resp_index, reason);
+}
+
+/*
+ * Binary commands
+ *
+ * These skip ei for the commands that are sent the most. Each is an
+ * opcode byte followed by big endian arguments:
+ *
+ *   1 read         <<Pin:16>>
+ *   2 write        <<Pin:16, Value:8>>
+ *   3 set_int      <<Pin:16, Mode:8, DebounceUs:32, ReportUs:32>>
+ *   4 read_mask    <<Pin:16, ...>>
+ *   5 write_mask   <<Pin:16, Value:8, ...>>
+ *
+ * Mode is the enum interrupt_mode value. Replies are the same terms
+ * that the term commands send.
+ */
+enum gpio_opcode {
+    GPIO_OP_READ = 1,
+    GPIO_OP_WRITE,
+    GPIO_OP_SET_INT,
+    GPIO_OP_READ_MASK,
+    GPIO_OP_WRITE_MASK,
+    GPIO_OP_COUNT
+};
+
+static void gpio_op_read(const uint8_t *args, size_t len, void *cookie)
+{
+    char resp[GPIO_RESP_SIZE];
+    int resp_index = 1; // Space for the type
+    resp[0] = 0; // Reply
+    ei_encode_version(resp, &resp_index);
+    gpio_cmd_read((struct gpio_bank *) cookie, erlcmd_get16(args), resp, &resp_index);
+    erlcmd_reply(resp, resp_index);
+}
+
+static void gpio_op_write(const uint8_t *args, size_t len, void *cookie)
+{
+    char resp[GPIO_RESP_SIZE];
+    int resp_index = 1;
+    resp[0] = 0;
+    ei_encode_version(resp, &resp_index);
+    gpio_cmd_write((struct gpio_bank *) cookie, erlcmd_get16(args), args[2], resp, &resp_index);
+    erlcmd_reply(resp, resp_index);
+}
+
+static void gpio_op_set_int(const uint8_t *args, size_t len, void *cookie)
+{
+    if (args[2] > GPIO_INT_COUNT) {
+        erlcmd_bad_request("set_int: bad mode %d", args[2]);
+        return;
+    }
+
+    char resp[GPIO_RESP_SIZE];
+    int resp_index = 1;
+    resp[0] = 0;
+    ei_encode_version(resp, &resp_index);
+    gpio_cmd_set_int((struct gpio_bank *) cookie, erlcmd_get16(args), (enum interrupt_mode) args[2],
+                     erlcmd_get32(&args[3]), erlcmd_get32(&args[7]), resp, &resp_index);
+    erlcmd_reply(resp, resp_index);
+}
+
+static void gpio_op_read_mask(const uint8_t *args, size_t len, void *cookie)
+{
+    if (len % 2 != 0 || len / 2 > GPIO_BANK_MAX_PINS) {
+        erlcmd_bad_request("read_mask: bad length %d", (int) len);
+        return;
+    }
+
+    long pin_numbers[GPIO_BANK_MAX_PINS];
+    int count = len / 2;
+    for (int i = 0; i < count; i++)
+        pin_numbers[i] = erlcmd_get16(&args[2 * i]);
+
+    char resp[GPIO_RESP_SIZE];
+    int resp_index = 1;
+    resp[0] = 0;
+    ei_encode_version(resp, &resp_index);
+    gpio_cmd_read_mask((struct gpio_bank *) cookie, pin_numbers, count, resp, &resp_index);
+    erlcmd_reply(resp, resp_index);
+}
+
+static void gpio_op_write_mask(const uint8_t *args, size_t len, void *cookie)
+{
+    if (len % 3 != 0 || len / 3 > GPIO_BANK_MAX_PINS) {
+        erlcmd_bad_request("write_mask: bad length %d", (int) len);
+        return;
+    }
+
+    long pin_numbers[GPIO_BANK_MAX_PINS];
+    long values[GPIO_BANK_MAX_PINS];
+    int count = len / 3;
+    for (int i = 0; i < count; i++) {
+        pin_numbers[i] = erlcmd_get16(&args[3 * i]);
+        values[i] = args[3 * i + 2];
+    }
+
+    char resp[GPIO_RESP_SIZE];
+    int resp_index = 1;
+    resp[0] = 0;
+    ei_encode_version(resp, &resp_index);
+    gpio_cmd_write_mask((struct gpio_bank *) cookie, pin_numbers, values, count, resp, &resp_index);
+    erlcmd_reply(resp, resp_index);
+}
+
+static const struct erlcmd_opcode gpio_opcodes[GPIO_OP_COUNT] = {
+    [GPIO_OP_READ] = {gpio_op_read, 2, 0},
+    [GPIO_OP_WRITE] = {gpio_op_write, 3, 0},
+    [GPIO_OP_SET_INT] = {gpio_op_set_int, 11, 0},
+    [GPIO_OP_READ_MASK] = {gpio_op_read_mask, 0, 1},
+    [GPIO_OP_WRITE_MASK] = {gpio_op_write_mask, 0, 1}
+};
+
+void gpio_handle_request(const char *req, void *cookie)
+{
+    struct gpio_bank *bank = (struct gpio_bank *) cookie;
+
+    // Commands are of the form {Command, Arguments}:
+    // { atom(), term() }
+    //
+    // Most commands address one pin, so the arguments are either the
+    // pin number or {Pin, Value}. open, read_mask and write_mask take
+    // lists of pins and set_batch affects the whole bank.
+    int req_index = 0;
+    if (ei_decode_version(req, &req_index, NULL) < 0) {
+        erlcmd_bad_request("Message version issue?");
+        return;
+    }
+
+    int arity;
+    if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+            arity != 2) {
+        erlcmd_bad_request("expecting {cmd, args} tuple");
+        return;
+    }
+
+    char cmd[MAXATOMLEN];
+    if (ei_decode_atom(req, &req_index, cmd) < 0) {
+        erlcmd_bad_request("expecting command atom");
+        return;
+    }
+
+    // Every mode reports stats and configures the simulator the same way
+    if (strcmp(cmd, "stats") == 0) {
+        stats_reply();
+        return;
+    } else if (strcmp(cmd, "sim") == 0) {
+        sim_handle_request(req, &req_index);
+        return;
+    }
+
+    char resp[GPIO_RESP_SIZE];
+    int resp_index = 1; // Space for the type
+    resp[0] = 0; // Reply
+    ei_encode_version(resp, &resp_index);
+    if (strcmp(cmd, "open") == 0) {
+        long pin_numbers[GPIO_BANK_MAX_PINS];
+        int count = 1;
+        int type;
+        int size;
+        enum gpio_state dir;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 2 ||
+                ei_get_type(req, &req_index, &type, &size) < 0) {
+            erlcmd_bad_request("open: expecting {pin | [pin], input|output}");
+            return;
+        }
+        if (type == ERL_SMALL_INTEGER_EXT || type == ERL_INTEGER_EXT) {
+            if (ei_decode_long(req, &req_index, &pin_numbers[0]) < 0) {
+                erlcmd_bad_request("open: bad pin");
+                return;
+            }
+        } else {
+            count = decode_pin_list(req, &req_index, pin_numbers, GPIO_BANK_MAX_PINS);
+            if (count < 0) {
+                erlcmd_bad_request("open: bad pin list");
+                return;
+            }
+        }
+        if (decode_direction(req, &req_index, &dir) < 0) {
+            erlcmd_bad_request("open: expecting input or output");
+            return;
+        }
+        debug("open %d pins", count);
+
+        enum gpio_state dirs[GPIO_BANK_MAX_PINS];
+        for (int i = 0; i < count; i++)
+            dirs[i] = dir;
+
+        const char *reason = gpio_bank_open(bank, pin_numbers, dirs, count);
+        if (!reason)
+            ei_encode_atom(resp, &resp_index, "ok");
+        else
+            encode_error(resp, &resp_index, reason);
+    } else if (strcmp(cmd, "init_pins") == 0) {
+        long pin_numbers[GPIO_BANK_MAX_PINS];
+        enum gpio_state dirs[GPIO_BANK_MAX_PINS];
+        int count;
+        if (ei_decode_list_header(req, &req_index, &count) < 0 ||
+                count > GPIO_BANK_MAX_PINS) {
+            erlcmd_bad_request("init_pins: expecting [{pin, input|output}]");
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                    arity != 2 ||
+                    ei_decode_long(req, &req_index, &pin_numbers[i]) < 0 ||
+                    decode_direction(req, &req_index, &dirs[i]) < 0) {
+                erlcmd_bad_request("init_pins: expecting [{pin, input|output}]");
+                return;
+            }
+        }
+        debug("init_pins %d pins", count);
+
+        const char *reason = gpio_bank_open(bank, pin_numbers, dirs, count);
+        if (!reason)
+            ei_encode_atom(resp, &resp_index, "ok");
+        else
+            encode_error(resp, &resp_index, reason);
+    } else if (strcmp(cmd, "close") == 0) {
+        long pin_number;
+        if (ei_decode_long(req, &req_index, &pin_number) < 0) {
+            erlcmd_bad_request("close: expecting pin");
+            return;
+        }
+        debug("close %d", pin_number);
+
+        struct gpio *pin = gpio_bank_find(bank, pin_number);
+        if (pin) {
+            gpio_bank_close(bank, pin);
+            ei_encode_atom(resp, &resp_index, "ok");
+        } else
+            encode_error(resp, &resp_index, "pin_not_open");
+    } else if (strcmp(cmd, "read") == 0) {
+        long pin_number;
+        if (ei_decode_long(req, &req_index, &pin_number) < 0) {
+            erlcmd_bad_request("read: expecting pin");
+            return;
+        }
+
+        gpio_cmd_read(bank, pin_number, resp, &resp_index);
+    } else if (strcmp(cmd, "write") == 0) {
+        long pin_number;
+        long value;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 2 ||
+                ei_decode_long(req, &req_index, &pin_number) < 0 ||
+                ei_decode_long(req, &req_index, &value) < 0) {
+            erlcmd_bad_request("write: expecting {pin, value}");
+            return;
+        }
+
+        gpio_cmd_write(bank, pin_number, value, resp, &resp_index);
+    } else if (strcmp(cmd, "set_int") == 0) {
+        long pin_number;
+        char mode_name[MAXATOMLEN];
+        enum interrupt_mode mode;
+        unsigned long debounce_us = 0;
+        unsigned long report_us = 0;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity < 2 || arity > 4 ||
+                ei_decode_long(req, &req_index, &pin_number) < 0 ||
+                ei_decode_atom(req, &req_index, mode_name) < 0 ||
+                gpio_decode_int_mode(mode_name, &mode) < 0 ||
+                (arity >= 3 && ei_decode_ulong(req, &req_index, &debounce_us) < 0) ||
+                (arity == 4 && ei_decode_ulong(req, &req_index, &report_us) < 0) ||
+                debounce_us > UINT32_MAX) {
+            erlcmd_bad_request("set_int: expecting {pin, mode, [debounce_us, [report_us]]}");
+            return;
+        }
+
+        gpio_cmd_set_int(bank, pin_number, mode, debounce_us, report_us, resp, &resp_index);
+    } else if (strcmp(cmd, "read_count") == 0) {
+        long pin_number;
+        if (ei_decode_long(req, &req_index, &pin_number) < 0) {
+            erlcmd_bad_request("read_count: expecting pin");
+            return;
+        }
+        debug("read_count %d", pin_number);
+
+        struct gpio *pin = gpio_bank_find(bank, pin_number);
+        if (!pin)
+            encode_error(resp, &resp_index, "pin_not_open");
+        else if (pin->int_mode != GPIO_INT_COUNT)
+            encode_error(resp, &resp_index, "not_counting");
+        else
+            gpio_encode_count(resp, &resp_index, pin);
+    } else if (strcmp(cmd, "write_mask") == 0) {
+        long pin_numbers[GPIO_BANK_MAX_PINS];
+        long values[GPIO_BANK_MAX_PINS];
+        int count;
+        if (ei_decode_list_header(req, &req_index, &count) < 0 ||
+                count > GPIO_BANK_MAX_PINS) {
+            erlcmd_bad_request("write_mask: expecting [{pin, value}]");
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                    arity != 2 ||
+                    ei_decode_long(req, &req_index, &pin_numbers[i]) < 0 ||
+                    ei_decode_long(req, &req_index, &values[i]) < 0) {
+                erlcmd_bad_request("write_mask: expecting [{pin, value}]");
+                return;
+            }
+        }
+
+        gpio_cmd_write_mask(bank, pin_numbers, values, count, resp, &resp_index);
+    } else if (strcmp(cmd, "read_mask") == 0) {
+        long pin_numbers[GPIO_BANK_MAX_PINS];
+        int count = decode_pin_list(req, &req_index, pin_numbers, GPIO_BANK_MAX_PINS);
+        if (count < 0) {
+            erlcmd_bad_request("read_mask: expecting [pin]");
+            return;
+        }
+
+        gpio_cmd_read_mask(bank, pin_numbers, count, resp, &resp_index);
+    } else if (strcmp(cmd, "set_batch") == 0) {
+        unsigned long max_events;
+        unsigned long max_delay_us;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 2 ||
+                ei_decode_ulong(req, &req_index, &max_events) < 0 ||
+                ei_decode_ulong(req, &req_index, &max_delay_us) < 0) {
+            erlcmd_bad_request("set_batch: expecting {max_events, max_delay_us}");
+            return;
+        }
+        debug("set_batch %lu %lu", max_events, max_delay_us);
+
+        gpio_set_batch(bank, max_events, max_delay_us);
+        ei_encode_atom(resp, &resp_index, "ok");
+    } else if (strcmp(cmd, "start_stream") == 0) {
+        unsigned long period_us;
+        unsigned long samples_per_batch;
+
+        stream_stop(&bank->stream);
+
+        bank->stream_pin_count = 0;
+        int count;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 3 ||
+                (count = decode_pin_list(req, &req_index, bank->stream_pins, GPIO_BANK_MAX_PINS)) < 1 ||
+                ei_decode_ulong(req, &req_index, &period_us) < 0 ||
+                ei_decode_ulong(req, &req_index, &samples_per_batch) < 0) {
+            erlcmd_bad_request("start_stream: expecting {[pin], period_us, samples_per_batch}");
+            return;
+        }
+        debug("start_stream %d pins, %lu us", count, period_us);
+
+        bank->stream_pin_count = count;
+        const char *reason = NULL;
+        for (int i = 0; i < count && !reason; i++) {
+            if (!gpio_bank_find(bank, bank->stream_pins[i]))
+                reason = "pin_not_open";
+        }
+        if (!reason && stream_start(&bank->stream, period_us, count, samples_per_batch) < 0)
+            reason = "bad_stream";
+
+        if (!reason)
+            ei_encode_atom(resp, &resp_index, "ok");
+        else
+            encode_error(resp, &resp_index, reason);
+    } else if (strcmp(cmd, "stop_stream") == 0) {
+        // Any batched samples are sent before the reply
+        stream_stop(&bank->stream);
+        ei_encode_atom(resp, &resp_index, "ok");
+    } else if (strcmp(cmd, "waveform") == 0) {
+        struct gpio_waveform *waveform = &bank->waveform;
+        long pin_number;
+        int count;
+
+        // Only one waveform plays at a time
+        gpio_waveform_stop(waveform);
+
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 3 ||
+                ei_decode_long(req, &req_index, &pin_number) < 0 ||
+                ei_decode_list_header(req, &req_index, &count) < 0 ||
+                count < 1 ||
+                count > GPIO_WAVEFORM_MAX_STEPS) {
+            erlcmd_bad_request("waveform: expecting {pin, [{level, duration_us}], repeat}");
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            long level;
+            unsigned long duration_us;
+            if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                    arity != 2 ||
+                    ei_decode_long(req, &req_index, &level) < 0 ||
+                    ei_decode_ulong(req, &req_index, &duration_us) < 0 ||
+                    duration_us < 1 ||
+                    duration_us > UINT32_MAX) {
+                erlcmd_bad_request("waveform: expecting {level, duration_us}");
+                return;
+            }
+            waveform->steps[i].level = level ? 1 : 0;
+            waveform->steps[i].duration_us = duration_us;
+        }
+        int tail;
+        if (ei_decode_list_header(req, &req_index, &tail) < 0 ||
+                ei_decode_ulong(req, &req_index, &waveform->repeat) < 0) {
+            erlcmd_bad_request("waveform: expecting repeat count");
+            return;
+        }
+        waveform->count = count;
+        debug("waveform %d: %d steps", pin_number, count);
+
+        struct gpio *pin = gpio_bank_find(bank, pin_number);
+        const char *reason = pin ? gpio_waveform_start(waveform, pin) : "pin_not_open";
+        if (!reason)
+            ei_encode_atom(resp, &resp_index, "ok");
+        else
+            encode_error(resp, &resp_index, reason);
+    } else if (strcmp(cmd, "stop_waveform") == 0) {
+        gpio_waveform_stop(&bank->waveform);
+        ei_encode_atom(resp, &resp_index, "ok");
+    } else {
+        erlcmd_bad_request("unknown command: %s", cmd);
+        return;
+    }
+
+    debug("sending response: %d bytes", resp_index);
+    erlcmd_reply(resp, resp_index);
+}
+
+/**
+ * @brief	Allocate a bank and have handler serve requests for it
+ *
+ * @return 	NULL on success, or an atom describing the failure with
+ *              errno set
+ */
+static const char *gpio_bank_create(struct erlcmd *handler, const char *chip_path)
+{
+    struct gpio_bank *bank = malloc(sizeof(struct gpio_bank));
+    if (!bank)
+        err(EXIT_FAILURE, "malloc");
+
+    const char *reason = gpio_bank_init(bank, chip_path);
+    if (reason) {
+        int errnum = errno;
+        free(bank);
+        errno = errnum;
+        return reason;
+    }
+    stream_init(&bank->stream, gpio_stream_sample, bank);
+
+    erlcmd_init(handler, gpio_handle_request, bank);
+    erlcmd_set_opcodes(handler, gpio_opcodes, GPIO_OP_COUNT);
+    return NULL;
+}
+
+/**
+ * @brief	Close every pin and free the bank of a handle opened by
+ *              gpio_open_handle() or gpio_bank_open_handle()
+ */
+void gpio_close_handle(struct erlcmd *handler)
+{
+    struct gpio_bank *bank = (struct gpio_bank *) handler->cookie;
+    stream_stop(&bank->stream);
+    gpio_waveform_stop(&bank->waveform);
+    for (int i = 0; i < GPIO_BANK_MAX_PINS; i++) {
+        if (bank->pins[i].fd >= 0)
+            gpio_bank_close(bank, &bank->pins[i]);
+    }
+    erlcmd_timer_close(bank->deadline_fd);
+    if (bank->chip_fd >= 0)
+        close(bank->chip_fd);
+    free(bank);
+}
+
+/**
+ * @brief	Open one pin for gpio_main() or a hub handle
+ *
+ * The arguments are the same as gpio_main()'s.
+ *
+ * @return 	NULL on success, or an atom describing the failure with
+ *              errno set
+ */
+const char *gpio_open_handle(struct erlcmd *handler, int argc, char *argv[])
+{
+    if (argc != 4 && argc != 5) {
+        errno = EINVAL;
+        return "bad_arguments";
+    }
+
+    long pin_number = strtol(argv[2], NULL, 0);
+    enum gpio_state initial_state;
+    if (strcmp(argv[3], "input") == 0)
+        initial_state = GPIO_INPUT;
+    else if (strcmp(argv[3], "output") == 0)
+        initial_state = GPIO_OUTPUT;
+    else {
+        errno = EINVAL;
+        return "bad_direction";
+    }
+
+    const char *reason = gpio_bank_create(handler, argc == 5 ? argv[4] : NULL);
+    if (reason)
+        return reason;
+
+    reason = gpio_bank_open((struct gpio_bank *) handler->cookie, &pin_number, &initial_state, 1);
+    if (reason) {
+        int errnum = errno;
+        gpio_close_handle(handler);
+        errno = errnum;
+    }
+    return reason;
+}
+
+/**
+ * @brief	Open an empty bank for gpio_bank_main() or a hub handle
+ *
+ * The arguments are the same as gpio_bank_main()'s.
+ *
+ * @return 	NULL on success, or an atom describing the failure with
+ *              errno set
+ */
+const char *gpio_bank_open_handle(struct erlcmd *handler, int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3) {
+        errno = EINVAL;
+        return "bad_arguments";
+    }
+
+    return gpio_bank_create(handler, argc == 3 ? argv[2] : NULL);
+}
+
+int gpio_main(int argc, char *argv[])
+{
+    if (argc != 4 && argc != 5)
+        errx(EXIT_FAILURE, "%s gpio <pin#> <input|output> [gpiochip path]", argv[0]);
+
+    if (strcmp(argv[3], "input") != 0 && strcmp(argv[3], "output") != 0)
+        errx(EXIT_FAILURE, "Specify 'input' or 'output'");
+
+    struct erlcmd handler;
+    const char *reason = gpio_open_handle(&handler, argc, argv);
+    if (reason)
+        err(EXIT_FAILURE, "Couldn't initialize gpio %s: %s", argv[2], reason);
+
+    erlcmd_run(&handler);
+}
+
+int gpio_bank_main(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3)
+        errx(EXIT_FAILURE, "%s gpio_bank [gpiochip path]", argv[0]);
+
+    struct erlcmd handler;
+    const char *reason = gpio_bank_open_handle(&handler, argc, argv);
+    if (reason)
+        err(EXIT_FAILURE, "Couldn't initialize the GPIO bank: %s", reason);
+
+    erlcmd_run(&handler);
 }
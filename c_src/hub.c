@@ -0,0 +1,252 @@
+/*
+ *  Copyright 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "erlcmd.h"
+#include "sim.h"
+#include "stats.h"
+
+//#define DEBUG
+#ifdef DEBUG
+#define debug(...) do { fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\r\n"); } while(0)
+#else
+#define debug(...)
+#endif
+
+extern const char *gpio_open_handle(struct erlcmd *handler, int argc, char *argv[]);
+extern const char *gpio_bank_open_handle(struct erlcmd *handler, int argc, char *argv[]);
+extern void gpio_close_handle(struct erlcmd *handler);
+extern const char *i2c_open_handle(struct erlcmd *handler, int argc, char *argv[]);
+extern void i2c_close_handle(struct erlcmd *handler);
+extern const char *spi_open_handle(struct erlcmd *handler, int argc, char *argv[]);
+extern void spi_close_handle(struct erlcmd *handler);
+
+/*
+ * A hub serves any number of GPIOs, GPIO banks, I2C buses and SPI
+ * devices from one process. Each one is opened as a handle and
+ * handles the same requests as its mode does in its own process.
+ * Requests to the hub itself go to handle 0:
+ *
+ *   {open, [Mode | Args]}  -> {ok, Handle} | {error, Reason, Errno}
+ *   {close, Handle}        -> ok | {error, not_open}
+ *   {stats, []}            -> the stats of the whole process
+ *
+ * Mode and Args are the same strings as on the command line, for
+ * example ["i2c", "/dev/i2c-1", "80"]. Options like --schedule and
+ * --retries apply to every handle.
+ */
+#define HUB_MAX_HANDLES 256
+#define HUB_MAX_ARGS 8
+#define HUB_MAX_ARG_LEN 256
+
+struct hub_mode
+{
+    const char *name;
+    const char *(*open)(struct erlcmd *handler, int argc, char *argv[]);
+    void (*close)(struct erlcmd *handler);
+};
+
+static const struct hub_mode hub_modes[] = {
+    {"gpio", gpio_open_handle, gpio_close_handle},
+    {"gpio_bank", gpio_bank_open_handle, gpio_close_handle},
+    {"i2c", i2c_open_handle, i2c_close_handle},
+    {"spi", spi_open_handle, spi_close_handle}
+};
+
+struct hub_handle
+{
+    const struct hub_mode *mode; // NULL when the handle isn't open
+    struct erlcmd handler;
+};
+
+// Indexed by handle. Handle 0 is the hub.
+static struct hub_handle handles[HUB_MAX_HANDLES];
+
+static struct erlcmd *hub_lookup(uint16_t handle)
+{
+    if (handle >= HUB_MAX_HANDLES || !handles[handle].mode)
+        return NULL;
+    return &handles[handle].handler;
+}
+
+static const struct hub_mode *hub_find_mode(const char *name)
+{
+    for (size_t i = 0; i < sizeof(hub_modes) / sizeof(hub_modes[0]); i++) {
+        if (strcmp(hub_modes[i].name, name) == 0)
+            return &hub_modes[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Decode the list of strings in an open request
+ *
+ * argv[0] is left for the program name like on the command line.
+ *
+ * @return the number of arguments including argv[0] or -1 on error
+ */
+static int hub_decode_args(const char *req, int *req_index, char args[][HUB_MAX_ARG_LEN], char **argv)
+{
+    int count;
+    if (ei_decode_list_header(req, req_index, &count) < 0 ||
+            count < 1 ||
+            count > HUB_MAX_ARGS)
+        return -1;
+
+    argv[0] = "erlang-ale";
+    for (int i = 0; i < count; i++) {
+        int type;
+        int len;
+        if (ei_get_type(req, req_index, &type, &len) < 0 ||
+                (type != ERL_STRING_EXT && type != ERL_NIL_EXT) ||
+                len >= HUB_MAX_ARG_LEN ||
+                ei_decode_string(req, req_index, args[i]) < 0)
+            return -1;
+        argv[i + 1] = args[i];
+    }
+
+    // Skip the tail of the list
+    if (ei_skip_term(req, req_index) < 0)
+        return -1;
+
+    return count + 1;
+}
+
+static void hub_open(const char *req, int *req_index)
+{
+    char args[HUB_MAX_ARGS][HUB_MAX_ARG_LEN];
+    char *argv[HUB_MAX_ARGS + 1];
+    int argc = hub_decode_args(req, req_index, args, argv);
+    const struct hub_mode *mode = (argc > 1 ? hub_find_mode(argv[1]) : NULL);
+    if (!mode) {
+        erlcmd_bad_request("open: expecting [Mode | Args]");
+        return;
+    }
+
+    char resp[128];
+    int resp_index = 1; // Space for the type
+    resp[0] = 0; // Reply
+    ei_encode_version(resp, &resp_index);
+
+    uint16_t handle = 1;
+    while (handle < HUB_MAX_HANDLES && handles[handle].mode)
+        handle++;
+    if (handle == HUB_MAX_HANDLES) {
+        erlcmd_encode_errno_error(resp, &resp_index, "too_many_handles", EMFILE);
+        erlcmd_reply(resp, resp_index);
+        return;
+    }
+
+    /* Select the new handle so that the timers and watches that the
+     * mode sets up send their notifications from it.
+     */
+    uint16_t previous = erlcmd_select_handle(handle);
+    const char *reason = mode->open(&handles[handle].handler, argc, argv);
+    erlcmd_select_handle(previous);
+
+    if (reason) {
+        erlcmd_encode_errno_error(resp, &resp_index, reason, errno);
+    } else {
+        debug("opened %s as handle %d", mode->name, handle);
+        handles[handle].mode = mode;
+        ei_encode_tuple_header(resp, &resp_index, 2);
+        ei_encode_atom(resp, &resp_index, "ok");
+        ei_encode_ulong(resp, &resp_index, handle);
+    }
+    erlcmd_reply(resp, resp_index);
+}
+
+static void hub_close(const char *req, int *req_index)
+{
+    unsigned long handle;
+    if (ei_decode_ulong(req, req_index, &handle) < 0) {
+        erlcmd_bad_request("close: expecting a handle");
+        return;
+    }
+
+    char resp[64];
+    int resp_index = 1; // Space for the type
+    resp[0] = 0; // Reply
+    ei_encode_version(resp, &resp_index);
+    if (handle == 0 || handle >= HUB_MAX_HANDLES || !handles[handle].mode) {
+        ei_encode_tuple_header(resp, &resp_index, 2);
+        ei_encode_atom(resp, &resp_index, "error");
+        ei_encode_atom(resp, &resp_index, "not_open");
+    } else {
+        // Anything that's sent while closing is from the handle
+        uint16_t previous = erlcmd_select_handle((uint16_t) handle);
+        handles[handle].mode->close(&handles[handle].handler);
+        erlcmd_select_handle(previous);
+
+        handles[handle].mode = NULL;
+        ei_encode_atom(resp, &resp_index, "ok");
+    }
+    erlcmd_reply(resp, resp_index);
+}
+
+static void hub_handle_request(const char *req, void *cookie)
+{
+    int req_index = 0;
+    if (ei_decode_version(req, &req_index, NULL) < 0) {
+        erlcmd_bad_request("Message version issue?");
+        return;
+    }
+
+    int arity;
+    if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+            arity != 2) {
+        erlcmd_bad_request("expecting {cmd, args} tuple");
+        return;
+    }
+
+    char cmd[MAXATOMLEN];
+    if (ei_decode_atom(req, &req_index, cmd) < 0) {
+        erlcmd_bad_request("expecting command atom");
+        return;
+    }
+
+    if (strcmp(cmd, "stats") == 0) {
+        stats_reply();
+        return;
+    } else if (strcmp(cmd, "sim") == 0) {
+        sim_handle_request(req, &req_index);
+        return;
+    }
+
+    if (strcmp(cmd, "open") == 0)
+        hub_open(req, &req_index);
+    else if (strcmp(cmd, "close") == 0)
+        hub_close(req, &req_index);
+    else
+        erlcmd_bad_request("unknown command: %s", cmd);
+}
+
+int hub_main(int argc, char *argv[])
+{
+    if (argc != 2)
+        errx(EXIT_FAILURE, "%s hub", argv[0]);
+
+    erlcmd_set_handles(hub_lookup);
+
+    struct erlcmd handler;
+    erlcmd_init(&handler, hub_handle_request, NULL);
+    erlcmd_run(&handler);
+}
@@ -16,6 +16,7 @@
  */
 
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,6 +30,11 @@
 #include <linux/i2c-dev.h>
 
 #include "erlcmd.h"
+#include "program.h"
+#include "sim.h"
+#include "stats.h"
+#include "stream.h"
+#include "worker.h"
 
 //#define DEBUG
 #ifdef DEBUG
@@ -37,26 +43,117 @@
 #define debug(...)
 #endif
 
+// i2c-dev rejects messages longer than this
+#define I2C_MSG_MAX 8192
+
+// Used when the port serves the whole bus rather than one device
+#define I2C_NO_ADDRESS (-1)
+
+/*
+ * A transaction is a list of messages that is submitted with one
+ * I2C_RDWR ioctl. Each message has its own address, so sequences
+ * across devices are atomic with respect to other bus users.
+ */
+struct i2c_transaction
+{
+    int count;
+    struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+    size_t rx_total;
+};
+
 struct i2c_info
 {
     int fd;
-    unsigned int addr;
+    int addr;
+
+    // Reused for every read, write and wrrd request
+    char write_buffer[I2C_MSG_MAX];
+    char read_buffer[I2C_MSG_MAX];
+    char resp_buffer[I2C_MSG_MAX + 64];
+
+    // Run every period while streaming
+    struct i2c_transaction stream_transaction;
+    struct stream stream;
+
+    // For combining queued transactions
+    struct erlcmd *handler;
+
+    // Runs the device requests when workers are enabled or NULL
+    struct worker *worker;
 };
 
-static void i2c_init(struct i2c_info *i2c, const char *devpath, unsigned int addr)
+/*
+ * A read, write, wrrd or transaction that runs on the bus's worker. It
+ * has copies of the messages since the request buffer is reused. A
+ * read, write or wrrd is a transaction of one or two messages that's
+ * replied to like the request. A transaction can have queued ones
+ * combined with it, and each of them is replied to separately.
+ */
+struct i2c_job
 {
-    memset(i2c, 0, sizeof(*i2c));
+    struct worker_job job;
+    struct i2c_info *i2c;
+    struct i2c_transaction t;
+    const char *failure; // The reason if a read, write or wrrd fails or NULL
+    int errnum;          // 0 if the I2C_RDWR ioctl worked
+
+    int requests;
+    int counts[I2C_RDWR_IOCTL_MAX_MSGS];
+    struct erlcmd_deferred replies[I2C_RDWR_IOCTL_MAX_MSGS];
+};
 
-    // Fail hard on error. May need to be nicer if this makes the
-    // Erlang side too hard to debug.
-    i2c->fd = open(devpath, O_RDWR);
-    if (i2c->fd < 0)
-        err(EXIT_FAILURE, "open %s", devpath);
+/**
+ * @brief	Open an I2C adapter
+ *
+ * @param	devpath  Path to the adapter (e.g., /dev/i2c-1)
+ * @param	addr     Default device address or I2C_NO_ADDRESS to only
+ *                       use transactions
+ *
+ * @return NULL on success, or an atom describing the failure with
+ *         errno set
+ */
+static const char *i2c_init(struct i2c_info *i2c, const char *devpath, int addr)
+{
+    i2c->addr = addr;
+    i2c->fd = -1;
+    if (sim_enabled())
+        return NULL;
 
-    if (ioctl(i2c->fd, I2C_SLAVE, addr) < 0)
-        err(EXIT_FAILURE, "ioctl(I2C_SLAVE %d)", addr);
+    i2c->fd = open(devpath, O_RDWR | O_CLOEXEC);
+    if (i2c->fd < 0)
+        return "i2c_open_failed";
+
+    // Only check the address. Since all transfers are done with
+    // I2C_RDWR, one process can talk to any device on the bus.
+    if (addr != I2C_NO_ADDRESS && ioctl(i2c->fd, I2C_SLAVE, addr) < 0) {
+        int errnum = errno;
+        close(i2c->fd);
+        i2c->fd = -1;
+        errno = errnum;
+        return "i2c_address_failed";
+    }
+    return NULL;
+}
 
-    i2c->addr = addr;
+/**
+ * @brief	Run an I2C_RDWR ioctl and record how long it took
+ *
+ * Transient failures like a NAK are retried if enabled with
+ * erlcmd_set_retries().
+ *
+ * @return 	the ioctl's return value with errno set on failure
+ */
+static int i2c_rdwr(const struct i2c_info *i2c, struct i2c_rdwr_ioctl_data *data)
+{
+    int rc;
+    for (int attempt = 0; ; attempt++) {
+        uint64_t start = stats_now_ns();
+        rc = sim_enabled() ? sim_i2c_transfer(data) : ioctl(i2c->fd, I2C_RDWR, data);
+        stats_record_io(start, rc >= 0);
+        if (rc >= 0 || !erlcmd_should_retry(attempt, errno))
+            break;
+    }
+    return rc;
 }
 
 /**
@@ -100,105 +197,779 @@ static int i2c_transfer(const struct i2c_info *i2c,
 
     data.nmsgs = (to_write_len != 0 && to_read_len != 0) ? 2 : 1;
 
-    int rc = ioctl(i2c->fd, I2C_RDWR, &data);
+    int rc = i2c_rdwr(i2c, &data);
     if (rc < 0)
         return 0;
     else
         return 1;
 }
 
+static void i2c_transaction_free(struct i2c_transaction *t)
+{
+    for (int i = 0; i < t->count; i++)
+        free(t->msgs[i].buf);
+    t->count = 0;
+}
+
+/**
+ * @brief Decode a transaction
+ *
+ * Each message is one of:
+ *
+ *   {write, Address, binary()}
+ *   {read, Address, integer()}
+ *
+ * @return 0 on success, -1 on decode error
+ */
+static int i2c_decode_transaction(const char *req, int *req_index, struct i2c_transaction *t)
+{
+    memset(t, 0, sizeof(*t));
+
+    int count;
+    if (ei_decode_list_header(req, req_index, &count) < 0 ||
+            count < 1 ||
+            count > I2C_RDWR_IOCTL_MAX_MSGS)
+        return -1;
+
+    for (int i = 0; i < count; i++) {
+        struct i2c_msg *msg = &t->msgs[i];
+        int arity;
+        char kind[MAXATOMLEN];
+        unsigned long addr;
+        if (ei_decode_tuple_header(req, req_index, &arity) < 0 ||
+                arity != 3 ||
+                ei_decode_atom(req, req_index, kind) < 0 ||
+                ei_decode_ulong(req, req_index, &addr) < 0 ||
+                addr > 0x3ff)
+            return -1;
+
+        msg->addr = addr;
+        msg->flags = (addr > 0x7f ? I2C_M_TEN : 0);
+        if (strcmp(kind, "read") == 0) {
+            unsigned long len;
+            if (ei_decode_ulong(req, req_index, &len) < 0 ||
+                    len < 1 ||
+                    len > I2C_MSG_MAX)
+                return -1;
+
+            msg->flags |= I2C_M_RD;
+            msg->len = len;
+            msg->buf = malloc(len);
+            t->rx_total += len;
+        } else if (strcmp(kind, "write") == 0) {
+            int type;
+            int size;
+            long llen;
+            if (ei_get_type(req, req_index, &type, &size) < 0 ||
+                    type != ERL_BINARY_EXT ||
+                    size > I2C_MSG_MAX)
+                return -1;
+
+            msg->len = size;
+            msg->buf = malloc(size ? size : 1);
+            if (msg->buf && ei_decode_binary(req, req_index, msg->buf, &llen) < 0) {
+                t->count = i + 1;
+                return -1;
+            }
+        } else
+            return -1;
+
+        if (!msg->buf)
+            err(EXIT_FAILURE, "malloc");
+        t->count = i + 1;
+    }
+    if (ei_decode_list_header(req, req_index, &count) < 0)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * @return the address of every message in the transaction or
+ *         I2C_NO_ADDRESS if they're not all the same
+ */
+static int i2c_transaction_address(const struct i2c_transaction *t)
+{
+    for (int i = 1; i < t->count; i++) {
+        if (t->msgs[i].addr != t->msgs[0].addr)
+            return I2C_NO_ADDRESS;
+    }
+    return t->msgs[0].addr;
+}
+
+/**
+ * @brief Decode the arguments of a transaction request
+ *
+ *   Messages | {Messages, [{coalesce, boolean()}]}
+ *
+ * @param coalesce set to 1 if the request may share an ioctl with others
+ *
+ * @return 0 on success, -1 on decode error
+ */
+static int i2c_decode_transaction_request(const char *req, int *req_index,
+                                          struct i2c_transaction *t, int *coalesce)
+{
+    *coalesce = 0;
+
+    int type;
+    int size;
+    if (ei_get_type(req, req_index, &type, &size) < 0) {
+        memset(t, 0, sizeof(*t));
+        return -1;
+    }
+    if (type != ERL_SMALL_TUPLE_EXT)
+        return i2c_decode_transaction(req, req_index, t);
+
+    int arity;
+    if (ei_decode_tuple_header(req, req_index, &arity) < 0 ||
+            arity != 2) {
+        memset(t, 0, sizeof(*t));
+        return -1;
+    }
+    if (i2c_decode_transaction(req, req_index, t) < 0)
+        return -1;
+
+    int count;
+    if (ei_decode_list_header(req, req_index, &count) < 0)
+        return -1;
+    for (int i = 0; i < count; i++) {
+        char name[MAXATOMLEN];
+        if (ei_decode_tuple_header(req, req_index, &arity) < 0 ||
+                arity != 2 ||
+                ei_decode_atom(req, req_index, name) < 0 ||
+                strcmp(name, "coalesce") != 0 ||
+                ei_decode_boolean(req, req_index, coalesce) < 0)
+            return -1;
+    }
+    if (count > 0 && ei_decode_list_header(req, req_index, &count) < 0)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * @brief Append a queued transaction to the same device
+ *
+ * When requests are scheduled, transactions to one device often queue
+ * up back to back. Running them in one I2C_RDWR ioctl saves a system
+ * call and a bus arbitration for each one. Requests that can't be
+ * appended are left alone to run normally.
+ *
+ * Only requests that asked for it with {coalesce, true} are merged,
+ * since there's a repeated START instead of a STOP between them.
+ * Devices that act on STOP, like an EEPROM starting its write cycle,
+ * misbehave otherwise. A failure anywhere in the ioctl also fails
+ * every request in it.
+ *
+ * @param n     which queued request to look at (see erlcmd_peek_queued())
+ * @param addr  the address of every message in t
+ * @param t     the transaction to append to
+ *
+ * @return the number of messages appended or 0 if the request isn't
+ *         a transaction to addr that fits
+ */
+static int i2c_coalesce(struct i2c_info *i2c, size_t n, int addr, struct i2c_transaction *t)
+{
+    const char *req = erlcmd_peek_queued(i2c->handler, n);
+    if (!req)
+        return 0;
+
+    int req_index = 0;
+    int arity;
+    char cmd[MAXATOMLEN];
+    if (ei_decode_version(req, &req_index, NULL) < 0 ||
+            ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+            arity != 2 ||
+            ei_decode_atom(req, &req_index, cmd) < 0 ||
+            strcmp(cmd, "transaction") != 0)
+        return 0;
+
+    struct i2c_transaction next;
+    int coalesce;
+    if (i2c_decode_transaction_request(req, &req_index, &next, &coalesce) < 0 ||
+            !coalesce ||
+            i2c_transaction_address(&next) != addr ||
+            t->count + next.count > I2C_RDWR_IOCTL_MAX_MSGS) {
+        i2c_transaction_free(&next);
+        return 0;
+    }
+
+    memcpy(&t->msgs[t->count], next.msgs, next.count * sizeof(struct i2c_msg));
+    t->count += next.count;
+    t->rx_total += next.rx_total;
+    return next.count;
+}
+
+/**
+ * @brief The size of the buffer for the replies to a transaction
+ *
+ * Each read has a 5 byte list cell and a 5 byte binary header. The
+ * rest covers the type, the version, the empty list and an error. When
+ * requests are coalesced, each reply fits since it's part of t.
+ */
+static size_t i2c_transaction_reply_size(const struct i2c_transaction *t)
+{
+    return t->rx_total + 10 * t->count + 64;
+}
+
+/**
+ * @brief Encode the reply to a transaction
+ *
+ * @param first  the first message of the request in t
+ * @param count  the number of messages in the request
+ * @param errnum 0 if the I2C_RDWR ioctl worked or its errno
+ */
+static void i2c_encode_transaction(char *resp, int *resp_index,
+                                   const struct i2c_transaction *t,
+                                   int first, int count, int errnum)
+{
+    if (errnum == 0) {
+        // Return a list with a binary for each read
+        for (int i = first; i < first + count; i++) {
+            if (t->msgs[i].flags & I2C_M_RD) {
+                ei_encode_list_header(resp, resp_index, 1);
+                ei_encode_binary(resp, resp_index, t->msgs[i].buf, t->msgs[i].len);
+            }
+        }
+        ei_encode_empty_list(resp, resp_index);
+    } else
+        erlcmd_encode_errno_error(resp, resp_index, "i2c_transaction_failed", errnum);
+}
+
+static void i2c_job_run(struct worker_job *job)
+{
+    struct i2c_job *j = (struct i2c_job *) job;
+    struct i2c_rdwr_ioctl_data data;
+    data.msgs = j->t.msgs;
+    data.nmsgs = j->t.count;
+    j->errnum = (i2c_rdwr(j->i2c, &data) >= 0 ? 0 : errno);
+}
+
+/**
+ * @brief Reply to one of the requests in a job
+ *
+ * @param first  the first message of the request
+ */
+static void i2c_job_reply(struct i2c_job *j, char *resp, int request, int first)
+{
+    int resp_index = 1; // Space for the type
+    resp[0] = 0; // Reply
+    ei_encode_version(resp, &resp_index);
+
+    const struct i2c_msg *last = &j->t.msgs[j->t.count - 1];
+    if (!j->failure)
+        i2c_encode_transaction(resp, &resp_index, &j->t, first, j->counts[request], j->errnum);
+    else if (j->errnum != 0)
+        erlcmd_encode_errno_error(resp, &resp_index, j->failure, j->errnum);
+    else if (last->flags & I2C_M_RD)
+        ei_encode_binary(resp, &resp_index, last->buf, last->len);
+    else
+        ei_encode_atom(resp, &resp_index, "ok");
+
+    erlcmd_reply_deferred(&j->replies[request], resp, resp_index);
+}
+
+static void i2c_job_complete(struct worker_job *job)
+{
+    struct i2c_job *j = (struct i2c_job *) job;
+
+    char *resp = malloc(i2c_transaction_reply_size(&j->t));
+    if (!resp)
+        err(EXIT_FAILURE, "malloc");
+
+    // Same order as i2c_handle_request() replies in
+    int first = j->counts[0];
+    for (int i = 1; i < j->requests; i++) {
+        i2c_job_reply(j, resp, i, first);
+        first += j->counts[i];
+    }
+    i2c_job_reply(j, resp, 0, 0);
+
+    free(resp);
+    i2c_transaction_free(&j->t);
+    free(j);
+}
+
+static struct i2c_job *i2c_job_new(struct i2c_info *i2c)
+{
+    struct i2c_job *j = calloc(1, sizeof(struct i2c_job));
+    if (!j)
+        err(EXIT_FAILURE, "calloc");
+
+    j->job.run = i2c_job_run;
+    j->job.complete = i2c_job_complete;
+    j->i2c = i2c;
+    j->requests = 1;
+    erlcmd_defer(&j->replies[0]);
+    return j;
+}
+
+static void i2c_job_add_msg(struct i2c_job *j, int flags, const char *data, size_t len)
+{
+    struct i2c_msg *msg = &j->t.msgs[j->t.count++];
+    msg->addr = j->i2c->addr;
+    msg->flags = flags;
+    msg->len = len;
+    msg->buf = malloc(len);
+    if (!msg->buf)
+        err(EXIT_FAILURE, "malloc");
+    if (data)
+        memcpy(msg->buf, data, len);
+    else
+        j->t.rx_total += len;
+}
+
+/**
+ * @brief Run a read, write or wrrd on the worker
+ */
+static void i2c_submit_transfer(struct i2c_info *i2c,
+                                const char *to_write, size_t to_write_len,
+                                size_t to_read_len, const char *failure)
+{
+    struct i2c_job *j = i2c_job_new(i2c);
+    j->failure = failure;
+    if (to_write_len > 0)
+        i2c_job_add_msg(j, 0, to_write, to_write_len);
+    if (to_read_len > 0)
+        i2c_job_add_msg(j, I2C_M_RD, NULL, to_read_len);
+    j->counts[0] = j->t.count;
+    worker_submit(i2c->worker, &j->job);
+}
+
+/**
+ * @brief Run a transaction and the queued ones combined with it on
+ *        the worker
+ *
+ * The job takes the messages from t.
+ */
+static void i2c_submit_transaction(struct i2c_info *i2c, struct i2c_transaction *t,
+                                   const int *counts, int requests)
+{
+    struct i2c_job *j = i2c_job_new(i2c);
+    j->t = *t;
+    t->count = 0;
+    j->requests = requests;
+    memcpy(j->counts, counts, requests * sizeof(int));
+    for (int i = 1; i < requests; i++)
+        erlcmd_defer_queued(i2c->handler, &j->replies[i]);
+    worker_submit(i2c->worker, &j->job);
+}
+
+/**
+ * @brief Run the stream's transaction and pack the reads into a sample
+ *
+ * @return 1 for success, 0 for failure
+ */
+static int i2c_stream_sample(char *data, void *cookie)
+{
+    struct i2c_info *i2c = (struct i2c_info *) cookie;
+    struct i2c_transaction *t = &i2c->stream_transaction;
+
+    struct i2c_rdwr_ioctl_data rdwr;
+    rdwr.msgs = t->msgs;
+    rdwr.nmsgs = t->count;
+    if (i2c_rdwr(i2c, &rdwr) < 0)
+        return 0;
+
+    for (int i = 0; i < t->count; i++) {
+        if (t->msgs[i].flags & I2C_M_RD) {
+            memcpy(data, t->msgs[i].buf, t->msgs[i].len);
+            data += t->msgs[i].len;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Write and then read a device for a program step
+ *
+ * @return 1 for success, 0 for failure
+ */
+static int i2c_program_transfer(void *cookie, int addr,
+                                const char *tx, size_t tx_len,
+                                char *rx, size_t rx_len)
+{
+    struct i2c_info *i2c = (struct i2c_info *) cookie;
+    struct i2c_rdwr_ioctl_data data;
+    struct i2c_msg msgs[2];
+    int flags = (addr > 0x7f ? I2C_M_TEN : 0);
+
+    data.msgs = msgs;
+    data.nmsgs = 0;
+    if (tx_len > 0) {
+        msgs[data.nmsgs].addr = addr;
+        msgs[data.nmsgs].flags = flags;
+        msgs[data.nmsgs].len = tx_len;
+        msgs[data.nmsgs].buf = (uint8_t *) tx;
+        data.nmsgs++;
+    }
+    if (rx_len > 0) {
+        msgs[data.nmsgs].addr = addr;
+        msgs[data.nmsgs].flags = flags | I2C_M_RD;
+        msgs[data.nmsgs].len = rx_len;
+        msgs[data.nmsgs].buf = (uint8_t *) rx;
+        data.nmsgs++;
+    }
+    if (data.nmsgs == 0)
+        return 1;
+
+    return i2c_rdwr(i2c, &data) >= 0;
+}
+
+static void i2c_encode_no_address(char *resp, int *resp_index)
+{
+    ei_encode_tuple_header(resp, resp_index, 2);
+    ei_encode_atom(resp, resp_index, "error");
+    ei_encode_atom(resp, resp_index, "no_address");
+}
+
+/*
+ * Binary commands
+ *
+ * read, write and wrrd are also available as an opcode byte followed
+ * by big endian arguments so that they can skip ei:
+ *
+ *   1 read   <<Len:16>>
+ *   2 write  <<Data/binary>>
+ *   3 wrrd   <<ReadLen:16, Data/binary>>
+ *
+ * Written data is sent straight from the request buffer. Replies are
+ * the same terms that the term commands send.
+ */
+enum i2c_opcode {
+    I2C_OP_READ = 1,
+    I2C_OP_WRITE,
+    I2C_OP_WRRD,
+    I2C_OP_COUNT
+};
+
+static void i2c_op_transfer(struct i2c_info *i2c, const uint8_t *to_write, size_t to_write_len, size_t to_read_len,
+                            const char *failure)
+{
+    char *resp = i2c->resp_buffer;
+    int resp_index = 1; // Space for the type
+    resp[0] = 0; // Reply
+    ei_encode_version(resp, &resp_index);
+
+    if (i2c->addr == I2C_NO_ADDRESS)
+        i2c_encode_no_address(resp, &resp_index);
+    else if (i2c->worker) {
+        i2c_submit_transfer(i2c, (const char *) to_write, to_write_len, to_read_len, failure);
+        return;
+    } else if (!i2c_transfer(i2c, (const char *) to_write, to_write_len, i2c->read_buffer, to_read_len))
+        erlcmd_encode_errno_error(resp, &resp_index, failure, errno);
+    else if (to_read_len > 0)
+        ei_encode_binary(resp, &resp_index, i2c->read_buffer, to_read_len);
+    else
+        ei_encode_atom(resp, &resp_index, "ok");
+
+    erlcmd_reply(resp, resp_index);
+}
+
+static void i2c_op_read(const uint8_t *args, size_t len, void *cookie)
+{
+    size_t read_len = erlcmd_get16(args);
+    if (read_len < 1 || read_len > I2C_MSG_MAX) {
+        erlcmd_bad_request("read amount: min=1, max=%d", I2C_MSG_MAX);
+        return;
+    }
+
+    i2c_op_transfer((struct i2c_info *) cookie, 0, 0, read_len, "i2c_read_failed");
+}
+
+static void i2c_op_write(const uint8_t *args, size_t len, void *cookie)
+{
+    if (len > I2C_MSG_MAX) {
+        erlcmd_bad_request("write: need a binary between 1 and %d bytes", I2C_MSG_MAX);
+        return;
+    }
+
+    i2c_op_transfer((struct i2c_info *) cookie, args, len, 0, "i2c_write_failed");
+}
+
+static void i2c_op_wrrd(const uint8_t *args, size_t len, void *cookie)
+{
+    size_t read_len = erlcmd_get16(args);
+    if (read_len < 1 || read_len > I2C_MSG_MAX || len - 2 > I2C_MSG_MAX) {
+        erlcmd_bad_request("wrrd: write 1 to %d bytes and read 1 to %d", I2C_MSG_MAX, I2C_MSG_MAX);
+        return;
+    }
+
+    i2c_op_transfer((struct i2c_info *) cookie, args + 2, len - 2, read_len, "i2c_wrrd_failed");
+}
+
+static const struct erlcmd_opcode i2c_opcodes[I2C_OP_COUNT] = {
+    [I2C_OP_READ] = {i2c_op_read, 2, 0},
+    [I2C_OP_WRITE] = {i2c_op_write, 1, 1},
+    [I2C_OP_WRRD] = {i2c_op_wrrd, 3, 1}
+};
+
 static void i2c_handle_request(const char *req, void *cookie)
 {
     struct i2c_info *i2c = (struct i2c_info *) cookie;
 
     // Commands are of the form {Command, Arguments}:
     // { atom(), term() }
-    int req_index = sizeof(uint16_t);
-    if (ei_decode_version(req, &req_index, NULL) < 0)
-        errx(EXIT_FAILURE, "Message version issue?");
+    int req_index = 0;
+    if (ei_decode_version(req, &req_index, NULL) < 0) {
+        erlcmd_bad_request("Message version issue?");
+        return;
+    }
 
     int arity;
     if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
-            arity != 2)
-        errx(EXIT_FAILURE, "expecting {cmd, args} tuple");
+            arity != 2) {
+        erlcmd_bad_request("expecting {cmd, args} tuple");
+        return;
+    }
 
     char cmd[MAXATOMLEN];
-    if (ei_decode_atom(req, &req_index, cmd) < 0)
-        errx(EXIT_FAILURE, "expecting command atom");
+    if (ei_decode_atom(req, &req_index, cmd) < 0) {
+        erlcmd_bad_request("expecting command atom");
+        return;
+    }
+
+    // Every mode reports stats and configures the simulator the same way
+    if (strcmp(cmd, "stats") == 0) {
+        stats_reply();
+        return;
+    } else if (strcmp(cmd, "sim") == 0) {
+        sim_handle_request(req, &req_index);
+        return;
+    }
 
-    char resp[256];
-    int resp_index = sizeof(uint16_t); // Space for payload size
+    char *resp = i2c->resp_buffer;
+    int resp_index = 1; // Space for the type
+    resp[0] = 0; // Reply
     ei_encode_version(resp, &resp_index);
-    if (strcmp(cmd, "read") == 0) {
+    if (i2c->addr == I2C_NO_ADDRESS &&
+            (strcmp(cmd, "read") == 0 || strcmp(cmd, "write") == 0 || strcmp(cmd, "wrrd") == 0)) {
+        i2c_encode_no_address(resp, &resp_index);
+    } else if (strcmp(cmd, "read") == 0) {
         long int len;
         if (ei_decode_long(req, &req_index, &len) < 0 ||
                 len < 1 ||
-                len > I2C_SMBUS_BLOCK_MAX)
-            errx(EXIT_FAILURE, "read amount: min=1, max=%d", I2C_SMBUS_BLOCK_MAX);
-
-        char data[I2C_SMBUS_BLOCK_MAX];
-
-        if (i2c_transfer(i2c, 0, 0, data, len))
-            ei_encode_binary(resp, &resp_index, data,len);
-        else {
-            ei_encode_tuple_header(resp, &resp_index, 2);
-            ei_encode_atom(resp, &resp_index, "error");
-            ei_encode_atom(resp, &resp_index, "i2c_read_failed");
+                len > I2C_MSG_MAX) {
+            erlcmd_bad_request("read amount: min=1, max=%d", I2C_MSG_MAX);
+            return;
         }
+
+        i2c_op_transfer(i2c, NULL, 0, len, "i2c_read_failed");
+        return;
     } else if (strcmp(cmd, "write") == 0) {
-        char data[I2C_SMBUS_BLOCK_MAX];
+        char *data = i2c->write_buffer;
         int len;
         int type;
         long llen;
         if (ei_get_type(req, &req_index, &type, &len) < 0 ||
                 type != ERL_BINARY_EXT ||
                 len < 1 ||
-                len > I2C_SMBUS_BLOCK_MAX ||
-                ei_decode_binary(req, &req_index, &data, &llen) < 0)
-            errx(EXIT_FAILURE, "write: need a binary between 1 and %d bytes", I2C_SMBUS_BLOCK_MAX);
-
-        if (i2c_transfer(i2c, data, len, 0, 0))
-            ei_encode_atom(resp, &resp_index, "ok");
-        else {
-            ei_encode_tuple_header(resp, &resp_index, 2);
-            ei_encode_atom(resp, &resp_index, "error");
-            ei_encode_atom(resp, &resp_index, "i2c_write_failed");
+                len > I2C_MSG_MAX ||
+                ei_decode_binary(req, &req_index, data, &llen) < 0) {
+            erlcmd_bad_request("write: need a binary between 1 and %d bytes", I2C_MSG_MAX);
+            return;
         }
+
+        i2c_op_transfer(i2c, (const uint8_t *) data, len, 0, "i2c_write_failed");
+        return;
     } else if (strcmp(cmd, "wrrd") == 0) {
-        char write_data[I2C_SMBUS_BLOCK_MAX];
-        char read_data[I2C_SMBUS_BLOCK_MAX];
+        char *write_data = i2c->write_buffer;
         int write_len;
         long int read_len;
         int type;
         long llen;
 
         if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
-            arity != 2)
-            errx(EXIT_FAILURE, "wrrd: expecting {write_data, read_count} tuple");
+            arity != 2) {
+            erlcmd_bad_request("wrrd: expecting {write_data, read_count} tuple");
+            return;
+        }
 
         if (ei_get_type(req, &req_index, &type, &write_len) < 0 ||
                 type != ERL_BINARY_EXT ||
                 write_len < 1 ||
-                write_len > I2C_SMBUS_BLOCK_MAX ||
-                ei_decode_binary(req, &req_index, &write_data, &llen) < 0)
-            errx(EXIT_FAILURE, "wrrd: need a binary between 1 and %d bytes", I2C_SMBUS_BLOCK_MAX);
+                write_len > I2C_MSG_MAX ||
+                ei_decode_binary(req, &req_index, write_data, &llen) < 0) {
+            erlcmd_bad_request("wrrd: need a binary between 1 and %d bytes", I2C_MSG_MAX);
+            return;
+        }
         if (ei_decode_long(req, &req_index, &read_len) < 0 ||
                 read_len < 1 ||
-                read_len > I2C_SMBUS_BLOCK_MAX)
-            errx(EXIT_FAILURE, "wrrd: read amount: min=1, max=%d", I2C_SMBUS_BLOCK_MAX);
+                read_len > I2C_MSG_MAX) {
+            erlcmd_bad_request("wrrd: read amount: min=1, max=%d", I2C_MSG_MAX);
+            return;
+        }
+
+        i2c_op_transfer(i2c, (const uint8_t *) write_data, write_len, read_len, "i2c_wrrd_failed");
+        return;
+    } else if (strcmp(cmd, "transaction") == 0) {
+        struct i2c_transaction t;
+        int coalesce;
+        if (i2c_decode_transaction_request(req, &req_index, &t, &coalesce) < 0) {
+            i2c_transaction_free(&t);
+            erlcmd_bad_request("transaction: expecting a list of 1 to %d messages and optionally [{coalesce, boolean()}]", I2C_RDWR_IOCTL_MAX_MSGS);
+            return;
+        }
+
+        /* Pull in the transactions queued behind this one that go to
+         * the same device if they all allow it. counts[] has the
+         * number of messages from each request. */
+        int counts[I2C_RDWR_IOCTL_MAX_MSGS];
+        int requests = 1;
+        counts[0] = t.count;
+        int addr = i2c_transaction_address(&t);
+        if (coalesce && addr != I2C_NO_ADDRESS) {
+            int count;
+            while ((count = i2c_coalesce(i2c, requests - 1, addr, &t)) > 0)
+                counts[requests++] = count;
+        }
+
+        if (i2c->worker) {
+            i2c_submit_transaction(i2c, &t, counts, requests);
+            return;
+        }
+
+        resp = malloc(i2c_transaction_reply_size(&t));
+        if (!resp)
+            err(EXIT_FAILURE, "malloc");
+
+        struct i2c_rdwr_ioctl_data data;
+        data.msgs = t.msgs;
+        data.nmsgs = t.count;
+        int errnum = (i2c_rdwr(i2c, &data) >= 0 ? 0 : errno);
+
+        /* The requests that were pulled in are replied to first. Their
+         * replies are tagged or the request being dispatched is, since
+         * Erlang only has one untagged request in flight. */
+        int first = counts[0];
+        for (int i = 1; i < requests; i++) {
+            resp_index = 1;
+            resp[0] = 0;
+            ei_encode_version(resp, &resp_index);
+            i2c_encode_transaction(resp, &resp_index, &t, first, counts[i], errnum);
+            erlcmd_reply_queued(i2c->handler, resp, resp_index);
+            first += counts[i];
+        }
+
+        resp_index = 1;
+        resp[0] = 0;
+        ei_encode_version(resp, &resp_index);
+        i2c_encode_transaction(resp, &resp_index, &t, 0, counts[0], errnum);
+
+        i2c_transaction_free(&t);
+    } else if (strcmp(cmd, "program") == 0) {
+        struct program *p = malloc(sizeof(struct program));
+        if (!p)
+            err(EXIT_FAILURE, "malloc");
+        if (program_decode(req, &req_index, 1, I2C_MSG_MAX, p) < 0) {
+            program_free(p);
+            free(p);
+            erlcmd_bad_request("program: bad step, too many steps (max %d, %d when run) or waits too long (max %d us)",
+                               PROGRAM_MAX_STEPS, PROGRAM_MAX_RUN_STEPS, PROGRAM_MAX_WAIT_US);
+            return;
+        }
+
+        if (i2c->worker) {
+            program_submit(i2c->worker, p, i2c_program_transfer, i2c);
+            return;
+        }
+
+        resp = program_reply(p, i2c_program_transfer, i2c, &resp_index);
+        program_free(p);
+        free(p);
+    } else if (strcmp(cmd, "start_stream") == 0) {
+        unsigned long period_us;
+        unsigned long samples_per_batch;
+
+        stream_stop(&i2c->stream);
+        i2c_transaction_free(&i2c->stream_transaction);
+
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 3 ||
+                i2c_decode_transaction(req, &req_index, &i2c->stream_transaction) < 0 ||
+                ei_decode_ulong(req, &req_index, &period_us) < 0 ||
+                ei_decode_ulong(req, &req_index, &samples_per_batch) < 0) {
+            i2c_transaction_free(&i2c->stream_transaction);
+            erlcmd_bad_request("start_stream: expecting {messages, period_us, samples_per_batch}");
+            return;
+        }
+        debug("start_stream %lu us", period_us);
 
-        if (i2c_transfer(i2c, write_data, write_len, read_data, read_len))
-            ei_encode_binary(resp, &resp_index, read_data, read_len);
+        if (stream_start(&i2c->stream, period_us, i2c->stream_transaction.rx_total, samples_per_batch) == 0)
+            ei_encode_atom(resp, &resp_index, "ok");
         else {
+            i2c_transaction_free(&i2c->stream_transaction);
             ei_encode_tuple_header(resp, &resp_index, 2);
             ei_encode_atom(resp, &resp_index, "error");
-            ei_encode_atom(resp, &resp_index, "i2c_wrrd_failed");
+            ei_encode_atom(resp, &resp_index, "bad_stream");
         }
-    } else
-        errx(EXIT_FAILURE, "unknown command: %s", cmd);
+    } else if (strcmp(cmd, "stop_stream") == 0) {
+        // Any batched samples are sent before the reply
+        stream_stop(&i2c->stream);
+        i2c_transaction_free(&i2c->stream_transaction);
+        ei_encode_atom(resp, &resp_index, "ok");
+    } else {
+        erlcmd_bad_request("unknown command: %s", cmd);
+        return;
+    }
 
     debug("sending response: %d bytes", resp_index);
-    erlcmd_send(resp, resp_index);
+    erlcmd_reply(resp, resp_index);
+
+    if (resp != i2c->resp_buffer)
+        free(resp);
+}
+
+/**
+ * @brief Open an I2C bus for i2c_main() or a hub handle
+ *
+ * The arguments are the same as i2c_main()'s.
+ *
+ * @return NULL on success, or an atom describing the failure with
+ *         errno set
+ */
+const char *i2c_open_handle(struct erlcmd *handler, int argc, char *argv[])
+{
+    if (argc != 3 && argc != 4) {
+        errno = EINVAL;
+        return "bad_arguments";
+    }
+
+    struct i2c_info *i2c = malloc(sizeof(struct i2c_info));
+    if (!i2c)
+        err(EXIT_FAILURE, "malloc");
+
+    const char *reason = i2c_init(i2c, argv[2], argc == 4 ? (int) strtoul(argv[3], 0, 0) : I2C_NO_ADDRESS);
+    if (reason) {
+        int errnum = errno;
+        free(i2c);
+        errno = errnum;
+        return reason;
+    }
+    i2c->stream_transaction.count = 0;
+    stream_init(&i2c->stream, i2c_stream_sample, i2c);
+
+    erlcmd_init(handler, i2c_handle_request, i2c);
+    erlcmd_set_opcodes(handler, i2c_opcodes, I2C_OP_COUNT);
+    i2c->handler = handler;
+    i2c->worker = (worker_enabled() ? worker_start() : NULL);
+    return NULL;
+}
+
+/**
+ * @brief Finish the requests on the worker, stop streaming and close
+ *        the bus opened by i2c_open_handle()
+ */
+void i2c_close_handle(struct erlcmd *handler)
+{
+    struct i2c_info *i2c = (struct i2c_info *) handler->cookie;
+    if (i2c->worker)
+        worker_stop(i2c->worker);
+    stream_stop(&i2c->stream);
+    i2c_transaction_free(&i2c->stream_transaction);
+    if (i2c->fd >= 0)
+        close(i2c->fd);
+    free(i2c);
 }
 
 /**
@@ -207,19 +978,13 @@ static void i2c_handle_request(const char *req, void *cookie)
  */
 int i2c_main(int argc, char *argv[])
 {
-    if (argc != 4)
-        errx(EXIT_FAILURE, "Must pass device path and device address as arguments");
-
-    struct i2c_info i2c;
-    i2c_init(&i2c, argv[2], strtoul(argv[3], 0, 0));
+    if (argc != 3 && argc != 4)
+        errx(EXIT_FAILURE, "Must pass device path and optionally the device address as arguments");
 
     struct erlcmd handler;
-    erlcmd_init(&handler, i2c_handle_request, &i2c);
-
-    for (;;) {
-        // Loop forever and process requests from Erlang.
-        erlcmd_process(&handler);
-    }
+    const char *reason = i2c_open_handle(&handler, argc, argv);
+    if (reason)
+        err(EXIT_FAILURE, "%s %s", reason, argv[2]);
 
-    return 1;
+    erlcmd_run(&handler);
 }
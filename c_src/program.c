@@ -0,0 +1,417 @@
+/*
+ *  Copyright 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "program.h"
+#include "erlcmd.h"
+#include "worker.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t program_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void program_sleep_us(unsigned long us)
+{
+    struct timespec ts;
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+/**
+ * @brief Decode a binary into a newly allocated buffer
+ *
+ * @return 0 on success, -1 on error
+ */
+static int program_decode_binary(const char *req, int *req_index, const struct program *p,
+                                 char **data, size_t *len)
+{
+    int type;
+    int size;
+    long llen;
+    if (ei_get_type(req, req_index, &type, &size) < 0 ||
+            type != ERL_BINARY_EXT ||
+            (size_t) size > p->max_transfer)
+        return -1;
+
+    *data = malloc(size ? size : 1);
+    if (!*data)
+        err(EXIT_FAILURE, "malloc");
+    *len = size;
+
+    return ei_decode_binary(req, req_index, *data, &llen);
+}
+
+static int program_decode_length(const char *req, int *req_index, const struct program *p,
+                                 size_t *len)
+{
+    unsigned long value;
+    if (ei_decode_ulong(req, req_index, &value) < 0 ||
+            value < 1 ||
+            value > p->max_transfer)
+        return -1;
+
+    *len = value;
+    return 0;
+}
+
+/**
+ * @brief Count a delay or poll timeout against PROGRAM_MAX_WAIT_US
+ *
+ * @return 0 if the program can still wait that long, -1 if not
+ */
+static int program_add_wait(struct program *p, uint64_t repeat, unsigned long us)
+{
+    if (us > PROGRAM_MAX_WAIT_US)
+        return -1;
+
+    // repeat is at most PROGRAM_MAX_READ_TOTAL + 1, so this can't overflow
+    p->wait_total += repeat * us;
+    return p->wait_total > PROGRAM_MAX_WAIT_US ? -1 : 0;
+}
+
+/**
+ * @brief Count steps or loop iterations against PROGRAM_MAX_RUN_STEPS
+ *
+ * @return 0 if the program can still run that many, -1 if not
+ */
+static int program_add_run_steps(struct program *p, uint64_t count)
+{
+    // count is at most PROGRAM_MAX_READ_TOTAL + 1, so this can't overflow
+    p->run_steps += count;
+    return p->run_steps > PROGRAM_MAX_RUN_STEPS ? -1 : 0;
+}
+
+/**
+ * @brief Decode a list of steps and append them to the program
+ *
+ * @param repeat how many times the steps will run, so that the size
+ *               of the response can be bounded
+ */
+static int program_decode_steps(const char *req, int *req_index, int has_address,
+                                struct program *p, int depth, uint64_t repeat)
+{
+    int count;
+    if (ei_decode_list_header(req, req_index, &count) < 0)
+        return -1;
+
+    for (int i = 0; i < count; i++) {
+        if (p->count >= PROGRAM_MAX_STEPS)
+            return -1;
+
+        struct program_step *step = &p->steps[p->count++];
+        memset(step, 0, sizeof(*step));
+        if (program_add_run_steps(p, repeat) < 0)
+            return -1;
+
+        int arity;
+        char kind[MAXATOMLEN];
+        if (ei_decode_tuple_header(req, req_index, &arity) < 0 ||
+                ei_decode_atom(req, req_index, kind) < 0)
+            return -1;
+
+        if (strcmp(kind, "delay_us") == 0) {
+            step->op = PROGRAM_DELAY;
+            if (arity != 2 ||
+                    ei_decode_ulong(req, req_index, &step->arg) < 0 ||
+                    program_add_wait(p, repeat, step->arg) < 0)
+                return -1;
+            continue;
+        }
+
+        if (strcmp(kind, "loop") == 0) {
+            step->op = PROGRAM_LOOP;
+            if (arity != 3 ||
+                    depth >= PROGRAM_MAX_DEPTH ||
+                    ei_decode_ulong(req, req_index, &step->arg) < 0)
+                return -1;
+
+            /* Any read in a body that runs more than this would go
+             * over the limit, so don't let the count overflow. */
+            uint64_t body_repeat = repeat * step->arg;
+            if (step->arg > 0 && repeat > PROGRAM_MAX_READ_TOTAL / step->arg)
+                body_repeat = PROGRAM_MAX_READ_TOTAL + 1;
+
+            // Even an empty body takes time to loop over
+            if (program_add_run_steps(p, body_repeat) < 0)
+                return -1;
+
+            int start = p->count;
+            if (program_decode_steps(req, req_index, has_address, p,
+                                     depth + 1, body_repeat) < 0)
+                return -1;
+            step->body_len = p->count - start;
+            continue;
+        }
+
+        int fields = arity - 1;
+        if (has_address) {
+            unsigned long addr;
+            if (ei_decode_ulong(req, req_index, &addr) < 0 ||
+                    addr > 0x3ff)
+                return -1;
+            step->addr = addr;
+            fields--;
+        }
+
+        if (strcmp(kind, "write") == 0) {
+            step->op = PROGRAM_TRANSFER;
+            if (fields != 1 ||
+                    program_decode_binary(req, req_index, p, &step->tx, &step->tx_len) < 0)
+                return -1;
+        } else if (strcmp(kind, "read") == 0) {
+            step->op = PROGRAM_TRANSFER;
+            if (fields != 1 ||
+                    program_decode_length(req, req_index, p, &step->rx_len) < 0)
+                return -1;
+        } else if (strcmp(kind, "write_read") == 0) {
+            step->op = PROGRAM_TRANSFER;
+            if (fields != 2 ||
+                    program_decode_binary(req, req_index, p, &step->tx, &step->tx_len) < 0 ||
+                    program_decode_length(req, req_index, p, &step->rx_len) < 0)
+                return -1;
+        } else if (strcmp(kind, "poll") == 0) {
+            step->op = PROGRAM_POLL;
+            size_t value_len;
+            if (fields != 4 ||
+                    program_decode_binary(req, req_index, p, &step->tx, &step->tx_len) < 0 ||
+                    program_decode_binary(req, req_index, p, &step->mask, &step->rx_len) < 0 ||
+                    program_decode_binary(req, req_index, p, &step->value, &value_len) < 0 ||
+                    ei_decode_ulong(req, req_index, &step->arg) < 0 ||
+                    step->rx_len < 1 ||
+                    value_len != step->rx_len ||
+                    program_add_wait(p, repeat, step->arg) < 0)
+                return -1;
+        } else
+            return -1;
+
+        if (step->op == PROGRAM_TRANSFER && step->rx_len > 0) {
+            p->read_count += repeat;
+            p->read_total += repeat * step->rx_len;
+            if (p->read_total > PROGRAM_MAX_READ_TOTAL)
+                return -1;
+        }
+    }
+    if (count > 0 && ei_decode_list_header(req, req_index, &count) < 0)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * @brief Decode a program
+ *
+ * @param has_address  1 if steps that access the bus include an address
+ * @param max_transfer the most that the bus can write or read at once
+ *
+ * @return 0 on success, -1 on a decode error or if the program is too
+ *         big. Call program_free() either way.
+ */
+int program_decode(const char *req, int *req_index, int has_address, size_t max_transfer, struct program *p)
+{
+    p->max_transfer = max_transfer < PROGRAM_MAX_TRANSFER ? max_transfer : PROGRAM_MAX_TRANSFER;
+    p->count = 0;
+    p->read_count = 0;
+    p->read_total = 0;
+    p->wait_total = 0;
+    p->run_steps = 0;
+    return program_decode_steps(req, req_index, has_address, p, 0, 1);
+}
+
+void program_free(struct program *p)
+{
+    for (int i = 0; i < p->count; i++) {
+        free(p->steps[i].tx);
+        free(p->steps[i].mask);
+        free(p->steps[i].value);
+    }
+    p->count = 0;
+}
+
+/**
+ * @brief Return the largest response that running the program can
+ *        encode, not counting the version and anything before it
+ */
+size_t program_response_size(const struct program *p)
+{
+    // Each read has a list and binary header
+    return p->read_total + 16 * p->read_count + 64;
+}
+
+static int program_poll_matches(const struct program_step *step, const char *rx)
+{
+    for (size_t i = 0; i < step->rx_len; i++) {
+        if ((rx[i] & step->mask[i]) != step->value[i])
+            return 0;
+    }
+    return 1;
+}
+
+static const char *program_run_steps(const struct program_step *steps, int count,
+                                     program_transfer_fn transfer, void *cookie,
+                                     char *resp, int *resp_index)
+{
+    // Programs can run on several bus workers at once
+    static _Thread_local char rx[PROGRAM_MAX_TRANSFER];
+
+    for (int i = 0; i < count; i++) {
+        const struct program_step *step = &steps[i];
+        switch (step->op) {
+        case PROGRAM_TRANSFER:
+            if (!transfer(cookie, step->addr, step->tx, step->tx_len, rx, step->rx_len))
+                return "transfer_failed";
+            if (step->rx_len > 0) {
+                ei_encode_list_header(resp, resp_index, 1);
+                ei_encode_binary(resp, resp_index, rx, step->rx_len);
+            }
+            break;
+
+        case PROGRAM_DELAY:
+            program_sleep_us(step->arg);
+            break;
+
+        case PROGRAM_POLL: {
+            uint64_t deadline = program_now_us() + step->arg;
+            for (;;) {
+                if (!transfer(cookie, step->addr, step->tx, step->tx_len, rx, step->rx_len))
+                    return "transfer_failed";
+                if (program_poll_matches(step, rx))
+                    break;
+                if (program_now_us() >= deadline)
+                    return "poll_timeout";
+                program_sleep_us(PROGRAM_POLL_INTERVAL_US);
+            }
+            break;
+        }
+
+        case PROGRAM_LOOP:
+            for (unsigned long j = 0; j < step->arg; j++) {
+                const char *reason = program_run_steps(step + 1, step->body_len,
+                                                       transfer, cookie, resp, resp_index);
+                if (reason)
+                    return reason;
+            }
+            i += step->body_len;
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Run a program and encode the list of reads
+ *
+ * The response buffer needs program_response_size() bytes after
+ * resp_index.
+ *
+ * @return NULL on success or an atom describing the failure. Nothing
+ *         is encoded on failure.
+ */
+const char *program_run(const struct program *p, program_transfer_fn transfer, void *cookie,
+                        char *resp, int *resp_index)
+{
+    int start = *resp_index;
+    const char *reason = program_run_steps(p->steps, p->count, transfer, cookie, resp, resp_index);
+    if (reason) {
+        *resp_index = start;
+        return reason;
+    }
+
+    ei_encode_empty_list(resp, resp_index);
+    return NULL;
+}
+
+/**
+ * @brief Run a program and encode the reply to its request
+ *
+ * @return the reply, which the caller frees
+ */
+char *program_reply(const struct program *p, program_transfer_fn transfer, void *cookie,
+                    int *resp_index)
+{
+    char *resp = malloc(program_response_size(p) + 64);
+    if (!resp)
+        err(EXIT_FAILURE, "malloc");
+    *resp_index = 1; // Space for the type
+    resp[0] = 0; // Reply
+    ei_encode_version(resp, resp_index);
+
+    const char *reason = program_run(p, transfer, cookie, resp, resp_index);
+    if (reason) {
+        ei_encode_tuple_header(resp, resp_index, 2);
+        ei_encode_atom(resp, resp_index, "error");
+        ei_encode_atom(resp, resp_index, reason);
+    }
+    return resp;
+}
+
+struct program_job
+{
+    struct worker_job job;
+    struct program *program;
+    program_transfer_fn transfer;
+    void *cookie;
+    char *resp;
+    int resp_index;
+    struct erlcmd_deferred reply;
+};
+
+static void program_job_run(struct worker_job *job)
+{
+    struct program_job *j = (struct program_job *) job;
+    j->resp = program_reply(j->program, j->transfer, j->cookie, &j->resp_index);
+}
+
+static void program_job_complete(struct worker_job *job)
+{
+    struct program_job *j = (struct program_job *) job;
+    erlcmd_reply_deferred(&j->reply, j->resp, j->resp_index);
+    free(j->resp);
+    program_free(j->program);
+    free(j->program);
+    free(j);
+}
+
+/**
+ * @brief Run a program on a bus worker and reply to the request being
+ *        dispatched when it's done
+ *
+ * The transfer callback is called on the worker's thread. The job
+ * frees p.
+ */
+void program_submit(struct worker *w, struct program *p, program_transfer_fn transfer, void *cookie)
+{
+    struct program_job *j = malloc(sizeof(struct program_job));
+    if (!j)
+        err(EXIT_FAILURE, "malloc");
+
+    j->job.run = program_job_run;
+    j->job.complete = program_job_complete;
+    j->program = p;
+    j->transfer = transfer;
+    j->cookie = cookie;
+    erlcmd_defer(&j->reply);
+    worker_submit(w, &j->job);
+}
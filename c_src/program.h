@@ -0,0 +1,111 @@
+/*
+ *  Copyright 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Register sequence program declarations
+ */
+
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A program is a list of steps that's run by the port so that device
+ * init and readout sequences cost one request. Steps are:
+ *
+ *   {write, [Addr,] binary()}
+ *   {read, [Addr,] Len}
+ *   {write_read, [Addr,] binary(), Len}
+ *   {delay_us, Us}
+ *   {poll, [Addr,] binary(), Mask, Value, TimeoutUs}
+ *   {loop, Count, [Step]}
+ *
+ * Addr is only present when the bus has addresses. A poll step
+ * writes the binary and reads byte_size(Mask) bytes until the bytes
+ * masked by Mask equal Value. The data from each read and write_read
+ * is returned in a list.
+ *
+ * Without --workers, a program runs on the event loop and nothing else
+ * is handled while it waits. The delays and poll timeouts of a program,
+ * counting every time a loop runs them, can add up to at most
+ * PROGRAM_MAX_WAIT_US and it can run at most PROGRAM_MAX_RUN_STEPS
+ * steps and loop iterations in total.
+ */
+#define PROGRAM_MAX_STEPS 256
+#define PROGRAM_MAX_DEPTH 8
+#define PROGRAM_MAX_READ_TOTAL (1024 * 1024)
+#define PROGRAM_MAX_TRANSFER (64 * 1024)
+#define PROGRAM_POLL_INTERVAL_US 100
+#define PROGRAM_MAX_WAIT_US 1000000
+#define PROGRAM_MAX_RUN_STEPS (PROGRAM_MAX_STEPS * 256)
+
+enum program_op {
+    PROGRAM_TRANSFER,
+    PROGRAM_DELAY,
+    PROGRAM_POLL,
+    PROGRAM_LOOP
+};
+
+struct program_step
+{
+    enum program_op op;
+    int addr;
+    char *tx;
+    size_t tx_len;
+    size_t rx_len;
+    char *mask;  // byte_size is rx_len (poll only)
+    char *value;
+    unsigned long arg; // delay or timeout in us or loop count
+    int body_len;      // Number of steps after a loop that it repeats
+};
+
+struct program
+{
+    size_t max_transfer;
+    int count;
+    struct program_step steps[PROGRAM_MAX_STEPS];
+
+    // Totals for sizing the response
+    size_t read_count;
+    size_t read_total;
+
+    // The longest the delays and polls can wait
+    uint64_t wait_total;
+
+    // Steps and loop iterations that a run goes through
+    uint64_t run_steps;
+};
+
+/*
+ * Bus callback for write, read, write_read and poll steps. Either
+ * length may be 0. Returns 1 on success and 0 on failure.
+ */
+typedef int (*program_transfer_fn)(void *cookie, int addr,
+                                   const char *tx, size_t tx_len,
+                                   char *rx, size_t rx_len);
+
+struct worker;
+
+int program_decode(const char *req, int *req_index, int has_address, size_t max_transfer, struct program *p);
+void program_free(struct program *p);
+size_t program_response_size(const struct program *p);
+const char *program_run(const struct program *p, program_transfer_fn transfer, void *cookie,
+                        char *resp, int *resp_index);
+char *program_reply(const struct program *p, program_transfer_fn transfer, void *cookie,
+                    int *resp_index);
+void program_submit(struct worker *w, struct program *p, program_transfer_fn transfer, void *cookie);
+
+#endif
@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "erlcmd.h"
+#include "gpio.h"
+#include "stats.h"
+
+//#define DEBUG
+#ifdef DEBUG
+#define debug(...) do { fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\r\n"); } while(0)
+#else
+#define debug(...)
+#endif
+
+/*
+ * PWM channels are driven through /sys/class/pwm/pwmchipN/pwmM. The
+ * hardware generates the signal, so nothing runs here per period.
+ */
+struct pwm_info
+{
+    char path[64]; // /sys/class/pwm/pwmchipN/pwmM
+};
+
+/**
+ * @brief	Export a PWM channel if needed
+ */
+static void pwm_init(struct pwm_info *pwm, unsigned int chip, unsigned int channel)
+{
+    snprintf(pwm->path, sizeof(pwm->path), "/sys/class/pwm/pwmchip%u/pwm%u", chip, channel);
+
+    if (access(pwm->path, F_OK) == -1) {
+        char export_path[64];
+        char channel_str[16];
+        snprintf(export_path, sizeof(export_path), "/sys/class/pwm/pwmchip%u/export", chip);
+        snprintf(channel_str, sizeof(channel_str), "%u", channel);
+        if (!sysfs_write_file(export_path, channel_str))
+            errx(EXIT_FAILURE, "Can't export PWM channel %u on pwmchip%u", channel, chip);
+    }
+}
+
+/**
+ * @brief	Write one of the channel's attributes
+ *
+ * @return 	1 for success, 0 for failure
+ */
+static int pwm_write_attr(struct pwm_info *pwm, const char *attr, const char *value)
+{
+    char path[96];
+    snprintf(path, sizeof(path), "%s/%s", pwm->path, attr);
+
+    uint64_t start = stats_now_ns();
+    int ok = sysfs_write_file(path, value) > 0;
+    stats_record_io(start, ok);
+    return ok;
+}
+
+static int pwm_write_ulong(struct pwm_info *pwm, const char *attr, unsigned long value)
+{
+    char str[32];
+    snprintf(str, sizeof(str), "%lu", value);
+    return pwm_write_attr(pwm, attr, str);
+}
+
+static void encode_error(char *resp, int *resp_index, const char *reason)
+{
+    ei_encode_tuple_header(resp, resp_index, 2);
+    ei_encode_atom(resp, resp_index, "error");
+    ei_encode_atom(resp, resp_index, reason);
+}
+
+static void pwm_handle_request(const char *req, void *cookie)
+{
+    struct pwm_info *pwm = (struct pwm_info *) cookie;
+
+    // Commands are of the form {Command, Arguments}:
+    // { atom(), term() }
+    int req_index = 0;
+    if (ei_decode_version(req, &req_index, NULL) < 0) {
+        erlcmd_bad_request("Message version issue?");
+        return;
+    }
+
+    int arity;
+    if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+            arity != 2) {
+        erlcmd_bad_request("expecting {cmd, args} tuple");
+        return;
+    }
+
+    char cmd[MAXATOMLEN];
+    if (ei_decode_atom(req, &req_index, cmd) < 0) {
+        erlcmd_bad_request("expecting command atom");
+        return;
+    }
+
+    // Every mode reports stats the same way
+    if (strcmp(cmd, "stats") == 0) {
+        stats_reply();
+        return;
+    }
+
+    char resp[256];
+    int resp_index = 1; // Space for the type
+    resp[0] = 0; // Reply
+    ei_encode_version(resp, &resp_index);
+    if (strcmp(cmd, "configure") == 0) {
+        unsigned long period_ns;
+        unsigned long duty_ns;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 2 ||
+                ei_decode_ulong(req, &req_index, &period_ns) < 0 ||
+                ei_decode_ulong(req, &req_index, &duty_ns) < 0) {
+            erlcmd_bad_request("configure: expecting {period_ns, duty_ns}");
+            return;
+        }
+        debug("configure %lu %lu", period_ns, duty_ns);
+
+        /* The kernel rejects a duty cycle longer than the period,
+         * so order the writes based on which way the period moves.
+         * If the first write fails, the second order is tried. */
+        int ok = (duty_ns <= period_ns) &&
+                 ((pwm_write_ulong(pwm, "duty_cycle", duty_ns) &&
+                   pwm_write_ulong(pwm, "period", period_ns)) ||
+                  (pwm_write_ulong(pwm, "period", period_ns) &&
+                   pwm_write_ulong(pwm, "duty_cycle", duty_ns)));
+        if (ok)
+            ei_encode_atom(resp, &resp_index, "ok");
+        else
+            encode_error(resp, &resp_index, "pwm_configure_failed");
+    } else if (strcmp(cmd, "set_duty_cycle") == 0) {
+        unsigned long duty_ns;
+        if (ei_decode_ulong(req, &req_index, &duty_ns) < 0) {
+            erlcmd_bad_request("set_duty_cycle: expecting duty_ns");
+            return;
+        }
+        debug("set_duty_cycle %lu", duty_ns);
+
+        if (pwm_write_ulong(pwm, "duty_cycle", duty_ns))
+            ei_encode_atom(resp, &resp_index, "ok");
+        else
+            encode_error(resp, &resp_index, "pwm_configure_failed");
+    } else if (strcmp(cmd, "set_polarity") == 0) {
+        char polarity[MAXATOMLEN];
+        if (ei_decode_atom(req, &req_index, polarity) < 0 ||
+                (strcmp(polarity, "normal") != 0 && strcmp(polarity, "inversed") != 0)) {
+            erlcmd_bad_request("set_polarity: expecting normal or inversed");
+            return;
+        }
+        debug("set_polarity %s", polarity);
+
+        if (pwm_write_attr(pwm, "polarity", polarity))
+            ei_encode_atom(resp, &resp_index, "ok");
+        else
+            encode_error(resp, &resp_index, "pwm_configure_failed");
+    } else if (strcmp(cmd, "enable") == 0) {
+        int enable;
+        if (ei_decode_boolean(req, &req_index, &enable) < 0) {
+            erlcmd_bad_request("enable: expecting true or false");
+            return;
+        }
+        debug("enable %d", enable);
+
+        if (pwm_write_attr(pwm, "enable", enable ? "1" : "0"))
+            ei_encode_atom(resp, &resp_index, "ok");
+        else
+            encode_error(resp, &resp_index, "pwm_enable_failed");
+    } else {
+        erlcmd_bad_request("unknown command: %s", cmd);
+        return;
+    }
+
+    debug("sending response: %d bytes", resp_index);
+    erlcmd_reply(resp, resp_index);
+}
+
+int pwm_main(int argc, char *argv[])
+{
+    if (argc != 4)
+        errx(EXIT_FAILURE, "%s pwm <pwmchip#> <channel#>", argv[0]);
+
+    unsigned int chip = (unsigned int) strtoul(argv[2], 0, 0);
+    unsigned int channel = (unsigned int) strtoul(argv[3], 0, 0);
+
+    struct pwm_info pwm;
+    pwm_init(&pwm, chip, channel);
+
+    struct erlcmd handler;
+    erlcmd_init(&handler, pwm_handle_request, &pwm);
+
+    erlcmd_run(&handler);
+}
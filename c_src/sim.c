@@ -0,0 +1,504 @@
+/*
+ *  Copyright 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Simulated GPIOs, I2C devices and SPI devices
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "erlcmd.h"
+#include "sim.h"
+#include "stats.h"
+
+struct sim_gpio
+{
+    int fd; // The open pin's timerfd or -1
+
+    // When edges are generated, the level toggles every period_ns
+    // starting from base_level at start_ns.
+    int base_level;
+    uint64_t start_ns;
+    uint64_t period_ns;
+
+    // 1 if Erlang changed the level and it hasn't been reported
+    int changed;
+};
+
+struct sim_spi_response
+{
+    struct sim_spi_response *next;
+    size_t len;
+    uint8_t data[];
+};
+
+static struct
+{
+    int enabled;
+    uint64_t latency_ns;
+
+    struct sim_gpio gpios[SIM_GPIO_MAX_PINS];
+
+    int i2c_absent[SIM_I2C_ADDRESSES];
+    uint8_t i2c_registers[SIM_I2C_ADDRESSES][SIM_I2C_REGISTERS];
+    uint8_t i2c_pointer[SIM_I2C_ADDRESSES];
+
+    struct sim_spi_response *spi_responses;
+    struct sim_spi_response **spi_responses_tail;
+    int spi_response_count;
+} sim;
+
+/* The I2C and SPI devices are shared with bus workers (see worker.h),
+ * so they and the settings are only touched with this held. GPIOs are
+ * only used by the event loop.
+ */
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Replace the kernel with the simulated devices
+ *
+ * This has to be called before any devices are opened.
+ */
+void sim_enable()
+{
+    sim.enabled = 1;
+    for (int i = 0; i < SIM_GPIO_MAX_PINS; i++)
+        sim.gpios[i].fd = -1;
+    sim.spi_responses_tail = &sim.spi_responses;
+}
+
+int sim_enabled()
+{
+    return sim.enabled;
+}
+
+static uint64_t sim_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Take as long as a real device access
+ */
+static void sim_delay()
+{
+    pthread_mutex_lock(&sim_lock);
+    uint64_t latency_ns = sim.latency_ns;
+    pthread_mutex_unlock(&sim_lock);
+    if (latency_ns == 0)
+        return;
+
+    // Buses sleep in parallel like real ones would
+    struct timespec ts;
+    ts.tv_sec = latency_ns / 1000000000ULL;
+    ts.tv_nsec = latency_ns % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR)
+        ;
+}
+
+static int sim_gpio_level(const struct sim_gpio *g)
+{
+    if (g->period_ns == 0)
+        return g->base_level;
+
+    uint64_t toggles = (sim_now_ns() - g->start_ns) / g->period_ns;
+    return g->base_level ^ (int) (toggles & 1);
+}
+
+/**
+ * @brief Arm the pin's timerfd for the next edge
+ */
+static void sim_gpio_arm(struct sim_gpio *g)
+{
+    if (g->fd < 0)
+        return;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (g->period_ns > 0) {
+        uint64_t first = g->start_ns + g->period_ns;
+        its.it_value.tv_sec = first / 1000000000ULL;
+        its.it_value.tv_nsec = first % 1000000000ULL;
+        its.it_interval.tv_sec = g->period_ns / 1000000000ULL;
+        its.it_interval.tv_nsec = g->period_ns % 1000000000ULL;
+    } else if (g->changed) {
+        /* Expire right away to report the change */
+        its.it_value.tv_nsec = 1;
+    }
+
+    if (timerfd_settime(g->fd, g->period_ns > 0 ? TFD_TIMER_ABSTIME : 0, &its, NULL) < 0)
+        err(EXIT_FAILURE, "timerfd_settime");
+}
+
+/**
+ * @brief Open a simulated pin
+ *
+ * Outputs start low like they do when sysfs sets the direction.
+ *
+ * @return 1 for success, -1 for failure
+ */
+int sim_gpio_open(struct gpio *pin)
+{
+    if (pin->pin_number < 0 || pin->pin_number >= SIM_GPIO_MAX_PINS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct sim_gpio *g = &sim.gpios[pin->pin_number];
+    g->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (g->fd < 0)
+        return -1;
+
+    if (pin->state == GPIO_OUTPUT) {
+        g->base_level = 0;
+        g->period_ns = 0;
+    }
+    g->changed = 0;
+    sim_gpio_arm(g);
+
+    pin->backend = GPIO_BACKEND_SIM;
+    pin->fd = g->fd;
+    return 1;
+}
+
+int sim_gpio_read(struct gpio *pin)
+{
+    sim_delay();
+    return sim_gpio_level(&sim.gpios[pin->pin_number]);
+}
+
+int sim_gpio_write(struct gpio *pin, unsigned int value)
+{
+    sim_delay();
+    sim.gpios[pin->pin_number].base_level = value ? 1 : 0;
+    return 1;
+}
+
+/**
+ * @brief Collect the edges on a pin since the last call
+ *
+ * This is called when the pin's fd is readable. If more than
+ * max_values edges happened, the oldest are dropped and counted as
+ * missed interrupts.
+ *
+ * @param values the level after each edge, oldest first
+ *
+ * @return the number of values
+ */
+int sim_gpio_edges(struct gpio *pin, int *values, int max_values)
+{
+    struct sim_gpio *g = &sim.gpios[pin->pin_number];
+
+    uint64_t edges = 0;
+    if (read(g->fd, &edges, sizeof(edges)) != sizeof(edges) || g->period_ns == 0)
+        edges = 0;
+    if (g->changed) {
+        g->changed = 0;
+        edges++;
+    }
+
+    if (edges > (uint64_t) max_values) {
+        stats.interrupts_missed += edges - max_values;
+        edges = max_values;
+    }
+
+    /* The levels alternate and end at the current one. */
+    int level = sim_gpio_level(g);
+    for (int i = (int) edges - 1; i >= 0; i--) {
+        values[i] = level;
+        level = !level;
+    }
+    return (int) edges;
+}
+
+void sim_gpio_close(struct gpio *pin)
+{
+    sim.gpios[pin->pin_number].fd = -1;
+}
+
+static void sim_gpio_set_level(int pin_number, int value)
+{
+    struct sim_gpio *g = &sim.gpios[pin_number];
+    int level = sim_gpio_level(g);
+    if (level == value)
+        return;
+
+    /* Flip the base so that periodic edges continue from here */
+    g->base_level ^= 1;
+    g->changed = 1;
+    if (g->period_ns == 0)
+        sim_gpio_arm(g);
+}
+
+static void sim_gpio_set_edges(int pin_number, uint64_t period_us)
+{
+    struct sim_gpio *g = &sim.gpios[pin_number];
+    g->base_level = sim_gpio_level(g);
+    g->start_ns = sim_now_ns();
+    g->period_ns = period_us * 1000;
+    sim_gpio_arm(g);
+}
+
+/**
+ * @brief Run an I2C_RDWR request against the register files
+ *
+ * @return the number of messages or -1 with errno set
+ */
+int sim_i2c_transfer(struct i2c_rdwr_ioctl_data *data)
+{
+    sim_delay();
+
+    pthread_mutex_lock(&sim_lock);
+    for (unsigned int i = 0; i < data->nmsgs; i++) {
+        const struct i2c_msg *msg = &data->msgs[i];
+        if (msg->addr >= SIM_I2C_ADDRESSES || sim.i2c_absent[msg->addr]) {
+            pthread_mutex_unlock(&sim_lock);
+            errno = ENXIO;
+            return -1;
+        }
+    }
+
+    for (unsigned int i = 0; i < data->nmsgs; i++) {
+        struct i2c_msg *msg = &data->msgs[i];
+        uint8_t *registers = sim.i2c_registers[msg->addr];
+        uint8_t *pointer = &sim.i2c_pointer[msg->addr];
+        for (unsigned int j = 0; j < msg->len; j++) {
+            if (msg->flags & I2C_M_RD)
+                msg->buf[j] = registers[(*pointer)++];
+            else if (j == 0)
+                *pointer = msg->buf[0];
+            else
+                registers[(*pointer)++] = msg->buf[j];
+        }
+    }
+    pthread_mutex_unlock(&sim_lock);
+    return data->nmsgs;
+}
+
+/**
+ * @brief Run a SPI_IOC_MESSAGE request
+ *
+ * @return the number of bytes transferred
+ */
+int sim_spi_transfer(int count, struct spi_ioc_transfer *transfers)
+{
+    sim_delay();
+
+    pthread_mutex_lock(&sim_lock);
+    int total = 0;
+    for (int i = 0; i < count; i++) {
+        struct spi_ioc_transfer *tfer = &transfers[i];
+        uint8_t *rx = (uint8_t *) (uintptr_t) tfer->rx_buf;
+        const uint8_t *tx = (const uint8_t *) (uintptr_t) tfer->tx_buf;
+        total += tfer->len;
+        if (!rx)
+            continue;
+
+        struct sim_spi_response *response = sim.spi_responses;
+        if (response) {
+            size_t len = response->len < tfer->len ? response->len : tfer->len;
+            memcpy(rx, response->data, len);
+            memset(rx + len, 0, tfer->len - len);
+
+            sim.spi_responses = response->next;
+            if (!sim.spi_responses)
+                sim.spi_responses_tail = &sim.spi_responses;
+            sim.spi_response_count--;
+            free(response);
+        } else if (tx)
+            memcpy(rx, tx, tfer->len);
+        else
+            memset(rx, 0, tfer->len);
+    }
+    pthread_mutex_unlock(&sim_lock);
+    return total;
+}
+
+/**
+ * @return 1 if the response was queued, 0 if the queue is full or -1
+ *         if the request is bad
+ */
+static int sim_add_spi_response(const char *req, int *req_index)
+{
+    int type;
+    int size;
+    long llen;
+    if (ei_get_type(req, req_index, &type, &size) < 0 || type != ERL_BINARY_EXT)
+        return -1;
+    if (sim.spi_response_count >= SIM_SPI_MAX_RESPONSES)
+        return 0;
+
+    struct sim_spi_response *response = malloc(sizeof(struct sim_spi_response) + size);
+    if (!response)
+        err(EXIT_FAILURE, "malloc");
+    if (ei_decode_binary(req, req_index, response->data, &llen) < 0) {
+        free(response);
+        return -1;
+    }
+    response->len = size;
+    response->next = NULL;
+    *sim.spi_responses_tail = response;
+    sim.spi_responses_tail = &response->next;
+    sim.spi_response_count++;
+    return 1;
+}
+
+static void sim_encode_error(char *resp, int *resp_index, const char *reason)
+{
+    ei_encode_tuple_header(resp, resp_index, 2);
+    ei_encode_atom(resp, resp_index, "error");
+    ei_encode_atom(resp, resp_index, reason);
+}
+
+static void sim_handle_command(const char *req, int *req_index)
+{
+    char resp[SIM_I2C_REGISTERS + 64];
+    int resp_index = 1; // Space for the type
+    resp[0] = 0; // Reply
+    ei_encode_version(resp, &resp_index);
+
+    int arity;
+    char cmd[MAXATOMLEN];
+    if (ei_decode_tuple_header(req, req_index, &arity) < 0 ||
+            arity < 2 ||
+            ei_decode_atom(req, req_index, cmd) < 0) {
+        erlcmd_bad_request("sim: expecting {command, args...}");
+        return;
+    }
+
+    if (!sim.enabled) {
+        sim_encode_error(resp, &resp_index, "not_simulated");
+        erlcmd_reply(resp, resp_index);
+        return;
+    }
+
+    if (strcmp(cmd, "latency") == 0) {
+        unsigned long latency_us;
+        if (arity != 2 || ei_decode_ulong(req, req_index, &latency_us) < 0) {
+            erlcmd_bad_request("sim: expecting {latency, us}");
+            return;
+        }
+        sim.latency_ns = (uint64_t) latency_us * 1000;
+        ei_encode_atom(resp, &resp_index, "ok");
+    } else if (strcmp(cmd, "gpio_level") == 0) {
+        long pin_number;
+        long value;
+        if (arity != 3 ||
+                ei_decode_long(req, req_index, &pin_number) < 0 ||
+                ei_decode_long(req, req_index, &value) < 0 ||
+                pin_number < 0 || pin_number >= SIM_GPIO_MAX_PINS) {
+            erlcmd_bad_request("sim: expecting {gpio_level, pin, value}");
+            return;
+        }
+        sim_gpio_set_level(pin_number, value ? 1 : 0);
+        ei_encode_atom(resp, &resp_index, "ok");
+    } else if (strcmp(cmd, "gpio_edges") == 0) {
+        long pin_number;
+        unsigned long period_us;
+        if (arity != 3 ||
+                ei_decode_long(req, req_index, &pin_number) < 0 ||
+                ei_decode_ulong(req, req_index, &period_us) < 0 ||
+                pin_number < 0 || pin_number >= SIM_GPIO_MAX_PINS) {
+            erlcmd_bad_request("sim: expecting {gpio_edges, pin, period_us}");
+            return;
+        }
+        sim_gpio_set_edges(pin_number, period_us);
+        ei_encode_atom(resp, &resp_index, "ok");
+    } else if (strcmp(cmd, "i2c_registers") == 0) {
+        long addr;
+        unsigned long offset;
+        int type;
+        int size;
+        long llen;
+        uint8_t data[SIM_I2C_REGISTERS];
+        if (arity != 4 ||
+                ei_decode_long(req, req_index, &addr) < 0 ||
+                ei_decode_ulong(req, req_index, &offset) < 0 ||
+                ei_get_type(req, req_index, &type, &size) < 0 ||
+                type != ERL_BINARY_EXT ||
+                addr < 0 || addr >= SIM_I2C_ADDRESSES ||
+                offset > SIM_I2C_REGISTERS ||
+                (unsigned long) size > SIM_I2C_REGISTERS - offset ||
+                ei_decode_binary(req, req_index, data, &llen) < 0) {
+            erlcmd_bad_request("sim: expecting {i2c_registers, addr, offset, data} within %d registers", SIM_I2C_REGISTERS);
+            return;
+        }
+        memcpy(&sim.i2c_registers[addr][offset], data, size);
+        ei_encode_atom(resp, &resp_index, "ok");
+    } else if (strcmp(cmd, "i2c_read_registers") == 0) {
+        long addr;
+        unsigned long offset;
+        unsigned long len;
+        if (arity != 4 ||
+                ei_decode_long(req, req_index, &addr) < 0 ||
+                ei_decode_ulong(req, req_index, &offset) < 0 ||
+                ei_decode_ulong(req, req_index, &len) < 0 ||
+                addr < 0 || addr >= SIM_I2C_ADDRESSES ||
+                offset > SIM_I2C_REGISTERS ||
+                len > SIM_I2C_REGISTERS - offset) {
+            erlcmd_bad_request("sim: expecting {i2c_read_registers, addr, offset, len} within %d registers", SIM_I2C_REGISTERS);
+            return;
+        }
+        ei_encode_binary(resp, &resp_index, &sim.i2c_registers[addr][offset], len);
+    } else if (strcmp(cmd, "i2c_present") == 0) {
+        long addr;
+        int present;
+        if (arity != 3 ||
+                ei_decode_long(req, req_index, &addr) < 0 ||
+                ei_decode_boolean(req, req_index, &present) < 0 ||
+                addr < 0 || addr >= SIM_I2C_ADDRESSES) {
+            erlcmd_bad_request("sim: expecting {i2c_present, addr, true|false}");
+            return;
+        }
+        sim.i2c_absent[addr] = !present;
+        ei_encode_atom(resp, &resp_index, "ok");
+    } else if (strcmp(cmd, "spi_response") == 0) {
+        int rc = (arity == 2 ? sim_add_spi_response(req, req_index) : -1);
+        if (rc < 0) {
+            erlcmd_bad_request("sim: expecting {spi_response, data}");
+            return;
+        }
+        if (rc > 0)
+            ei_encode_atom(resp, &resp_index, "ok");
+        else
+            sim_encode_error(resp, &resp_index, "too_many_responses");
+    } else {
+        erlcmd_bad_request("sim: unknown command: %s", cmd);
+        return;
+    }
+
+    erlcmd_reply(resp, resp_index);
+}
+
+/**
+ * @brief Handle a {sim, Command} request
+ *
+ * Every mode passes these here the same way as stats.
+ */
+void sim_handle_request(const char *req, int *req_index)
+{
+    pthread_mutex_lock(&sim_lock);
+    sim_handle_command(req, req_index);
+    pthread_mutex_unlock(&sim_lock);
+}
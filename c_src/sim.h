@@ -0,0 +1,77 @@
+/*
+ *  Copyright 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Simulated device declarations
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <linux/spi/spidev.h>
+
+#include "gpio.h"
+
+/*
+ * The simulated backend stands in for the kernel in bench mode. The
+ * GPIO, I2C and SPI code call these functions instead of using sysfs,
+ * the GPIO character device, i2c-dev or spidev.
+ *
+ *  - GPIOs: outputs keep the last value written. Inputs read a level
+ *    that's set by Erlang and can toggle every period to generate
+ *    edges. Each pin's fd is a timerfd that's readable when the pin
+ *    has edges to report, so it's polled like any other pin.
+ *  - I2C: every address is a 256 byte register file like a 24C02
+ *    EEPROM. The first byte of a write sets the register pointer and
+ *    the rest are stored from there. Reads return registers from the
+ *    pointer on. Addresses can be removed so that transfers to them
+ *    fail with ENXIO like a NAK.
+ *  - SPI: transfers receive what they send, as if MOSI were wired to
+ *    MISO, unless responses were queued. Then each transfer receives
+ *    the next one.
+ *
+ * Every device access can be given a fixed latency to model the bus.
+ *
+ * Each mode configures the simulation with {sim, Command}:
+ *
+ *   {latency, Us}                         -> ok
+ *   {gpio_level, Pin, Value}              -> ok
+ *   {gpio_edges, Pin, PeriodUs}           -> ok (0 stops them)
+ *   {i2c_registers, Addr, Offset, Data}   -> ok
+ *   {i2c_read_registers, Addr, Offset, Len} -> Data
+ *   {i2c_present, Addr, true | false}     -> ok
+ *   {spi_response, Data}                  -> ok
+ */
+#define SIM_GPIO_MAX_PINS 4096
+#define SIM_I2C_ADDRESSES 128
+#define SIM_I2C_REGISTERS 256
+#define SIM_SPI_MAX_RESPONSES 64
+
+void sim_enable();
+int sim_enabled();
+
+int sim_gpio_open(struct gpio *pin);
+int sim_gpio_read(struct gpio *pin);
+int sim_gpio_write(struct gpio *pin, unsigned int value);
+int sim_gpio_edges(struct gpio *pin, int *values, int max_values);
+void sim_gpio_close(struct gpio *pin);
+
+int sim_i2c_transfer(struct i2c_rdwr_ioctl_data *data);
+int sim_spi_transfer(int count, struct spi_ioc_transfer *transfers);
+
+void sim_handle_request(const char *req, int *req_index);
+
+#endif
@@ -16,8 +16,10 @@
  */
 
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
@@ -27,7 +29,20 @@
 
 #include <linux/spi/spidev.h>
 
+// Older headers don't have the dual and quad mode flags
+#ifndef SPI_TX_DUAL
+#define SPI_TX_DUAL 0x100
+#define SPI_TX_QUAD 0x200
+#define SPI_RX_DUAL 0x400
+#define SPI_RX_QUAD 0x800
+#endif
+
 #include "erlcmd.h"
+#include "program.h"
+#include "sim.h"
+#include "stats.h"
+#include "stream.h"
+#include "worker.h"
 
 //#define DEBUG
 #ifdef DEBUG
@@ -36,16 +51,159 @@
 #define debug(...)
 #endif
 
-// Max SPI transfer size that we support
-#define SPI_TRANSFER_MAX 256
+// Max SPI transfer size that we support. Transfers larger than
+// spidev's bufsiz are split up.
+#define SPI_TRANSFER_MAX (1024 * 1024)
+
+// Max number of segments in one transaction
+#define SPI_TRANSACTION_MAX_SEGMENTS 64
+
+// spidev's default bufsiz if it can't be read from sysfs
+#define SPIDEV_DEFAULT_BUFSIZ 4096
+
+/*
+ * A transaction is a list of segments that are run with one
+ * SPI_IOC_MESSAGE(n) ioctl. Chip select stays active across the
+ * segments unless cs_change is set on one.
+ */
+struct spi_transaction
+{
+    int count;
+    struct spi_ioc_transfer transfers[SPI_TRANSACTION_MAX_SEGMENTS];
+    int returns_data[SPI_TRANSACTION_MAX_SEGMENTS];
+    size_t rx_total;
+};
 
 struct spi_info
 {
     int fd;
 
+    // Largest amount that spidev can handle in one message
+    size_t bufsiz;
+
+    // SPI mode (0-3) and the SPI_TX_* and SPI_RX_* lane flags
+    uint32_t mode;
+
+    // Speed, bits and delay for segments without their own
     struct spi_ioc_transfer transfer;
+
+    // Lanes for tx-only and rx-only segments without their own. Full
+    // duplex transfers always use one lane each way.
+    uint8_t tx_lanes;
+    uint8_t rx_lanes;
+
+    // Reused for every transfer request. See spi_reserve_buffers().
+    char *tx_buffer;
+    char *rx_buffer;
+    size_t buffer_size;
+
+    // Run every period while streaming
+    struct spi_transaction stream_transaction;
+    struct stream stream;
+
+    // Runs the device requests when workers are enabled or NULL
+    struct worker *worker;
+};
+
+/*
+ * A transfer or transaction that runs on the device's worker. It has
+ * its own copy of the data since the request buffer is reused.
+ */
+struct spi_job
+{
+    struct worker_job job;
+    struct spi_info *spi;
+
+    // A transfer if tx is set. Otherwise a transaction.
+    char *tx;
+    char *rx;
+    unsigned int len;
+    struct spi_transaction t;
+
+    int errnum; // 0 if it worked
+    struct erlcmd_deferred reply;
 };
 
+/**
+ * @brief Read the spidev bufsiz module parameter
+ */
+static size_t spidev_bufsiz()
+{
+    size_t bufsiz = SPIDEV_DEFAULT_BUFSIZ;
+    FILE *fp = fopen("/sys/module/spidev/parameters/bufsiz", "r");
+    if (fp) {
+        unsigned long value;
+        if (fscanf(fp, "%lu", &value) == 1 && value > 0)
+            bufsiz = value;
+        fclose(fp);
+    }
+    return bufsiz;
+}
+
+/**
+ * @brief Allocate a buffer for transfer data
+ *
+ * Buffers start on a page boundary so that they don't share cache
+ * lines with anything else when a controller driver maps them for
+ * DMA. Ones larger than a page aren't mmap'd and faulted in again on
+ * every request when they're reused, which matters with --mlockall.
+ */
+static char *spi_alloc_buffer(size_t len)
+{
+    static size_t page_size = 0;
+    if (page_size == 0)
+        page_size = (size_t) sysconf(_SC_PAGESIZE);
+
+    void *buffer;
+    if (posix_memalign(&buffer, page_size, len ? len : 1) != 0)
+        err(EXIT_FAILURE, "posix_memalign");
+    return buffer;
+}
+
+/**
+ * @brief Make the reusable tx and rx buffers at least len bytes
+ *
+ * They only grow, so pointers into them stay valid unless len is
+ * bigger than any transfer so far.
+ */
+static void spi_reserve_buffers(struct spi_info *spi, size_t len)
+{
+    if (len <= spi->buffer_size)
+        return;
+
+    size_t size = spi->buffer_size ? spi->buffer_size : SPIDEV_DEFAULT_BUFSIZ;
+    while (size < len)
+        size *= 2;
+
+    free(spi->tx_buffer);
+    free(spi->rx_buffer);
+    spi->tx_buffer = spi_alloc_buffer(size);
+    spi->rx_buffer = spi_alloc_buffer(size);
+    spi->buffer_size = size;
+}
+
+/**
+ * @brief Set the mode, bits and speed of a device
+ *
+ * The speed and bits get set again on each transfer, but setting them
+ * here checks them. The 8-bit mode ioctl is used unless lane flags
+ * are set so that kernels without SPI_IOC_WR_MODE32 still work.
+ *
+ * @return NULL on success, or an atom describing the failure with
+ *         errno set
+ */
+static const char *spi_configure_device(int fd, uint32_t mode, uint8_t bits_per_word, uint32_t speed_hz)
+{
+    uint8_t mode8 = (uint8_t) mode;
+    if ((mode > 0xff ? ioctl(fd, SPI_IOC_WR_MODE32, &mode) : ioctl(fd, SPI_IOC_WR_MODE, &mode8)) < 0)
+        return "spi_mode_failed";
+    else if (ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits_per_word) < 0)
+        return "spi_bits_per_word_failed";
+    else if (ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) < 0)
+        return "spi_speed_failed";
+    return NULL;
+}
+
 /**
  * @brief        Initialize a SPI device
  *
@@ -56,124 +214,750 @@ struct spi_info
  * @param        speed_hz   Bus speed
  * @param        delay_usecs   Delay between transfers
  *
- * @return       1 if success, -1 if fails
+ * @return NULL on success, or an atom describing the failure with
+ *         errno set
  */
-static void spi_init(struct spi_info *spi,
-                     const char *devpath,
-                     uint8_t mode,
-                     uint8_t bits_per_word,
-                     uint32_t speed_hz,
-                     uint16_t delay_usecs)
+static const char *spi_init(struct spi_info *spi,
+                            const char *devpath,
+                            uint8_t mode,
+                            uint8_t bits_per_word,
+                            uint32_t speed_hz,
+                            uint16_t delay_usecs)
 {
     memset(spi, 0, sizeof(*spi));
 
+    spi->mode = mode;
+    spi->tx_lanes = 1;
+    spi->rx_lanes = 1;
     spi->transfer.speed_hz = speed_hz;
     spi->transfer.delay_usecs = delay_usecs;
     spi->transfer.bits_per_word = bits_per_word;
+    spi->bufsiz = spidev_bufsiz();
 
-    // Fail hard on error. May need to be nicer if this makes the
-    // Erlang side too hard to debug.
-    spi->fd = open(devpath, O_RDWR);
-    if (spi->fd < 0)
-        err(EXIT_FAILURE, "open %s", devpath);
+    spi->fd = -1;
+    if (sim_enabled())
+        return NULL;
 
-    if (ioctl(spi->fd, SPI_IOC_WR_MODE, &mode) < 0)
-        err(EXIT_FAILURE, "ioctl(SPI_IOC_WR_MODE %d)", mode);
+    spi->fd = open(devpath, O_RDWR | O_CLOEXEC);
+    if (spi->fd < 0)
+        return "spi_open_failed";
 
-    // Set these to check for bad values given by the user. They get
-    // set again on each transfer.
-    if (ioctl(spi->fd, SPI_IOC_WR_BITS_PER_WORD, &bits_per_word) < 0)
-        err(EXIT_FAILURE, "ioctl(SPI_IOC_WR_BITS_PER_WORD %d)", bits_per_word);
+    const char *reason = spi_configure_device(spi->fd, mode, bits_per_word, speed_hz);
+    if (reason) {
+        int errnum = errno;
+        close(spi->fd);
+        spi->fd = -1;
+        errno = errnum;
+    }
+    return reason;
+}
 
-    if (ioctl(spi->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) < 0)
-        err(EXIT_FAILURE, "ioctl(SPI_IOC_WR_MAX_SPEED_HZ %d)", speed_hz);
+/**
+ * @brief	Run a SPI_IOC_MESSAGE ioctl and record how long it took
+ *
+ * Transient failures are retried if enabled with erlcmd_set_retries().
+ *
+ * @return 	the ioctl's return value with errno set on failure
+ */
+static int spi_message(const struct spi_info *spi, int count, struct spi_ioc_transfer *transfers)
+{
+    int rc;
+    for (int attempt = 0; ; attempt++) {
+        uint64_t start = stats_now_ns();
+        rc = sim_enabled() ? sim_spi_transfer(count, transfers) : ioctl(spi->fd, SPI_IOC_MESSAGE(count), transfers);
+        stats_record_io(start, rc >= 0);
+        if (rc >= 0 || !erlcmd_should_retry(attempt, errno))
+            break;
+    }
+    return rc;
 }
 
 /**
  * @brief	spi transfer operation
  *
+ * spidev limits the total size of a message to bufsiz, so larger
+ * transfers are sent as several messages. Chip select is held
+ * active between them with cs_change so that the device sees one
+ * transfer.
+ *
  * @param	tx      Data to write into the device
  * @param	rx      Data to read from the device
  * @param	len     Length of data
  *
- * @return 	1 for success, 0 for failure
+ * @return 	1 for success, 0 for failure with errno set
  */
 static int spi_transfer(struct spi_info *spi, const char *tx, char *rx, unsigned int len)
 {
-    struct spi_ioc_transfer tfer = spi->transfer;
+    unsigned int offset = 0;
+    while (offset < len) {
+        struct spi_ioc_transfer tfer = spi->transfer;
+        unsigned int chunk = len - offset;
+        if (chunk > spi->bufsiz)
+            chunk = spi->bufsiz;
 
-    tfer.tx_buf = (__u64) tx;
-    tfer.rx_buf = (__u64) rx;
-    tfer.len = len;
+        tfer.tx_buf = (__u64) (tx + offset);
+        tfer.rx_buf = (__u64) (rx + offset);
+        tfer.len = chunk;
+        // Full duplex, so one lane each way whatever is configured
+        tfer.tx_nbits = 1;
+        tfer.rx_nbits = 1;
+        tfer.cs_change = (offset + chunk < len);
 
-    if (ioctl(spi->fd, SPI_IOC_MESSAGE(1), &tfer) < 1)
-        err(EXIT_FAILURE, "ioctl(SPI_IOC_MESSAGE)");
+        if (spi_message(spi, 1, &tfer) < 1)
+            return 0;
+
+        offset += chunk;
+    }
 
     return 1;
 }
 
+static void spi_transaction_free(struct spi_transaction *t)
+{
+    for (int i = 0; i < t->count; i++) {
+        free((void *) (uintptr_t) t->transfers[i].tx_buf);
+        free((void *) (uintptr_t) t->transfers[i].rx_buf);
+    }
+    t->count = 0;
+}
+
+static int spi_lanes_valid(unsigned long lanes)
+{
+    return lanes == 1 || lanes == 2 || lanes == 4;
+}
+
+/**
+ * @brief Decode a segment's option list
+ *
+ *   [{cs_change, boolean()} | {delay_us, integer()} |
+ *    {speed_hz, integer()} | {bits_per_word, integer()} |
+ *    {tx_lanes, 1 | 2 | 4} | {rx_lanes, 1 | 2 | 4}]
+ *
+ * Values that don't fit in spidev's fields are decode errors rather
+ * than being truncated. More than one lane only works if the device was configured for it.
+ *
+ * @return 0 on success, -1 on a decode error
+ */
+static int spi_decode_segment_options(const char *req, int *req_index, struct spi_ioc_transfer *tfer)
+{
+    int count;
+    if (ei_decode_list_header(req, req_index, &count) < 0)
+        return -1;
+
+    for (int i = 0; i < count; i++) {
+        int arity;
+        char name[MAXATOMLEN];
+        if (ei_decode_tuple_header(req, req_index, &arity) < 0 ||
+                arity != 2 ||
+                ei_decode_atom(req, req_index, name) < 0)
+            return -1;
+
+        unsigned long value;
+        if (strcmp(name, "cs_change") == 0) {
+            int enabled;
+            if (ei_decode_boolean(req, req_index, &enabled) < 0)
+                return -1;
+            tfer->cs_change = enabled;
+        } else if (ei_decode_ulong(req, req_index, &value) < 0) {
+            return -1;
+        } else if (strcmp(name, "delay_us") == 0 && value <= UINT16_MAX) {
+            tfer->delay_usecs = value;
+        } else if (strcmp(name, "speed_hz") == 0 && value > 0 && value <= UINT32_MAX) {
+            tfer->speed_hz = value;
+        } else if (strcmp(name, "bits_per_word") == 0 && value > 0 && value <= 32) {
+            tfer->bits_per_word = value;
+        } else if (strcmp(name, "tx_lanes") == 0 && spi_lanes_valid(value)) {
+            tfer->tx_nbits = value;
+        } else if (strcmp(name, "rx_lanes") == 0 && spi_lanes_valid(value)) {
+            tfer->rx_nbits = value;
+        } else
+            return -1;
+    }
+    if (count > 0 && ei_decode_list_header(req, req_index, &count) < 0)
+        return -1;
+
+    return 0;
+}
+
+static uint32_t spi_lane_flags(unsigned long lanes, uint32_t dual, uint32_t quad)
+{
+    return lanes == 4 ? quad : (lanes == 2 ? dual : 0);
+}
+
+/**
+ * @brief Decode the options of a configure request
+ *
+ *   [{mode, 0..3} | {speed_hz, integer()} | {bits_per_word, integer()} |
+ *    {delay_us, integer()} | {tx_lanes, 1 | 2 | 4} | {rx_lanes, 1 | 2 | 4}]
+ *
+ * Settings that aren't in the list keep their values. tx_lanes and
+ * rx_lanes let segments use dual or quad SPI and are the default for
+ * tx and rx segments that don't set their own.
+ *
+ * @return 0 on success, -1 on a decode error
+ */
+static int spi_decode_config(const char *req, int *req_index, uint32_t *mode,
+                             struct spi_ioc_transfer *tfer, uint8_t *tx_lanes, uint8_t *rx_lanes)
+{
+    int count;
+    if (ei_decode_list_header(req, req_index, &count) < 0)
+        return -1;
+
+    for (int i = 0; i < count; i++) {
+        int arity;
+        char name[MAXATOMLEN];
+        unsigned long value;
+        if (ei_decode_tuple_header(req, req_index, &arity) < 0 ||
+                arity != 2 ||
+                ei_decode_atom(req, req_index, name) < 0 ||
+                ei_decode_ulong(req, req_index, &value) < 0)
+            return -1;
+
+        if (strcmp(name, "mode") == 0 && value <= 3) {
+            *mode = (*mode & ~(uint32_t) (SPI_CPHA | SPI_CPOL)) | value;
+        } else if (strcmp(name, "speed_hz") == 0 && value > 0 && value <= UINT32_MAX) {
+            tfer->speed_hz = value;
+        } else if (strcmp(name, "bits_per_word") == 0 && value > 0 && value <= 32) {
+            tfer->bits_per_word = value;
+        } else if (strcmp(name, "delay_us") == 0 && value <= UINT16_MAX) {
+            tfer->delay_usecs = value;
+        } else if (strcmp(name, "tx_lanes") == 0 && spi_lanes_valid(value)) {
+            *mode = (*mode & ~(uint32_t) (SPI_TX_DUAL | SPI_TX_QUAD)) |
+                    spi_lane_flags(value, SPI_TX_DUAL, SPI_TX_QUAD);
+            *tx_lanes = value;
+        } else if (strcmp(name, "rx_lanes") == 0 && spi_lanes_valid(value)) {
+            *mode = (*mode & ~(uint32_t) (SPI_RX_DUAL | SPI_RX_QUAD)) |
+                    spi_lane_flags(value, SPI_RX_DUAL, SPI_RX_QUAD);
+            *rx_lanes = value;
+        } else
+            return -1;
+    }
+    if (count > 0 && ei_decode_list_header(req, req_index, &count) < 0)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * @brief Decode a transaction
+ *
+ * Each segment is one of:
+ *
+ *   {tx, binary()}        write; received data is discarded
+ *   {rx, integer()}       read the number of bytes (zeros are sent)
+ *   {txrx, binary()}      write and return what's received
+ *
+ * with an optional third element for per-segment options. tx and rx
+ * segments use the configured lanes unless they set their own. txrx
+ * segments are full duplex, so they can only use one lane.
+ *
+ * @return 0 on success, -1 on a decode error
+ */
+static int spi_decode_transaction(struct spi_info *spi, const char *req, int *req_index, struct spi_transaction *t)
+{
+    memset(t, 0, sizeof(*t));
+
+    int count;
+    if (ei_decode_list_header(req, req_index, &count) < 0 ||
+            count < 1 ||
+            count > SPI_TRANSACTION_MAX_SEGMENTS)
+        return -1;
+
+    for (int i = 0; i < count; i++) {
+        struct spi_ioc_transfer *tfer = &t->transfers[i];
+        *tfer = spi->transfer;
+
+        int arity;
+        char kind[MAXATOMLEN];
+        if (ei_decode_tuple_header(req, req_index, &arity) < 0 ||
+                (arity != 2 && arity != 3) ||
+                ei_decode_atom(req, req_index, kind) < 0)
+            return -1;
+
+        int is_rx = (strcmp(kind, "rx") == 0);
+        int is_tx = (strcmp(kind, "tx") == 0);
+        int is_txrx = (strcmp(kind, "txrx") == 0);
+        if (!is_rx && !is_tx && !is_txrx)
+            return -1;
+
+        tfer->tx_nbits = (is_tx ? spi->tx_lanes : 1);
+        tfer->rx_nbits = (is_rx ? spi->rx_lanes : 1);
+
+        unsigned long len;
+        char *tx = NULL;
+        if (is_rx) {
+            if (ei_decode_ulong(req, req_index, &len) < 0)
+                return -1;
+        } else {
+            int type;
+            int size;
+            long llen;
+            if (ei_get_type(req, req_index, &type, &size) < 0 ||
+                    type != ERL_BINARY_EXT)
+                return -1;
+            len = size;
+            tx = spi_alloc_buffer(len);
+            tfer->tx_buf = (__u64) (uintptr_t) tx;
+            t->count = i + 1;
+            if (ei_decode_binary(req, req_index, tx, &llen) < 0)
+                return -1;
+        }
+        if (len < 1 || len > SPI_TRANSFER_MAX)
+            return -1;
+
+        tfer->len = len;
+        if (!is_tx) {
+            char *rx = spi_alloc_buffer(len);
+            tfer->rx_buf = (__u64) (uintptr_t) rx;
+            t->returns_data[i] = 1;
+            t->rx_total += len;
+        }
+        t->count = i + 1;
+
+        if (arity == 3 && spi_decode_segment_options(req, req_index, tfer) < 0)
+            return -1;
+        if (is_txrx && (tfer->tx_nbits != 1 || tfer->rx_nbits != 1))
+            return -1;
+    }
+    if (ei_decode_list_header(req, req_index, &count) < 0)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * @brief The size of the buffer for the reply to a transaction
+ *
+ * Each segment that returns data has a 5 byte list cell and a 5 byte
+ * binary header. The rest covers the type, the version, the empty
+ * list and an error.
+ */
+static size_t spi_transaction_reply_size(const struct spi_transaction *t)
+{
+    return t->rx_total + 10 * t->count + 64;
+}
+
+/**
+ * @brief Encode the reply to a transaction
+ *
+ * @param errnum 0 if the SPI_IOC_MESSAGE ioctl worked or its errno
+ */
+static void spi_encode_transaction(char *resp, int *resp_index,
+                                   const struct spi_transaction *t, int errnum)
+{
+    if (errnum == 0) {
+        // Return a list with one binary per segment that read data
+        for (int i = 0; i < t->count; i++) {
+            if (t->returns_data[i]) {
+                ei_encode_list_header(resp, resp_index, 1);
+                ei_encode_binary(resp, resp_index,
+                                 (const char *) (uintptr_t) t->transfers[i].rx_buf,
+                                 t->transfers[i].len);
+            }
+        }
+        ei_encode_empty_list(resp, resp_index);
+    } else
+        erlcmd_encode_errno_error(resp, resp_index, "spi_transaction_failed", errnum);
+}
+
+/**
+ * @brief Run the stream's transaction and pack the received data
+ *        into a sample
+ *
+ * @return 1 for success, 0 for failure
+ */
+static int spi_stream_sample(char *data, void *cookie)
+{
+    struct spi_info *spi = (struct spi_info *) cookie;
+    struct spi_transaction *t = &spi->stream_transaction;
+
+    if (spi_message(spi, t->count, t->transfers) < 0)
+        return 0;
+
+    for (int i = 0; i < t->count; i++) {
+        if (t->returns_data[i]) {
+            memcpy(data, (const char *) (uintptr_t) t->transfers[i].rx_buf, t->transfers[i].len);
+            data += t->transfers[i].len;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Write and then read with chip select held for a program step
+ *
+ * @return 1 for success, 0 for failure
+ */
+static int spi_program_transfer(void *cookie, int addr,
+                                const char *tx, size_t tx_len,
+                                char *rx, size_t rx_len)
+{
+    struct spi_info *spi = (struct spi_info *) cookie;
+    struct spi_ioc_transfer tfers[2];
+    int count = 0;
+
+    if (tx_len + rx_len > spi->bufsiz)
+        return 0;
+
+    if (tx_len > 0) {
+        tfers[count] = spi->transfer;
+        tfers[count].tx_nbits = spi->tx_lanes;
+        tfers[count].tx_buf = (__u64) (uintptr_t) tx;
+        tfers[count].len = tx_len;
+        count++;
+    }
+    if (rx_len > 0) {
+        tfers[count] = spi->transfer;
+        tfers[count].rx_nbits = spi->rx_lanes;
+        tfers[count].rx_buf = (__u64) (uintptr_t) rx;
+        tfers[count].len = rx_len;
+        count++;
+    }
+    if (count == 0)
+        return 1;
+
+    return spi_message(spi, count, tfers) >= 0;
+}
+
+/**
+ * @brief	Run a transfer and encode the reply
+ *
+ * Data is received into the reusable rx buffer, so the caller reserves
+ * len bytes with spi_reserve_buffers() first. The reply holds the
+ * received data, so it's encoded in a buffer big enough for it.
+ *
+ * @return	the reply, which the caller frees
+ */
+static char *spi_encode_transfer(struct spi_info *spi, const char *tx, unsigned int len, int *resp_index)
+{
+    char *resp = malloc(len + 64);
+    if (!resp)
+        err(EXIT_FAILURE, "malloc");
+    *resp_index = 1; // Space for the type
+    resp[0] = 0; // Reply
+    ei_encode_version(resp, resp_index);
+
+    if (spi_transfer(spi, tx, spi->rx_buffer, len))
+        ei_encode_binary(resp, resp_index, spi->rx_buffer, len);
+    else
+        erlcmd_encode_errno_error(resp, resp_index, "spi_transfer_failed", errno);
+
+    return resp;
+}
+
+static void spi_job_run(struct worker_job *job)
+{
+    struct spi_job *j = (struct spi_job *) job;
+    int ok;
+    if (j->tx)
+        ok = spi_transfer(j->spi, j->tx, j->rx, j->len);
+    else
+        ok = (spi_message(j->spi, j->t.count, j->t.transfers) >= 0);
+    j->errnum = (ok ? 0 : errno);
+}
+
+static void spi_job_complete(struct worker_job *job)
+{
+    struct spi_job *j = (struct spi_job *) job;
+
+    // A transfer's reply is one binary
+    char *resp = malloc(j->tx ? j->len + 64 : spi_transaction_reply_size(&j->t));
+    if (!resp)
+        err(EXIT_FAILURE, "malloc");
+    int resp_index = 1; // Space for the type
+    resp[0] = 0; // Reply
+    ei_encode_version(resp, &resp_index);
+
+    if (!j->tx)
+        spi_encode_transaction(resp, &resp_index, &j->t, j->errnum);
+    else if (j->errnum == 0)
+        ei_encode_binary(resp, &resp_index, j->rx, j->len);
+    else
+        erlcmd_encode_errno_error(resp, &resp_index, "spi_transfer_failed", j->errnum);
+    erlcmd_reply_deferred(&j->reply, resp, resp_index);
+
+    free(resp);
+    free(j->tx);
+    free(j->rx);
+    spi_transaction_free(&j->t);
+    free(j);
+}
+
+static struct spi_job *spi_job_new(struct spi_info *spi)
+{
+    struct spi_job *j = calloc(1, sizeof(struct spi_job));
+    if (!j)
+        err(EXIT_FAILURE, "calloc");
+
+    j->job.run = spi_job_run;
+    j->job.complete = spi_job_complete;
+    j->spi = spi;
+    erlcmd_defer(&j->reply);
+    return j;
+}
+
+/**
+ * @brief Run a transfer on the worker
+ */
+static void spi_submit_transfer(struct spi_info *spi, const char *tx, unsigned int len)
+{
+    struct spi_job *j = spi_job_new(spi);
+    j->tx = spi_alloc_buffer(len);
+    j->rx = spi_alloc_buffer(len);
+    memcpy(j->tx, tx, len);
+    j->len = len;
+    worker_submit(spi->worker, &j->job);
+}
+
+/**
+ * @brief Run a transaction on the worker
+ *
+ * The job takes the segments from t.
+ */
+static void spi_submit_transaction(struct spi_info *spi, struct spi_transaction *t)
+{
+    struct spi_job *j = spi_job_new(spi);
+    j->t = *t;
+    t->count = 0;
+    worker_submit(spi->worker, &j->job);
+}
+
+/*
+ * Binary commands
+ *
+ * transfer is also available as an opcode byte followed by the data
+ * so that it can skip ei and be sent straight from the request
+ * buffer:
+ *
+ *   1 transfer  <<Data/binary>>
+ *
+ * The reply is the same term that the term command sends.
+ */
+enum spi_opcode {
+    SPI_OP_TRANSFER = 1,
+    SPI_OP_COUNT
+};
+
+static void spi_op_transfer(const uint8_t *args, size_t len, void *cookie)
+{
+    struct spi_info *spi = (struct spi_info *) cookie;
+    if (len > SPI_TRANSFER_MAX) {
+        erlcmd_bad_request("transfer: need a binary between 1 and %d bytes", SPI_TRANSFER_MAX);
+        return;
+    }
+
+    if (spi->worker) {
+        spi_submit_transfer(spi, (const char *) args, len);
+        return;
+    }
+
+    // Data is sent from the request buffer, so only rx is needed
+    spi_reserve_buffers(spi, len);
+    int resp_index;
+    char *resp = spi_encode_transfer(spi, (const char *) args, len, &resp_index);
+    erlcmd_reply(resp, resp_index);
+    free(resp);
+}
+
+static const struct erlcmd_opcode spi_opcodes[SPI_OP_COUNT] = {
+    [SPI_OP_TRANSFER] = {spi_op_transfer, 1, 1}
+};
+
 static void spi_handle_request(const char *req, void *cookie)
 {
     struct spi_info *spi = (struct spi_info *) cookie;
 
     // Commands are of the form {Command, Arguments}:
     // { atom(), term() }
-    int req_index = sizeof(uint16_t);
-    if (ei_decode_version(req, &req_index, NULL) < 0)
-        errx(EXIT_FAILURE, "Message version issue?");
+    int req_index = 0;
+    if (ei_decode_version(req, &req_index, NULL) < 0) {
+        erlcmd_bad_request("Message version issue?");
+        return;
+    }
 
     int arity;
     if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
-            arity != 2)
-        errx(EXIT_FAILURE, "expecting {cmd, args} tuple");
+            arity != 2) {
+        erlcmd_bad_request("expecting {cmd, args} tuple");
+        return;
+    }
 
     char cmd[MAXATOMLEN];
-    if (ei_decode_atom(req, &req_index, cmd) < 0)
-        errx(EXIT_FAILURE, "expecting command atom");
+    if (ei_decode_atom(req, &req_index, cmd) < 0) {
+        erlcmd_bad_request("expecting command atom");
+        return;
+    }
+
+    // Every mode reports stats and configures the simulator the same way
+    if (strcmp(cmd, "stats") == 0) {
+        stats_reply();
+        return;
+    } else if (strcmp(cmd, "sim") == 0) {
+        sim_handle_request(req, &req_index);
+        return;
+    }
 
-    char resp[SPI_TRANSFER_MAX + 64];
-    int resp_index = sizeof(uint16_t); // Space for payload size
+    char small_resp[256];
+    char *resp = small_resp;
+    int resp_index = 1; // Space for the type
+    resp[0] = 0; // Reply
     ei_encode_version(resp, &resp_index);
     if (strcmp(cmd, "transfer") == 0) {
-        char data[SPI_TRANSFER_MAX];
         int len;
         int type;
         long llen;
         if (ei_get_type(req, &req_index, &type, &len) < 0 ||
                 type != ERL_BINARY_EXT ||
                 len < 1 ||
-                len > SPI_TRANSFER_MAX ||
-                ei_decode_binary(req, &req_index, &data, &llen) < 0)
-            errx(EXIT_FAILURE, "transfer: need a binary between 1 and %d bytes (%d, %d)", SPI_TRANSFER_MAX,
+                len > SPI_TRANSFER_MAX) {
+            erlcmd_bad_request("transfer: need a binary between 1 and %d bytes (%d, %d)", SPI_TRANSFER_MAX,
                     type, len);
+            return;
+        }
+
+        spi_reserve_buffers(spi, len);
+        if (ei_decode_binary(req, &req_index, spi->tx_buffer, &llen) < 0) {
+            erlcmd_bad_request("transfer: bad binary");
+            return;
+        }
+
+        if (spi->worker) {
+            spi_submit_transfer(spi, spi->tx_buffer, len);
+            return;
+        }
+
+        resp = spi_encode_transfer(spi, spi->tx_buffer, len, &resp_index);
+    } else if (strcmp(cmd, "transaction") == 0) {
+        struct spi_transaction t;
+        if (spi_decode_transaction(spi, req, &req_index, &t) < 0) {
+            spi_transaction_free(&t);
+            erlcmd_bad_request("transaction: expecting a list of 1 to %d segments", SPI_TRANSACTION_MAX_SEGMENTS);
+            return;
+        }
+
+        if (spi->worker) {
+            spi_submit_transaction(spi, &t);
+            return;
+        }
+
+        resp = malloc(spi_transaction_reply_size(&t));
+        if (!resp)
+            err(EXIT_FAILURE, "malloc");
+        resp_index = 1;
+        resp[0] = 0;
+        ei_encode_version(resp, &resp_index);
+
+        int errnum = (spi_message(spi, t.count, t.transfers) >= 0 ? 0 : errno);
+        spi_encode_transaction(resp, &resp_index, &t, errnum);
+        spi_transaction_free(&t);
+    } else if (strcmp(cmd, "program") == 0) {
+        struct program *p = malloc(sizeof(struct program));
+        if (!p)
+            err(EXIT_FAILURE, "malloc");
+        if (program_decode(req, &req_index, 0, spi->bufsiz, p) < 0) {
+            program_free(p);
+            free(p);
+            erlcmd_bad_request("program: bad step, too many steps (max %d, %d when run) or waits too long (max %d us)",
+                               PROGRAM_MAX_STEPS, PROGRAM_MAX_RUN_STEPS, PROGRAM_MAX_WAIT_US);
+            return;
+        }
+
+        if (spi->worker) {
+            program_submit(spi->worker, p, spi_program_transfer, spi);
+            return;
+        }
+
+        resp = program_reply(p, spi_program_transfer, spi, &resp_index);
+        program_free(p);
+        free(p);
+    } else if (strcmp(cmd, "configure") == 0) {
+        uint32_t mode = spi->mode;
+        struct spi_ioc_transfer transfer = spi->transfer;
+        uint8_t tx_lanes = spi->tx_lanes;
+        uint8_t rx_lanes = spi->rx_lanes;
+        if (spi_decode_config(req, &req_index, &mode, &transfer, &tx_lanes, &rx_lanes) < 0) {
+            erlcmd_bad_request("configure: expecting a list of mode, speed_hz, bits_per_word, delay_us, tx_lanes or rx_lanes");
+            return;
+        }
+
+        // The mode is for the whole device, so let the requests on the
+        // worker finish with the old settings first
+        if (spi->worker)
+            worker_drain(spi->worker);
+
+        const char *reason = (spi->fd >= 0 ?
+                              spi_configure_device(spi->fd, mode, transfer.bits_per_word, transfer.speed_hz) :
+                              NULL);
+        if (reason) {
+            // Go back to the old settings if only some were taken
+            int errnum = errno;
+            spi_configure_device(spi->fd, spi->mode, spi->transfer.bits_per_word, spi->transfer.speed_hz);
+            erlcmd_encode_errno_error(resp, &resp_index, reason, errnum);
+        } else {
+            debug("configure mode 0x%x, %u Hz", mode, transfer.speed_hz);
+            spi->mode = mode;
+            spi->transfer = transfer;
+            spi->tx_lanes = tx_lanes;
+            spi->rx_lanes = rx_lanes;
+            ei_encode_atom(resp, &resp_index, "ok");
+        }
+    } else if (strcmp(cmd, "start_stream") == 0) {
+        unsigned long period_us;
+        unsigned long samples_per_batch;
+
+        stream_stop(&spi->stream);
+        spi_transaction_free(&spi->stream_transaction);
 
-        char rxbuffer[SPI_TRANSFER_MAX];
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                arity != 3 ||
+                spi_decode_transaction(spi, req, &req_index, &spi->stream_transaction) < 0 ||
+                ei_decode_ulong(req, &req_index, &period_us) < 0 ||
+                ei_decode_ulong(req, &req_index, &samples_per_batch) < 0) {
+            spi_transaction_free(&spi->stream_transaction);
+            erlcmd_bad_request("start_stream: expecting {segments, period_us, samples_per_batch}");
+            return;
+        }
+        debug("start_stream %lu us", period_us);
 
-        if (spi_transfer(spi,
-                         data,
-                         rxbuffer,
-                         len))
-            ei_encode_binary(resp, &resp_index, rxbuffer, len);
+        if (stream_start(&spi->stream, period_us, spi->stream_transaction.rx_total, samples_per_batch) == 0)
+            ei_encode_atom(resp, &resp_index, "ok");
         else {
+            spi_transaction_free(&spi->stream_transaction);
             ei_encode_tuple_header(resp, &resp_index, 2);
             ei_encode_atom(resp, &resp_index, "error");
-            ei_encode_atom(resp, &resp_index, "spi_transfer_failed");
+            ei_encode_atom(resp, &resp_index, "bad_stream");
         }
-    } else
-        errx(EXIT_FAILURE, "unknown command: %s", cmd);
+    } else if (strcmp(cmd, "stop_stream") == 0) {
+        // Any batched samples are sent before the reply
+        stream_stop(&spi->stream);
+        spi_transaction_free(&spi->stream_transaction);
+        ei_encode_atom(resp, &resp_index, "ok");
+    } else {
+        erlcmd_bad_request("unknown command: %s", cmd);
+        return;
+    }
 
     debug("sending response: %d bytes", resp_index);
-    erlcmd_send(resp, resp_index);
+    erlcmd_reply(resp, resp_index);
+
+    if (resp != small_resp)
+        free(resp);
 }
 
 /**
- * @brief The main function.
- * It waits for data in the buffer and calls the driver.
+ * @brief Open an SPI device for spi_main() or a hub handle
+ *
+ * The arguments are the same as spi_main()'s.
+ *
+ * @return NULL on success, or an atom describing the failure with
+ *         errno set
  */
-int spi_main(int argc, char *argv[])
+const char *spi_open_handle(struct erlcmd *handler, int argc, char *argv[])
 {
-    if (argc != 7)
-        errx(EXIT_FAILURE, "%s spi <device path> <SPI mode (0-3)> <bits/word (8)> <speed (1000000 Hz)> <delay (10 us)>", argv[0]);
+    if (argc != 7) {
+        errno = EINVAL;
+        return "bad_arguments";
+    }
 
     const char *devpath = argv[2];
     uint8_t mode = (uint8_t) strtoul(argv[3], 0, 0);
@@ -181,16 +965,56 @@ int spi_main(int argc, char *argv[])
     uint32_t speed = (uint32_t) strtoul(argv[5], 0, 0);
     uint16_t delay = (uint16_t) strtoul(argv[6], 0, 0);
 
-    struct spi_info spi;
-    spi_init(&spi, devpath, mode, bits, speed, delay);
-
-    struct erlcmd handler;
-    erlcmd_init(&handler, spi_handle_request, &spi);
+    struct spi_info *spi = malloc(sizeof(struct spi_info));
+    if (!spi)
+        err(EXIT_FAILURE, "malloc");
 
-    for (;;) {
-        // Loop forever and process requests from Erlang.
-        erlcmd_process(&handler);
+    const char *reason = spi_init(spi, devpath, mode, bits, speed, delay);
+    if (reason) {
+        int errnum = errno;
+        free(spi);
+        errno = errnum;
+        return reason;
     }
+    stream_init(&spi->stream, spi_stream_sample, spi);
 
-    return 1;
+    erlcmd_init(handler, spi_handle_request, spi);
+    erlcmd_set_opcodes(handler, spi_opcodes, SPI_OP_COUNT);
+    spi->worker = (worker_enabled() ? worker_start() : NULL);
+    return NULL;
+}
+
+/**
+ * @brief Finish the requests on the worker, stop streaming and close
+ *        the device opened by spi_open_handle()
+ */
+void spi_close_handle(struct erlcmd *handler)
+{
+    struct spi_info *spi = (struct spi_info *) handler->cookie;
+    if (spi->worker)
+        worker_stop(spi->worker);
+    stream_stop(&spi->stream);
+    spi_transaction_free(&spi->stream_transaction);
+    if (spi->fd >= 0)
+        close(spi->fd);
+    free(spi->tx_buffer);
+    free(spi->rx_buffer);
+    free(spi);
+}
+
+/**
+ * @brief The main function.
+ * It waits for data in the buffer and calls the driver.
+ */
+int spi_main(int argc, char *argv[])
+{
+    if (argc != 7)
+        errx(EXIT_FAILURE, "%s spi <device path> <SPI mode (0-3)> <bits/word (8)> <speed (1000000 Hz)> <delay (10 us)>", argv[0]);
+
+    struct erlcmd handler;
+    const char *reason = spi_open_handle(&handler, argc, argv);
+    if (reason)
+        err(EXIT_FAILURE, "%s %s", reason, argv[2]);
+
+    erlcmd_run(&handler);
 }
@@ -0,0 +1,172 @@
+/*
+ *  Copyright 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "stats.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#ifndef ALE_NIF
+#include <err.h>
+#include <stdlib.h>
+
+#include "erlcmd.h"
+#endif
+
+struct stats stats;
+
+/* Bus workers record their device accesses from their own threads */
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Return CLOCK_MONOTONIC in nanoseconds
+ */
+uint64_t stats_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int stats_bucket(uint64_t value)
+{
+    if (value < STATS_SUB_BUCKETS)
+        return (int) value;
+
+    int power = 63 - __builtin_clzll(value);
+    if (power > STATS_MAX_POWER)
+        return STATS_BUCKETS - 1;
+
+    // The two bits after the leading one pick the sub-bucket
+    int sub = (int) (value >> (power - 2)) & (STATS_SUB_BUCKETS - 1);
+    return (power - 1) * STATS_SUB_BUCKETS + sub;
+}
+
+#ifndef ALE_NIF
+/**
+ * @brief Return the largest value that goes in a bucket
+ */
+static uint64_t stats_bucket_limit(int bucket)
+{
+    if (bucket < STATS_SUB_BUCKETS)
+        return bucket;
+
+    int power = bucket / STATS_SUB_BUCKETS + 1;
+    uint64_t sub = bucket % STATS_SUB_BUCKETS;
+    return ((STATS_SUB_BUCKETS + sub + 1) << (power - 2)) - 1;
+}
+#endif
+
+void stats_record(struct stats_histogram *h, uint64_t value)
+{
+    h->count++;
+    h->sum += value;
+    if (value > h->max)
+        h->max = value;
+    h->buckets[stats_bucket(value)]++;
+}
+
+/**
+ * @brief Record a device access that started at start_ns
+ */
+void stats_record_io(uint64_t start_ns, int ok)
+{
+    uint64_t elapsed = stats_now_ns() - start_ns;
+    pthread_mutex_lock(&io_lock);
+    stats_record(&stats.io_time, elapsed);
+    if (!ok)
+        stats.io_errors++;
+    pthread_mutex_unlock(&io_lock);
+}
+
+void stats_record_retry()
+{
+    pthread_mutex_lock(&io_lock);
+    stats.retries++;
+    pthread_mutex_unlock(&io_lock);
+}
+
+#ifndef ALE_NIF
+static void stats_encode_counter(char *buf, int *index, const char *name, uint64_t value)
+{
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, name);
+    ei_encode_ulonglong(buf, index, value);
+}
+
+/*
+ * Histograms are encoded as {Count, Sum, Max, [{UpperBound, Count}]}
+ * with only the buckets that have values.
+ */
+static void stats_encode_histogram(char *buf, int *index, const char *name, const struct stats_histogram *h)
+{
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, name);
+    ei_encode_tuple_header(buf, index, 4);
+    ei_encode_ulonglong(buf, index, h->count);
+    ei_encode_ulonglong(buf, index, h->sum);
+    ei_encode_ulonglong(buf, index, h->max);
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        if (h->buckets[i] == 0)
+            continue;
+        ei_encode_list_header(buf, index, 1);
+        ei_encode_tuple_header(buf, index, 2);
+        ei_encode_ulonglong(buf, index, stats_bucket_limit(i));
+        ei_encode_ulonglong(buf, index, h->buckets[i]);
+    }
+    ei_encode_empty_list(buf, index);
+}
+
+/**
+ * @brief Reply to a stats request with a proplist of every counter
+ */
+void stats_reply()
+{
+    // Every bucket of the histograms plus the counters
+    char *resp = malloc(3 * STATS_BUCKETS * 32 + 1024);
+    if (!resp)
+        err(EXIT_FAILURE, "malloc");
+
+    int resp_index = 1; // Space for the type
+    resp[0] = 0; // Reply
+    ei_encode_version(resp, &resp_index);
+
+    ei_encode_list_header(resp, &resp_index, 17);
+    stats_encode_counter(resp, &resp_index, "requests", stats.requests);
+    stats_encode_counter(resp, &resp_index, "bad_requests", stats.bad_requests);
+    stats_encode_counter(resp, &resp_index, "bytes_in", stats.bytes_in);
+    stats_encode_counter(resp, &resp_index, "bytes_out", stats.bytes_out);
+    stats_encode_counter(resp, &resp_index, "messages_out", stats.messages_out);
+    stats_encode_counter(resp, &resp_index, "max_input_backlog", stats.max_input_backlog);
+    stats_encode_counter(resp, &resp_index, "max_output_queue", stats.max_output_queue);
+    stats_encode_histogram(resp, &resp_index, "request_time", &stats.request_time);
+    stats_encode_counter(resp, &resp_index, "max_queued", stats.max_queued);
+    stats_encode_counter(resp, &resp_index, "coalesced", stats.coalesced);
+    stats_encode_histogram(resp, &resp_index, "queue_time", &stats.queue_time);
+    pthread_mutex_lock(&io_lock);
+    stats_encode_counter(resp, &resp_index, "io_errors", stats.io_errors);
+    stats_encode_counter(resp, &resp_index, "retries", stats.retries);
+    stats_encode_histogram(resp, &resp_index, "io_time", &stats.io_time);
+    pthread_mutex_unlock(&io_lock);
+    stats_encode_counter(resp, &resp_index, "interrupts", stats.interrupts);
+    stats_encode_counter(resp, &resp_index, "interrupts_doubled", stats.interrupts_doubled);
+    stats_encode_counter(resp, &resp_index, "interrupts_missed", stats.interrupts_missed);
+    ei_encode_empty_list(resp, &resp_index);
+
+    erlcmd_reply(resp, resp_index);
+    free(resp);
+}
+#endif
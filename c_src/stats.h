@@ -0,0 +1,82 @@
+/*
+ *  Copyright 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Instrumentation declarations
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+/*
+ * Histograms have log-linear buckets like HdrHistogram: each power of
+ * two is split into STATS_SUB_BUCKETS equal parts, so a bucket is
+ * within 25% of the values in it. Times are in nanoseconds and the
+ * last bucket catches everything over about 30 minutes.
+ */
+#define STATS_SUB_BUCKETS 4
+#define STATS_MAX_POWER 40
+#define STATS_BUCKETS (STATS_MAX_POWER * STATS_SUB_BUCKETS)
+
+struct stats_histogram
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[STATS_BUCKETS];
+};
+
+/*
+ * Counters for everything that goes through one erlang-ale process.
+ * Every mode fills in the parts that apply to it.
+ */
+struct stats
+{
+    uint64_t requests;
+    uint64_t bad_requests; // Requests that couldn't be decoded
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t messages_out;
+    uint64_t max_input_backlog; // Bytes received but not yet processed
+    uint64_t max_output_queue;  // Bytes waiting for Erlang to read
+    struct stats_histogram request_time;
+
+    // Scheduled requests (see erlcmd_set_scheduling())
+    uint64_t max_queued;
+    uint64_t coalesced;  // Requests run along with the one before
+    struct stats_histogram queue_time;
+
+    // Time in ioctl/pread/pwrite calls to devices. Bus workers update
+    // these, so they're only accessed through the functions below.
+    uint64_t io_errors;
+    uint64_t retries;
+    struct stats_histogram io_time;
+
+    // GPIO interrupts
+    uint64_t interrupts;
+    uint64_t interrupts_doubled; // Edges reported twice since one was missed
+    uint64_t interrupts_missed;  // Events the kernel dropped from a line request
+};
+
+extern struct stats stats;
+
+uint64_t stats_now_ns();
+void stats_record(struct stats_histogram *h, uint64_t value);
+void stats_record_io(uint64_t start_ns, int ok);
+void stats_record_retry();
+void stats_reply();
+
+#endif
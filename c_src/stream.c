@@ -0,0 +1,179 @@
+/*
+ *  Copyright 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "stream.h"
+#include "erlcmd.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+static void stream_process(int fd, uint32_t events, void *cookie);
+
+/**
+ * @brief Initialize a stopped stream
+ *
+ * @param sample called with a buffer of sample_size bytes for each
+ *               sample. It returns 0 if the sample failed.
+ */
+void stream_init(struct stream *s,
+                 int (*sample)(char *data, void *cookie),
+                 void *cookie)
+{
+    s->timer_fd = -1;
+    s->sample_size = 0;
+    s->max_samples = 0;
+    s->count = 0;
+    s->overruns = 0;
+    s->samples = NULL;
+    s->sample = sample;
+    s->cookie = cookie;
+}
+
+/**
+ * @brief Start sampling every period_us
+ *
+ * A running stream is flushed and stopped first.
+ *
+ * @return 0 on success, -1 if the arguments are out of range or the
+ *         timer couldn't be created
+ */
+int stream_start(struct stream *s, unsigned long period_us, size_t sample_size, unsigned long samples_per_batch)
+{
+    stream_stop(s);
+
+    size_t record_size = STREAM_TIMESTAMP_SIZE + sample_size;
+    if (period_us < STREAM_MIN_PERIOD_US ||
+            record_size > STREAM_MAX_BATCH_SIZE)
+        return -1;
+
+    if (samples_per_batch < 1)
+        samples_per_batch = 1;
+    if (samples_per_batch > STREAM_MAX_BATCH_SIZE / record_size)
+        samples_per_batch = STREAM_MAX_BATCH_SIZE / record_size;
+
+    s->samples = malloc(samples_per_batch * record_size);
+    if (!s->samples)
+        err(EXIT_FAILURE, "malloc");
+
+    s->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (s->timer_fd < 0) {
+        free(s->samples);
+        s->samples = NULL;
+        return -1;
+    }
+
+    struct itimerspec period;
+    period.it_interval.tv_sec = period_us / 1000000;
+    period.it_interval.tv_nsec = (period_us % 1000000) * 1000;
+    period.it_value = period.it_interval;
+    if (timerfd_settime(s->timer_fd, 0, &period, NULL) < 0) {
+        stream_stop(s);
+        return -1;
+    }
+    erlcmd_watch(s->timer_fd, EPOLLIN, stream_process, s);
+
+    s->sample_size = sample_size;
+    s->max_samples = samples_per_batch;
+    s->count = 0;
+    s->overruns = 0;
+    return 0;
+}
+
+/**
+ * @brief Send any batched samples and stop the stream
+ */
+void stream_stop(struct stream *s)
+{
+    if (s->timer_fd < 0)
+        return;
+
+    stream_flush(s);
+    erlcmd_unwatch(s->timer_fd);
+    close(s->timer_fd);
+    free(s->samples);
+    s->timer_fd = -1;
+    s->samples = NULL;
+}
+
+/**
+ * @brief Send the batched samples to Erlang
+ */
+void stream_flush(struct stream *s)
+{
+    if (s->count == 0)
+        return;
+
+    size_t samples_len = s->count * (STREAM_TIMESTAMP_SIZE + s->sample_size);
+    char *resp = malloc(samples_len + 64);
+    if (!resp)
+        err(EXIT_FAILURE, "malloc");
+
+    int resp_index = 1; // Space for the type
+    resp[0] = 1; // Notification
+    ei_encode_version(resp, &resp_index);
+    ei_encode_tuple_header(resp, &resp_index, 3);
+    ei_encode_atom(resp, &resp_index, "stream");
+    ei_encode_binary(resp, &resp_index, s->samples, samples_len);
+    ei_encode_ulonglong(resp, &resp_index, s->overruns);
+    erlcmd_send(resp, resp_index);
+    free(resp);
+
+    s->count = 0;
+}
+
+/**
+ * @brief Called when the timer fd is readable
+ *
+ * Only one sample is taken no matter how many periods elapsed. The
+ * extra ones are counted as overruns rather than run back to back so
+ * that the samples stay evenly spaced.
+ */
+static void stream_process(int fd, uint32_t events, void *cookie)
+{
+    struct stream *s = (struct stream *) cookie;
+    uint64_t expirations;
+    ssize_t amount = read(s->timer_fd, &expirations, sizeof(expirations));
+    if (amount < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return;
+        err(EXIT_FAILURE, "read(timerfd)");
+    }
+    if (amount != sizeof(expirations) || expirations == 0)
+        return;
+
+    s->overruns += expirations - 1;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t timestamp = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    char *record = s->samples + s->count * (STREAM_TIMESTAMP_SIZE + s->sample_size);
+    if (!s->sample(record + STREAM_TIMESTAMP_SIZE, s->cookie)) {
+        s->overruns++;
+        return;
+    }
+
+    for (int i = 0; i < STREAM_TIMESTAMP_SIZE; i++)
+        record[i] = (char) (timestamp >> (56 - 8 * i));
+
+    s->count++;
+    if (s->count >= s->max_samples)
+        stream_flush(s);
+}
@@ -0,0 +1,64 @@
+/*
+ *  Copyright 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Periodic sampling declarations
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A stream calls a sample function every period from a timerfd and
+ * sends the results to Erlang as notifications in batches:
+ *
+ *   {stream, Samples, Overruns}
+ *
+ * Samples is a binary of <<Timestamp:64, Data/binary>> records where
+ * Timestamp is CLOCK_MONOTONIC in nanoseconds when the sample was
+ * started. Overruns counts the samples that were missed since the
+ * stream started, either because the port fell behind or because
+ * the sample function failed.
+ */
+#define STREAM_MIN_PERIOD_US 10
+#define STREAM_TIMESTAMP_SIZE 8
+
+// Keep batches small enough for {packet, 2}
+#define STREAM_MAX_BATCH_SIZE (60 * 1024)
+
+struct stream
+{
+    int timer_fd; // -1 when stopped
+
+    size_t sample_size; // Bytes of data per sample
+    unsigned int max_samples;
+    unsigned int count;
+    uint64_t overruns;
+    char *samples;
+
+    int (*sample)(char *data, void *cookie);
+    void *cookie;
+};
+
+void stream_init(struct stream *s,
+                 int (*sample)(char *data, void *cookie),
+                 void *cookie);
+int stream_start(struct stream *s, unsigned long period_us, size_t sample_size, unsigned long samples_per_batch);
+void stream_stop(struct stream *s);
+void stream_flush(struct stream *s);
+
+#endif
@@ -0,0 +1,216 @@
+/*
+ *  Copyright 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "worker.h"
+#include "erlcmd.h"
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define WORKER_QUEUE_MASK (WORKER_QUEUE_SIZE - 1)
+
+/* Buses get workers when this is set. It's off by default since a
+ * request that's handed to a thread takes longer than one that's run
+ * right away on a process with one bus.
+ */
+static int enabled = 0;
+
+void worker_set_enabled(int enable)
+{
+    enabled = enable;
+}
+
+int worker_enabled()
+{
+    return enabled;
+}
+
+/* The producer never overruns the ring since the event loop keeps
+ * track of how many jobs are in both rings and holds the rest back.
+ */
+static void worker_ring_put(struct worker_ring *ring, struct worker_job *job)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    ring->jobs[tail & WORKER_QUEUE_MASK] = job;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+static struct worker_job *worker_ring_take(struct worker_ring *ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&ring->tail, memory_order_acquire))
+        return NULL;
+
+    struct worker_job *job = ring->jobs[head & WORKER_QUEUE_MASK];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return job;
+}
+
+static void worker_signal(int fd)
+{
+    uint64_t one = 1;
+    while (write(fd, &one, sizeof(one)) < 0) {
+        if (errno != EINTR && errno != EAGAIN)
+            err(EXIT_FAILURE, "write(eventfd)");
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *w = (struct worker *) arg;
+    for (;;) {
+        struct worker_job *job;
+        while ((job = worker_ring_take(&w->requests)) != NULL) {
+            job->run(job);
+            worker_ring_put(&w->completions, job);
+            worker_signal(w->done_fd);
+        }
+
+        if (atomic_load(&w->stopping))
+            return NULL;
+
+        // Wait for more. The count doesn't matter since the ring is
+        // checked again.
+        uint64_t count;
+        if (read(w->work_fd, &count, sizeof(count)) < 0 && errno != EINTR)
+            err(EXIT_FAILURE, "read(eventfd)");
+    }
+}
+
+/**
+ * @brief Complete the finished jobs and hand the thread waiting ones
+ */
+static void worker_collect(int fd, uint32_t events, void *cookie)
+{
+    struct worker *w = (struct worker *) cookie;
+
+    uint64_t count;
+    if (read(w->done_fd, &count, sizeof(count)) < 0 &&
+            errno != EAGAIN && errno != EINTR)
+        err(EXIT_FAILURE, "read(eventfd)");
+
+    struct worker_job *job;
+    while ((job = worker_ring_take(&w->completions)) != NULL) {
+        w->in_ring--;
+        job->complete(job);
+    }
+
+    int submitted = 0;
+    while (w->backlog && w->in_ring < WORKER_QUEUE_SIZE) {
+        job = w->backlog;
+        w->backlog = job->next;
+        worker_ring_put(&w->requests, job);
+        w->in_ring++;
+        submitted = 1;
+    }
+    if (!w->backlog)
+        w->backlog_tail = &w->backlog;
+    if (submitted)
+        worker_signal(w->work_fd);
+}
+
+/**
+ * @brief Start a thread for a bus
+ *
+ * The thread inherits the process's CPU affinity and scheduling
+ * policy, so --cpus and --rt-priority apply to it too.
+ */
+struct worker *worker_start()
+{
+    struct worker *w = calloc(1, sizeof(struct worker));
+    if (!w)
+        err(EXIT_FAILURE, "calloc");
+
+    w->backlog_tail = &w->backlog;
+    w->work_fd = eventfd(0, EFD_CLOEXEC);
+    w->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (w->work_fd < 0 || w->done_fd < 0)
+        err(EXIT_FAILURE, "eventfd");
+
+    int rc = pthread_create(&w->thread, NULL, worker_thread, w);
+    if (rc != 0) {
+        errno = rc;
+        err(EXIT_FAILURE, "pthread_create");
+    }
+
+    erlcmd_watch(w->done_fd, EPOLLIN, worker_collect, w);
+    return w;
+}
+
+/**
+ * @brief Run a job on the thread
+ *
+ * Jobs run in the order that they're submitted. The job belongs to
+ * the worker until its complete() is called.
+ */
+void worker_submit(struct worker *w, struct worker_job *job)
+{
+    if (w->in_ring < WORKER_QUEUE_SIZE && !w->backlog) {
+        worker_ring_put(&w->requests, job);
+        w->in_ring++;
+        worker_signal(w->work_fd);
+    } else {
+        job->next = NULL;
+        *w->backlog_tail = job;
+        w->backlog_tail = &job->next;
+    }
+}
+
+/**
+ * @brief Wait for every job to finish and complete them
+ *
+ * This is for requests that change how the bus is accessed, so that
+ * the jobs that were submitted before them aren't affected.
+ */
+void worker_drain(struct worker *w)
+{
+    while (w->in_ring > 0) {
+        struct pollfd fdset;
+        fdset.fd = w->done_fd;
+        fdset.events = POLLIN;
+        fdset.revents = 0;
+        if (poll(&fdset, 1, -1) < 0 && errno != EINTR)
+            err(EXIT_FAILURE, "poll(eventfd)");
+
+        worker_collect(w->done_fd, POLLIN, w);
+    }
+}
+
+/**
+ * @brief Finish every job and stop the thread
+ *
+ * Jobs are completed rather than dropped so that every request gets
+ * its reply.
+ */
+void worker_stop(struct worker *w)
+{
+    worker_drain(w);
+
+    atomic_store(&w->stopping, 1);
+    worker_signal(w->work_fd);
+    pthread_join(w->thread, NULL);
+
+    erlcmd_unwatch(w->done_fd);
+    close(w->done_fd);
+    close(w->work_fd);
+    free(w);
+}
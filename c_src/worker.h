@@ -0,0 +1,82 @@
+/*
+ *  Copyright 2015 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Bus worker thread declarations
+ */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+/*
+ * An I2C or SPI access can block for milliseconds with clock
+ * stretching or a long transfer. When workers are enabled, each bus
+ * gets a thread that runs its accesses so that the event loop keeps
+ * handling requests, GPIO events and other buses in the meantime.
+ * There's one thread per bus so that its accesses stay in order.
+ *
+ * Jobs go to the thread through a single producer, single consumer
+ * ring and come back through another one. The thread signals
+ * completions on an eventfd that the event loop watches. Jobs that
+ * don't fit in the ring wait on the event loop until there's room.
+ *
+ * run() is called on the worker's thread, so it must only touch the
+ * job and the device. complete() is called on the event loop to
+ * reply and free the job.
+ */
+#define WORKER_QUEUE_SIZE 64 // Must be a power of two
+
+struct worker_job
+{
+    void (*run)(struct worker_job *job);
+    void (*complete)(struct worker_job *job);
+    struct worker_job *next; // While waiting for room in the ring
+};
+
+struct worker_ring
+{
+    struct worker_job *jobs[WORKER_QUEUE_SIZE];
+    atomic_size_t head; // Only written by the consumer
+    atomic_size_t tail; // Only written by the producer
+};
+
+struct worker
+{
+    pthread_t thread;
+    int work_fd; // eventfd that the thread waits on
+    int done_fd; // eventfd that the event loop watches
+    atomic_int stopping;
+
+    struct worker_ring requests;
+    struct worker_ring completions;
+
+    // Only used by the event loop
+    size_t in_ring; // Jobs submitted to the thread and not completed
+    struct worker_job *backlog;
+    struct worker_job **backlog_tail;
+};
+
+void worker_set_enabled(int enable);
+int worker_enabled();
+
+struct worker *worker_start();
+void worker_submit(struct worker *w, struct worker_job *job);
+void worker_drain(struct worker *w);
+void worker_stop(struct worker *w);
+
+#endif
@@ -63,17 +63,17 @@ handle_call(_Request, _From, State) ->
 handle_cast(_Msg, State) ->
     {noreply, State}.
 
-handle_info({gpio_interrupt, ?UP_PIN, rising},
+handle_info({gpio_interrupt, ?UP_PIN, rising, _Timestamp},
             #state{count=N}=State)  when N < 3 ->
     N1 = N + 1,
     set_counter_pins(State, N1),
     {noreply, State#state{count=N1}};
-handle_info({gpio_interrupt, ?DOWN_PIN, rising},
+handle_info({gpio_interrupt, ?DOWN_PIN, rising, _Timestamp},
             #state{count=N}=State) when N > 0 ->
     N1 = N - 1,
     set_counter_pins(State, N1),
     {noreply, State#state{count=N1}};
-handle_info({gpio_interrupt, _Pin, _Condition},
+handle_info({gpio_interrupt, _Pin, _Condition, _Timestamp},
             State) ->
     {noreply, State}.
 
@@ -0,0 +1,150 @@
+%%% @author Frank Hunleth <fhunleth@troodon-software.com>
+%%% @copyright (C) 2015, Frank Hunleth
+%%% @doc
+%%% Measure the round trip latency and throughput of erlang-ale requests.
+%%%
+%%% The ports are opened with <code>{loopback, true}</code>, so the GPIOs,
+%%% the I2C adapter and the SPI device are simulated. What's
+%%% measured is the gen_server call, the port protocol, erlcmd and each
+%%% mode's request handling. Use it as the baseline for changes to any of
+%%% those. It doesn't need hardware, so it can run on a build server.
+%%% @end
+
+-module(ale_bench).
+
+%% API
+-export([run/0, run/1, measure/2]).
+
+-define(DEFAULT_ITERATIONS, 10000).
+-define(DEFAULT_SIZES, [1, 16, 256, 4096]).
+-define(WARMUP_ITERATIONS, 100).
+
+%% i2c-dev's limit on one message
+-define(I2C_MAX_SIZE, 8192).
+
+-type measurement() :: [{'ops_per_sec' | 'p50_us' | 'p99_us' | 'p999_us' | 'max_us', float()}].
+-type result() :: {Name :: atom(), Size :: pos_integer(), measurement()}.
+
+-export_type([measurement/0, result/0]).
+
+%%%===================================================================
+%%% API
+%%%===================================================================
+
+%% @doc
+%% Run every benchmark with the default options and print a table of
+%% the results.
+%% @end
+-spec run() -> 'ok'.
+run() ->
+    Results = run([]),
+    io:format("~-16s ~8s ~12s ~10s ~10s ~10s~n",
+              ["benchmark", "bytes", "ops/sec", "p50 us", "p99 us", "p99.9 us"]),
+    [ io:format("~-16s ~8b ~12b ~10.1f ~10.1f ~10.1f~n",
+                [Name, Size,
+                 round(proplists:get_value(ops_per_sec, M)),
+                 proplists:get_value(p50_us, M),
+                 proplists:get_value(p99_us, M),
+                 proplists:get_value(p999_us, M)])
+      || {Name, Size, M} <- Results ],
+    ok.
+
+%% @doc
+%% Run gpio:read/1, gpio:write/2, i2c:write_read/3 and spi:transfer/2
+%% against simulated devices and return the measurements.
+%%
+%% Options:
+%%    {iterations, N}   Requests per measurement (default 10000)
+%%    {sizes, [Bytes]}  Payload sizes for I2C and SPI (default
+%%                      [1, 16, 256, 4096]). I2C skips sizes over
+%%                      8192 bytes.
+%%    {latency_us, Us}  Make every simulated device access take Us
+%%                      (default 0)
+%%
+%% Other options are passed to ale_util:open_port/2, so the effect of
+%% options like rt_priority can be measured too.
+%% @end
+-spec run([{atom(), term()}]) -> [result()].
+run(Options) ->
+    N = proplists:get_value(iterations, Options, ?DEFAULT_ITERATIONS),
+    Sizes = proplists:get_value(sizes, Options, ?DEFAULT_SIZES),
+    Latency = proplists:get_value(latency_us, Options, 0),
+    PortOptions = [{loopback, true} | Options],
+    gpio_results(N, Latency, PortOptions)
+        ++ i2c_results(N, Latency, [S || S <- Sizes, S =< ?I2C_MAX_SIZE], PortOptions)
+        ++ spi_results(N, Latency, Sizes, PortOptions).
+
+%% @doc
+%% Call Fun(I) for I from 1 to N, after a warmup, and return the
+%% throughput and latency percentiles.
+%% @end
+-spec measure(fun((pos_integer()) -> term()), pos_integer()) -> measurement().
+measure(Fun, N) ->
+    _ = [Fun(I) || I <- lists:seq(1, ?WARMUP_ITERATIONS)],
+    Start = erlang:monotonic_time(nanosecond),
+    Times = [time_call(Fun, I) || I <- lists:seq(1, N)],
+    Elapsed = erlang:monotonic_time(nanosecond) - Start,
+    Sorted = list_to_tuple(lists:sort(Times)),
+    [{ops_per_sec, N * 1.0e9 / Elapsed},
+     {p50_us, percentile(Sorted, 0.5)},
+     {p99_us, percentile(Sorted, 0.99)},
+     {p999_us, percentile(Sorted, 0.999)},
+     {max_us, element(N, Sorted) / 1000}].
+
+%%%===================================================================
+%%% Internal functions
+%%%===================================================================
+
+gpio_results(N, Latency, Options) ->
+    {ok, In} = gpio:start_link(17, input, Options),
+    {ok, Out} = gpio:start_link(18, output, Options),
+    ok = gpio:sim(In, {latency, Latency}),
+    ok = gpio:sim(Out, {latency, Latency}),
+    Results = [{gpio_read, 1, measure(fun(_) -> 0 = gpio:read(In) end, N)},
+               {gpio_write, 1, measure(fun(I) -> ok = gpio:write(Out, I band 1) end, N)}],
+    stop(gpio, In),
+    stop(gpio, Out),
+    Results.
+
+i2c_results(N, Latency, Sizes, Options) ->
+    {ok, I2c} = i2c:start_link({local, ale_bench_i2c}, "i2c-bench", 16#50, Options),
+    ok = i2c:sim(I2c, {latency, Latency}),
+    Results = [{i2c_write_read, Size, i2c_measure(I2c, Size, N)} || Size <- Sizes],
+    stop(i2c, I2c),
+    Results.
+
+i2c_measure(I2c, Size, N) ->
+    measure(fun(_) ->
+                    Data = i2c:write_read(I2c, <<0>>, Size),
+                    Size = byte_size(Data)
+            end, N).
+
+spi_results(N, Latency, Sizes, Options) ->
+    {ok, Spi} = spi:start_link("spidev-bench", Options),
+    ok = spi:sim(Spi, {latency, Latency}),
+    Results = [{spi_transfer, Size, spi_measure(Spi, Size, N)} || Size <- Sizes],
+    stop(spi, Spi),
+    Results.
+
+spi_measure(Spi, Size, N) ->
+    Data = binary:copy(<<16#a5>>, Size),
+    measure(fun(_) -> Data = spi:transfer(Spi, Data) end, N).
+
+time_call(Fun, I) ->
+    Start = erlang:monotonic_time(nanosecond),
+    _ = Fun(I),
+    erlang:monotonic_time(nanosecond) - Start.
+
+percentile(Sorted, P) ->
+    Count = tuple_size(Sorted),
+    Index = min(Count, max(1, ceil(P * Count))),
+    element(Index, Sorted) / 1000.
+
+%% The stop functions are casts, so wait for the process to exit before
+%% the next benchmark starts.
+stop(Module, Pid) ->
+    Ref = monitor(process, Pid),
+    Module:stop(Pid),
+    receive
+        {'DOWN', Ref, process, Pid, _} -> ok
+    end.
@@ -0,0 +1,147 @@
+%%% @author Frank Hunleth <fhunleth@troodon-software.com>
+%%% @copyright (C) 2015, Frank Hunleth
+%%% @doc
+%%% Serve GPIOs, GPIO banks, I2C buses and SPI devices from one
+%%% erlang-ale process.
+%%%
+%%% Each gpio, gpio_bank, i2c or spi server started with the
+%%% <code>{hub, Hub}</code> option opens a handle on the hub instead of
+%%% starting its own process. Requests are prefixed with the handle and
+%%% the hub forwards everything the process sends for a handle to the
+%%% server that opened it. Handles close when their server exits.
+%%% @end
+
+-module(ale_hub).
+
+-behaviour(gen_server).
+
+%% API
+-export([start_link/1, start_link/2, stop/1, open/2, stats/1]).
+
+%% gen_server callbacks
+-export([init/1, handle_call/3, handle_cast/2, handle_info/2,
+	 terminate/2, code_change/3]).
+
+-define(REPLY, 0).
+
+%% Requests to the hub itself go to handle 0
+-define(HUB_HANDLE, 0).
+
+-type server_ref() :: atom() | {atom(), atom()} | pid().
+
+-export_type([server_ref/0]).
+
+-record(state,
+        { port              :: port(),
+          handles = []      :: [{1..65535, pid()}]
+        }).
+
+%%%===================================================================
+%%% API
+%%%===================================================================
+
+%% @doc
+%% Start a hub. Options are the ale_util:open_port/2 options for the
+%% erlang-ale process and apply to every handle. Since SPI transfers
+%% can be larger than {packet, 2} allows, the default is
+%% <code>{packet, 4}</code>.
+%% @end
+-spec start_link([ale_util:port_option()]) -> {ok, pid()} | {error, term()}.
+start_link(Options) ->
+    gen_server:start_link(?MODULE, Options, []).
+
+-spec start_link({local, atom()} | {global, term()}, [ale_util:port_option()]) ->
+                        {ok, pid()} | {error, term()}.
+start_link(ServerName, Options) ->
+    gen_server:start_link(ServerName, ?MODULE, Options, []).
+
+%% @doc
+%% Stop the hub. Every handle on it closes.
+%% @end
+-spec stop(server_ref()) -> 'ok'.
+stop(ServerRef) ->
+    gen_server:cast(ServerRef, stop).
+
+%% @doc
+%% Open a handle for the mode arguments that would otherwise be passed
+%% to ale_util:open_port/2, like <code>["i2c", "/dev/i2c-1", "80"]</code>.
+%% The handle closes when the calling process exits.
+%% @end
+-spec open(server_ref(), [string()]) ->
+                  {ok, ale_util:port_handle()} | {error, term(), term()} | {error, badarg}.
+open(ServerRef, Args) ->
+    gen_server:call(ServerRef, {open, Args}).
+
+%% @doc
+%% Return the counters of the hub's erlang-ale process. These cover
+%% every handle. See ale_util:stats().
+%% @end
+-spec stats(server_ref()) -> ale_util:stats().
+stats(ServerRef) ->
+    gen_server:call(ServerRef, stats).
+
+%%%===================================================================
+%%% gen_server callbacks
+%%%===================================================================
+
+%% @private
+init(Options) ->
+    process_flag(trap_exit, true),
+    PortOptions = [{packet, proplists:get_value(packet, Options, 4)}
+                   | lists:keydelete(hub, 1, Options)],
+    Port = ale_util:open_port(["hub"], PortOptions),
+    {ok, #state{port=Port}}.
+
+%% @private
+handle_call({open, Args}, {Owner, _}, #state{port=Port, handles=Handles}=State) ->
+    case call_port(Port, open, Args) of
+        {ok, Handle} ->
+            link(Owner),
+            {reply, {ok, {ale_hub, Port, Handle}},
+             State#state{handles=[{Handle, Owner} | Handles]}};
+        Error ->
+            {reply, Error, State}
+    end;
+handle_call(stats, _From, #state{port=Port}=State) ->
+    {reply, call_port(Port, stats, []), State}.
+
+%% @private
+handle_cast(stop, State) ->
+    {stop, normal, State}.
+
+%% @private
+handle_info({Port, {data, <<Type, Handle:16, Msg/binary>>}},
+            #state{port=Port, handles=Handles}=State) ->
+    case lists:keyfind(Handle, 1, Handles) of
+        {Handle, Owner} -> Owner ! {{ale_hub, Port, Handle}, {data, <<Type, Msg/binary>>}};
+        false -> ok
+    end,
+    {noreply, State};
+handle_info({Port, {exit_status, Status}}, #state{port=Port}=State) ->
+    {stop, {exit_status, Status}, State};
+handle_info({'EXIT', Pid, _Reason}, #state{port=Port, handles=Handles}=State) ->
+    {Closed, Open} = lists:partition(fun({_, Owner}) -> Owner =:= Pid end, Handles),
+    [ok = call_port(Port, close, Handle) || {Handle, _} <- Closed],
+    {noreply, State#state{handles=Open}};
+handle_info(_Info, State) ->
+    {noreply, State}.
+
+%% @private
+%% Even when the hub stops normally, the servers using it can't go on
+terminate(_Reason, #state{handles=Handles}) ->
+    [exit(Owner, hub_stopped) || {_, Owner} <- Handles],
+    ok.
+
+%% @private
+code_change(_OldVsn, State, _Extra) ->
+    {ok, State}.
+
+%%%===================================================================
+%%% Internal functions
+%%%===================================================================
+
+call_port(Port, Command, Args) ->
+    true = erlang:port_command(Port, [<<?HUB_HANDLE:16>>, term_to_binary({Command, Args})]),
+    receive
+        {Port, {data, <<?REPLY, ?HUB_HANDLE:16, Response/binary>>}} -> binary_to_term(Response)
+    end.
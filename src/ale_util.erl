@@ -6,17 +6,320 @@
 
 -module(ale_util).
 
+-compile({no_auto_import, [open_port/2]}).
+
 %% API
--export([open_port/1
+-export([open_port/1,
+         open_port/2,
+         port_command/2,
+         gpio_notifications/1,
+         gpio_command/2,
+         stream_samples/2,
+         send_async/4,
+         send_async/5,
+         deliver_async/1
          ]).
 
+-type port_option() :: {'packet', 2 | 4} | {'nonblocking', boolean()} |
+                       {'gpiomem', boolean()} | {'rt_priority', 1..99} |
+                       {'cpus', [non_neg_integer()]} | {'mlockall', boolean()} |
+                       {'schedule', boolean()} | {'retries', non_neg_integer()} |
+                       {'loopback', boolean()} | {'hub', ale_hub:server_ref()} |
+                       {'workers', boolean()}.
+
+%% A port of its own or a handle on an ale_hub port
+-type port_handle() :: port() | {'ale_hub', port(), 1..65535}.
+
+%% How soon a request runs when the port schedules requests. Urgent
+%% requests run before everything else that's waiting.
+-type priority() :: 'urgent' | 'high' | 'normal' | 'low'.
+
+%% The time histograms are {Count, SumNs, MaxNs, [{UpperBoundNs, Count}]}
+%% with log-linear buckets where each bucket is within 25% of the
+%% values in it. Only buckets with values are listed.
+-type histogram() :: {non_neg_integer(), non_neg_integer(), non_neg_integer(),
+                      [{non_neg_integer(), pos_integer()}]}.
+
+%% Counters from one erlang-ale process. These are totals since it
+%% started:
+%%    requests, bytes_in      Requests from Erlang and their size
+%%    bad_requests            Requests that got {error, badarg}
+%%    messages_out, bytes_out Replies and notifications to Erlang
+%%    max_input_backlog       Most bytes received and not yet handled
+%%    max_output_queue        Most bytes waiting for Erlang to read
+%%    request_time            Time handling each request
+%%    max_queued              Most scheduled requests waiting to run
+%%    coalesced               Requests run in the same ioctl as another
+%%    queue_time              Time scheduled requests waited to run
+%%    io_time, io_errors      Time in each device ioctl, read or write
+%%    retries                 Device accesses retried after an error
+%%    interrupts              GPIO edges reported
+%%    interrupts_doubled      Extra edges sent because sysfs missed one
+%%    interrupts_missed       Edges the kernel dropped from a line request
+-type stats() :: [{atom(), non_neg_integer() | histogram()}].
+
+%% Commands for the simulated devices of a port opened with
+%% {loopback, true}:
+%%    {latency, Us}              Make every device access take Us
+%%    {gpio_level, Pin, Value}   Set an input's level
+%%    {gpio_edges, Pin, PeriodUs}  Toggle an input every PeriodUs (0 stops)
+%%    {i2c_registers, Addr, Offset, Data}  Load a device's registers
+%%    {i2c_read_registers, Addr, Offset, Len}  Return a device's registers
+%%    {i2c_present, Addr, Present}  Make a device NAK (false) or answer
+%%    {spi_response, Data}       Queue what the next transfer receives
+%% They return ok except for i2c_read_registers, which returns a binary.
+-type sim_command() :: {'latency', non_neg_integer()} |
+                       {'gpio_level', non_neg_integer(), 0 | 1} |
+                       {'gpio_edges', non_neg_integer(), non_neg_integer()} |
+                       {'i2c_registers', 0..127, 0..255, binary()} |
+                       {'i2c_read_registers', 0..127, 0..255, 0..256} |
+                       {'i2c_present', 0..127, boolean()} |
+                       {'spi_response', binary()}.
 
--spec open_port([list()]) -> port().
+-export_type([port_option/0, port_handle/0, priority/0, histogram/0, stats/0, sim_command/0]).
+
+%% GPIO binary commands (see gpio_port.c)
+-define(GPIO_OP_READ, 1).
+-define(GPIO_OP_WRITE, 2).
+-define(GPIO_OP_SET_INT, 3).
+-define(GPIO_OP_READ_MASK, 4).
+-define(GPIO_OP_WRITE_MASK, 5).
+
+-define(IS_UINT(X, Bits), (is_integer(X) andalso X >= 0 andalso X < (1 bsl Bits))).
+
+-spec open_port([list()]) -> port_handle().
 open_port(Args) ->
-    open_port({spawn_executable, code:priv_dir(erlang_ale) ++ "/erlang-ale"},
-              [{packet, 2},
-              binary,
-              use_stdio,
-              exit_status,
-              {args, Args}]).
+    open_port(Args, []).
+
+%% @doc
+%% Start erlang-ale with the specified mode arguments.
+%%
+%% Options:
+%%    {packet, 2 | 4}      Size of the length prefix on messages. Use 4 for
+%%                         requests or responses that may be over 64 KiB.
+%%                         The default is 2.
+%%    {nonblocking, true}  Don't let erlang-ale block when Erlang is slow
+%%                         to read notifications. They're queued instead.
+%%    {gpiomem, true}      Read and write GPIOs on the BCM283x/BCM2711
+%%                         (Raspberry Pi) through the registers mapped by
+%%                         /dev/gpiomem. Pins that can't be mapped still
+%%                         use sysfs or the GPIO character device.
+%%    {rt_priority, P}     Run erlang-ale with SCHED_FIFO priority P
+%%                         (1-99) so it preempts the BEAM's schedulers.
+%%    {cpus, [Cpu]}        Only run erlang-ale on these CPUs. Pair this
+%%                         with rt_priority on a CPU kept free of BEAM
+%%                         schedulers for the most consistent latency.
+%%    {mlockall, true}     Lock erlang-ale's memory so it never waits
+%%                         on a page fault.
+%%    {schedule, true}     Queue I2C and SPI requests and run them by
+%%                         priority. See send_async/5.
+%%    {retries, N}         Retry I2C and SPI accesses up to N times if
+%%                         they fail with an error that's likely to be
+%%                         transient, like eio, enxio (NAK) or
+%%                         etimedout. A retried write may reach the
+%%                         device twice, so the default is 0.
+%%    {workers, true}      Run I2C and SPI accesses on a thread for
+%%                         each bus so that a slow transfer doesn't
+%%                         hold up other requests, GPIO interrupts or
+%%                         other buses on an ale_hub. Requests to one
+%%                         bus still run in order. This adds a thread
+%%                         handoff to each access, so it's off by
+%%                         default.
+%%    {loopback, true}     Replace the GPIOs, I2C adapter or SPI device
+%%                         with simulated ones. GPIO reads return the
+%%                         last value written, I2C addresses act like
+%%                         256 byte EEPROMs and SPI transfers receive
+%%                         what they send. Each module's sim/2 changes
+%%                         this (see sim_command()). See ale_bench.
+%%    {hub, Hub}           Open the mode as a handle on the ale_hub
+%%                         Hub instead of starting a process for it.
+%%                         The other options are the hub's. The
+%%                         handle closes when the caller exits.
+%%
+%% rt_priority, cpus and mlockall need privileges like CAP_SYS_NICE
+%% and CAP_IPC_LOCK. If they can't be applied, erlang-ale logs a
+%% warning and runs anyway.
+%%
+%% Other options are ignored so that callers can pass their own options
+%% through.
+%%
+%% erlang-ale doesn't exit on requests that it can't decode. They get
+%% <code>{error, badarg}</code>. Device accesses that fail return
+%% <code>{error, Reason, Errno}</code> where Errno is an atom like eio
+%% or, if it doesn't have a name, the number.
+%%
+%% Messages from a hub handle arrive as <code>{Handle, {data, Msg}}</code>
+%% just like they do from a port. Send to it with port_command/2.
+%% @end
+-spec open_port([list()], [port_option() | term()]) -> port_handle().
+open_port(Args, Options) ->
+    case proplists:get_value(hub, Options) of
+        undefined -> spawn_port(Args, Options);
+        Hub -> open_handle(Hub, Args)
+    end.
+
+open_handle(Hub, Args) ->
+    case ale_hub:open(Hub, Args) of
+        {ok, Handle} -> Handle;
+        Error -> erlang:error(Error)
+    end.
+
+spawn_port(Args, Options) ->
+    Packet = proplists:get_value(packet, Options, 2),
+    Flags = [Flag || {Option, Flag} <- [{nonblocking, "--nonblocking"},
+                                        {gpiomem, "--gpiomem"},
+                                        {mlockall, "--mlockall"},
+                                        {schedule, "--schedule"},
+                                        {workers, "--workers"}],
+                     proplists:get_value(Option, Options, false) =:= true]
+        ++ value_args(Options),
+    Mode = case proplists:get_value(loopback, Options, false) of
+               true -> ["bench"];
+               false -> []
+           end,
+    erlang:open_port({spawn_executable, code:priv_dir(erlang_ale) ++ "/erlang-ale"},
+                     [{packet, Packet},
+                     binary,
+                     use_stdio,
+                     exit_status,
+                     {args, ["--packet", integer_to_list(Packet)] ++ Flags ++ Mode ++ Args}]).
+
+value_args(Options) ->
+    Priority = case proplists:get_value(rt_priority, Options) of
+                   undefined -> [];
+                   P -> ["--rt-priority", integer_to_list(P)]
+               end,
+    Cpus = case proplists:get_value(cpus, Options) of
+               undefined -> [];
+               List -> ["--cpus", string:join([integer_to_list(C) || C <- List], ",")]
+           end,
+    Retries = case proplists:get_value(retries, Options) of
+                  undefined -> [];
+                  N -> ["--retries", integer_to_list(N)]
+              end,
+    Priority ++ Cpus ++ Retries.
+
+%% @doc
+%% Send Data to a port or hub handle. The hub's port is owned by the
+%% hub, so erlang:port_command/2 is used to send to it from the caller.
+%% @end
+-spec port_command(port_handle(), iodata()) -> 'ok'.
+port_command({ale_hub, Port, Handle}, Data) ->
+    true = erlang:port_command(Port, [<<Handle:16>>, Data]),
+    ok;
+port_command(Port, Data) ->
+    erlang:send(Port, {self(), {command, Data}}),
+    ok.
+
+%% @doc
+%% Send a request to the port without waiting for the reply. The reply
+%% comes back as a tagged reply (type 2) that should be passed to
+%% deliver_async/1. Erlang can queue up any number of these, so the port
+%% processes them back to back.
+%% @end
+-spec send_async(port_handle(), {pid(), reference()}, atom(), term()) -> 'ok'.
+send_async(Port, {_Pid, _Ref} = Tag, Command, Args) ->
+    port_command(Port, term_to_binary({async, Tag, {Command, Args}})).
+
+%% @doc
+%% Like send_async/4, but when the port was opened with
+%% <code>{schedule, true}</code>, the request runs ahead of the less
+%% urgent ones waiting for the bus. The Tag {reply, From} has
+%% deliver_async/1 reply to a gen_server call from From.
+%% @end
+-spec send_async(port_handle(), {pid(), reference()} | {'reply', {pid(), term()}},
+                 atom(), term(), priority()) -> 'ok'.
+send_async(Port, Tag, Command, Args, Priority) ->
+    Request = {priority, priority_level(Priority), {async, Tag, {Command, Args}}},
+    port_command(Port, term_to_binary(Request)).
+
+priority_level(urgent) -> 0;
+priority_level(high) -> 1;
+priority_level(normal) -> 2;
+priority_level(low) -> 3.
+
+%% @doc
+%% Send a tagged reply from the port to the process that made the
+%% request as <code>{ale_reply, Ref, Reply}</code>.
+%% @end
+-spec deliver_async(binary()) -> 'ok'.
+deliver_async(Msg) ->
+    case binary_to_term(Msg) of
+        {{reply, From}, Reply} ->
+            gen_server:reply(From, Reply),
+            ok;
+        {{Pid, Ref}, Reply} ->
+            Pid ! {ale_reply, Ref, Reply},
+            ok
+    end.
+
+%% @doc
+%% Convert a notification from a GPIO port into a list of
+%% gpio_interrupt or gpio_count messages. Batched notifications are
+%% packed as <<Timestamp:64, Pin:16, IsRising:8>> records.
+%% @end
+-spec gpio_notifications(tuple()) -> [tuple()].
+gpio_notifications({gpio_interrupts, Records}) ->
+    [ {gpio_interrupt, Pin, edge(IsRising), Timestamp}
+      || <<Timestamp:64, Pin:16, IsRising:8>> <= Records ];
+gpio_notifications({gpio_interrupt, _Pin, _Condition, _Timestamp} = Notif) ->
+    [Notif];
+gpio_notifications({gpio_count, _Pin, _Count} = Notif) ->
+    [Notif].
+
+edge(1) -> rising;
+edge(0) -> falling.
+
+%% @doc
+%% Encode a GPIO request. read, write, set_int, read_mask and
+%% write_mask are sent as binary commands so that the port doesn't
+%% have to decode a term for them. Everything else, and arguments
+%% that don't fit the binary layout, are sent as {Command, Args}.
+%% The reply is the same either way.
+%% @end
+-spec gpio_command(atom(), term()) -> binary().
+gpio_command(read, Pin) when ?IS_UINT(Pin, 16) ->
+    <<?GPIO_OP_READ, Pin:16>>;
+gpio_command(write, {Pin, Value}) when ?IS_UINT(Pin, 16), ?IS_UINT(Value, 8) ->
+    <<?GPIO_OP_WRITE, Pin:16, Value:8>>;
+gpio_command(set_int, {Pin, Condition, DebounceUs, ReportUs} = Args)
+  when ?IS_UINT(Pin, 16), ?IS_UINT(DebounceUs, 32), ?IS_UINT(ReportUs, 32) ->
+    case int_mode(Condition) of
+        undefined -> term_to_binary({set_int, Args});
+        Mode -> <<?GPIO_OP_SET_INT, Pin:16, Mode:8, DebounceUs:32, ReportUs:32>>
+    end;
+gpio_command(read_mask, Pins) when is_list(Pins) ->
+    case lists:all(fun(P) -> ?IS_UINT(P, 16) end, Pins) of
+        true -> <<?GPIO_OP_READ_MASK, << <<P:16>> || P <- Pins >>/binary>>;
+        false -> term_to_binary({read_mask, Pins})
+    end;
+gpio_command(write_mask, PinValues) when is_list(PinValues) ->
+    case lists:all(fun({P, V}) -> ?IS_UINT(P, 16) andalso ?IS_UINT(V, 8);
+                      (_) -> false
+                   end, PinValues) of
+        true -> <<?GPIO_OP_WRITE_MASK, << <<P:16, V:8>> || {P, V} <- PinValues >>/binary>>;
+        false -> term_to_binary({write_mask, PinValues})
+    end;
+gpio_command(Command, Args) ->
+    term_to_binary({Command, Args}).
+
+%% These match enum interrupt_mode in gpio.h
+int_mode(none) -> 0;
+int_mode(both) -> 1;
+int_mode(enabled) -> 1;
+int_mode(rising) -> 2;
+int_mode(falling) -> 3;
+int_mode(summarize) -> 4;
+int_mode(count) -> 5;
+int_mode(_) -> undefined.
 
+%% @doc
+%% Split the Samples binary from a start_stream notification into
+%% {Timestamp, Data} tuples. Each sample is packed as
+%% <<Timestamp:64, Data:DataSize/binary>> where Timestamp is
+%% CLOCK_MONOTONIC in nanoseconds when the sample was taken. DataSize
+%% is the total number of bytes read by the stream's template.
+%% @end
+-spec stream_samples(binary(), non_neg_integer()) -> [{non_neg_integer(), binary()}].
+stream_samples(Samples, DataSize) ->
+    [ {Timestamp, Data} || <<Timestamp:64, Data:DataSize/binary>> <= Samples ].
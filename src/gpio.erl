@@ -13,10 +13,22 @@
 %% API
 -export([start_link/2,
          start_link/3,
+         start_link/4,
          stop/1,
+         stats/1,
+         sim/2,
          write/2,
          read/1,
+         read_count/1,
          set_int/2,
+         set_int/3,
+         set_batch/3,
+         start_stream/3,
+         async_read/1,
+         async_write/2,
+         stop_stream/1,
+         waveform/3,
+         stop_waveform/1,
          register_int/1,
          register_int/2,
          unregister_int/1,
@@ -29,19 +41,28 @@
 -define(SERVER, ?MODULE).
 -define(REPLY, 0).
 -define(NOTIFICATION, 1).
+-define(TAGGED_REPLY, 2).
 
 -type pin() :: non_neg_integer().
 -type pin_direction() :: 'input' | 'output'.
 -type pin_state() :: 0 | 1.
--type interrupt_condition() :: 'enabled' | 'summarize' | 'none' | 'rising' | 'falling' | 'both'.
+-type interrupt_condition() :: 'enabled' | 'summarize' | 'none' | 'rising' | 'falling' | 'both' | 'count'.
 -type server_ref() :: atom() | {atom(), atom()} | pid().
+-type waveform_step() :: {pin_state(), DurationUs :: pos_integer()}.
+-type gpio_option() :: {'chip', string()} | ale_util:port_option().
+-type interrupt_option() :: {'debounce_us', non_neg_integer()} |
+                            {'report_interval_ms', non_neg_integer()}.
+-type edge_count() :: {Count :: non_neg_integer(), LastEdgeNs :: non_neg_integer(),
+                       MinPeriodNs :: non_neg_integer(), MaxPeriodNs :: non_neg_integer()}.
 
--export_type([interrupt_condition/0]).
+-export_type([interrupt_condition/0, gpio_option/0, interrupt_option/0, edge_count/0]).
 
 -record(state,
         { pin               :: pos_integer(),
           pids = []         :: [pid()],
-          port              :: port()
+          port              :: ale_util:port_handle(),
+          stream = none     :: none | {pid(), reference()},
+          waveform = none   :: none | pid()
         }).
 
 %%%===================================================================
@@ -50,15 +71,31 @@
 
 %% @doc
 %% Starts a process to handle a GPIO.
+%%
+%% Options:
+%%    {chip, Name}  Use the GPIO character device /dev/Name (e.g.
+%%                  "gpiochip0") instead of /sys/class/gpio. The pin
+%%                  is then the line offset on that chip.
+%%
+%% See ale_util:open_port/2 for options that affect the port.
 %% @end
+-spec start_link(term(), pin(), pin_direction(), [gpio_option()]) ->
+                    {'ok', pid()} | 'ignore' | {'error', term()}.
+start_link(ServerName, Pin, Direction, Options) ->
+  gen_server:start_link(ServerName, ?MODULE, {Pin, Direction, Options}, []).
+
 -spec start_link(term(), pin(), pin_direction()) ->
+                    {'ok', pid()} | 'ignore' | {'error', term()};
+                (pin(), pin_direction(), [gpio_option()]) ->
                     {'ok', pid()} | 'ignore' | {'error', term()}.
+start_link(Pin, Direction, Options) when is_integer(Pin) ->
+  gen_server:start_link(?MODULE, {Pin, Direction, Options}, []);
 start_link(ServerName, Pin, Direction) ->
-  gen_server:start_link(ServerName, ?MODULE, {Pin, Direction}, []).
+  start_link(ServerName, Pin, Direction, []).
 
 -spec(start_link(pin(), pin_direction()) -> {ok, pid()} | {error, reason}).
 start_link(Pin, Direction) ->
-  gen_server:start_link(?MODULE, {Pin, Direction}, []).
+  start_link(Pin, Direction, []).
 
 %% @doc
 %% Stop the process channel and release it.
@@ -67,6 +104,22 @@ start_link(Pin, Direction) ->
 stop(ServerRef) ->
     gen_server:cast(ServerRef, stop).
 
+%% @doc
+%% Return the counters and histograms that erlang-ale keeps for this
+%% process. See ale_util:stats() for the format.
+%% @end
+-spec(stats(server_ref()) -> ale_util:stats()).
+stats(ServerRef) ->
+    gen_server:call(ServerRef, stats).
+
+%% @doc
+%% Configure the simulated devices of a process started with
+%% <code>{loopback, true}</code>. See ale_util:sim_command().
+%% @end
+-spec(sim(server_ref(), ale_util:sim_command()) -> term()).
+sim(ServerRef, Command) ->
+    gen_server:call(ServerRef, {sim, Command}).
+
 %% @doc write/2 sets an output pin to the value given.
 %% @end
 -spec write(server_ref(), pin_state()) -> 'ok' | {'error', 'writing_to_input_pin'}.
@@ -87,22 +140,138 @@ read(ServerRef) ->
 %%    'rising'    Only rising transitions are notified
 %%    'both'      Both rising and falling transitions are notified
 %%    'summarize' If interrupts come too quickly, coallesce transitions
+%%    'count'     Count rising edges in erlang-ale instead of notifying
+%%                each one. See read_count/1.
 %%
 %% See register_int/1 and register_int/2 for enabling event generation.
 %% @end
 -spec set_int(server_ref(), interrupt_condition()) -> 'ok' | {'error', term()}.
-set_int(ServerRef, Condition) when Condition == enabled;
-                             Condition == summerize;
-                             Condition == both;
-                             Condition == rising;
-                             Condition == falling;
-                             Condition == none ->
-  gen_server:call(ServerRef, {set_int, Condition}).
+set_int(ServerRef, Condition) ->
+  set_int(ServerRef, Condition, []).
+
+%% @doc set_int/3 configures how interrupts are notified with options.
+%%
+%% Options:
+%%    {debounce_us, Us}  Only notify a transition once the input has
+%%                       stayed at the new level for Us microseconds.
+%%                       Bounces in between aren't sent to Erlang. The
+%%                       GPIO character device uses the kernel's
+%%                       debouncing when the chip supports it.
+%%    {report_interval_ms, Ms}
+%%                       In 'count' mode, send listeners
+%%                       <code>{gpio_count, Pin, Count}</code> every Ms
+%%                       milliseconds. Count is what read_count/1
+%%                       returns.
+%% @end
+-spec set_int(server_ref(), interrupt_condition(), [interrupt_option()]) -> 'ok' | {'error', term()}.
+set_int(ServerRef, Condition, Options) when Condition == enabled;
+                                            Condition == summarize;
+                                            Condition == both;
+                                            Condition == rising;
+                                            Condition == falling;
+                                            Condition == count;
+                                            Condition == none ->
+  DebounceUs = proplists:get_value(debounce_us, Options, 0),
+  ReportUs = proplists:get_value(report_interval_ms, Options, 0) * 1000,
+  gen_server:call(ServerRef, {set_int, Condition, DebounceUs, ReportUs}).
+
+%% @doc read_count/1 returns the edge count when in 'count' mode.
+%%
+%% The result is <code>{Count, LastEdgeNs, MinPeriodNs, MaxPeriodNs}</code>.
+%% Count is the number of rising edges since set_int/3 and LastEdgeNs is
+%% the CLOCK_MONOTONIC time of the last one. The min and max periods are
+%% the shortest and longest times between edges since the last call, or
+%% 0 if there weren't two edges. The frequency is the change in Count
+%% divided by the time between calls.
+%% @end
+-spec read_count(server_ref()) -> edge_count() | {'error', term()}.
+read_count(ServerRef) ->
+  gen_server:call(ServerRef, read_count).
+
+%% @doc set_batch/3 batches interrupt notifications.
+%%
+%% Rather than one port message per edge, erlang-ale collects up to
+%% MaxEvents edges or waits up to MaxDelayUs microseconds after the first
+%% one and then sends them all at once. Listeners still receive one
+%% <code>gpio_interrupt</code> message per edge. Pass 0 for MaxEvents
+%% to turn batching off.
+%% @end
+-spec set_batch(server_ref(), non_neg_integer(), non_neg_integer()) -> 'ok'.
+set_batch(ServerRef, MaxEvents, MaxDelayUs) ->
+  gen_server:call(ServerRef, {set_batch, MaxEvents, MaxDelayUs}).
+
+%% @doc
+%% Read the pin without waiting for the result. The caller receives
+%% <code>{ale_reply, Ref, Reply}</code> where Reply is what read/1 would
+%% have returned. Many requests can be in flight at once and their
+%% replies arrive in order.
+%% @end
+-spec async_read(server_ref()) -> reference().
+async_read(ServerRef) ->
+  Ref = make_ref(),
+  gen_server:cast(ServerRef, {async, {self(), Ref}, read}),
+  Ref.
+
+%% @doc
+%% Write the pin without waiting for the result. See async_read/1.
+%% @end
+-spec async_write(server_ref(), pin_state()) -> reference().
+async_write(ServerRef, Value) ->
+  Ref = make_ref(),
+  gen_server:cast(ServerRef, {async, {self(), Ref}, {write, Value}}),
+  Ref.
+
+%% @doc
+%% Sample the pin every PeriodUs microseconds in erlang-ale and send
+%% the values to the caller. This is much less overhead than calling
+%% read/1 from a timer and the samples are evenly spaced.
+%%
+%% The caller receives <code>{gpio_stream, Pid, Samples, Overruns}</code>
+%% after every SamplesPerBatch samples. Each sample has one byte for the
+%% pin's value. See ale_util:stream_samples/2 for the format of
+%% Samples. Overruns is the number of samples missed since the stream
+%% started.
+%% @end
+-spec start_stream(server_ref(), pos_integer(), pos_integer()) -> 'ok' | {'error', term()}.
+start_stream(ServerRef, PeriodUs, SamplesPerBatch) ->
+  gen_server:call(ServerRef, {start_stream, self(), PeriodUs, SamplesPerBatch}).
+
+%% @doc Stop streaming. Samples that were collected are sent first.
+%% @end
+-spec stop_stream(server_ref()) -> 'ok'.
+stop_stream(ServerRef) ->
+  gen_server:call(ServerRef, stop_stream).
+
+%% @doc
+%% Play a list of {Level, DurationUs} steps on an output pin. The steps
+%% are timed in erlang-ale, so Erlang isn't involved per edge. The pin
+%% is left at the last level when the waveform finishes and the caller
+%% receives <code>{gpio_waveform_done, Pid, Pin}</code>. Repeat is the
+%% number of times to play the steps or 'forever'. Starting a new
+%% waveform replaces the one that's playing.
+%%
+%% Steps are timed from a timer rather than by busy waiting, so expect
+%% tens of microseconds of jitter. Use the pwm module when the hardware
+%% can generate the signal.
+%% @end
+-spec waveform(server_ref(), [waveform_step()], pos_integer() | 'forever') ->
+                  'ok' | {'error', term()}.
+waveform(ServerRef, Steps, Repeat) ->
+  gen_server:call(ServerRef, {waveform, self(), Steps, Repeat}).
+
+%% @doc Stop the waveform that's playing.
+%% @end
+-spec stop_waveform(server_ref()) -> 'ok'.
+stop_waveform(ServerRef) ->
+  gen_server:call(ServerRef, stop_waveform).
 
 %% @doc register_int/2 registers a process to receive interrupt notifications.
 %%
 %% The requesting process will be sent a message with the structure
-%% <code>{gpio_interrupt, Pin, Condition}</code> when the interrupt triggers.
+%% <code>{gpio_interrupt, Pin, Condition, Timestamp}</code> when the
+%% interrupt triggers. Timestamp is CLOCK_MONOTONIC in nanoseconds. When
+%% using the GPIO character device, the kernel timestamps the edge.
+%% Otherwise, it's when erlang-ale was woken up.
 %% @end
 -spec register_int(server_ref(), pid() | atom()) -> 'ok' | {'error', term()}.
 register_int(ServerRef, Dest) ->
@@ -111,7 +280,10 @@ register_int(ServerRef, Dest) ->
 %% @doc register_int/2 registers the caller to receive interrupt notifications.
 %%
 %% The requesting process will be sent a message with the structure
-%% <code>{gpio_interrupt, Pin, Condition}</code> when the interrupt triggers.
+%% <code>{gpio_interrupt, Pin, Condition, Timestamp}</code> when the
+%% interrupt triggers. Timestamp is CLOCK_MONOTONIC in nanoseconds. When
+%% using the GPIO character device, the kernel timestamps the edge.
+%% Otherwise, it's when erlang-ale was woken up.
 %% @end
 -spec register_int(server_ref()) -> 'ok' | {'error', term()}.
 register_int(ServerRef) ->
@@ -142,21 +314,54 @@ unregister_int(ServerRef, Pid) ->
 %%                     {stop, Reason}
 %% @end
 %%--------------------------------------------------------------------
-init({Pin, Direction}) ->
+init({Pin, Direction, Options}) ->
     Port = ale_util:open_port(["gpio",
                                integer_to_list(Pin),
-                               atom_to_list(Direction)]),
+                               atom_to_list(Direction)]
+                              ++ chip_args(Options),
+                              Options),
     {ok, #state{pin=Pin, port=Port}}.
 
-handle_call({write, Value}, _From, #state{port=Port}=State) ->
-    Reply = call_port(Port, write, Value),
+handle_call(stats, _From, #state{port=Port}=State) ->
+    {reply, call_port(Port, stats, []), State};
+handle_call({sim, Command}, _From, #state{port=Port}=State) ->
+    {reply, call_port(Port, sim, Command), State};
+handle_call({write, Value}, _From, #state{pin=Pin, port=Port}=State) ->
+    Reply = call_port(Port, write, {Pin, Value}),
+    {reply, Reply, State};
+handle_call(read, _From, #state{pin=Pin, port=Port}=State) ->
+    Reply = call_port(Port, read, Pin),
+    {reply, Reply, State};
+handle_call({set_int, Condition, DebounceUs, ReportUs}, _From, #state{pin=Pin, port=Port}=State) ->
+    Reply = call_port(Port, set_int, {Pin, Condition, DebounceUs, ReportUs}),
     {reply, Reply, State};
-handle_call(read, _From, #state{port=Port}=State) ->
-    Reply = call_port(Port, read, []),
+handle_call(read_count, _From, #state{pin=Pin, port=Port}=State) ->
+    Reply = call_port(Port, read_count, Pin),
     {reply, Reply, State};
-handle_call({set_int, Condition}, _From, #state{port=Port}=State) ->
-    call_port(Port, set_int, Condition),
-    {reply, ok, State};
+handle_call({set_batch, MaxEvents, MaxDelayUs}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, set_batch, {MaxEvents, MaxDelayUs}),
+    {reply, Reply, State};
+handle_call({start_stream, Pid, PeriodUs, SamplesPerBatch}, _From,
+            #state{pin=Pin, port=Port}=State) ->
+    NewState = stop_streaming(State),
+    case call_port(Port, start_stream, {[Pin], PeriodUs, SamplesPerBatch}) of
+        ok ->
+            {reply, ok, NewState#state{stream={Pid, erlang:monitor(process, Pid)}}};
+        Error ->
+            {reply, Error, NewState}
+    end;
+handle_call(stop_stream, _From, State) ->
+    {reply, ok, stop_streaming(State)};
+handle_call({waveform, Pid, Steps, Repeat}, _From, #state{pin=Pin, port=Port}=State) ->
+    case call_port(Port, waveform, {Pin, Steps, repeat_count(Repeat)}) of
+        ok ->
+            {reply, ok, State#state{waveform=Pid}};
+        Error ->
+            {reply, Error, State#state{waveform=none}}
+    end;
+handle_call(stop_waveform, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, stop_waveform, []),
+    {reply, Reply, State#state{waveform=none}};
 handle_call({register_int, Pid}, _From,
             #state{pids=Pids}=State) ->
     link(Pid),
@@ -178,14 +383,25 @@ handle_call({unregister_int, Pid}, _From,
 %% @end
 %%--------------------------------------------------------------------
 
+handle_cast({async, Tag, read}, #state{pin=Pin, port=Port}=State) ->
+    ale_util:send_async(Port, Tag, read, Pin),
+    {noreply, State};
+handle_cast({async, Tag, {write, Value}}, #state{pin=Pin, port=Port}=State) ->
+    ale_util:send_async(Port, Tag, write, {Pin, Value}),
+    {noreply, State};
 handle_cast(stop, State) ->
     {stop, normal, State}.
 
+handle_info({Port, {data, <<?TAGGED_REPLY, Msg/binary>>}}, #state{port=Port}=State) ->
+    ale_util:deliver_async(Msg),
+    {noreply, State};
 handle_info({Port, {data, <<?NOTIFICATION, Msg/binary>>}},
-            #state{port=Port, pids=Pids}=State) ->
-    Notif = binary_to_term(Msg),
-    [ Pid ! Notif || Pid <- Pids ],
+            #state{port=Port}=State) ->
+    notify(binary_to_term(Msg), State),
     {noreply, State};
+handle_info({'DOWN', Ref, process, _Pid, _Reason},
+            #state{stream={_, Ref}}=State) ->
+    {noreply, stop_streaming(State)};
 handle_info({'EXIT', DeadPid, _Reason},     % a listener died
 	    #state{pids=Pids}=State) ->
     NewPids = [ Pid || Pid <- Pids, Pid /= DeadPid ],
@@ -201,9 +417,48 @@ code_change(_OldVsn, State, _Extra) ->
 %%% Internal functions
 %%%===================================================================
 
+chip_args(Options) ->
+    case lists:keyfind(chip, 1, Options) of
+        {chip, Chip} -> ["/dev/" ++ Chip];
+        false -> []
+    end.
+
+stop_streaming(#state{stream=none}=State) ->
+    State;
+stop_streaming(#state{port=Port, stream={_, Ref}}=State) ->
+    erlang:demonitor(Ref, [flush]),
+    ok = call_port(Port, stop_stream, []),
+    %% The last samples were sent before the reply
+    forward_notifications(State),
+    State#state{stream=none}.
+
+forward_notifications(#state{port=Port}=State) ->
+    receive
+        {Port, {data, <<?NOTIFICATION, Msg/binary>>}} ->
+            notify(binary_to_term(Msg), State),
+            forward_notifications(State)
+    after 0 ->
+            ok
+    end.
+
+notify({stream, Samples, Overruns}, #state{stream={Pid, _}}) ->
+    Pid ! {gpio_stream, self(), Samples, Overruns};
+notify({stream, _Samples, _Overruns}, _State) ->
+    ok;
+notify({waveform_done, Pin}, #state{waveform=Pid}) when is_pid(Pid) ->
+    Pid ! {gpio_waveform_done, self(), Pin};
+notify({waveform_done, _Pin}, _State) ->
+    ok;
+notify(Notif, #state{pids=Pids}) ->
+    [ Pid ! N || N <- ale_util:gpio_notifications(Notif), Pid <- Pids ],
+    ok.
+
+%% The port plays the steps forever when the count is 0
+repeat_count(forever) -> 0;
+repeat_count(Count) when is_integer(Count), Count > 0 -> Count.
+
 call_port(Port, Command, Args) ->
-    Message = {Command, Args},
-    erlang:send(Port, {self(), {command, term_to_binary(Message)}}),
+    ale_util:port_command(Port, ale_util:gpio_command(Command, Args)),
     receive
         {Port, {data, <<?REPLY, Response/binary>>}} -> binary_to_term(Response)
     end.
@@ -0,0 +1,484 @@
+%%% @author Frank Hunleth <fhunleth@troodon-software.com>
+%%% @copyright (C) 2015, Frank Hunleth
+%%% @doc
+%%% This is the implementation of the GPIO bank interface module.
+%%%
+%%% A GPIO bank is one erlang-ale process that serves many pins. Pins
+%%% are opened and closed at runtime and share a single port, so a
+%%% board with dozens of GPIOs doesn't need dozens of OS processes.
+%%% @end
+
+-module(gpio_bank).
+
+-behaviour(gen_server).
+
+%% API
+-export([start_link/0,
+         start_link/1,
+         start_link/2,
+         stop/1,
+         stats/1,
+         sim/2,
+         open/3,
+         init_pins/2,
+         close/2,
+         write/3,
+         read/2,
+         read_count/2,
+         write_mask/2,
+         write_mask/3,
+         read_mask/2,
+         set_int/3,
+         set_int/4,
+         set_batch/3,
+         start_stream/4,
+         async_read/2,
+         async_write/3,
+         async_read_mask/2,
+         async_write_mask/2,
+         stop_stream/1,
+         waveform/4,
+         stop_waveform/1,
+         register_int/2,
+         register_int/3,
+         unregister_int/2,
+         unregister_int/3]).
+
+%% gen_server callbacks
+-export([init/1, handle_call/3, handle_cast/2, handle_info/2,
+         terminate/2, code_change/3]).
+
+-define(REPLY, 0).
+-define(NOTIFICATION, 1).
+-define(TAGGED_REPLY, 2).
+
+-type pin() :: non_neg_integer().
+-type pin_direction() :: 'input' | 'output'.
+-type pin_state() :: 0 | 1.
+-type server_ref() :: atom() | {atom(), atom()} | pid().
+-type waveform_step() :: {pin_state(), DurationUs :: pos_integer()}.
+
+-record(state,
+        { listeners = []    :: [{pin(), pid()}],
+          port              :: ale_util:port_handle(),
+          stream = none     :: none | {pid(), reference()},
+          waveform = none   :: none | pid()
+        }).
+
+%%%===================================================================
+%%% API
+%%%===================================================================
+
+%% @doc
+%% Starts a process to handle a bank of GPIOs.
+%%
+%% See gpio:start_link/4 for the options.
+%% @end
+-spec start_link(term(), [gpio:gpio_option()]) ->
+                    {'ok', pid()} | 'ignore' | {'error', term()}.
+start_link(ServerName, Options) ->
+  gen_server:start_link(ServerName, ?MODULE, Options, []).
+
+-spec start_link([gpio:gpio_option()]) ->
+                    {'ok', pid()} | 'ignore' | {'error', term()}.
+start_link(Options) ->
+  gen_server:start_link(?MODULE, Options, []).
+
+-spec start_link() -> {'ok', pid()} | 'ignore' | {'error', term()}.
+start_link() ->
+  start_link([]).
+
+%% @doc
+%% Stop the process and release all of its pins.
+%% @end
+-spec stop(server_ref()) -> ok.
+stop(ServerRef) ->
+    gen_server:cast(ServerRef, stop).
+
+%% @doc
+%% Return the counters and histograms that erlang-ale keeps for this
+%% process. See ale_util:stats() for the format.
+%% @end
+-spec(stats(server_ref()) -> ale_util:stats()).
+stats(ServerRef) ->
+    gen_server:call(ServerRef, stats).
+
+%% @doc
+%% Configure the simulated devices of a process started with
+%% <code>{loopback, true}</code>. See ale_util:sim_command().
+%% @end
+-spec(sim(server_ref(), ale_util:sim_command()) -> term()).
+sim(ServerRef, Command) ->
+    gen_server:call(ServerRef, {sim, Command}).
+
+%% @doc open/3 exports and configures a pin or list of pins so that they
+%% can be used.
+%%
+%% When using the GPIO character device, a list of pins is requested
+%% from the kernel together so that read_mask/2 and write_mask/2 can
+%% access them all at the same time.
+%% @end
+-spec open(server_ref(), pin() | [pin()], pin_direction()) -> 'ok' | {'error', term()}.
+open(ServerRef, Pins, Direction) when Direction == input; Direction == output ->
+  gen_server:call(ServerRef, {open, Pins, Direction}).
+
+%% @doc init_pins/2 opens a list of pins with their own directions in one
+%% call. With sysfs, every pin is exported before any is configured, so
+%% bringing up many pins at boot doesn't wait on each one in turn. Like
+%% open/3, either every pin is opened or none are.
+%% @end
+-spec init_pins(server_ref(), [{pin(), pin_direction()}]) -> 'ok' | {'error', term()}.
+init_pins(ServerRef, Pins) ->
+  gen_server:call(ServerRef, {init_pins, Pins}).
+
+%% @doc close/2 releases a pin. Its interrupt listeners are dropped.
+%% @end
+-spec close(server_ref(), pin()) -> 'ok' | {'error', term()}.
+close(ServerRef, Pin) ->
+  gen_server:call(ServerRef, {close, Pin}).
+
+%% @doc write/3 sets an output pin to the value given.
+%% @end
+-spec write(server_ref(), pin(), pin_state()) -> 'ok' | {'error', term()}.
+write(ServerRef, Pin, Value) ->
+  gen_server:call(ServerRef, {write, Pin, Value}).
+
+%% @doc read/2 returns the value of a pin.
+%% @end
+-spec read(server_ref(), pin()) -> pin_state() | {'error', term()}.
+read(ServerRef, Pin) ->
+  gen_server:call(ServerRef, {read, Pin}).
+
+%% @doc write_mask/2 sets several output pins in one request.
+%% @end
+-spec write_mask(server_ref(), [{pin(), pin_state()}]) -> 'ok' | {'error', term()}.
+write_mask(ServerRef, PinValues) ->
+  gen_server:call(ServerRef, {write_mask, PinValues}).
+
+%% @doc write_mask/3 sets the pins whose bits are set in Mask to the
+%% corresponding bits in Values. Bit N is pin N.
+%% @end
+-spec write_mask(server_ref(), non_neg_integer(), non_neg_integer()) -> 'ok' | {'error', term()}.
+write_mask(ServerRef, Mask, Values) ->
+  write_mask(ServerRef, [ {Pin, (Values bsr Pin) band 1} || Pin <- mask_to_pins(Mask) ]).
+
+%% @doc read_mask/2 samples several pins in one request.
+%%
+%% If passed a list of pins, the values are returned in the same order.
+%% If passed a bitmask, the values are returned as a bitmask.
+%% @end
+-spec read_mask(server_ref(), [pin()] | non_neg_integer()) ->
+                       [pin_state()] | non_neg_integer() | {'error', term()}.
+read_mask(ServerRef, Pins) when is_list(Pins) ->
+  gen_server:call(ServerRef, {read_mask, Pins});
+read_mask(ServerRef, Mask) when is_integer(Mask) ->
+  Pins = mask_to_pins(Mask),
+  case read_mask(ServerRef, Pins) of
+      Values when is_list(Values) ->
+          lists:foldl(fun({Pin, Value}, Acc) -> Acc bor (Value bsl Pin) end,
+                      0, lists:zip(Pins, Values));
+      Error ->
+          Error
+  end.
+
+%% @doc set_int/3 configures how interrupts are notified on a pin.
+%%
+%% See gpio:set_int/2 for the supported conditions.
+%% @end
+-spec set_int(server_ref(), pin(), gpio:interrupt_condition()) -> 'ok' | {'error', term()}.
+set_int(ServerRef, Pin, Condition) ->
+  set_int(ServerRef, Pin, Condition, []).
+
+%% @doc set_int/4 configures interrupts on a pin with options.
+%%
+%% See gpio:set_int/3 for the options.
+%% @end
+-spec set_int(server_ref(), pin(), gpio:interrupt_condition(), [gpio:interrupt_option()]) ->
+                 'ok' | {'error', term()}.
+set_int(ServerRef, Pin, Condition, Options) ->
+  DebounceUs = proplists:get_value(debounce_us, Options, 0),
+  ReportUs = proplists:get_value(report_interval_ms, Options, 0) * 1000,
+  gen_server:call(ServerRef, {set_int, Pin, Condition, DebounceUs, ReportUs}).
+
+%% @doc read_count/2 returns the edge count of a pin in 'count' mode.
+%%
+%% See gpio:read_count/1.
+%% @end
+-spec read_count(server_ref(), pin()) -> gpio:edge_count() | {'error', term()}.
+read_count(ServerRef, Pin) ->
+  gen_server:call(ServerRef, {read_count, Pin}).
+
+%% @doc set_batch/3 batches interrupt notifications for all pins.
+%%
+%% See gpio:set_batch/3.
+%% @end
+-spec set_batch(server_ref(), non_neg_integer(), non_neg_integer()) -> 'ok'.
+set_batch(ServerRef, MaxEvents, MaxDelayUs) ->
+  gen_server:call(ServerRef, {set_batch, MaxEvents, MaxDelayUs}).
+
+%% @doc async_read/2 reads a pin without waiting for the result.
+%%
+%% The caller receives <code>{ale_reply, Ref, Reply}</code> where Reply
+%% is what read/2 would have returned. Replies arrive in order.
+%% @end
+-spec async_read(server_ref(), pin()) -> reference().
+async_read(ServerRef, Pin) ->
+  async(ServerRef, read, Pin).
+
+%% @doc async_write/3 writes a pin without waiting for the result.
+%% @end
+-spec async_write(server_ref(), pin(), pin_state()) -> reference().
+async_write(ServerRef, Pin, Value) ->
+  async(ServerRef, write, {Pin, Value}).
+
+%% @doc async_read_mask/2 reads a list of pins without waiting for the
+%% result. The reply is a list of values.
+%% @end
+-spec async_read_mask(server_ref(), [pin()]) -> reference().
+async_read_mask(ServerRef, Pins) ->
+  async(ServerRef, read_mask, Pins).
+
+%% @doc async_write_mask/2 writes a list of {Pin, Value} without waiting
+%% for the result.
+%% @end
+-spec async_write_mask(server_ref(), [{pin(), pin_state()}]) -> reference().
+async_write_mask(ServerRef, PinValues) ->
+  async(ServerRef, write_mask, PinValues).
+
+%% @doc start_stream/4 samples pins every PeriodUs microseconds.
+%%
+%% Each sample has one byte per pin in the order of Pins. All of the
+%% pins need to be open. See gpio:start_stream/3.
+%% @end
+-spec start_stream(server_ref(), [pin()], pos_integer(), pos_integer()) -> 'ok' | {'error', term()}.
+start_stream(ServerRef, Pins, PeriodUs, SamplesPerBatch) ->
+  gen_server:call(ServerRef, {start_stream, self(), Pins, PeriodUs, SamplesPerBatch}).
+
+%% @doc stop_stream/1 stops streaming. Samples that were collected are
+%% sent first.
+%% @end
+-spec stop_stream(server_ref()) -> 'ok'.
+stop_stream(ServerRef) ->
+  gen_server:call(ServerRef, stop_stream).
+
+%% @doc waveform/4 plays a list of steps on an open output.
+%%
+%% See gpio:waveform/3. Only one waveform plays on a bank at a time.
+%% @end
+-spec waveform(server_ref(), pin(), [waveform_step()], pos_integer() | 'forever') ->
+                  'ok' | {'error', term()}.
+waveform(ServerRef, Pin, Steps, Repeat) ->
+  gen_server:call(ServerRef, {waveform, self(), Pin, Steps, Repeat}).
+
+%% @doc stop_waveform/1 stops the waveform that's playing.
+%% @end
+-spec stop_waveform(server_ref()) -> 'ok'.
+stop_waveform(ServerRef) ->
+  gen_server:call(ServerRef, stop_waveform).
+
+%% @doc register_int/3 registers a process to receive interrupt notifications
+%% for a pin.
+%%
+%% The process will be sent a message with the structure
+%% <code>{gpio_interrupt, Pin, Condition, Timestamp}</code> when the
+%% interrupt triggers.
+%% @end
+-spec register_int(server_ref(), pin(), pid() | atom()) -> 'ok' | {'error', term()}.
+register_int(ServerRef, Pin, Dest) ->
+  gen_server:call(ServerRef, {register_int, Pin, Dest}).
+
+%% @doc register_int/2 registers the caller to receive interrupt notifications
+%% for a pin.
+%% @end
+-spec register_int(server_ref(), pin()) -> 'ok' | {'error', term()}.
+register_int(ServerRef, Pin) ->
+  register_int(ServerRef, Pin, self()).
+
+%% @doc unregister_int/2 unregisters the caller from receiving interrupt
+%% notifications for a pin.
+%% @end
+unregister_int(ServerRef, Pin) ->
+  unregister_int(ServerRef, Pin, self()).
+
+%% @doc unregister_int/3 unregisters a process from receiving interrupt
+%% notifications for a pin.
+%% @end
+unregister_int(ServerRef, Pin, Pid) ->
+  gen_server:call(ServerRef, {unregister_int, Pin, Pid}).
+
+%%%===================================================================
+%%% gen_server callbacks
+%%%===================================================================
+
+%%--------------------------------------------------------------------
+%% @private
+%% @doc
+%% Initializes the server
+%%
+%% @spec init(Args) -> {ok, State} |
+%%                     {ok, State, Timeout} |
+%%                     ignore |
+%%                     {stop, Reason}
+%% @end
+%%--------------------------------------------------------------------
+init(Options) ->
+    Args = case lists:keyfind(chip, 1, Options) of
+               {chip, Chip} -> ["/dev/" ++ Chip];
+               false -> []
+           end,
+    Port = ale_util:open_port(["gpio_bank" | Args], Options),
+    {ok, #state{port=Port}}.
+
+handle_call(stats, _From, #state{port=Port}=State) ->
+    {reply, call_port(Port, stats, []), State};
+handle_call({sim, Command}, _From, #state{port=Port}=State) ->
+    {reply, call_port(Port, sim, Command), State};
+handle_call({open, Pins, Direction}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, open, {Pins, Direction}),
+    {reply, Reply, State};
+handle_call({init_pins, Pins}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, init_pins, Pins),
+    {reply, Reply, State};
+handle_call({close, Pin}, _From,
+            #state{port=Port, listeners=Listeners}=State) ->
+    Reply = call_port(Port, close, Pin),
+    NewListeners = [ L || {P, _} = L <- Listeners, P /= Pin ],
+    {reply, Reply, State#state{listeners=NewListeners}};
+handle_call({write, Pin, Value}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, write, {Pin, Value}),
+    {reply, Reply, State};
+handle_call({read, Pin}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, read, Pin),
+    {reply, Reply, State};
+handle_call({write_mask, PinValues}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, write_mask, PinValues),
+    {reply, Reply, State};
+handle_call({read_mask, Pins}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, read_mask, Pins),
+    {reply, Reply, State};
+handle_call({set_int, Pin, Condition, DebounceUs, ReportUs}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, set_int, {Pin, Condition, DebounceUs, ReportUs}),
+    {reply, Reply, State};
+handle_call({read_count, Pin}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, read_count, Pin),
+    {reply, Reply, State};
+handle_call({set_batch, MaxEvents, MaxDelayUs}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, set_batch, {MaxEvents, MaxDelayUs}),
+    {reply, Reply, State};
+handle_call({start_stream, Pid, Pins, PeriodUs, SamplesPerBatch}, _From,
+            #state{port=Port}=State) ->
+    NewState = stop_streaming(State),
+    case call_port(Port, start_stream, {Pins, PeriodUs, SamplesPerBatch}) of
+        ok ->
+            {reply, ok, NewState#state{stream={Pid, erlang:monitor(process, Pid)}}};
+        Error ->
+            {reply, Error, NewState}
+    end;
+handle_call(stop_stream, _From, State) ->
+    {reply, ok, stop_streaming(State)};
+handle_call({waveform, Pid, Pin, Steps, Repeat}, _From, #state{port=Port}=State) ->
+    case call_port(Port, waveform, {Pin, Steps, repeat_count(Repeat)}) of
+        ok ->
+            {reply, ok, State#state{waveform=Pid}};
+        Error ->
+            {reply, Error, State#state{waveform=none}}
+    end;
+handle_call(stop_waveform, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, stop_waveform, []),
+    {reply, Reply, State#state{waveform=none}};
+handle_call({register_int, Pin, Pid}, _From,
+            #state{listeners=Listeners}=State) ->
+    link(Pid),
+    {reply, ok, State#state{listeners=[{Pin, Pid}|Listeners]}};
+handle_call({unregister_int, Pin, Pid}, _From,
+            #state{listeners=Listeners}=State) ->
+    NewListeners = lists:delete({Pin, Pid}, Listeners),
+    {reply, ok, State#state{listeners=NewListeners}}.
+
+handle_cast({async, Tag, Command, Args}, #state{port=Port}=State) ->
+    ale_util:send_async(Port, Tag, Command, Args),
+    {noreply, State};
+handle_cast(stop, State) ->
+    {stop, normal, State}.
+
+handle_info({Port, {data, <<?TAGGED_REPLY, Msg/binary>>}}, #state{port=Port}=State) ->
+    ale_util:deliver_async(Msg),
+    {noreply, State};
+handle_info({Port, {data, <<?NOTIFICATION, Msg/binary>>}},
+            #state{port=Port}=State) ->
+    notify(binary_to_term(Msg), State),
+    {noreply, State};
+handle_info({'DOWN', Ref, process, _Pid, _Reason},
+            #state{stream={_, Ref}}=State) ->
+    {noreply, stop_streaming(State)};
+handle_info({'EXIT', DeadPid, _Reason},     % a listener died
+	    #state{listeners=Listeners}=State) ->
+    NewListeners = [ L || {_, Pid} = L <- Listeners, Pid /= DeadPid ],
+    {noreply, State#state{listeners=NewListeners}}.
+
+terminate(_Reason, _State) ->
+  ok.
+
+code_change(_OldVsn, State, _Extra) ->
+  {ok, State}.
+
+%%%===================================================================
+%%% Internal functions
+%%%===================================================================
+
+async(ServerRef, Command, Args) ->
+    Ref = make_ref(),
+    gen_server:cast(ServerRef, {async, {self(), Ref}, Command, Args}),
+    Ref.
+
+mask_to_pins(Mask) ->
+    mask_to_pins(Mask, 0, []).
+
+mask_to_pins(0, _Pin, Acc) ->
+    lists:reverse(Acc);
+mask_to_pins(Mask, Pin, Acc) when Mask band 1 == 1 ->
+    mask_to_pins(Mask bsr 1, Pin + 1, [Pin | Acc]);
+mask_to_pins(Mask, Pin, Acc) ->
+    mask_to_pins(Mask bsr 1, Pin + 1, Acc).
+
+stop_streaming(#state{stream=none}=State) ->
+    State;
+stop_streaming(#state{port=Port, stream={_, Ref}}=State) ->
+    erlang:demonitor(Ref, [flush]),
+    ok = call_port(Port, stop_stream, []),
+    %% The last samples were sent before the reply
+    forward_notifications(State),
+    State#state{stream=none}.
+
+forward_notifications(#state{port=Port}=State) ->
+    receive
+        {Port, {data, <<?NOTIFICATION, Msg/binary>>}} ->
+            notify(binary_to_term(Msg), State),
+            forward_notifications(State)
+    after 0 ->
+            ok
+    end.
+
+notify({stream, Samples, Overruns}, #state{stream={Pid, _}}) ->
+    Pid ! {gpio_stream, self(), Samples, Overruns};
+notify({stream, _Samples, _Overruns}, _State) ->
+    ok;
+notify({waveform_done, Pin}, #state{waveform=Pid}) when is_pid(Pid) ->
+    Pid ! {gpio_waveform_done, self(), Pin};
+notify({waveform_done, _Pin}, _State) ->
+    ok;
+notify(Notif, #state{listeners=Listeners}) ->
+    %% The pin is the second element of every GPIO notification
+    [ Pid ! N || N <- ale_util:gpio_notifications(Notif),
+                 {P, Pid} <- Listeners, P == element(2, N) ],
+    ok.
+
+%% The port plays the steps forever when the count is 0
+repeat_count(forever) -> 0;
+repeat_count(Count) when is_integer(Count), Count > 0 -> Count.
+
+call_port(Port, Command, Args) ->
+    ale_util:port_command(Port, ale_util:gpio_command(Command, Args)),
+    receive
+        {Port, {data, <<?REPLY, Response/binary>>}} -> binary_to_term(Response)
+    end.
@@ -0,0 +1,70 @@
+%%% @author Frank Hunleth <fhunleth@troodon-software.com>
+%%% @copyright (C) 2015, Frank Hunleth
+%%% @doc
+%%% Optional NIF for reading and writing GPIOs from the calling process.
+%%%
+%%% A call to gpio:read/1 or gpio:write/2 goes through a gen_server and
+%%% a port. That is safe, but it takes tens of microseconds. This module
+%%% reads and writes the pin directly from the caller instead. A bug in
+%%% the NIF can take down the VM, so the port based gpio module is still
+%%% the default. Interrupts, batching and streaming are only available
+%%% through the port.
+%%% @end
+
+-module(gpio_nif).
+
+-on_load(init/0).
+
+%% API
+-export([enable_gpiomem/0,
+         open/2,
+         open/3,
+         read/1,
+         write/2,
+         close/1]).
+
+-type pin() :: non_neg_integer().
+-type pin_direction() :: 'input' | 'output'.
+-type pin_state() :: 0 | 1.
+-opaque handle() :: reference().
+
+-export_type([handle/0]).
+
+init() ->
+    erlang:load_nif(code:priv_dir(erlang_ale) ++ "/gpio_nif", 0).
+
+%% @doc
+%% Use the registers mapped by /dev/gpiomem for pins opened after this
+%% call on a BCM283x/BCM2711 (Raspberry Pi). Other pins, and all pins if
+%% this fails, keep using sysfs or the GPIO character device.
+%% @end
+-spec enable_gpiomem() -> 'ok' | {'error', 'not_available'}.
+enable_gpiomem() ->
+    erlang:nif_error(nif_not_loaded).
+
+%% @doc
+%% Open a GPIO through /sys/class/gpio. The pin is closed when the
+%% handle is garbage collected or close/1 is called.
+%% @end
+-spec open(pin(), pin_direction()) -> {'ok', handle()} | {'error', term()}.
+open(_Pin, _Direction) ->
+    erlang:nif_error(nif_not_loaded).
+
+%% @doc
+%% Open a line on a GPIO character device like "/dev/gpiochip0".
+%% @end
+-spec open(string(), pin(), pin_direction()) -> {'ok', handle()} | {'error', term()}.
+open(_ChipPath, _Offset, _Direction) ->
+    erlang:nif_error(nif_not_loaded).
+
+-spec read(handle()) -> pin_state() | {'error', term()}.
+read(_Handle) ->
+    erlang:nif_error(nif_not_loaded).
+
+-spec write(handle(), pin_state()) -> 'ok' | {'error', term()}.
+write(_Handle, _Value) ->
+    erlang:nif_error(nif_not_loaded).
+
+-spec close(handle()) -> 'ok'.
+close(_Handle) ->
+    erlang:nif_error(nif_not_loaded).
@@ -11,21 +11,46 @@
 -behaviour(gen_server).
 
 %% API
--export([start_link/2, start_link/3, stop/1]).
+-export([start_link/1, start_link/2, start_link/3, start_link/4, stop/1, stats/1, sim/2]).
 -export([write/2, read/2, write_read/3]).
+-export([write/3, read/3, write_read/4, transaction/2, transaction/3, transaction/4, program/2]).
+-export([start_stream/4, stop_stream/1]).
+-export([async_transaction/2, async_transaction/3, async_transaction/4, async_program/2]).
 
 %% gen_server callbacks
 -export([init/1, handle_call/3, handle_cast/2, handle_info/2,
 	 terminate/2, code_change/3]).
 
 -define(SERVER, ?MODULE).
+-define(REPLY, 0).
+-define(NOTIFICATION, 1).
+-define(TAGGED_REPLY, 2).
+
+%% Binary commands (see i2c_port.c)
+-define(OP_READ, 1).
+-define(OP_WRITE, 2).
+-define(OP_WRRD, 3).
 
 -type addr() :: integer(). %% fix to be 2-127
+-type message() :: {'write', addr(), data()} | {'read', addr(), len()}.
 -type data() :: binary().
+-type transaction_option() :: {'coalesce', boolean()}.
+-type step() :: {'write', addr(), data()} |
+                {'read', addr(), len()} |
+                {'write_read', addr(), data(), len()} |
+                {'delay_us', non_neg_integer()} |
+                {'poll', addr(), data(), Mask :: binary(), Value :: binary(),
+                 TimeoutUs :: non_neg_integer()} |
+                {'loop', non_neg_integer(), [step()]}.
 -type len() :: integer().
 -type devname() :: string().
 -type server_ref() :: atom() | {atom(), atom()} | pid().
 
+-record(state,
+        { port              :: ale_util:port_handle(),
+          stream = none     :: none | {pid(), reference()}
+        }).
+
 %%%===================================================================
 %%% API
 %%%===================================================================
@@ -33,14 +58,37 @@
 %% @doc
 %% Starts the process with the channel name and Initialize the devname device.
 %% You can identify the device by a channel name. Each channel drive a devname device.
+%%
+%% Pass 'bus' as the address to have one process serve every device on the
+%% bus. Use the functions that take an address or transaction/2 with it.
+%%
+%% See ale_util:open_port/2 for Options that affect the port, such as
+%% real-time scheduling.
+%%
+%% To have one process own a bus that many drivers share, register a
+%% 'bus' process and pass <code>{schedule, true}</code>. Drivers then
+%% call transaction/3 or async_transaction/3 with a priority. Their
+%% requests are queued in erlang-ale and the most urgent runs next.
+%% Transactions to the same device that are queued back to back and
+%% were made with <code>{coalesce, true}</code> run in one I2C_RDWR
+%% ioctl. See transaction/4.
 %% @end
--spec(start_link(tuple(), devname(), addr()) -> {ok, pid()} | {error, reason}).
+-spec(start_link(tuple(), devname(), addr() | 'bus', [ale_util:port_option()]) ->
+             {ok, pid()} | {error, reason}).
+start_link(ServerName, Devname, Address, Options) ->
+    gen_server:start_link(ServerName, ?MODULE, {Devname, Address, Options}, []).
+
+-spec(start_link(tuple(), devname(), addr() | 'bus') -> {ok, pid()} | {error, reason}).
 start_link(ServerName, Devname, Address) ->
-    gen_server:start_link(ServerName, ?MODULE, {Devname, Address}, []).
+    start_link(ServerName, Devname, Address, []).
 
--spec(start_link(devname(), addr()) -> {ok, pid()} | {error, reason}).
+-spec(start_link(devname(), addr() | 'bus') -> {ok, pid()} | {error, reason}).
 start_link(Devname, Address) ->
-    gen_server:start_link(?MODULE, {Devname, Address}, []).
+    gen_server:start_link(?MODULE, {Devname, Address, []}, []).
+
+-spec(start_link(devname()) -> {ok, pid()} | {error, reason}).
+start_link(Devname) ->
+    start_link(Devname, bus).
 
 %% @doc
 %% Stop the process channel and release it.
@@ -50,14 +98,30 @@ stop(ServerRef) ->
     gen_server:cast(ServerRef, stop).
 
 %% @doc
-%% Write data into an i2c slave device.
+%% Return the counters and histograms that erlang-ale keeps for this
+%% process. See ale_util:stats() for the format.
+%% @end
+-spec(stats(server_ref()) -> ale_util:stats()).
+stats(ServerRef) ->
+    gen_server:call(ServerRef, stats).
+
+%% @doc
+%% Configure the simulated devices of a process started with
+%% <code>{loopback, true}</code>. See ale_util:sim_command().
+%% @end
+-spec(sim(server_ref(), ale_util:sim_command()) -> term()).
+sim(ServerRef, Command) ->
+    gen_server:call(ServerRef, {sim, Command}).
+
+%% @doc
+%% Write data into an i2c slave device. Up to 8192 bytes may be written.
 %% @end
 -spec(write(server_ref(), data()) -> ok | {error, reason}).
 write(ServerRef, Data) ->
     gen_server:call(ServerRef, {write, Data}).
 
 %% @doc
-%% Read data from an i2c slave device.
+%% Read data from an i2c slave device. Up to 8192 bytes may be read.
 %% @end
 -spec(read(server_ref(), len()) -> {data()} | {error, reason}).
 read(ServerRef, Len) ->
@@ -67,6 +131,167 @@ read(ServerRef, Len) ->
 write_read(ServerRef, Data, Len) ->
     gen_server:call(ServerRef, {wrrd, Data, Len}).
 
+%% @doc
+%% Write data to the device at the specified address.
+%% @end
+-spec(write(server_ref(), addr(), data()) -> ok | {error, term()}).
+write(ServerRef, Address, Data) ->
+    case transaction(ServerRef, [{write, Address, Data}]) of
+        [] -> ok;
+        Error -> Error
+    end.
+
+%% @doc
+%% Read data from the device at the specified address.
+%% @end
+-spec(read(server_ref(), addr(), len()) -> data() | {error, term()}).
+read(ServerRef, Address, Len) ->
+    case transaction(ServerRef, [{read, Address, Len}]) of
+        [Data] -> Data;
+        Error -> Error
+    end.
+
+%% @doc
+%% Write data to and then read data from the device at the specified
+%% address without releasing the bus in between.
+%% @end
+-spec(write_read(server_ref(), addr(), data(), len()) -> data() | {error, term()}).
+write_read(ServerRef, Address, Data, Len) ->
+    case transaction(ServerRef, [{write, Address, Data}, {read, Address, Len}]) of
+        [Result] -> Result;
+        Error -> Error
+    end.
+
+%% @doc
+%% Run a list of reads and writes with one I2C_RDWR ioctl. Each message
+%% has its own address, so multi-device sequences are atomic. Up to 42
+%% messages of up to 8192 bytes each are supported. A list with the data
+%% from each read is returned.
+%% @end
+-spec(transaction(server_ref(), [message()]) -> [data()] | {error, term()}).
+transaction(ServerRef, Messages) ->
+    gen_server:call(ServerRef, {transaction, Messages}).
+
+%% @doc
+%% Run a transaction with a priority. The process serving the bus keeps
+%% taking requests while this one waits, so callers with higher
+%% priorities can go first. The priority only matters if the process
+%% was started with the <code>{schedule, true}</code> option.
+%% @end
+-spec(transaction(server_ref(), [message()], ale_util:priority()) -> [data()] | {error, term()}).
+transaction(ServerRef, Messages, Priority) ->
+    gen_server:call(ServerRef, {transaction, Messages, Priority}).
+
+%% @doc
+%% Run a transaction with a priority and options. With
+%% <code>{coalesce, true}</code>, it may run in the same I2C_RDWR ioctl
+%% as other coalesced transactions to the same device that are queued
+%% next to it. They then lose the STOP between them and get a repeated
+%% START instead, so don't coalesce requests to devices that act on a
+%% STOP. For example, an EEPROM only starts its write cycle on one. If
+%% any message fails, every coalesced request gets the error.
+%% @end
+-spec(transaction(server_ref(), [message()], ale_util:priority(), [transaction_option()]) ->
+             [data()] | {error, term()}).
+transaction(ServerRef, Messages, Priority, Options) ->
+    gen_server:call(ServerRef, {transaction, {Messages, Options}, Priority}).
+
+%% @doc
+%% Run a sequence of steps in erlang-ale and return the data from every
+%% read and write_read in one list. This turns a multi-step device init
+%% or readout into one call. Unlike transaction/2, each step that
+%% accesses the bus is its own I2C transfer. The steps are:
+%%
+%%    {write, Addr, Data}
+%%    {read, Addr, Len}
+%%    {write_read, Addr, Data, Len}
+%%    {delay_us, Us}
+%%    {poll, Addr, Data, Mask, Value, TimeoutUs}
+%%       Write Data and read byte_size(Mask) bytes until the bytes
+%%       anded with Mask equal Value. Data may be <<>>.
+%%    {loop, Count, Steps}
+%%
+%% The program returns {error, transfer_failed} or {error, poll_timeout}
+%% if a step fails. Nothing else runs on the bus while it runs.
+%% The delays and poll timeouts, counting every time a loop runs them,
+%% can add up to at most 1 second, and a program can run at most 65536
+%% steps and loop iterations in total. Longer programs get
+%% {error, badarg}. Unless the process was started with
+%% <code>{workers, true}</code>, nothing else it serves is handled
+%% while a program waits.
+%%
+%% For example, to start a conversion, wait for bit 7 of register 0 to
+%% clear and then read 6 bytes:
+%%    i2c:program(Bus, [{write, 16#40, <<16#00, 16#80>>},
+%%                      {poll, 16#40, <<16#00>>, <<16#80>>, <<0>>, 100000},
+%%                      {write_read, 16#40, <<16#01>>, 6}])
+%% @end
+-spec(program(server_ref(), [step()]) -> [data()] | {error, term()}).
+program(ServerRef, Steps) ->
+    gen_server:call(ServerRef, {program, Steps}).
+
+%% @doc
+%% Queue a transaction without waiting for it to finish. The caller
+%% receives <code>{ale_reply, Ref, Reply}</code> where Reply is what
+%% transaction/2 would have returned. Many requests can be in flight at
+%% once and their replies arrive in order.
+%% @end
+-spec(async_transaction(server_ref(), [message()]) -> reference()).
+async_transaction(ServerRef, Messages) ->
+    async(ServerRef, transaction, Messages).
+
+%% @doc
+%% Queue a transaction with a priority. See async_transaction/2 and
+%% transaction/3. Replies to requests with different priorities may
+%% arrive out of order.
+%% @end
+-spec(async_transaction(server_ref(), [message()], ale_util:priority()) -> reference()).
+async_transaction(ServerRef, Messages, Priority) ->
+    Ref = make_ref(),
+    gen_server:cast(ServerRef, {async, {self(), Ref}, transaction, Messages, Priority}),
+    Ref.
+
+%% @doc
+%% Queue a transaction with a priority and options. See
+%% async_transaction/3 and transaction/4.
+%% @end
+-spec(async_transaction(server_ref(), [message()], ale_util:priority(), [transaction_option()]) ->
+             reference()).
+async_transaction(ServerRef, Messages, Priority, Options) ->
+    Ref = make_ref(),
+    gen_server:cast(ServerRef, {async, {self(), Ref}, transaction, {Messages, Options}, Priority}),
+    Ref.
+
+%% @doc
+%% Queue a program without waiting for it to finish. See
+%% async_transaction/2 and program/2.
+%% @end
+-spec(async_program(server_ref(), [step()]) -> reference()).
+async_program(ServerRef, Steps) ->
+    async(ServerRef, program, Steps).
+
+%% @doc
+%% Run Messages every PeriodUs microseconds in erlang-ale and send the
+%% data that's read to the caller. This is much less overhead than
+%% calling transaction/2 from a timer and the samples are evenly
+%% spaced. Messages are the same as for transaction/2.
+%%
+%% The caller receives <code>{i2c_stream, Pid, Samples, Overruns}</code>
+%% after every SamplesPerBatch samples. See ale_util:stream_samples/2 for
+%% the format of Samples. Overruns is the number of samples missed since
+%% the stream started. Starting a new stream replaces the old one.
+%% @end
+-spec(start_stream(server_ref(), [message()], pos_integer(), pos_integer()) -> ok | {error, term()}).
+start_stream(ServerRef, Messages, PeriodUs, SamplesPerBatch) ->
+    gen_server:call(ServerRef, {start_stream, self(), Messages, PeriodUs, SamplesPerBatch}).
+
+%% @doc
+%% Stop streaming. Samples that were collected are sent first.
+%% @end
+-spec(stop_stream(server_ref()) -> ok).
+stop_stream(ServerRef) ->
+    gen_server:call(ServerRef, stop_stream).
+
 %%%===================================================================
 %%% gen_server callbacks
 %%%===================================================================
@@ -82,11 +307,15 @@ write_read(ServerRef, Data, Len) ->
 %%                     {stop, Reason}
 %% @end
 %%--------------------------------------------------------------------
-init({Devname, Address}) ->
-    Port = ale_util:open_port(["i2c",
-                               "/dev/" ++ Devname,
-                               integer_to_list(Address)]),
-    {ok, Port}.
+init({Devname, Address, Options}) ->
+    AddressArgs = case Address of
+                      bus -> [];
+                      _ -> [integer_to_list(Address)]
+                  end,
+    %% Transactions can be larger than {packet, 2} allows.
+    Port = ale_util:open_port(["i2c", "/dev/" ++ Devname | AddressArgs],
+                              [{packet, 4} | Options]),
+    {ok, #state{port=Port}}.
 
 %%--------------------------------------------------------------------
 %% @private
@@ -102,17 +331,47 @@ init({Devname, Address}) ->
 %%                                   {stop, Reason, State}
 %% @end
 %%--------------------------------------------------------------------
-handle_call({write, Data}, _From, State) ->
-    Reply = call_port(State, write, Data),
+handle_call(stats, _From, #state{port=Port}=State) ->
+    {reply, call_port(Port, stats, []), State};
+handle_call({sim, Command}, _From, #state{port=Port}=State) ->
+    {reply, call_port(Port, sim, Command), State};
+handle_call({write, Data}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, write, Data),
+    {reply, Reply, State};
+
+handle_call({read, Len}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, read, Len),
+    {reply, Reply, State};
+
+handle_call({wrrd, Data, Len}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, wrrd, {Data, Len}),
+    {reply, Reply, State};
+
+handle_call({transaction, Messages}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, transaction, Messages),
     {reply, Reply, State};
 
-handle_call({read, Len}, _From, State) ->
-    Reply = call_port(State, read, Len),
+handle_call({transaction, Messages, Priority}, From, #state{port=Port}=State) ->
+    %% The port's tagged reply answers the call
+    ale_util:send_async(Port, {reply, From}, transaction, Messages, Priority),
+    {noreply, State};
+
+handle_call({program, Steps}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, program, Steps),
     {reply, Reply, State};
 
-handle_call({wrrd, Data, Len}, _From, State) ->
-    Reply = call_port(State, wrrd, {Data, Len}),
-    {reply, Reply, State}.
+handle_call({start_stream, Pid, Messages, PeriodUs, SamplesPerBatch}, _From,
+            #state{port=Port}=State) ->
+    NewState = stop_streaming(State),
+    case call_port(Port, start_stream, {Messages, PeriodUs, SamplesPerBatch}) of
+        ok ->
+            {reply, ok, NewState#state{stream={Pid, erlang:monitor(process, Pid)}}};
+        Error ->
+            {reply, Error, NewState}
+    end;
+
+handle_call(stop_stream, _From, State) ->
+    {reply, ok, stop_streaming(State)}.
 
 %%--------------------------------------------------------------------
 %% @private
@@ -125,6 +384,12 @@ handle_call({wrrd, Data, Len}, _From, State) ->
 %% @end
 %%--------------------------------------------------------------------
 
+handle_cast({async, Tag, Command, Args}, #state{port=Port}=State) ->
+    ale_util:send_async(Port, Tag, Command, Args),
+    {noreply, State};
+handle_cast({async, Tag, Command, Args, Priority}, #state{port=Port}=State) ->
+    ale_util:send_async(Port, Tag, Command, Args, Priority),
+    {noreply, State};
 handle_cast(stop, State) ->
     {stop, normal, State}.
 
@@ -138,6 +403,19 @@ handle_cast(stop, State) ->
 %%                                   {stop, Reason, State}
 %% @end
 %%--------------------------------------------------------------------
+handle_info({Port, {data, <<?TAGGED_REPLY, Msg/binary>>}}, #state{port=Port}=State) ->
+    ale_util:deliver_async(Msg),
+    {noreply, State};
+handle_info({Port, {data, <<?NOTIFICATION, Msg/binary>>}},
+            #state{port=Port, stream=Stream}=State) ->
+    case Stream of
+        {Pid, _} -> send_samples(Pid, Msg);
+        none -> ok
+    end,
+    {noreply, State};
+handle_info({'DOWN', Ref, process, _Pid, _Reason},
+            #state{stream={_, Ref}}=State) ->
+    {noreply, stop_streaming(State)};
 handle_info(_Info, State) ->
     {noreply, State}.
 
@@ -170,9 +448,47 @@ code_change(_OldVsn, State, _Extra) ->
 %%% Internal functions
 %%%===================================================================
 
+async(ServerRef, Command, Args) ->
+    Ref = make_ref(),
+    gen_server:cast(ServerRef, {async, {self(), Ref}, Command, Args}),
+    Ref.
+
+stop_streaming(#state{stream=none}=State) ->
+    State;
+stop_streaming(#state{port=Port, stream={Pid, Ref}}=State) ->
+    erlang:demonitor(Ref, [flush]),
+    ok = call_port(Port, stop_stream, []),
+    %% The last samples were sent before the reply
+    forward_samples(Port, Pid),
+    State#state{stream=none}.
+
+forward_samples(Port, Pid) ->
+    receive
+        {Port, {data, <<?NOTIFICATION, Msg/binary>>}} ->
+            send_samples(Pid, Msg),
+            forward_samples(Port, Pid)
+    after 0 ->
+            ok
+    end.
+
+send_samples(Pid, Msg) ->
+    {stream, Samples, Overruns} = binary_to_term(Msg),
+    Pid ! {i2c_stream, self(), Samples, Overruns}.
+
+%% read, write and wrrd are sent as binary commands so that the port
+%% doesn't have to decode a term for them
+command(read, Len) when is_integer(Len), Len > 0, Len < 65536 ->
+    <<?OP_READ, Len:16>>;
+command(write, Data) when is_binary(Data), byte_size(Data) > 0 ->
+    <<?OP_WRITE, Data/binary>>;
+command(wrrd, {Data, Len}) when is_binary(Data), byte_size(Data) > 0,
+                                is_integer(Len), Len > 0, Len < 65536 ->
+    <<?OP_WRRD, Len:16, Data/binary>>;
+command(Command, Args) ->
+    term_to_binary({Command, Args}).
+
 call_port(Port, Command, Args) ->
-    Message = {Command, Args},
-    erlang:send(Port, {self(), {command, term_to_binary(Message)}}),
+    ale_util:port_command(Port, command(Command, Args)),
     receive
-        {_, {data, Response}} -> binary_to_term(Response)
+        {Port, {data, <<?REPLY, Response/binary>>}} -> binary_to_term(Response)
     end.
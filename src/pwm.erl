@@ -0,0 +1,127 @@
+%%% @author Frank Hunleth <fhunleth@troodon-software.com>
+%%% @copyright (C) 2015, Frank Hunleth
+%%% @doc
+%%% This is the implementation of the PWM interface module. It drives
+%%% a channel through /sys/class/pwm so the signal is generated by
+%%% hardware. For pulse trains on ordinary GPIOs, see gpio:waveform/3.
+%%% @end
+
+-module(pwm).
+
+-behaviour(gen_server).
+
+%% API
+-export([start_link/2, start_link/3, stop/1, stats/1]).
+-export([configure/3, set_duty_cycle/2, set_polarity/2, enable/1, disable/1]).
+
+%% gen_server callbacks
+-export([init/1, handle_call/3, handle_cast/2, handle_info/2,
+	 terminate/2, code_change/3]).
+
+-define(SERVER, ?MODULE).
+-define(REPLY, 0).
+
+-type server_ref() :: atom() | {atom(), atom()} | pid().
+
+-record(state, {port :: port()}).
+
+%%%===================================================================
+%%% API
+%%%===================================================================
+
+%% @doc
+%% Starts a process to handle channel Channel of /sys/class/pwm/pwmchipChip.
+%% The channel is exported if needed.
+%% @end
+-spec(start_link(term(), non_neg_integer(), non_neg_integer()) -> {ok, pid()} | {error, reason}).
+start_link(ServerName, Chip, Channel) ->
+    gen_server:start_link(ServerName, ?MODULE, {Chip, Channel}, []).
+
+-spec(start_link(non_neg_integer(), non_neg_integer()) -> {ok, pid()} | {error, reason}).
+start_link(Chip, Channel) ->
+    gen_server:start_link(?MODULE, {Chip, Channel}, []).
+
+%% @doc
+%% Stop the process channel and release it.
+%% @end
+-spec(stop(server_ref()) -> ok).
+stop(ServerRef) ->
+    gen_server:cast(ServerRef, stop).
+
+%% @doc
+%% Return the counters and histograms that erlang-ale keeps for this
+%% process. See ale_util:stats() for the format.
+%% @end
+-spec(stats(server_ref()) -> ale_util:stats()).
+stats(ServerRef) ->
+    gen_server:call(ServerRef, stats).
+
+%% @doc
+%% Set the period and the active time of the signal in nanoseconds.
+%% DutyNs must not be longer than PeriodNs.
+%% @end
+-spec(configure(server_ref(), pos_integer(), non_neg_integer()) -> ok | {error, term()}).
+configure(ServerRef, PeriodNs, DutyNs) ->
+    gen_server:call(ServerRef, {configure, {PeriodNs, DutyNs}}).
+
+%% @doc
+%% Change only the active time. This is glitch free on most hardware.
+%% @end
+-spec(set_duty_cycle(server_ref(), non_neg_integer()) -> ok | {error, term()}).
+set_duty_cycle(ServerRef, DutyNs) ->
+    gen_server:call(ServerRef, {set_duty_cycle, DutyNs}).
+
+%% @doc
+%% Set whether the active part of the period is high (normal) or low
+%% (inversed). Most drivers only allow this while disabled.
+%% @end
+-spec(set_polarity(server_ref(), normal | inversed) -> ok | {error, term()}).
+set_polarity(ServerRef, Polarity) when Polarity == normal; Polarity == inversed ->
+    gen_server:call(ServerRef, {set_polarity, Polarity}).
+
+-spec(enable(server_ref()) -> ok | {error, term()}).
+enable(ServerRef) ->
+    gen_server:call(ServerRef, {enable, true}).
+
+-spec(disable(server_ref()) -> ok | {error, term()}).
+disable(ServerRef) ->
+    gen_server:call(ServerRef, {enable, false}).
+
+%%%===================================================================
+%%% gen_server callbacks
+%%%===================================================================
+
+init({Chip, Channel}) ->
+    Port = ale_util:open_port(["pwm",
+                               integer_to_list(Chip),
+                               integer_to_list(Channel)]),
+    {ok, #state{port=Port}}.
+
+handle_call(stats, _From, #state{port=Port}=State) ->
+    {reply, call_port(Port, stats, []), State};
+handle_call({Command, Args}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, Command, Args),
+    {reply, Reply, State}.
+
+handle_cast(stop, State) ->
+    {stop, normal, State}.
+
+handle_info(_Info, State) ->
+    {noreply, State}.
+
+terminate(_Reason, _State) ->
+    ok.
+
+code_change(_OldVsn, State, _Extra) ->
+    {ok, State}.
+
+%%%===================================================================
+%%% Internal functions
+%%%===================================================================
+
+call_port(Port, Command, Args) ->
+    Message = {Command, Args},
+    erlang:send(Port, {self(), {command, term_to_binary(Message)}}),
+    receive
+        {Port, {data, <<?REPLY, Response/binary>>}} -> binary_to_term(Response)
+    end.
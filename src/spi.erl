@@ -11,25 +11,72 @@
 -behaviour(gen_server).
 
 %% API
--export([start_link/2, start_link/3, stop/1]).
--export([transfer/2]).
+-export([start_link/2, start_link/3, stop/1, stats/1, sim/2]).
+-export([configure/2, transfer/2, transaction/2, transaction/3, program/2]).
+-export([start_stream/4, stop_stream/1]).
+-export([async_transfer/2, async_transaction/2, async_transaction/3, async_program/2]).
 
 %% gen_server callbacks
 -export([init/1, handle_call/3, handle_cast/2, handle_info/2,
 	 terminate/2, code_change/3]).
 
 -define(SERVER, ?MODULE).
+-define(REPLY, 0).
+-define(NOTIFICATION, 1).
+-define(TAGGED_REPLY, 2).
+
+%% Binary commands (see spi_port.c)
+-define(OP_TRANSFER, 1).
 
 -type data() :: binary().
+-type segment_option() :: {'cs_change', boolean()} |
+                          {'delay_us', non_neg_integer()} |
+                          {'speed_hz', pos_integer()} |
+                          {'bits_per_word', pos_integer()} |
+                          {'tx_lanes', lanes()} |
+                          {'rx_lanes', lanes()}.
+-type lanes() :: 1 | 2 | 4.
+-type config_option() :: {'mode', 0..3} |
+                         {'speed_hz', pos_integer()} |
+                         {'bits_per_word', pos_integer()} |
+                         {'delay_us', non_neg_integer()} |
+                         {'tx_lanes', lanes()} |
+                         {'rx_lanes', lanes()}.
+-type segment() :: {'tx', data()} | {'tx', data(), [segment_option()]} |
+                   {'rx', pos_integer()} | {'rx', pos_integer(), [segment_option()]} |
+                   {'txrx', data()} | {'txrx', data(), [segment_option()]}.
+
+-type step() :: {'write', data()} |
+                {'read', pos_integer()} |
+                {'write_read', data(), pos_integer()} |
+                {'delay_us', non_neg_integer()} |
+                {'poll', data(), Mask :: binary(), Value :: binary(),
+                 TimeoutUs :: non_neg_integer()} |
+                {'loop', non_neg_integer(), [step()]}.
+
+-export_type([segment/0, step/0, config_option/0]).
 -type devname() :: string().
 -type server_ref() :: atom() | {atom(), atom()} | pid().
 
+-record(state,
+        { port              :: ale_util:port_handle(),
+          stream = none     :: none | {pid(), reference()}
+        }).
+
 %%%===================================================================
 %%% API
 %%%===================================================================
 
 %% @doc
 %% Starts the process and initialize the device.
+%%
+%% SpiOptions are mode, bits_per_word, speed_hz, delay_us, tx_lanes
+%% and rx_lanes (see configure/2), plus any of the port options in
+%% ale_util:open_port/2.
+%%
+%% To share one device between many drivers, register the process and
+%% pass <code>{schedule, true}</code>. Requests made with
+%% transaction/3 or async_transaction/3 then run in priority order.
 %% @end
 -spec(start_link(term(), devname(), list()) -> {ok, pid()} | {error, reason}).
 start_link(ServerName, Devname, SpiOptions) ->
@@ -46,13 +93,180 @@ start_link(Devname, SpiOptions) ->
 stop(ServerRef) ->
     gen_server:cast(ServerRef, stop).
 
+%% @doc
+%% Return the counters and histograms that erlang-ale keeps for this
+%% process. See ale_util:stats() for the format.
+%% @end
+-spec(stats(server_ref()) -> ale_util:stats()).
+stats(ServerRef) ->
+    gen_server:call(ServerRef, stats).
+
+%% @doc
+%% Configure the simulated devices of a process started with
+%% <code>{loopback, true}</code>. See ale_util:sim_command().
+%% @end
+-spec(sim(server_ref(), ale_util:sim_command()) -> term()).
+sim(ServerRef, Command) ->
+    gen_server:call(ServerRef, {sim, Command}).
+
+%% @doc
+%% Change the device's settings without restarting the process. Only
+%% the options that are given change. speed_hz, bits_per_word and
+%% delay_us are the defaults for segments that don't set their own.
+%%
+%% tx_lanes and rx_lanes set up dual or quad SPI for controllers that
+%% support it, and are also the default for tx and rx segments and the
+%% reads and writes of programs. Full duplex transfers, like
+%% transfer/2 and txrx segments, always use one lane. For example, a
+%% QSPI flash fast read sends its command on one lane and reads on
+%% four:
+%%
+%%    ok = spi:configure(Spi, [{rx_lanes, 4}]),
+%%    spi:transaction(Spi, [{tx, <<16#6b, 0, 0, 0, 0>>}, {rx, 4096}])
+%%
+%% Requests queued before this finish with the old settings. If the
+%% device refuses a setting, the old ones are put back and
+%% <code>{error, Reason, Errno}</code> is returned.
+%% @end
+-spec(configure(server_ref(), [config_option()]) -> ok | {error, term(), term()} | {error, badarg}).
+configure(ServerRef, Options) ->
+    gen_server:call(ServerRef, {configure, Options}).
+
 %% @doc
 %% Transfer data trough the SPI bus.
+%%
+%% Transfers can be up to 1 MiB. Ones larger than spidev's bufsiz
+%% (usually 4 KiB) are split up with chip select held active between
+%% the pieces.
 %% @end
 -spec(transfer(server_ref(), data()) -> data() | {error, reason}).
 transfer(ServerRef, Data) ->
     gen_server:call(ServerRef, {transfer, Data}).
 
+%% @doc
+%% Run a list of segments as one SPI message. Chip select stays active
+%% for the whole transaction unless a segment sets cs_change.
+%%
+%% A segment is one of:
+%%    {tx, Data}    Send Data and discard what's received
+%%    {rx, Len}     Receive Len bytes
+%%    {txrx, Data}  Send Data and return what's received
+%%
+%% Each may have a list of options as a third element to override the
+%% device's delay_us, speed_hz and bits_per_word or to set cs_change.
+%% tx segments can set tx_lanes and rx segments rx_lanes. txrx segments
+%% only support one lane. A list with one binary for each rx and txrx segment is returned.
+%%
+%% For example, to send a command byte and read 2 KiB:
+%%    spi:transaction(Spi, [{tx, <<16#03, 0, 0, 0>>}, {rx, 2048}])
+%% @end
+-spec(transaction(server_ref(), [segment()]) -> [data()] | {error, term()}).
+transaction(ServerRef, Segments) ->
+    gen_server:call(ServerRef, {transaction, Segments}).
+
+%% @doc
+%% Run a transaction with a priority. The process keeps taking requests
+%% while this one waits, so callers with higher priorities can go
+%% first. The priority only matters if the process was started with
+%% the <code>{schedule, true}</code> option.
+%% @end
+-spec(transaction(server_ref(), [segment()], ale_util:priority()) -> [data()] | {error, term()}).
+transaction(ServerRef, Segments, Priority) ->
+    gen_server:call(ServerRef, {transaction, Segments, Priority}).
+
+%% @doc
+%% Run a sequence of steps in erlang-ale and return the data from every
+%% read and write_read in one list. Each step that accesses the bus is
+%% its own SPI message, so chip select is released between them. The
+%% steps are:
+%%
+%%    {write, Data}
+%%    {read, Len}               Zeros are sent
+%%    {write_read, Data, Len}   Send Data and then read Len bytes
+%%    {delay_us, Us}
+%%    {poll, Data, Mask, Value, TimeoutUs}
+%%       Send Data and read byte_size(Mask) bytes until the bytes
+%%       anded with Mask equal Value
+%%    {loop, Count, Steps}
+%%
+%% Each bus access is limited to spidev's bufsiz. The program returns
+%% {error, transfer_failed} or {error, poll_timeout} if a step fails.
+%% The delays and poll timeouts, counting every time a loop runs them,
+%% can add up to at most 1 second, and a program can run at most 65536
+%% steps and loop iterations in total. Longer programs get
+%% {error, badarg}. Unless the process was started with
+%% <code>{workers, true}</code>, nothing else it serves is handled
+%% while a program waits.
+%%
+%% For example, to erase a SPI flash sector and wait for the busy bit
+%% in the status register to clear:
+%%    spi:program(Spi, [{write, <<16#06>>},
+%%                      {write, <<16#20, 0, 0, 0>>},
+%%                      {poll, <<16#05>>, <<1>>, <<0>>, 500000}])
+%% @end
+-spec(program(server_ref(), [step()]) -> [data()] | {error, term()}).
+program(ServerRef, Steps) ->
+    gen_server:call(ServerRef, {program, Steps}).
+
+%% @doc
+%% Queue a transfer without waiting for it to finish. The caller
+%% receives <code>{ale_reply, Ref, Reply}</code> where Reply is what
+%% transfer/2 would have returned. Many requests can be in flight at
+%% once and their replies arrive in order.
+%% @end
+-spec(async_transfer(server_ref(), data()) -> reference()).
+async_transfer(ServerRef, Data) ->
+    async(ServerRef, transfer, Data).
+
+%% @doc
+%% Queue a transaction without waiting for it to finish. See
+%% async_transfer/2 and transaction/2.
+%% @end
+-spec(async_transaction(server_ref(), [segment()]) -> reference()).
+async_transaction(ServerRef, Segments) ->
+    async(ServerRef, transaction, Segments).
+
+%% @doc
+%% Queue a transaction with a priority. See async_transaction/2 and
+%% transaction/3. Replies to requests with different priorities may
+%% arrive out of order.
+%% @end
+-spec(async_transaction(server_ref(), [segment()], ale_util:priority()) -> reference()).
+async_transaction(ServerRef, Segments, Priority) ->
+    Ref = make_ref(),
+    gen_server:cast(ServerRef, {async, {self(), Ref}, transaction, Segments, Priority}),
+    Ref.
+
+%% @doc
+%% Queue a program without waiting for it to finish. See
+%% async_transfer/2 and program/2.
+%% @end
+-spec(async_program(server_ref(), [step()]) -> reference()).
+async_program(ServerRef, Steps) ->
+    async(ServerRef, program, Steps).
+
+%% @doc
+%% Run Segments every PeriodUs microseconds in erlang-ale and send the
+%% data that's received to the caller. This is much less overhead than
+%% calling transaction/2 from a timer and the samples are evenly
+%% spaced. Segments are the same as for transaction/2.
+%%
+%% The caller receives <code>{spi_stream, Pid, Samples, Overruns}</code>
+%% after every SamplesPerBatch samples. See ale_util:stream_samples/2 for
+%% the format of Samples. Overruns is the number of samples missed since
+%% the stream started. Starting a new stream replaces the old one.
+%% @end
+-spec(start_stream(server_ref(), [segment()], pos_integer(), pos_integer()) -> ok | {error, term()}).
+start_stream(ServerRef, Segments, PeriodUs, SamplesPerBatch) ->
+    gen_server:call(ServerRef, {start_stream, self(), Segments, PeriodUs, SamplesPerBatch}).
+
+%% @doc
+%% Stop streaming. Samples that were collected are sent first.
+%% @end
+-spec(stop_stream(server_ref()) -> ok).
+stop_stream(ServerRef) ->
+    gen_server:call(ServerRef, stop_stream).
+
 %%%===================================================================
 %%% gen_server callbacks
 %%%===================================================================
@@ -74,13 +288,26 @@ init({Devname, SpiOptions}) ->
     SpeedHz = keyword_get(SpiOptions, speed_hz, 1000000),
     DelayUs = keyword_get(SpiOptions, delay_us, 10),
 
+    %% Transfers can be larger than {packet, 2} allows.
     Port = ale_util:open_port(["spi",
                                "/dev/" ++ Devname,
                                integer_to_list(Mode),
                                integer_to_list(BitsPerWord),
                                integer_to_list(SpeedHz),
-                               integer_to_list(DelayUs)]),
-    {ok, Port}.
+                               integer_to_list(DelayUs)],
+                              [{packet, 4} | SpiOptions]),
+
+    %% Lanes need the 32-bit mode, which older kernels don't have, so
+    %% they're only set when asked for.
+    case [Lanes || {Key, _}=Lanes <- SpiOptions, Key =:= tx_lanes orelse Key =:= rx_lanes] of
+        [] ->
+            {ok, #state{port=Port}};
+        Config ->
+            case call_port(Port, configure, Config) of
+                ok -> {ok, #state{port=Port}};
+                Error -> {stop, Error}
+            end
+    end.
 
 %%--------------------------------------------------------------------
 %% @private
@@ -96,9 +323,36 @@ init({Devname, SpiOptions}) ->
 %%                                   {stop, Reason, State}
 %% @end
 %%--------------------------------------------------------------------
-handle_call({transfer, Data}, _From, State) ->
-    Reply = call_port(State, transfer, Data),
-    {reply, Reply, State}.
+handle_call(stats, _From, #state{port=Port}=State) ->
+    {reply, call_port(Port, stats, []), State};
+handle_call({sim, Command}, _From, #state{port=Port}=State) ->
+    {reply, call_port(Port, sim, Command), State};
+handle_call({configure, Options}, _From, #state{port=Port}=State) ->
+    {reply, call_port(Port, configure, Options), State};
+handle_call({transfer, Data}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, transfer, Data),
+    {reply, Reply, State};
+handle_call({transaction, Segments}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, transaction, Segments),
+    {reply, Reply, State};
+handle_call({transaction, Segments, Priority}, From, #state{port=Port}=State) ->
+    %% The port's tagged reply answers the call
+    ale_util:send_async(Port, {reply, From}, transaction, Segments, Priority),
+    {noreply, State};
+handle_call({program, Steps}, _From, #state{port=Port}=State) ->
+    Reply = call_port(Port, program, Steps),
+    {reply, Reply, State};
+handle_call({start_stream, Pid, Segments, PeriodUs, SamplesPerBatch}, _From,
+            #state{port=Port}=State) ->
+    NewState = stop_streaming(State),
+    case call_port(Port, start_stream, {Segments, PeriodUs, SamplesPerBatch}) of
+        ok ->
+            {reply, ok, NewState#state{stream={Pid, erlang:monitor(process, Pid)}}};
+        Error ->
+            {reply, Error, NewState}
+    end;
+handle_call(stop_stream, _From, State) ->
+    {reply, ok, stop_streaming(State)}.
 
 %%--------------------------------------------------------------------
 %% @private
@@ -111,6 +365,12 @@ handle_call({transfer, Data}, _From, State) ->
 %% @end
 %%--------------------------------------------------------------------
 
+handle_cast({async, Tag, Command, Args}, #state{port=Port}=State) ->
+    ale_util:send_async(Port, Tag, Command, Args),
+    {noreply, State};
+handle_cast({async, Tag, Command, Args, Priority}, #state{port=Port}=State) ->
+    ale_util:send_async(Port, Tag, Command, Args, Priority),
+    {noreply, State};
 handle_cast(stop, State) ->
     {stop, normal, State}.
 
@@ -124,6 +384,19 @@ handle_cast(stop, State) ->
 %%                                   {stop, Reason, State}
 %% @end
 %%--------------------------------------------------------------------
+handle_info({Port, {data, <<?TAGGED_REPLY, Msg/binary>>}}, #state{port=Port}=State) ->
+    ale_util:deliver_async(Msg),
+    {noreply, State};
+handle_info({Port, {data, <<?NOTIFICATION, Msg/binary>>}},
+            #state{port=Port, stream=Stream}=State) ->
+    case Stream of
+        {Pid, _} -> send_samples(Pid, Msg);
+        none -> ok
+    end,
+    {noreply, State};
+handle_info({'DOWN', Ref, process, _Pid, _Reason},
+            #state{stream={_, Ref}}=State) ->
+    {noreply, stop_streaming(State)};
 handle_info(_Info, State) ->
     {noreply, State}.
 
@@ -162,9 +435,42 @@ keyword_get(Keywords, Key, Default) ->
     end.
 
 
+async(ServerRef, Command, Args) ->
+    Ref = make_ref(),
+    gen_server:cast(ServerRef, {async, {self(), Ref}, Command, Args}),
+    Ref.
+
+stop_streaming(#state{stream=none}=State) ->
+    State;
+stop_streaming(#state{port=Port, stream={Pid, Ref}}=State) ->
+    erlang:demonitor(Ref, [flush]),
+    ok = call_port(Port, stop_stream, []),
+    %% The last samples were sent before the reply
+    forward_samples(Port, Pid),
+    State#state{stream=none}.
+
+forward_samples(Port, Pid) ->
+    receive
+        {Port, {data, <<?NOTIFICATION, Msg/binary>>}} ->
+            send_samples(Pid, Msg),
+            forward_samples(Port, Pid)
+    after 0 ->
+            ok
+    end.
+
+send_samples(Pid, Msg) ->
+    {stream, Samples, Overruns} = binary_to_term(Msg),
+    Pid ! {spi_stream, self(), Samples, Overruns}.
+
+%% transfer is sent as a binary command so that the port doesn't have
+%% to decode a term or copy the data
+command(transfer, Data) when is_binary(Data), byte_size(Data) > 0 ->
+    <<?OP_TRANSFER, Data/binary>>;
+command(Command, Args) ->
+    term_to_binary({Command, Args}).
+
 call_port(Port, Command, Args) ->
-    Message = {Command, Args},
-    erlang:send(Port, {self(), {command, term_to_binary(Message)}}),
+    ale_util:port_command(Port, command(Command, Args)),
     receive
-        {_, {data, Response}} -> binary_to_term(Response)
+        {Port, {data, <<?REPLY, Response/binary>>}} -> binary_to_term(Response)
     end.